@@ -26,9 +26,23 @@ function c(unit: string, defaultValue: any, flags = 0) {
 }
 
 export const CONFIG_KEYS_CONFIG = {
-  "sensorDistanceFromBottomMM": c("mm", 5000),
+  // Also bounds how long the device waits for an echo
+  "sensorDistanceFromBottomMM": c("mm", 5000, FIELD_DEPLOYED_READABLE),
   "measurementIntervalS": c("s", 60 * 60, FIELD_DEPLOYED_READABLE),
+  // The device sleeps up to this long while the level is flat
+  "maximumMeasurementIntervalS": c("s", 2 * 60 * 60, FIELD_DEPLOYED_READABLE),
   "numberOfMeasurementsToSkipBetweenUploads": c("naturalNumber", 0, FIELD_DEPLOYED_READABLE),
+  // Defaults match the firmware's, see mcu/include/deployed_config.h
+  "maximumInterTransmitDistanceMM": c("mm", 30, FIELD_DEPLOYED_READABLE),
+  "maximumInterTransmitMeasurements": c("naturalNumber", 30, FIELD_DEPLOYED_READABLE),
+  "maximumInterTransmitTimeS": c("s", 24 * 60 * 60, FIELD_DEPLOYED_READABLE),
+  "batteryCutoffMV": c("mV", 3500, FIELD_DEPLOYED_READABLE),
+  // 0 powers the modem off between uploads, 1 keeps it registered in DTR
+  // sleep. The simulator's modem-sleep report tells which is cheaper per site.
+  "modemSleepMode": c("naturalNumber", 0, FIELD_DEPLOYED_READABLE),
+  // 0 has larger uploads sent as they are, 1 lets the firmware compress them
+  // with heatshrink, see heatshrink.ts
+  "uploadEncoding": c("naturalNumber", 0, FIELD_DEPLOYED_READABLE),
   "readAuthorizationToken": c("text", generateRandomToken),
   "writeAuthorizationToken": c("text", generateRandomToken),
   "lowerThresholdMM": c("mm", 0),
@@ -44,7 +58,7 @@ export type ConfigKey = keyof typeof CONFIG_KEYS_CONFIG
 export type Config = Record<ConfigKey, any>
 
 export function parseUnitValue(unit: string, value: any) {
-  if (["mm", "s", "naturalNumber"].includes(unit)) {
+  if (["mm", "mV", "s", "naturalNumber"].includes(unit)) {
     return Number(value)
   } else if (unit === "text") {
     return String(value)
@@ -0,0 +1,44 @@
+// Decoder for the heatshrink bit stream the firmware compresses larger
+// uploads with, see mcu/lib/lzss_codec. The parameters travel in the
+// Content-Encoding, as in "heatshrink-w8-l4".
+
+export function parseHeatshrinkEncoding(contentEncoding: string): [number, number] | null {
+  const match = /^heatshrink-w(\d+)-l(\d+)$/.exec(contentEncoding.trim())
+  if (match == null) return null
+  const windowBits = Number(match[1])
+  const lookaheadBits = Number(match[2])
+  if (windowBits < 4 || windowBits > 15 || lookaheadBits < 3 || lookaheadBits >= windowBits) {
+    return null
+  }
+  return [windowBits, lookaheadBits]
+}
+
+export function decodeHeatshrink(data: Buffer, windowBits: number, lookaheadBits: number): Buffer {
+  const out: number[] = []
+  let bitOffset = 0
+  const remaining = () => data.length * 8 - bitOffset
+  function read(count: number) {
+    let value = 0
+    for (; count > 0; count--, bitOffset++) {
+      value = (value << 1) | ((data[bitOffset >> 3] >> (7 - (bitOffset & 7))) & 1)
+    }
+    return value
+  }
+  // No token is shorter than a byte, so less than that is the padding
+  while (remaining() >= 8) {
+    if (read(1) === 1) {
+      if (remaining() < 8) throw new Error("Truncated literal")
+      out.push(read(8))
+      continue
+    }
+    if (remaining() < windowBits + lookaheadBits) throw new Error("Truncated back reference")
+    const offset = read(windowBits) + 1
+    const count = read(lookaheadBits) + 1
+    if (offset > out.length) throw new Error("Back reference before the start")
+    // One at a time, the copy may overlap what it produces
+    for (let i = 0; i < count; i++) {
+      out.push(out[out.length - offset])
+    }
+  }
+  return Buffer.from(out)
+}
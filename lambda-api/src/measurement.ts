@@ -1,9 +1,10 @@
 import { PublishCommand } from "@aws-sdk/client-sns";
+import { ConditionalCheckFailedException } from "@aws-sdk/client-dynamodb";
 import { getDataTableName, getDynamo, getSns } from "./awsClients";
 import { Config, updateConfigItem } from "./config";
 import { nowS } from "./time";
 import { envStringOrThrow } from "./env";
-import { PutCommand, ScanCommand } from "@aws-sdk/lib-dynamodb";
+import { PutCommand, QueryCommand, ScanCommand } from "@aws-sdk/lib-dynamodb";
 
 
 export interface Measurement {
@@ -60,12 +61,48 @@ async function notifyNewMeasurement(config: Config, waterLevel: number) {
   console.log({ fastDropAmountMM, fastDropTimeS, fastRiseAmountMM, fastRiseTimeS, startMeasurementTime, now });
 }
 
-export async function publishMeasurement(config: Config, measurement: Measurement) {
-  notifyNewMeasurement(config, measurement.waterLevelMM);
-  return await getDynamo().send(
-    new PutCommand({
+// The device hashes a measurement as it stored it, so a retried upload
+// carries the same hash even where the server corrected its time differently
+// the first time. Items are keyed by (hash, timeS), all attempts at one
+// measurement share the hash partition.
+async function findStoredMeasurement(measurement: Measurement) {
+  const res = await getDynamo().send(
+    new QueryCommand({
       TableName: getDataTableName(),
-      Item: measurement,
+      KeyConditionExpression: "#hash = :hash",
+      ExpressionAttributeNames: { "#hash": "hash" },
+      ExpressionAttributeValues: { ":hash": measurement.hash },
     })
   );
+  // A hash collision of two different measurements is no retry
+  return res.Items?.find(item =>
+    item.waterLevelMM === measurement.waterLevelMM && item.batteryVoltage === measurement.batteryVoltage
+  ) as Measurement | undefined;
+}
+
+// Returns the measurement as stored, which for a retry is the first attempt's
+export async function publishMeasurement(config: Config, measurement: Measurement) {
+  const stored = await findStoredMeasurement(measurement);
+  if (stored != null) {
+    console.log(`Measurement ${measurement.hash} is already stored at ${stored.timeS}`);
+    return stored;
+  }
+  try {
+    await getDynamo().send(
+      new PutCommand({
+        TableName: getDataTableName(),
+        Item: measurement,
+        // A retry racing the first attempt
+        ConditionExpression: "attribute_not_exists(#hash)",
+        ExpressionAttributeNames: { "#hash": "hash" },
+      })
+    );
+  } catch (e) {
+    if (e instanceof ConditionalCheckFailedException) {
+      return measurement;
+    }
+    throw e;
+  }
+  notifyNewMeasurement(config, measurement.waterLevelMM);
+  return measurement;
 }
@@ -5,12 +5,11 @@ import { validateBatteryVoltage, validateDistance, validateTime } from "./valida
 import { Measurement, publishMeasurement } from "./measurement";
 import { CONFIG_KEYS_CONFIG, ConfigKey, parseUnitValue, updateConfigItem } from "./config";
 import { PutCommand, ScanCommand } from "@aws-sdk/lib-dynamodb";
-import { nowS } from "./time";
+import { nowS, timeCorrectionS } from "./time";
+import { decodeHeatshrink, parseHeatshrinkEncoding } from "./heatshrink";
 
 
 const BEARER_PREFIX = "Bearer ";
-// If older than this, assume time of sensor is off and correct with server time 
-const NEWEST_MEASUREMENT_MAX_AGE_S = 60 * 2;
 
 enum HeaderTokenMatch {
   NotPresent,
@@ -95,7 +94,17 @@ registrar
   let clientData: Record<string, string | undefined> | Array<Record<string, string | number>> = event.queryStringParameters ?? {};
   const bodyBase64 = event.body;
   if (bodyBase64 != null && bodyBase64.trim().length > 0) {
-    const bodyString = Buffer.from(bodyBase64, "base64").toString("utf-8");
+    let bodyBytes = Buffer.from(bodyBase64, "base64");
+    const contentEncoding = event.headers["content-encoding"];
+    if (contentEncoding != null) {
+      const heatshrinkParameters = parseHeatshrinkEncoding(contentEncoding)
+      if (heatshrinkParameters == null) {
+        throw new HttpBadRequestError(`Unsupported Content-Encoding: ${contentEncoding}`)
+      }
+      try { bodyBytes = decodeHeatshrink(bodyBytes, ...heatshrinkParameters) }
+      catch (e) { throw new HttpBadRequestError(`Invalid ${contentEncoding} body: ${(e as Error).message}`) }
+    }
+    const bodyString = bodyBytes.toString("utf-8");
     try { clientData = JSON.parse(bodyString) }
     catch (e) { if (e instanceof SyntaxError) {
       console.error(`Invalid JSON: ${e.message}. Got body (between ><): >${bodyString}<`)
@@ -116,27 +125,45 @@ registrar
     if (batteryVoltageInvalid != null) {
       throw new HttpBadRequestError(`batteryVoltage ${batteryVoltageInvalid}, got ${message.batteryVoltage}`)
     }
-    return { timeS, waterLevelMM, batteryVoltage }
+    // Stays the same across retries of an upload, unlike the time which may
+    // be corrected below
+    const hash = typeof message.hash === "number" ? message.hash : undefined
+    return { timeS, waterLevelMM, batteryVoltage, hash }
+  }
+  // The firmware wraps its batch as {"batch":<n>,"measurements":[...],
+  // "clockSynced":<bool>,"wakeProfile":{...},"uplink":{...}}. The profile
+  // tells where the device's awake time went since its last upload, the uplink
+  // whether it came over WiFi or cellular and what connecting took. The batch
+  // number is echoed as "ack" once every measurement is stored.
+  let batch: number | undefined = undefined
+  let clockSynced = false
+  if (!Array.isArray(clientData) && Array.isArray((clientData as any).measurements)) {
+    const { measurements, wakeProfile, uplink } = clientData as any
+    console.log(JSON.stringify({ wakeProfile, uplink }))
+    batch = typeof (clientData as any).batch === "number" ? (clientData as any).batch : undefined
+    clockSynced = (clientData as any).clockSynced === true
+    clientData = measurements
   }
   const messages = Array.isArray(clientData) ? clientData : [clientData];
   const validatedMessages = messages.map(validateSensorMessage);
-  const newestMessage = validatedMessages[validatedMessages.length - 1];
-  if (newestMessage == null) {
+  if (validatedMessages.length === 0) {
     throw new HttpBadRequestError("Empty array")
   }
   const now = nowS()
-  if (newestMessage.timeS < now - NEWEST_MEASUREMENT_MAX_AGE_S) {
-    console.log(`Newest message is too old: ${newestMessage.timeS} < now [${now}] - ${NEWEST_MEASUREMENT_MAX_AGE_S}. Correcting to server time...`)
-    validatedMessages.forEach(message => message.timeS += now - newestMessage.timeS)
+  const correctionS = timeCorrectionS(validatedMessages.map(message => message.timeS), now, clockSynced)
+  if (correctionS !== 0) {
+    console.log(`Newest message is too old, ${correctionS} s before now [${now}]. Correcting to server time...`)
+    validatedMessages.forEach(message => message.timeS += correctionS)
   }
   const measurements = validatedMessages.map((message, indexInBatch) => ({
     ...message,
-    hash: message.timeS,
+    hash: message.hash ?? message.timeS,
     numberOfMeasurementsInBatch: validatedMessages.length,
     indexInBatch
   } as Measurement));
-  await Promise.all(measurements.map(measurements => publishMeasurement(
-    config, measurements
+  // Retried chunks come back as first stored, none of them twice
+  const storedMeasurements = await Promise.all(measurements.map(measurement => publishMeasurement(
+    config, measurement
   )));
   const fieldDeployedReadableConfigValues = Object.fromEntries(
     Object.entries(CONFIG_KEYS_CONFIG)
@@ -146,7 +173,7 @@ registrar
         return [key, { unit, value }]
       })
   )
-  return { measurements, config: fieldDeployedReadableConfigValues, now }
+  return { measurements: storedMeasurements, config: fieldDeployedReadableConfigValues, now, ack: batch }
 })
 .get("/config", async (event, getConfig) => {
   const config = await getConfig();
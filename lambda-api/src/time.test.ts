@@ -0,0 +1,61 @@
+import { test } from "node:test";
+import assert from "node:assert/strict";
+import { NEWEST_MEASUREMENT_MAX_AGE_S, timeCorrectionS } from "./time.ts";
+
+
+const NOW_S = 1700000000
+const HOUR_S = 60 * 60
+// Like UPLOAD_CHUNK_MEASUREMENTS in the firmware's main.cpp
+const CHUNK_MEASUREMENTS = 33
+
+// The firmware's order: the current measurement, then the backlog oldest
+// first, hourly
+function backlogTimes(nbroMeasurements: number, currentS: number) {
+  const backlog = Array.from(
+    { length: nbroMeasurements - 1 },
+    (_, i) => currentS - (nbroMeasurements - 1 - i) * HOUR_S
+  )
+  return [currentS, ...backlog]
+}
+
+function chunks<T>(items: T[], size: number) {
+  return Array.from({ length: Math.ceil(items.length / size) }, (_, i) => items.slice(i * size, (i + 1) * size))
+}
+
+// What POST /measurement stores for each chunk
+function postChunks(timesS: number[], now: number, clockSynced: boolean) {
+  return chunks(timesS, CHUNK_MEASUREMENTS).flatMap(chunk => {
+    const correctionS = timeCorrectionS(chunk, now, clockSynced)
+    return chunk.map(timeS => timeS + correctionS)
+  })
+}
+
+test("a week of backlog in chunks keeps its times", () => {
+  const timesS = backlogTimes(7 * 24, NOW_S - 5)
+  const stored = postChunks(timesS, NOW_S, true)
+  assert.ok(chunks(timesS, CHUNK_MEASUREMENTS).length > 1)
+  assert.deepEqual(stored, timesS)
+  assert.equal(new Set(stored).size, stored.length)
+})
+
+test("the current measurement first is the newest, not the last element", () => {
+  const timesS = backlogTimes(CHUNK_MEASUREMENTS, NOW_S - 5)
+  assert.equal(timeCorrectionS(timesS, NOW_S, false), 0)
+})
+
+test("chunks of old measurements from a synced clock are not moved", () => {
+  const timesS = backlogTimes(3 * CHUNK_MEASUREMENTS, NOW_S - 5).slice(CHUNK_MEASUREMENTS)
+  assert.equal(timeCorrectionS(timesS, NOW_S, true), 0)
+})
+
+test("an unsynced clock moves the newest measurement to now", () => {
+  const timesS = backlogTimes(10, 5 * HOUR_S)
+  const correctionS = timeCorrectionS(timesS, NOW_S, false)
+  assert.equal(correctionS, NOW_S - 5 * HOUR_S)
+  assert.deepEqual(timesS.map(timeS => timeS + correctionS), backlogTimes(10, NOW_S))
+})
+
+test("an unsynced clock within the allowed age is left alone", () => {
+  const timesS = backlogTimes(10, NOW_S - NEWEST_MEASUREMENT_MAX_AGE_S)
+  assert.equal(timeCorrectionS(timesS, NOW_S, false), 0)
+})
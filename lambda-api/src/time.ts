@@ -1,3 +1,22 @@
 export function nowS() {
   return Math.floor(Date.now() / 1000);
 }
+
+// If older than this, assume time of sensor is off and correct with server time
+export const NEWEST_MEASUREMENT_MAX_AGE_S = 60 * 2;
+
+// Seconds to add to every time of a request so its newest one is `now`, 0 if
+// it needs no correction. The newest is the largest time, not the last one:
+// the firmware sends the current measurement first and a backlog in chunks,
+// where the chunks after the first hold only old measurements. A device whose
+// clock is synced to network time sends real times, which stay as they are.
+export function timeCorrectionS(timesS: number[], now: number, clockSynced: boolean) {
+  if (clockSynced || timesS.length === 0) {
+    return 0
+  }
+  const newestTimeS = Math.max(...timesS)
+  if (newestTimeS >= now - NEWEST_MEASUREMENT_MAX_AGE_S) {
+    return 0
+  }
+  return now - newestTimeS
+}
@@ -1,16 +1,132 @@
 #pragma once
 
+#include "stream_extensions.h"
+#include "modem_channel.h"
 
 #define PIN_CELLULAR_PWR 3
+// Wired to the modem's DTR, only needed for CELLULAR_SLEEP_MODE_DTR
+#define PIN_CELLULAR_DTR 5
 
-#define AT_OK_STATUS 0
-#define AT_ERROR_STATUS 1
-#define ERROR_RECEIVING_AT_STATUS 2
+// What the modem does between uploads, see DeployedConfig::modemSleepMode
+#define CELLULAR_SLEEP_MODE_POWER_OFF 0
+// AT+CSCLK=1 with DTR held high through deep sleep. The modem stays
+// registered, so an upload skips the boot and the registration, at the cost
+// of its sleep current between wakes.
+#define CELLULAR_SLEEP_MODE_DTR 1
 
-unsigned char sendNoResponseCommand(Stream* modemStream, String command);
+#define CELLULAR_CONFIRMED_OFF 0x46464f43  // "COFF"
+#define CELLULAR_PARKED 0x4b524150  // "PARK"
+// DTR low to the UART taking commands, typically 20 ms
+#define CELLULAR_DTR_WAKE_MS 50
+// A parked modem answers right away, otherwise it isn't there anymore
+#define CELLULAR_RESUME_UART_TIMEOUT_MS 1000
+// The network may have dropped it while parked
+#define CELLULAR_RESUME_REGISTRATION_TIMEOUT_MS 30000
+// OK to AT+CPOF
+#define CELLULAR_SOFT_POWER_OFF_TIMEOUT_MS 3000
+// Power off request to NORMAL POWER DOWN, typically 1.9 s
+#define CELLULAR_POWER_DOWN_TIMEOUT_MS 5000
+// An unanswered AT after this long means the modem is off
+#define CELLULAR_SILENCE_PROBE_MS 500
+// POWERKEY has to be held for at least 2.5 s
+#define CELLULAR_POWER_OFF_PULSE_MS 3000
+#define CELLULAR_SHUTDOWN_HISTOGRAM_BUCKETS 8
+#define CELLULAR_SHUTDOWN_HISTOGRAM_BUCKET_MS 1000
+
+// The modem boots at this rate. AT+IPR changes it until the modem powers
+// off, parking keeps it.
+#define CELLULAR_UART_DEFAULT_BAUD 115200
+// Only if RTS and CTS are wired to the modem, which they aren't on every
+// board
+#define CELLULAR_UART_FLOW_CONTROL false
+#define PIN_CELLULAR_RTS 6
+#define PIN_CELLULAR_CTS 7
+// What a cold boot asks the modem for. Without RTS/CTS a long body could
+// overrun the modem's UART buffer at the higher rates.
+#define CELLULAR_UART_FAST_BAUD (CELLULAR_UART_FLOW_CONTROL ? 921600 : 460800)
+// Both ends switched, before probing the new rate
+#define CELLULAR_UART_SETTLE_MS 20
+#define CELLULAR_UART_PROBES 3
+#define CELLULAR_UART_PROBE_TIMEOUT_MS 200
+#define CELLULAR_UART_CONFIG_MAGIC 0x54524155  // "UART"
+#define CELLULAR_UART_CONFIG_VERSION 1
+
+// How long powering the modem off took, kept across deep sleep. Statistics
+// only, a panic leaving them half written does no harm.
+struct CellularShutdownStats {
+  uint32_t nbroShutdowns;
+  uint32_t nbroPowerKeyFallbacks;
+  // Neither NORMAL POWER DOWN nor silence afterwards
+  uint32_t nbroUnconfirmed;
+  uint32_t lastLatencyMs;
+  // By CELLULAR_SHUTDOWN_HISTOGRAM_BUCKET_MS, the last one holds the rest
+  uint32_t latencyHistogram[CELLULAR_SHUTDOWN_HISTOGRAM_BUCKETS];
+};
+
+extern CellularShutdownStats cellularShutdownStats;
+
+// How parking the modem between wakes works out, kept across deep sleep.
+// Statistics only, like CellularShutdownStats.
+struct CellularSleepStats {
+  uint32_t nbroParks;
+  uint32_t nbroResumes;
+  // Parked, but it didn't answer or register when woken
+  uint32_t nbroColdBootFallbacks;
+};
+
+extern CellularSleepStats cellularSleepStats;
+
+// The rate the modem agreed to, kept in RTC memory. The next cold boot asks
+// for it again without trying others, a parked modem is still at it. A power
+// loss starts over at the default rate, like the modem does.
+struct CellularUartConfig {
+  uint32_t magic;
+  uint16_t version;
+  bool flowControl;
+  // CELLULAR_UART_DEFAULT_BAUD once a faster rate failed its probe
+  uint32_t baud;
+  uint16_t nbroNegotiations;
+  uint16_t nbroFallbacks;
+  // CRC-32 of everything above
+  uint32_t checksum;
+};
+
+extern CellularUartConfig cellularUartConfig;
+
+// All reads from the modem go through this, it owns Serial1's RX side
+extern LineReader modemReader;
+// Routes the lines read by modemReader to commands and URC handlers
+extern ModemChannel modemChannel;
+
+unsigned char sendNoResponseCommand(ModemChannel* modem, const String& command);
 void setupCellularIO();
+// beginCellularSetup() powers the modem on, or wakes it if it is parked, and
+// returns while it boots and registers. finishCellularSetup() waits for that,
+// cold booting a parked modem that doesn't come back. setupCellular() does
+// both.
+void beginCellularSetup();
+void finishCellularSetup();
+// Powers the modem back off if a setup was begun, or parks it again if it
+// was woken from parking. A modem still booting is only told to power off,
+// powerOffCellular() has to finish that before deep sleep.
+void cancelCellularSetup();
 void setupCellular();
 unsigned char checkIfCellularIsOn(unsigned long timeout, bool* isOn);
 void powerOnCellular();
-void powerOffCellular();
+// AT+CPOF, POWERKEY if the modem doesn't take it. RET_OK once the modem is
+// confirmed off.
+unsigned char powerOffCellular();
+// By powerOffCellular() or an unanswered checkIfCellularIsOn(), this wake or
+// an earlier one
+bool cellularIsConfirmedOff();
+// Between a cancelCellularSetup() of a booting modem and the
+// powerOffCellular() that finishes it
+bool cellularIsPoweringOff();
+// Puts a registered modem to sleep for CELLULAR_SLEEP_MODE_DTR, powers it off
+// if it won't take AT+CSCLK=1. The next beginCellularSetup() wakes it.
+unsigned char parkCellular();
+// By parkCellular(), this wake or an earlier one
+bool cellularIsParked();
 void rebootCellular();
+// What Serial1 runs at right now
+uint32_t cellularUartBaud();
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <Arduino.h>
+#include "modem_channel.h"
+
+
+#define CLOCK_SYNC_MAGIC 0x434f4c43  // "CLOC"
+#define CLOCK_SYNC_VERSION 1
+// Two syncs closer than this say more about the one second resolution of
+// AT+CCLK? than about the drift
+#define CLOCK_DRIFT_MIN_ELAPSED_S (60 * 60)
+// Beyond what any crystal or the RC oscillator does, a bad sync instead
+#define CLOCK_DRIFT_MAX_PPM 20000
+#define CLOCK_CCLK_RESPONSE_CAPACITY 40
+
+// What the clock has learned from the network. The ESP32 clock counts from 0
+// after a power loss, so until the first sync timestamps are seconds since
+// power on. The sync records how to turn those into real times, and the drift
+// between two syncs corrects the clock from then on. Kept in RTC memory like
+// the RTC batch, a power loss starts it over.
+struct ClockSync {
+  uint32_t magic;
+  uint16_t version;
+  bool driftKnown;
+  // Added to a timestamp taken before the first sync since power on
+  bool hasBackfill;
+  uint32_t backfillOffsetS;
+  // Real time of the last sync
+  uint32_t lastSyncS;
+  // How much faster than real time the clock runs, negative if slower
+  int32_t driftPpm;
+  // CRC-32 of everything above
+  uint32_t checksum;
+};
+
+extern ClockSync clockSync;
+// Correct the clock and the deep sleep for the estimated drift. The
+// simulator turns this off to measure what it saves.
+extern bool clockDriftCorrection;
+
+// The clock corrected for the drift since the last sync, to the nearest
+// second
+unsigned long clockNowS();
+// Whether the clock has been set since power on, so clockNowS() is real time
+bool clockIsSynced();
+// `timeS` in real time if it was taken before the first sync and that sync
+// has happened since, unchanged otherwise
+unsigned long backfilledTimeS(unsigned long timeS);
+// How long to ask the RTC timer for so `sleepS` real seconds pass
+uint64_t clockSleepUs(unsigned long sleepS);
+
+// From the network time the modem got with its registration, see AT+CTZU.
+// RET_ERROR if the modem doesn't know the time yet.
+unsigned char syncClockFromModem(ModemChannel* modem);
+// From the "now" of an upload response, when the modem didn't know
+void syncClockFromServer(long nowS, unsigned long requestMs);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Arduino.h>
+#include <coap_codec.h>
+#include "common_macros.h"
+#include "upload_transport.h"
+
+
+#define COAP_DEFAULT_PORT 5683
+// Bodies longer than a block go out block-wise (Block1). 2^(6 + 4) = 1024
+// bytes per datagram keeps a block with its options under the 1152 bytes
+// RFC 7252 recommends, and every block costs a round trip.
+#define COAP_UPLOAD_BLOCK_SZX 6
+// Retransmission of RFC 7252 section 4.8. The first timeout is spread over
+// up to 1.5 times this, then it doubles with every try.
+#define COAP_ACK_TIMEOUT_MS 2000
+#define COAP_MAX_RETRANSMIT 4
+// After an empty ACK, for the server's separate response
+#define COAP_SEPARATE_RESPONSE_TIMEOUT_MS 10000
+// RFC 7252 recommends messages of at most 1152 bytes, the answer has to fit
+#define COAP_RECEIVE_MAX_BYTES 1152
+// Header, token and options of a request, the payload is not copied
+#define COAP_REQUEST_HEADER_MAX_BYTES 192
+#define COAP_UPLOAD_PATH "measurement"
+// From the experimental range, for the batches of lib/batch_codec
+#define COAP_CONTENT_FORMAT_BATCH 65000
+
+// A request as it goes out, see coap_transport.cpp
+struct CoapDatagram;
+
+// Confirmable CoAP POSTs over UDP with the SIM7600 socket commands, one
+// round trip per block instead of an HTTPS exchange. The server's answer is
+// the piggybacked response to the last block. There is no DTLS: the body
+// and the write token, a query option, travel unencrypted.
+class CoapUploadTransport : public UploadTransport {
+public:
+  // `tokenQuery` like "token=..."
+  CoapUploadTransport(const char* host, uint16_t port, const char* tokenQuery);
+
+  unsigned char begin(const UploadRequest& request) override;
+  unsigned char send(
+    const UploadRequest& request,
+    HttpResponseSink sink,
+    void* sinkContext,
+    HttpResult* result
+  ) override;
+  unsigned char end() override;
+
+private:
+  unsigned char exchange(CoapDatagram* datagram, uint16_t messageId, CoapMessage* answer);
+  unsigned char awaitAnswer(uint16_t messageId, unsigned long timeout, CoapMessage* answer);
+  unsigned char acknowledge(uint16_t messageId);
+
+  const char* host;
+  uint16_t port;
+  const char* tokenQuery;
+};
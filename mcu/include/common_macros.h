@@ -12,5 +12,6 @@
 #define OK_OR_RETURN(x) ret = x; if (ret != RET_OK) return ret;
 #define RET_ERROR 1
 #define RET_TIMEOUT 2
+#define RET_OVERFLOW 3
 
 #define DEFAULT_TIMEOUT 20000
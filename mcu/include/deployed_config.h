@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+#include "stream_extensions.h"
+#include "cellular.h"
+#include "upload_compression.h"
+
+
+#define DEPLOYED_CONFIG_FILE_PATH "/deployed_config.bin"
+#define DEPLOYED_CONFIG_MAGIC 0x47464e43  // "CNFG"
+#define DEPLOYED_CONFIG_VERSION 5
+
+// Until the server sends its own values
+#define DEFAULT_MEASUREMENT_INTERVAL_S (60 * 60)
+#define DEFAULT_MAXIMUM_MEASUREMENT_INTERVAL_S (2 * 60 * 60)
+#define DEFAULT_MAXIMUM_INTER_TRANSMIT_DISTANCE_MM 30
+#define DEFAULT_MAXIMUM_INTER_TRANSMIT_MEASUREMENTS 30
+#define DEFAULT_MAXIMUM_INTER_TRANSMIT_TIME_S (60 * 60 * 24)
+#define DEFAULT_BATTERY_CUTOFF_MV 3500
+#define DEFAULT_SENSOR_DISTANCE_FROM_BOTTOM_MM 5000
+#define DEFAULT_MODEM_SLEEP_MODE CELLULAR_SLEEP_MODE_POWER_OFF
+#define DEFAULT_UPLOAD_ENCODING UPLOAD_ENCODING_IDENTITY
+
+// The tunables the server may set, named after its config keys. Kept in RTC
+// memory so a wake reads them with no parsing, and in flash to survive a
+// power loss.
+struct DeployedConfig {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t measurementIntervalS;
+  // How long the interval gets while the level is flat
+  uint32_t maximumMeasurementIntervalS;
+  // Upload when the level moved this much since the last upload
+  uint32_t maximumInterTransmitDistanceMM;
+  // Upload once this many measurements are waiting
+  uint32_t maximumInterTransmitMeasurements;
+  // Upload once the oldest waiting measurement is this old
+  uint32_t maximumInterTransmitTimeS;
+  // Below this, sleep for a day without measuring
+  uint32_t batteryCutoffMV;
+  // The deepest the water can be, echoes from further away are not waited for
+  uint32_t sensorDistanceFromBottomMM;
+  // What the modem does between uploads, one of CELLULAR_SLEEP_MODE_*
+  uint32_t modemSleepMode;
+  // What larger uploads are compressed with, one of UPLOAD_ENCODING_*
+  uint32_t uploadEncoding;
+  // CRC-32 of everything above
+  uint32_t checksum;
+};
+
+extern DeployedConfig deployedConfig;
+
+bool deployedConfigIsValid();
+// From flash if the copy there is valid, the defaults otherwise. LittleFS has
+// to be mounted.
+void loadDeployedConfig();
+unsigned char saveDeployedConfig();
+
+// Starts a candidate from the current config
+DeployedConfig beginDeployedConfigUpdate();
+// Takes `value` for `key` if it is a whitelisted key and within its bounds
+bool setDeployedConfigValue(DeployedConfig* candidate, const LineView& key, long value);
+// Makes the candidate current, returns false if nothing changed
+bool commitDeployedConfigUpdate(DeployedConfig* candidate);
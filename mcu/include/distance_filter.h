@@ -0,0 +1,147 @@
+#pragma once
+
+#include <Arduino.h>
+
+
+// Most shots one measurement can hold
+#define DISTANCE_SAMPLES_CAPACITY 16
+#define DISTANCE_TEMPERATURE_UNKNOWN INT16_MIN
+// The MAD of a sensor that reads the same every time is 0, which would
+// reject its 1 mm jitter
+#define DISTANCE_FILTER_MAD_FLOOR_MM 3
+// Samples that still spread more than this lower the confidence
+#define DISTANCE_FILTER_SPREAD_TOLERANCE_MM 20
+// The speed of sound the sensor driver assumes, 0.344 mm/us, in 0.01 mm/s
+#define DISTANCE_SPEED_OF_SOUND_REFERENCE 34400000L
+// Less sure readings are still saved, but can't trigger an upload or move
+// the measurement interval on their own
+#define DISTANCE_MIN_CONFIDENCE 50
+
+// The echoes of one measurement, in the order the shots were fired
+struct DistanceSamples {
+  unsigned long distancesMM[DISTANCE_SAMPLES_CAPACITY];
+  size_t count;
+  // Including the ones that never got an echo
+  size_t nbroShots;
+  // Dropped on purpose by TrimExtremes, which doesn't make a reading less
+  // trustworthy
+  size_t nbroTrimmed;
+  // Air temperature in 0.1 °C, DISTANCE_TEMPERATURE_UNKNOWN without a sensor
+  int16_t temperatureDeciC;
+};
+
+struct DistanceReading {
+  // 0 if no echo made it through the filters
+  unsigned long distanceMM;
+  // 0 to 100: the share of shots that made it through the filters, less if
+  // they still disagree
+  unsigned char confidence;
+};
+
+void sortDistances(unsigned long* distancesMM, size_t count);
+unsigned long medianDistanceMM(const DistanceSamples& samples);
+// Median absolute deviation from `medianMM`
+unsigned long distanceMadMM(const DistanceSamples& samples, unsigned long medianMM);
+// Mean and confidence of what is left of `samples`
+DistanceReading summarizeDistanceSamples(const DistanceSamples& samples);
+
+/// Stages
+// Each has a static apply(DistanceSamples*) and works in place, fixed size
+// and without the heap.
+
+// Replaces each sample with the median of the `Window` samples around it, so
+// a lone spike can't pull the mean
+template <size_t Window>
+struct MedianOfN {
+  static_assert(Window % 2 == 1 && Window <= DISTANCE_SAMPLES_CAPACITY, "Window has to be odd and fit");
+
+  static void apply(DistanceSamples* samples) {
+    if (samples->count < Window) return;
+    unsigned long filtered[DISTANCE_SAMPLES_CAPACITY];
+    for (size_t i = 0; i < samples->count; i++) {
+      // The first and last samples share the window at their end
+      size_t start = i < Window / 2 ? 0 : i - Window / 2;
+      if (start + Window > samples->count) start = samples->count - Window;
+      unsigned long window[Window];
+      memcpy(window, samples->distancesMM + start, sizeof(window));
+      sortDistances(window, Window);
+      filtered[i] = window[Window / 2];
+    }
+    memcpy(samples->distancesMM, filtered, samples->count * sizeof(unsigned long));
+  }
+};
+
+// Drops samples more than `KTenths` / 10 standard deviations from the median,
+// estimated from the MAD so the outliers don't widen it. Catches a wall
+// reflection that shows up in several shots in a row.
+template <unsigned KTenths>
+struct RejectMadOutliers {
+  static void apply(DistanceSamples* samples) {
+    if (samples->count < 3) return;
+    unsigned long medianMM = medianDistanceMM(*samples);
+    unsigned long madMM = max(distanceMadMM(*samples, medianMM), (unsigned long) DISTANCE_FILTER_MAD_FLOOR_MM);
+    // 1.4826 MAD is the standard deviation of normally distributed samples
+    unsigned long limitMM = (uint64_t) madMM * 14826 * KTenths / 100000;
+    size_t kept = 0;
+    for (size_t i = 0; i < samples->count; i++) {
+      unsigned long distanceMM = samples->distancesMM[i];
+      unsigned long deviationMM = distanceMM > medianMM ? distanceMM - medianMM : medianMM - distanceMM;
+      if (deviationMM <= limitMM) {
+        samples->distancesMM[kept++] = distanceMM;
+      }
+    }
+    samples->count = kept;
+  }
+};
+
+// Drops the lowest and the highest `Percent` of the samples, the mean of the
+// rest is the trimmed mean
+template <unsigned Percent>
+struct TrimExtremes {
+  static_assert(Percent < 50, "Nothing would be left");
+
+  static void apply(DistanceSamples* samples) {
+    size_t trim = samples->count * Percent / 100;
+    if (trim == 0) return;
+    sortDistances(samples->distancesMM, samples->count);
+    size_t kept = samples->count - 2 * trim;
+    memmove(samples->distancesMM, samples->distancesMM + trim, kept * sizeof(unsigned long));
+    samples->count = kept;
+    samples->nbroTrimmed += 2 * trim;
+  }
+};
+
+// Rescales from the speed of sound the driver assumes to the one at the
+// measured air temperature, 331.3 m/s + 0.606 m/s per °C. Does nothing
+// without a temperature.
+struct CompensateTemperature {
+  static void apply(DistanceSamples* samples) {
+    if (samples->temperatureDeciC == DISTANCE_TEMPERATURE_UNKNOWN) return;
+    int64_t speed = 33130000L + 6060L * samples->temperatureDeciC;
+    for (size_t i = 0; i < samples->count; i++) {
+      samples->distancesMM[i] = samples->distancesMM[i] * speed / DISTANCE_SPEED_OF_SOUND_REFERENCE;
+    }
+  }
+};
+
+/// Chain
+
+// Runs `Stages` in order on a copy of the samples, then averages what is left
+template <typename... Stages>
+struct DistanceFilter {
+  static DistanceReading apply(DistanceSamples samples) {
+    // Expands to one call per stage, in order
+    int stages[] = { 0, (Stages::apply(&samples), 0)... };
+    (void) stages;
+    return summarizeDistanceSamples(samples);
+  }
+};
+
+// What the sensor driver uses. No temperature sensor on this board yet, so
+// CompensateTemperature is a no-op until the samples come with one.
+typedef DistanceFilter<
+  MedianOfN<3>,
+  RejectMadOutliers<30>,
+  TrimExtremes<10>,
+  CompensateTemperature
+> DefaultDistanceFilter;
@@ -1,9 +1,42 @@
 #pragma once
 
+#include "distance_filter.h"
+
+
+#define PIN_DISTANCE_TRIGGER A5
+#define PIN_DISTANCE_ECHO A4
 
 #define AVERAGED_DISTANCE_COUNT_DEFAULT 5
 
+// What the ultrasonic sensor can tell apart from its own burst, and its range
+#define DISTANCE_SENSOR_MIN_MM 200
+#define DISTANCE_SENSOR_MAX_MM 10000
+
+// Trigger to rising echo while the sensor sends its burst, generously
+#define DISTANCE_ECHO_DELAY_MAX_US 1000
+// How long the sensor holds the echo line when nothing comes back
+#define DISTANCE_ECHO_HOLD_MAX_US 40000
+// Lets reflections of the previous shot die down before the next one
+#define DISTANCE_SHOT_SETTLE_US 2000
+
 void setupDistanceSensor();
-unsigned long getDistanceMMAveraged(
-    unsigned char count = AVERAGED_DISTANCE_COUNT_DEFAULT
+
+// Fires `count` shots from a timer and the echo interrupt, so the CPU is free
+// while they are in flight. An echo from further than `maximumDistanceMM` is
+// not waited for, and each shot follows as soon as the previous echo settled.
+void startDistanceMeasurement(unsigned char count, unsigned long maximumDistanceMM);
+bool distanceMeasurementDone();
+// The echoes received so far, without waiting. Its confidence only counts the
+// shots that are done.
+DistanceReading peekDistanceMeasurement();
+// Waits until `count` shots are done. Its confidence counts all shots, as if
+// the ones still to come got no echo.
+DistanceReading awaitDistanceShots(unsigned char count);
+// Waits for the shots still in flight and runs their echoes through
+// DefaultDistanceFilter
+DistanceReading finishDistanceMeasurement();
+
+DistanceReading measureDistance(
+    unsigned char count = AVERAGED_DISTANCE_COUNT_DEFAULT,
+    unsigned long maximumDistanceMM = DISTANCE_SENSOR_MAX_MM
 );
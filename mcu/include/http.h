@@ -3,15 +3,97 @@
 
 #include "common_macros.h"
 
-unsigned char httpGetDemo();
-unsigned char httpGet(
-    String url,
-    String* response,
-    unsigned long timeout = DEFAULT_TIMEOUT
+// Largest body AT+HTTPDATA takes (SIM7600 AT command manual)
+#define HTTP_DATA_MAX_BYTES 153600
+// The response is read with one AT+HTTPREAD per this many bytes into a
+// buffer of this size, however long it is
+#define HTTP_READ_CHUNK_BYTES 512
+
+// Numbered like AT+HTTPACTION takes them
+enum HttpMethod {
+  HTTP_METHOD_GET = 0,
+  HTTP_METHOD_POST = 1,
+};
+
+struct HttpHeader {
+  const char* name;
+  const char* value;
+};
+
+// Writes the request body to `out` and returns its length. Called twice,
+// first to measure the body and then to send it, and has to write the same
+// bytes both times.
+typedef size_t (*HttpBodyWriter)(Print* out, void* context);
+
+// Receives the response body a chunk at a time, in order. `data` is only
+// valid during the call.
+typedef void (*HttpResponseSink)(const char* data, size_t length, void* context);
+
+// What the request is as a whole. A session sends the URL, the content type
+// and the headers once, each request only its method and body.
+struct HttpRequest {
+  HttpMethod method;
+  const char* url;
+  // nullptr keeps the modem's default
+  const char* contentType;
+  const HttpHeader* headers;
+  size_t nbroHeaders;
+  // nullptr sends no body
+  HttpBodyWriter writeBody;
+  void* bodyContext;
+};
+
+enum HttpStatusClass {
+  // No +HTTPACTION result
+  HTTP_STATUS_NONE,
+  HTTP_STATUS_SUCCESS,
+  HTTP_STATUS_REDIRECT,
+  HTTP_STATUS_CLIENT_ERROR,
+  HTTP_STATUS_SERVER_ERROR,
+  // The 6xx and 7xx the modem reports in place of a status, like 713 when
+  // the network dropped the request
+  HTTP_STATUS_MODEM_ERROR,
+};
+
+struct HttpResult {
+  int status;
+  HttpStatusClass statusClass;
+  // As announced by the modem
+  uint32_t bodyLength;
+};
+
+HttpStatusClass httpStatusClass(int status);
+
+// A session sends any number of requests to one URL with a single
+// AT+HTTPINIT
+struct HttpSessionStats {
+  uint16_t nbroRequests;
+  uint32_t bytesSent;
+  uint32_t bytesReceived;
+  // Each from AT+HTTPDATA to the response read
+  uint32_t requestsMs;
+  uint32_t slowestRequestMs;
+};
+
+// Of the current or last session
+extern HttpSessionStats httpSessionStats;
+
+unsigned char beginHttpSession(const HttpRequest& request);
+// Sends the request's method and body with the session's URL and headers and
+// streams the response into `sink`, nullptr to drop it. RET_OK once the
+// modem has a result, whatever the status in `result`.
+unsigned char httpSessionRequest(
+    const HttpRequest& request,
+    HttpResponseSink sink,
+    void* sinkContext,
+    HttpResult* result
 );
-unsigned char httpPost(
-    String url,
-    String* body,
-    String* response,
-    unsigned long timeout = DEFAULT_TIMEOUT
+unsigned char endHttpSession();
+
+// A session for a single request
+unsigned char httpRequest(
+    const HttpRequest& request,
+    HttpResponseSink sink,
+    void* sinkContext,
+    HttpResult* result
 );
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <Arduino.h>
+#include "measurements.h"
+#include "distance_filter.h"
+
+
+// Whatever the server configures stays within these
+#define MEASUREMENT_INTERVAL_MIN_S (5 * 60)
+#define MEASUREMENT_INTERVAL_MAX_S (12 * 60 * 60)
+// While the level moves, aim for about this much change between wakes
+#define MEASUREMENT_TARGET_CHANGE_MM 50
+// Less change than this between wakes is sensor noise on a flat level
+#define MEASUREMENT_FLAT_CHANGE_MM 10
+// Each flat wake stretches the interval by half, up to flatMaxIntervalS
+#define MEASUREMENT_FLAT_STRETCH_PERCENT 150
+// Awake time a day the battery affords. Spending it faster than it accrues
+// lengthens the interval until the debt is paid back.
+#define MEASUREMENT_AWAKE_BUDGET_MS_PER_DAY (30UL * 60 * 1000)
+
+struct IntervalSchedulerConfig {
+  // measurementIntervalS from the server, used as is on a slowly moving level
+  uint32_t intervalS;
+  // maximumMeasurementIntervalS from the server, what a flat level stretches
+  // the interval to. Never below intervalS.
+  uint32_t flatMaxIntervalS;
+  uint32_t minIntervalS;
+  uint32_t maxIntervalS;
+  uint32_t awakeBudgetMsPerDay;
+};
+
+IntervalSchedulerConfig makeIntervalSchedulerConfig(uint32_t configuredIntervalS, uint32_t flatMaxIntervalS);
+
+// Lives in RTC memory. After a power loss or a panic that corrupted it, the
+// checksum no longer matches and scheduling starts over from the configured
+// interval.
+struct IntervalScheduler {
+  unsigned long lastTimeS;
+  unsigned long lastDistanceMM;
+  uint32_t intervalS;
+  // Unspent awake time. Negative after a wake that cost more than the
+  // interval before it earned.
+  int32_t awakeCreditMs;
+  // CRC-32 of everything above
+  uint32_t checksum;
+};
+
+// How long to sleep after a wake that measured `current` with `confidence`
+// and has been awake for `awakeMs`. Shortens the interval while the level
+// moves and stretches it toward flatMaxIntervalS while the level is flat,
+// within the bounds and the energy budget. A missed echo or a reading below
+// DISTANCE_MIN_CONFIDENCE keeps the interval and is not compared against.
+uint32_t nextMeasurementIntervalS(
+  IntervalScheduler* scheduler,
+  const IntervalSchedulerConfig& config,
+  const Measurement& current,
+  unsigned char confidence,
+  uint32_t awakeMs
+);
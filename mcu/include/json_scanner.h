@@ -0,0 +1,81 @@
+#pragma once
+
+#include <Arduino.h>
+#include "stream_extensions.h"
+
+
+// Keys deeper than this are not reported
+#define JSON_SCANNER_MAX_PATH 4
+// Longer member names are cut to this many bytes
+#define JSON_SCANNER_MAX_NAME 32
+// Nesting levels tracked, one bit each
+#define JSON_SCANNER_MAX_NESTING 32
+
+// `path` holds the member names leading to the number, outermost first. Only
+// valid during the call. Array levels add no name.
+typedef void (*JsonNumberHandler)(
+  const LineView* path,
+  size_t depth,
+  long value,
+  void* context
+);
+
+// Walks JSON text once and reports every member whose value is a number,
+// without building a document: names are kept only while they are on the
+// path and numbers parsed as their digits arrive. Fractions are dropped and
+// numbers beyond a long saturate. The text can be fed in pieces of any size,
+// split anywhere, so a response never has to be held in full.
+class JsonNumberScanner {
+public:
+  JsonNumberScanner(JsonNumberHandler handler, void* context);
+
+  void begin();
+  // False once the text is known not to be well nested
+  bool feed(const char* json, size_t length);
+  // Reports a number the text ends with. False if the text was not well
+  // nested or ended inside a string or a container.
+  bool finish();
+
+private:
+  enum State {
+    STATE_VALUE,
+    STATE_STRING,
+    STATE_STRING_ESCAPE,
+    // Between a string and the ':' that would make it a name
+    STATE_AFTER_STRING,
+    STATE_NUMBER,
+  };
+
+  bool scan(char c);
+  void reportNumber();
+
+  JsonNumberHandler handler;
+  void* context;
+  State state;
+  bool malformed;
+  char path[JSON_SCANNER_MAX_PATH][JSON_SCANNER_MAX_NAME];
+  uint8_t pathLengths[JSON_SCANNER_MAX_PATH];
+  size_t pathDepth;
+  // Bit n is set if nesting level n added a name to `path`
+  uint32_t namedLevels;
+  size_t nesting;
+  // The last string, until it turns out to be a name or not
+  char string[JSON_SCANNER_MAX_NAME];
+  uint8_t stringLength;
+  char name[JSON_SCANNER_MAX_NAME];
+  uint8_t nameLength;
+  bool hasName;
+  long number;
+  bool negative;
+  // Past the integer part, the rest is skipped
+  bool fraction;
+};
+
+// Scans text that is already in memory in one go. Returns false if it is not
+// well nested.
+bool scanJsonNumbers(
+  const char* json,
+  size_t length,
+  JsonNumberHandler handler,
+  void* context
+);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "measurements.h"
+
+
+#define MEASUREMENT_LOG_FILE_PATH "/measurement_log.bin"
+// Slots in the ring. Once full, the oldest record is overwritten. With the
+// RTC batch on top that holds twelve days of hourly measurements.
+#define MEASUREMENT_LOG_CAPACITY 256
+#define MEASUREMENT_LOG_RECORD_BYTES 32
+
+// Append-only log of measurements in a preallocated ring file. Every record
+// carries a sequence number and a CRC. Opening the log scans the ring and
+// continues after the newest valid record, so a write torn by a power loss
+// only ever costs that one record and the log never needs a format.
+//
+// Uploads are marked with a record of their own, measurements appended
+// after the last one are pending.
+class MeasurementLog {
+public:
+  explicit MeasurementLog(
+    const char* path = MEASUREMENT_LOG_FILE_PATH,
+    size_t capacity = MEASUREMENT_LOG_CAPACITY
+  );
+
+  // LittleFS has to be mounted
+  unsigned char open();
+  void close();
+
+  // Each of these writes exactly one record
+  unsigned char append(const Measurement& measurement);
+  // Everything appended so far stops being pending
+  unsigned char markUploaded();
+
+  // Of the pending measurements. Built by open() and updated by each write,
+  // so it only needs a scan of its own once appends overwrite pending ones.
+  const MeasurementSummary& pendingSummary() const;
+
+  // Iterates the pending measurements oldest first. Start with `sequence`
+  // set to firstPendingSequence() and call until it returns false.
+  uint32_t firstPendingSequence() const;
+  bool nextPending(uint32_t* sequence, Measurement* measurement);
+
+private:
+  struct Record {
+    uint32_t sequence;
+    uint8_t kind;
+    Measurement measurement;
+  };
+
+  unsigned char preallocate();
+  // From a scan of the pending records
+  void rebuildSummary();
+  bool readRecord(size_t slot, Record* record);
+  unsigned char writeRecord(const Record& record);
+
+  const char* path;
+  size_t capacity;
+  File file;
+  // Sequence numbers start at 1, 0 is never valid
+  uint32_t nextSequence = 1;
+  uint32_t pendingSequence = 1;
+  MeasurementSummary summary = {};
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Arduino.h>
+#include <LittleFS.h>
+
+
+class MeasurementLog;
+
+struct Measurement {
+  unsigned long timeS;
+  unsigned long distanceMM;
+  uint16_t batteryMV;
+};
+
+// CRC-32 of the measurement as stored, so the same on every retry of its
+// upload. The API dedupes on it.
+uint32_t measurementHash(const Measurement& measurement);
+
+// The raw structs /last_measurements.txt held before the measurement log
+bool readMeasurementFromFile(File* file, Measurement* measurement);
+// Older firmware stored the battery voltage as a double
+uint16_t voltsToMV(double volts);
+
+// What the transmit decision needs to know about the pending measurements,
+// kept up to date one measurement at a time. Zero-initialise for an empty one.
+struct MeasurementSummary {
+  uint32_t count;
+  unsigned long smallestDistanceMM;
+  unsigned long largestDistanceMM;
+  unsigned long firstTimeS;
+  unsigned long lastTimeS;
+  uint64_t distanceSumMM;
+};
+
+void addToSummary(MeasurementSummary* summary, const Measurement& measurement);
+unsigned long meanDistanceMM(const MeasurementSummary& summary);
+
+// One upload: the current measurement, then the ones pending in `log`, then
+// the ones buffered in RTC memory. `log` is nullptr when nothing is pending
+// in flash.
+//
+// `first` and `count` narrow it down to a chunk, index 0 being the current
+// measurement. A `count` of 0 goes on to the end, so leaving both out is
+// the whole batch.
+struct MeasurementBatch {
+  const Measurement* current;
+  MeasurementLog* log;
+  const Measurement* buffered;
+  size_t nbroBuffered;
+  size_t first;
+  size_t count;
+};
+
+// Of the whole batch, ignoring `first` and `count`
+size_t countMeasurements(const MeasurementBatch& batch);
+
+// The upload writers read the log one record at a time so RAM use does not
+// depend on the batch size. They return the number of bytes written and
+// produce the same bytes on every call.
+
+// The JSON array the API expects, byte for byte what ArduinoJson produced.
+// Each measurement carries its hash.
+#define MEASUREMENT_JSON_MAX_BYTES 112
+size_t writeMeasurementsJson(Print* out, const MeasurementBatch& batch);
+// The format of lib/batch_codec
+size_t writeMeasurementsBatch(Print* out, const MeasurementBatch& batch);
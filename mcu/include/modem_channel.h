@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+#include "common_macros.h"
+#include "stream_extensions.h"
+
+
+#define AT_OK_STATUS 0
+#define AT_ERROR_STATUS 1
+#define ERROR_RECEIVING_AT_STATUS 2
+
+#define MODEM_URC_HANDLERS_CAPACITY 8
+
+typedef void (*UrcHandler)(const LineView& line);
+
+// Sorts every line from the modem into replies to the command in flight and
+// unsolicited result codes (URCs), which go to the handler registered for
+// their prefix. Lines nobody expects are logged and dropped, so a stray URC
+// can no longer desync a request/response exchange.
+class ModemChannel {
+public:
+  explicit ModemChannel(LineReader* reader);
+
+  Stream* stream() const;
+  LineReader* reader() const;
+
+  // Replaces any handler already registered for `prefix`
+  bool onUrc(const char* prefix, UrcHandler handler);
+
+  // Sends an AT command and reads up to its final result code. The first
+  // line starting with `infoPrefix` (any line for "") is copied into `info`.
+  unsigned char sendCommand(
+    const String& command,
+    unsigned long timeout = DEFAULT_TIMEOUT,
+    const char* infoPrefix = nullptr,
+    char* info = nullptr,
+    size_t infoCapacity = 0
+  );
+  // Same as sendCommand, for when the command has already been written
+  unsigned char readResult(
+    unsigned long timeout = DEFAULT_TIMEOUT,
+    const char* infoPrefix = nullptr,
+    char* info = nullptr,
+    size_t infoCapacity = 0
+  );
+  // Reads until a line starting with `prefix` arrives. RET_ERROR if the modem
+  // reports an error first.
+  unsigned char waitForLine(const char* prefix, LineView* line, unsigned long timeout);
+  // Dispatches URCs until `condition` holds
+  unsigned char waitUntil(bool (*condition)(), unsigned long timeout);
+  // Dispatches the URCs that have already arrived
+  void poll();
+
+private:
+  struct UrcRoute {
+    const char* prefix;
+    UrcHandler handler;
+  };
+
+  bool dispatchUrc(const LineView& line);
+
+  LineReader* lineReader;
+  UrcRoute routes[MODEM_URC_HANDLERS_CAPACITY];
+  size_t routeCount = 0;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+#include "measurements.h"
+#include "measurement_log.h"
+
+
+// Sized above DEFAULT_MAXIMUM_INTER_TRANSMIT_MEASUREMENTS so a regular batch
+// is uploaded before it ever has to move to flash
+#define RTC_BATCH_CAPACITY 32
+#define RTC_BATCH_MAGIC 0x48435442  // "BTCH"
+#define RTC_BATCH_VERSION 3
+
+// Measurements taken since the last upload, kept in RTC memory across deep
+// sleep so a wake that only stores a measurement does not mount LittleFS.
+// RTC memory survives deep sleep and software resets but not a power loss,
+// and a panic may leave it half written, hence the checksum.
+//
+// A plain struct with free functions on purpose: a constructor would run on
+// every wake and wipe it.
+struct RtcBatch {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t nbroMeasurements;
+  // Everything pending, in the log and in `measurements`
+  MeasurementSummary pending;
+  Measurement measurements[RTC_BATCH_CAPACITY];
+  // CRC-32 of everything above
+  uint32_t checksum;
+};
+
+extern RtcBatch rtcBatch;
+
+// False after a power loss or if the batch was corrupted, in which case the
+// log has to be read to rebuild it
+bool rtcBatchIsValid();
+// Empties the buffer, `pending` describes what is left in the log
+void resetRtcBatch(const MeasurementSummary& pending);
+bool rtcBatchIsFull();
+void appendToRtcBatch(const Measurement& measurement);
+// Measurements pending in the log rather than in RTC memory
+uint32_t nbroPendingInLog();
+// Appends the buffered measurements to the log and empties the buffer
+void moveRtcBatchToLog(MeasurementLog* measurementLog);
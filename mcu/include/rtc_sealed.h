@@ -0,0 +1,38 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <batch_codec.h>
+
+
+// State kept across deep sleep, or in flash, starts with a magic and a
+// version and ends its checked part with a CRC-32 of everything in front of
+// it. A power loss, a panic halfway through an update or firmware with an
+// older layout then fails the check instead of being read as garbage. Bump
+// the version whenever the layout of a struct changes.
+
+template <typename T>
+uint32_t rtcChecksum(const T& sealed) {
+  return batchCrc32(0, (const uint8_t*) &sealed, offsetof(T, checksum));
+}
+
+template <typename T>
+void sealRtc(T* sealed) {
+  sealed->checksum = rtcChecksum(*sealed);
+}
+
+template <typename T>
+bool rtcIsValid(const T& sealed, uint32_t magic, uint16_t version) {
+  return sealed.magic == magic
+    && sealed.version == version
+    && sealed.checksum == rtcChecksum(sealed);
+}
+
+// Zeroes the padding too since the checksum covers it. Still to be sealed
+// once the caller filled in its defaults.
+template <typename T>
+void resetRtc(T* sealed, uint32_t magic, uint16_t version) {
+  memset(sealed, 0, sizeof(T));
+  sealed->magic = magic;
+  sealed->version = version;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Arduino.h>
+#include "distance_filter.h"
+
+
+// Raw sensor readings to the units the firmware stores, in integers. The
+// ESP32-S2 has no FPU, every double operation would be a call into libgcc's
+// soft-float routines.
+
+/// ADC
+// ADC_ATTEN_DB_11, 2.5 V over 13 bits
+// https://docs.espressif.com/projects/esp-idf/en/v4.4.2/esp32s2/api-reference/peripherals/adc.html#adc-attenuation
+#define ADC_FULL_SCALE_MV 2500
+#define ADC_MAX_COUNT 8191
+
+// Millivolts per ADC count in Q16, behind a voltage divider of
+// `ratioTenths` / 10
+constexpr uint32_t adcMillivoltScaleQ16(uint32_t ratioTenths) {
+  return ((uint64_t) ADC_FULL_SCALE_MV * ratioTenths * 65536 + ADC_MAX_COUNT * 10 / 2) / (ADC_MAX_COUNT * 10);
+}
+
+// Mean of `count` readings that add up to `adcSum`, rounded to the
+// millivolt. The scale's own rounding adds under 0.1 mV at full scale.
+constexpr uint16_t adcSumToMV(uint32_t adcSum, uint8_t count, uint32_t scaleQ16) {
+  // Q8 keeps the fraction through the division. Up to 255 readings still
+  // fit 32 bits.
+  uint32_t sumQ8 = (uint32_t) (((uint64_t) adcSum * scaleQ16) >> 8);
+  uint32_t divisor = (uint32_t) count << 8;
+  return (sumQ8 + divisor / 2) / divisor;
+}
+
+/// Echo
+// Half the round trip at DISTANCE_SPEED_OF_SOUND_REFERENCE, 0.172 mm/us
+#define ECHO_MM_PER_1000_US 172
+static_assert(
+  ECHO_MM_PER_1000_US * 200000L == DISTANCE_SPEED_OF_SOUND_REFERENCE,
+  "The echo conversion has to assume the filter's speed of sound"
+);
+
+// Rounded down like the cast of the double was. Good for echoes of up to
+// 24 s, the sensor gives up after 40 ms.
+constexpr unsigned long echoUsToMM(unsigned long pulseUs) {
+  return pulseUs * ECHO_MM_PER_1000_US / 1000;
+}
+
+constexpr unsigned long mmToEchoUs(unsigned long distanceMM) {
+  return distanceMM * 1000 / ECHO_MM_PER_1000_US;
+}
+
+/// Battery
+// Charge estimate from the resting voltage of the LiPo cell, 0 to 100.
+// Interpolated in 10 mV steps between the points of its discharge curve.
+uint8_t batteryMVToPercentage(uint16_t batteryMV);
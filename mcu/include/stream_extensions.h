@@ -4,32 +4,87 @@
 #include "common_macros.h"
 
 
+// Longest line (including "\r\n") the reader can hold, the modem's AT
+// responses are far shorter
+#define LINE_READER_CAPACITY 256
+// How long to give up the CPU when no data has arrived yet
+#define LINE_READER_POLL_MS 1
+
+// Slice of a LineReader's buffer without the line ending. Only valid until
+// the next read from the same reader.
+struct LineView {
+  const char* data;
+  size_t length;
+
+  bool isEmpty() const;
+  bool equals(const char* other) const;
+  bool startsWith(const char* prefix) const;
+  int indexOf(char c, size_t from = 0) const;
+  int indexOf(const char* needle, size_t from = 0) const;
+  bool contains(const char* needle) const;
+  // Parses the decimal number starting at `from`, 0 if there is none
+  long toLong(size_t from = 0) const;
+};
+
+// Splits a stream into lines using a fixed ring buffer, so reading AT
+// responses never touches the heap
+class LineReader {
+public:
+  explicit LineReader(Stream* stream);
+
+  Stream* stream() const;
+  // Bytes buffered or waiting in the stream
+  int available();
+  // Drops everything buffered or waiting in the stream
+  void clear();
+
+  unsigned char readLine(LineView* line, unsigned long timeout);
+  unsigned char readExactly(char* buffer, size_t length, unsigned long timeout);
+
+private:
+  void consumePendingLine();
+  void fill();
+  char at(size_t offset) const;
+
+  Stream* source;
+  char buffer[LINE_READER_CAPACITY];
+  size_t start = 0;
+  size_t count = 0;
+  // Length of the last returned line including its ending, consumed lazily
+  // so the LineView stays valid until the next read
+  size_t pendingLineLength = 0;
+};
+
+// Discards what is written, only counting the bytes. Used to measure a body
+// before streaming it.
+class ByteCounter : public Print {
+public:
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+
+  size_t count = 0;
+};
+
 unsigned char timedRead(
   Stream* stream,
   char* c,
   unsigned long timeout = DEFAULT_TIMEOUT
 );
 
-unsigned char readStringUntil(
-  Stream* stream,
-  char terminator,
-  String* result,
-  unsigned long timeout = DEFAULT_TIMEOUT
-);
-
 unsigned char readLine(
-  Stream* stream,
-  String* line,
+  LineReader* reader,
+  LineView* line,
   unsigned long timeout = DEFAULT_TIMEOUT
 );
 
 unsigned char readEmptyLine(
-  Stream* stream,
+  LineReader* reader,
   unsigned long timeout = DEFAULT_TIMEOUT
 );
 
 unsigned char readExactly(
-  Stream* stream,
+  LineReader* reader,
   char* buffer,
   int length,
   unsigned long timeout = DEFAULT_TIMEOUT
@@ -0,0 +1,31 @@
+#pragma once
+
+
+#include "common_macros.h"
+
+// AT+CIPSEND takes at most this many bytes per datagram (SIM7600 AT command
+// manual)
+#define UDP_DATAGRAM_MAX_BYTES 1500
+
+// Writes a datagram to `out` and returns its length. Called twice like an
+// HttpBodyWriter, to measure and then to send, and has to write the same
+// bytes both times.
+typedef size_t (*UdpDatagramWriter)(Print* out, void* context);
+
+// Brings up the modem's IP stack (AT+NETOPEN) and opens a UDP socket on
+// `localPort`. The modem pushes each datagram it receives as +IPD, which
+// lands in `receiveBuffer` whenever the modem channel reads. A newer
+// datagram replaces one that was not received yet, longer ones than
+// `capacity` are dropped.
+unsigned char openUdpSocket(uint16_t localPort, uint8_t* receiveBuffer, size_t capacity);
+unsigned char sendUdpDatagram(
+    const char* host,
+    uint16_t port,
+    UdpDatagramWriter writeDatagram,
+    void* context
+);
+// Waits up to `timeout` for the next datagram, which stays in the receive
+// buffer until the modem channel reads again. RET_TIMEOUT if none came.
+unsigned char receiveUdpDatagram(size_t* length, unsigned long timeout);
+// Closes the socket and the IP stack again
+unsigned char closeUdpSocket();
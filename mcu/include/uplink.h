@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Arduino.h>
+
+
+#define UPLINK_CELLULAR 0
+#define UPLINK_WIFI 1
+#define UPLINKS 2
+
+#define UPLINK_STATS_MAGIC 0x4b4e4c55  // "ULNK"
+#define UPLINK_STATS_VERSION 1
+// Until a link has been measured: a scan and DHCP, a cold boot and
+// registration
+#define UPLINK_WIFI_DEFAULT_CONNECT_MS 3000
+#define UPLINK_CELLULAR_DEFAULT_CONNECT_MS 16000
+// Drawn while connecting, the MCU's 30 mA included
+#define UPLINK_WIFI_CONNECT_MA 110
+#define UPLINK_CELLULAR_CONNECT_MA 120
+// What the upload then costs on top, about one HTTPS request
+#define UPLINK_WIFI_UPLOAD_MAS 100
+#define UPLINK_CELLULAR_UPLOAD_MAS 250
+// A link that failed to connect is passed over for the next 2^n - 1
+// uploads after the nth failure in a row, up to this many
+#define UPLINK_MAX_SKIPPED_UPLOADS 31
+
+// What connecting each link took lately, the input of the cost model. Kept
+// in RTC memory, a power loss starts over from the defaults.
+struct UplinkStats {
+  uint32_t magic;
+  uint16_t version;
+  // Moving average of the successful connects
+  uint32_t connectMs[UPLINKS];
+  // In a row
+  uint16_t nbroFailures[UPLINKS];
+  uint16_t uploadsToSkip[UPLINKS];
+  // CRC-32 of everything above
+  uint32_t checksum;
+};
+
+extern UplinkStats uplinkStats;
+
+// Expected charge of connecting over `link` and uploading, in mAs
+uint32_t uplinkCostMAs(uint8_t link);
+// The cheapest link that is configured and not passed over after failures.
+// Cellular is always there to fall back to.
+uint8_t chooseUplink();
+// Starts connecting the cheapest link while the wake goes on, like
+// beginCellularSetup()
+void beginUplink();
+// Waits for the link begun, falling back to cellular if WiFi doesn't
+// connect. Returns the link the upload goes over.
+uint8_t connectUplink();
+// The upload is off after all
+void cancelUplink();
+// After the upload: WiFi off, the modem parked or powered off like
+// DeployedConfig::modemSleepMode says
+void releaseUplink();
+// {"link":"wifi","fallback":false,"connectMs":{"wifi":<ms>,"cellular":<ms>},
+// "costMAs":{"wifi":<mAs>,"cellular":<mAs>}}, this wake's
+size_t writeUplinkJson(Print* out);
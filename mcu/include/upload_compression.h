@@ -0,0 +1,55 @@
+#pragma once
+
+#include <Arduino.h>
+#include <lzss_codec.h>
+#include "common_macros.h"
+#include "http.h"
+
+
+// What the API may accept, see DeployedConfig::uploadEncoding. The server
+// switches to heatshrink once it can decode it.
+#define UPLOAD_ENCODING_IDENTITY 0
+#define UPLOAD_ENCODING_HEATSHRINK 1
+
+// Picked with the upload-compression benchmark in the simulator: a larger
+// window gains a few percent and takes several times as long to search
+#define UPLOAD_COMPRESSION_WINDOW_BITS 8
+#define UPLOAD_COMPRESSION_LOOKAHEAD_BITS 4
+// Names the parameters, the decoder has to use the same
+#define UPLOAD_COMPRESSION_CONTENT_ENCODING \
+  "heatshrink-w" STRINGIFY(UPLOAD_COMPRESSION_WINDOW_BITS) "-l" STRINGIFY(UPLOAD_COMPRESSION_LOOKAHEAD_BITS)
+// Smaller uploads go out as they are, the header and the literals would
+// cost more than the few matches save. The benchmark breaks even at 2, this
+// leaves room for noisier levels.
+#define UPLOAD_COMPRESSION_MIN_MEASUREMENTS 4
+
+// Compresses whatever is printed to it into `out`. Uses a static window
+// buffer, so only one may be in use at a time.
+class CompressingPrint : public Print {
+public:
+  explicit CompressingPrint(Print* out);
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+
+  // Returns the number of compressed bytes written to `out`
+  size_t finish();
+
+private:
+  static void writeToOut(const uint8_t* bytes, size_t length, void* context);
+
+  LzssEncoder encoder;
+};
+
+// Whether an upload of `nbroMeasurements` goes out compressed
+bool shouldCompressUpload(size_t nbroMeasurements);
+
+// The context of writeCompressedBody()
+struct CompressedBody {
+  HttpBodyWriter writeBody;
+  void* context;
+};
+
+// An HttpBodyWriter for what the CompressedBody's writer writes, compressed
+size_t writeCompressedBody(Print* out, void* context);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <Arduino.h>
+
+
+#define UPLOAD_OUTBOX_MAGIC 0x58424f55  // "UOBX"
+#define UPLOAD_OUTBOX_VERSION 1
+// After the nth failed upload in a row the next 2^n - 1 wakes only store,
+// up to this many
+#define UPLOAD_BACKOFF_MAX_WAKES 31
+
+// Where the pending measurements stand with the server. They stay in the RTC
+// batch and the log until an upload is acknowledged, the server echoes the
+// batch sequence once it stored every measurement. Failed uploads back off
+// in wakes, the measurements piling up meanwhile go out in one session.
+//
+// Kept in RTC memory like the RTC batch. A power loss only forgets the
+// backoff, the measurements themselves are in the log by then.
+struct UploadOutbox {
+  uint32_t magic;
+  uint16_t version;
+  // In a row, since the last acknowledged upload
+  uint16_t nbroFailures;
+  // Of the batch being uploaded, the same across its retries
+  uint32_t batchSequence;
+  uint32_t wakesUntilRetry;
+  // CRC-32 of everything above
+  uint32_t checksum;
+};
+
+extern UploadOutbox uploadOutbox;
+// The simulator turns this off to measure what backing off saves
+extern bool uploadBackoff;
+
+uint32_t uploadBatchSequence();
+// A wake that would upload stores instead
+bool uploadIsBackingOff();
+// Once per wake that doesn't upload
+void passUploadBackoffWake();
+void acknowledgeUpload();
+void failUpload();
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Arduino.h>
+#include "common_macros.h"
+#include "http.h"
+
+
+// Which of the transports below an upload goes with
+#define UPLOAD_TRANSPORT_HTTP 0
+#define UPLOAD_TRANSPORT_COAP 1
+
+// What every chunk of an upload is sent with, only the state behind
+// `bodyContext` changes from one chunk to the next
+struct UploadRequest {
+  HttpBodyWriter writeBody;
+  void* bodyContext;
+  // nullptr for JSON
+  const char* contentType;
+  // nullptr for none, like UPLOAD_COMPRESSION_CONTENT_ENCODING otherwise
+  const char* contentEncoding;
+};
+
+// How an upload gets to the API and its answer back. The modem is set up
+// and registered before begin().
+class UploadTransport {
+public:
+  virtual unsigned char begin(const UploadRequest& request) = 0;
+  // Streams the answer into `sink`. RET_OK once the server answered,
+  // whatever the status in `result`.
+  virtual unsigned char send(
+    const UploadRequest& request,
+    HttpResponseSink sink,
+    void* sinkContext,
+    HttpResult* result
+  ) = 0;
+  virtual unsigned char end() = 0;
+};
+
+// HTTPS with the modem's HTTP stack, the write token as a bearer token
+class HttpUploadTransport : public UploadTransport {
+public:
+  // `oneSession` sends all chunks with one AT+HTTPINIT rather than one each
+  HttpUploadTransport(const char* url, const char* authorization, bool oneSession);
+
+  unsigned char begin(const UploadRequest& request) override;
+  unsigned char send(
+    const UploadRequest& request,
+    HttpResponseSink sink,
+    void* sinkContext,
+    HttpResult* result
+  ) override;
+  unsigned char end() override;
+
+private:
+  HttpRequest toHttpRequest(const UploadRequest& request);
+
+  const char* url;
+  HttpHeader headers[2];
+  bool oneSession;
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <Arduino.h>
+
+
+#define WAKE_PROFILE_MAGIC 0x464f5250  // "PROF"
+#define WAKE_PROFILE_VERSION 3
+// Bucket 0 counts durations below 1 ms, each further bucket four times as
+// long, the last one everything from 16 s up
+#define WAKE_PROFILE_BUCKETS 9
+
+// Where a wake's time goes. Phases may overlap, the shots for instance run
+// while the battery is read, so they don't add up to the awake time.
+enum WakePhase {
+  WAKE_PHASE_USB_CHECK,
+  WAKE_PHASE_BATTERY,
+  WAKE_PHASE_DISTANCE,
+  WAKE_PHASE_FLASH,
+  // Power on or wake from parking to the UART answering
+  WAKE_PHASE_MODEM_BOOT,
+  WAKE_PHASE_REGISTRATION,
+  // WiFi.begin() to an address, or to giving up on WiFi
+  WAKE_PHASE_WIFI,
+  // The upload, over whichever link
+  WAKE_PHASE_HTTP,
+  // Powering off or parking the modem
+  WAKE_PHASE_MODEM_OFF,
+  WAKE_PHASE_BLINK,
+  WAKE_PHASES,
+};
+
+struct WakePhaseHistogram {
+  // Summed over the wakes
+  uint32_t totalMs;
+  uint16_t buckets[WAKE_PROFILE_BUCKETS];
+};
+
+// Upload bodies and datagrams written to the modem, for the throughput of
+// its UART. The AT commands around them are too short to tell.
+struct ModemUartTransfer {
+  uint32_t bytes;
+  uint32_t us;
+  // Of the last transfer
+  uint32_t baud;
+};
+
+// The wakes since the last upload, phase by phase. Kept in RTC memory, a
+// power loss or a corrupted checksum starts it over.
+struct WakeProfile {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t nbroWakes;
+  WakePhaseHistogram phases[WAKE_PHASES];
+  WakePhaseHistogram awake;
+  ModemUartTransfer modemUart;
+  // CRC-32 of everything above
+  uint32_t checksum;
+};
+
+extern WakeProfile wakeProfile;
+
+// At the start of a wake, forgets the timings of the previous one
+void beginWakeProfile();
+// Nest, only the outermost start and stop of a phase count. A few
+// microseconds each.
+void startWakePhase(WakePhase phase);
+void stopWakePhase(WakePhase phase);
+
+// Times the enclosing scope
+class WakePhaseTimer {
+public:
+  explicit WakePhaseTimer(WakePhase phase);
+  ~WakePhaseTimer();
+
+private:
+  WakePhase phase;
+};
+
+const char* wakePhaseName(WakePhase phase);
+// Spent in `phase` this wake so far, 0 if it didn't run
+uint32_t wakePhaseUs(WakePhase phase);
+// `bytes` went to the modem at `baud` in `us`
+void recordModemUartTransfer(uint32_t baud, size_t bytes, uint32_t us);
+// This wake so far
+const ModemUartTransfer& wakeModemUartTransfer();
+
+// Adds this wake to the profile, right before deep sleep
+void finishWakeProfile();
+// After the profile was uploaded
+void clearWakeProfile();
+// {"wakes":<n>,"bucketsMs":[...],"<phase>":{"totalMs":<ms>,"histogram":[...]},
+// ...,"awake":{...},"modemUart":{"baud":<rate>,"bytes":<n>,"bytesPerS":<n>}}
+size_t writeWakeProfileJson(Print* out);
+// This wake and the profile so far as a table
+void printWakeProfile(Print* out);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Arduino.h>
+
+
+#define WIFI_LINK_CACHE_MAGIC 0x49464957  // "WIFI"
+#define WIFI_LINK_CACHE_VERSION 1
+// With the cached channel and BSSID the station skips the scan and usually
+// has an address in a few hundred ms. Longer means the access point moved.
+#define WIFI_FAST_CONNECT_TIMEOUT_MS 2000
+// A scan of every channel, authentication and DHCP
+#define WIFI_CONNECT_TIMEOUT_MS 10000
+#define WIFI_BSSID_BYTES 6
+
+// The access point the station last got an address from. Kept in RTC
+// memory, a power loss or a corrupted checksum means a full scan.
+struct WifiLinkCache {
+  uint32_t magic;
+  uint16_t version;
+  uint8_t bssid[WIFI_BSSID_BYTES];
+  int32_t channel;
+  // CRC-32 of everything above
+  uint32_t checksum;
+};
+
+extern WifiLinkCache wifiLinkCache;
+// WIFI_SSID of api_secrets.h, empty if there is none. The simulator sets it
+// to compare the links.
+extern const char* wifiSsid;
+
+// A known SSID to connect to
+bool wifiIsConfigured();
+// Starts connecting in the background, to the cached access point if there
+// is one
+void beginWifiConnect();
+// Waits for an address. If the cached access point doesn't answer, forgets
+// it and scans for the SSID. RET_TIMEOUT if nothing came of either.
+unsigned char finishWifiConnect();
+// Disconnects and turns the radio off
+void stopWifi();
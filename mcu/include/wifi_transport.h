@@ -0,0 +1,35 @@
+#pragma once
+
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <WiFiClientSecure.h>
+#include "common_macros.h"
+#include "upload_transport.h"
+
+
+// Connecting, TLS handshake included, and each read of the response
+#define WIFI_HTTP_TIMEOUT_MS 15000
+
+// HTTPS with the ESP32's own stack once the station has an address, the
+// same requests as HttpUploadTransport. Chunks go out over one kept-alive
+// connection, each buffered whole on the heap since HTTPClient wants the
+// length up front.
+class WifiHttpUploadTransport : public UploadTransport {
+public:
+  WifiHttpUploadTransport(const char* url, const char* authorization);
+
+  unsigned char begin(const UploadRequest& request) override;
+  unsigned char send(
+    const UploadRequest& request,
+    HttpResponseSink sink,
+    void* sinkContext,
+    HttpResult* result
+  ) override;
+  unsigned char end() override;
+
+private:
+  const char* url;
+  const char* authorization;
+  WiFiClientSecure client;
+  HTTPClient http;
+};
@@ -0,0 +1,184 @@
+#include <string.h>
+#include "batch_codec.h"
+
+
+#define VARINT_MAX_BYTES 5
+
+static uint32_t zigzagEncode(int32_t value) {
+  return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static int32_t zigzagDecode(uint32_t value) {
+  return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+// Differences wrap around like the unsigned fields themselves, so any pair of
+// values survives the round trip
+static uint32_t delta(uint32_t value, uint32_t previous) {
+  return zigzagEncode((int32_t) (value - previous));
+}
+
+uint32_t batchCrc32(uint32_t crc, const uint8_t* bytes, size_t length) {
+  // Bitwise rather than table driven, batches are small and flash is not
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= bytes[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+/// BatchEncoder
+
+BatchEncoder::BatchEncoder(BatchByteSink sink, void* context)
+  : sink(sink), context(context) {}
+
+void BatchEncoder::write(const uint8_t* bytes, size_t count) {
+  crc = batchCrc32(crc, bytes, count);
+  length += count;
+  sink(bytes, count, context);
+}
+
+void BatchEncoder::writeVarint(uint32_t value) {
+  uint8_t bytes[VARINT_MAX_BYTES];
+  size_t count = 0;
+  do {
+    bytes[count] = value & 0x7f;
+    value >>= 7;
+    if (value != 0) bytes[count] |= 0x80;
+    count++;
+  } while (value != 0);
+  write(bytes, count);
+}
+
+void BatchEncoder::begin(uint32_t baseTimeS) {
+  crc = 0;
+  length = 0;
+  previous = { baseTimeS, 0, 0 };
+  uint8_t version = BATCH_CODEC_VERSION;
+  write(&version, 1);
+  writeVarint(baseTimeS);
+}
+
+void BatchEncoder::add(const BatchRecord& record) {
+  writeVarint(delta(record.timeS, previous.timeS));
+  writeVarint(delta(record.distanceMM, previous.distanceMM));
+  writeVarint(delta(record.batteryMV, previous.batteryMV));
+  previous = record;
+}
+
+size_t BatchEncoder::finish() {
+  uint32_t value = crc;
+  uint8_t bytes[BATCH_CODEC_CRC_BYTES];
+  for (size_t i = 0; i < BATCH_CODEC_CRC_BYTES; i++) {
+    bytes[i] = value >> (8 * i);
+  }
+  // The CRC does not cover itself
+  length += BATCH_CODEC_CRC_BYTES;
+  sink(bytes, BATCH_CODEC_CRC_BYTES, context);
+  return length;
+}
+
+/// Buffer encoding
+
+struct BufferSink {
+  uint8_t* out;
+  size_t capacity;
+  size_t length;
+};
+
+static void writeToBuffer(const uint8_t* bytes, size_t length, void* context) {
+  BufferSink* buffer = (BufferSink*) context;
+  if (buffer->length + length <= buffer->capacity) {
+    memcpy(buffer->out + buffer->length, bytes, length);
+  }
+  buffer->length += length;
+}
+
+size_t encodeBatch(
+  const BatchRecord records[],
+  size_t nbroRecords,
+  uint8_t* out,
+  size_t capacity
+) {
+  BufferSink buffer = { out, capacity, 0 };
+  BatchEncoder encoder(writeToBuffer, &buffer);
+  encoder.begin(nbroRecords > 0 ? records[0].timeS : 0);
+  for (size_t i = 0; i < nbroRecords; i++) {
+    encoder.add(records[i]);
+  }
+  size_t length = encoder.finish();
+  return length <= capacity ? length : 0;
+}
+
+/// Decoding
+
+static unsigned char readVarint(
+  const uint8_t* data,
+  size_t end,
+  size_t* offset,
+  uint32_t* value
+) {
+  *value = 0;
+  for (size_t i = 0; i < VARINT_MAX_BYTES; i++) {
+    if (*offset >= end) return BATCH_DECODE_TRUNCATED;
+    uint8_t byte = data[(*offset)++];
+    if (i == VARINT_MAX_BYTES - 1 && byte > 0x0f) return BATCH_DECODE_MALFORMED;
+    *value |= (uint32_t) (byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0) return BATCH_DECODE_OK;
+  }
+  return BATCH_DECODE_MALFORMED;
+}
+
+unsigned char decodeBatch(
+  const uint8_t* data,
+  size_t length,
+  BatchRecord records[],
+  size_t capacity,
+  size_t* nbroRecords
+) {
+  *nbroRecords = 0;
+  if (length < 1 + 1 + BATCH_CODEC_CRC_BYTES) {
+    return BATCH_DECODE_TRUNCATED;
+  }
+  size_t end = length - BATCH_CODEC_CRC_BYTES;
+  uint32_t expectedCrc = 0;
+  for (size_t i = 0; i < BATCH_CODEC_CRC_BYTES; i++) {
+    expectedCrc |= (uint32_t) data[end + i] << (8 * i);
+  }
+  if (batchCrc32(0, data, end) != expectedCrc) {
+    return BATCH_DECODE_BAD_CRC;
+  }
+  if (data[0] != BATCH_CODEC_VERSION) {
+    return BATCH_DECODE_BAD_VERSION;
+  }
+
+  size_t offset = 1;
+  unsigned char ret;
+  uint32_t baseTimeS;
+  if ((ret = readVarint(data, end, &offset, &baseTimeS)) != BATCH_DECODE_OK) {
+    return ret;
+  }
+  BatchRecord previous = { baseTimeS, 0, 0 };
+  while (offset < end) {
+    if (*nbroRecords == capacity) {
+      return BATCH_DECODE_TOO_MANY_RECORDS;
+    }
+    uint32_t fields[3];
+    for (size_t i = 0; i < 3; i++) {
+      if ((ret = readVarint(data, end, &offset, &fields[i])) != BATCH_DECODE_OK) {
+        return ret;
+      }
+    }
+    BatchRecord record = {
+      previous.timeS + (uint32_t) zigzagDecode(fields[0]),
+      previous.distanceMM + (uint32_t) zigzagDecode(fields[1]),
+      (uint16_t) (previous.batteryMV + zigzagDecode(fields[2]))
+    };
+    records[(*nbroRecords)++] = record;
+    previous = record;
+  }
+  return BATCH_DECODE_OK;
+}
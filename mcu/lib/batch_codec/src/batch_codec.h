@@ -0,0 +1,88 @@
+#pragma once
+
+// Compact binary encoding of a measurement batch, the opt-in alternative to
+// the JSON upload. Plain C++ without Arduino dependencies so the backend can
+// build the decoder as is.
+//
+// Layout:
+//   version           1 byte, BATCH_CODEC_VERSION
+//   base time         varint, seconds since the Unix epoch
+//   per record        zigzag varints of the difference to the previous
+//                     record (the base time and 0 for the first):
+//                     time in s, distance in mm, battery voltage in mV
+//   CRC-32            4 bytes little endian, IEEE 802.3 (same as zlib's
+//                     crc32()) over everything before it
+//
+// The record count follows from the length of the body.
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define BATCH_CODEC_VERSION 1
+#define BATCH_CODEC_CONTENT_TYPE "application/vnd.water-level.batch"
+
+// Worst case sizes, for sizing buffers
+#define BATCH_CODEC_HEADER_MAX_BYTES (1 + 5)
+#define BATCH_CODEC_RECORD_MAX_BYTES (5 + 5 + 3)
+#define BATCH_CODEC_CRC_BYTES 4
+#define BATCH_CODEC_MAX_BYTES(nbroRecords) \
+  (BATCH_CODEC_HEADER_MAX_BYTES + (nbroRecords) * BATCH_CODEC_RECORD_MAX_BYTES + BATCH_CODEC_CRC_BYTES)
+
+#define BATCH_DECODE_OK 0
+#define BATCH_DECODE_TRUNCATED 1
+#define BATCH_DECODE_BAD_CRC 2
+#define BATCH_DECODE_BAD_VERSION 3
+#define BATCH_DECODE_TOO_MANY_RECORDS 4
+#define BATCH_DECODE_MALFORMED 5
+
+struct BatchRecord {
+  uint32_t timeS;
+  uint32_t distanceMM;
+  uint16_t batteryMV;
+};
+
+// Receives the encoded bytes as they are produced
+typedef void (*BatchByteSink)(const uint8_t* bytes, size_t length, void* context);
+
+// Encodes one record at a time, so a batch never has to be in memory whole
+class BatchEncoder {
+public:
+  BatchEncoder(BatchByteSink sink, void* context);
+
+  void begin(uint32_t baseTimeS);
+  void add(const BatchRecord& record);
+  // Appends the CRC. Returns the number of bytes written since begin().
+  size_t finish();
+
+private:
+  void write(const uint8_t* bytes, size_t length);
+  void writeVarint(uint32_t value);
+
+  BatchByteSink sink;
+  void* context;
+  uint32_t crc = 0;
+  size_t length = 0;
+  BatchRecord previous = { 0, 0, 0 };
+};
+
+// Encodes `records` with the first record's time as base time. Returns the
+// encoded length, or 0 if it does not fit in `capacity`.
+size_t encodeBatch(
+  const BatchRecord records[],
+  size_t nbroRecords,
+  uint8_t* out,
+  size_t capacity
+);
+
+// Returns one of BATCH_DECODE_*. `nbroRecords` is set to the number of
+// records decoded.
+unsigned char decodeBatch(
+  const uint8_t* data,
+  size_t length,
+  BatchRecord records[],
+  size_t capacity,
+  size_t* nbroRecords
+);
+
+uint32_t batchCrc32(uint32_t crc, const uint8_t* bytes, size_t length);
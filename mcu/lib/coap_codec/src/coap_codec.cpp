@@ -0,0 +1,193 @@
+#include <string.h>
+#include "coap_codec.h"
+
+
+// Option deltas and lengths from 13 on take extra bytes
+#define COAP_EXTENDED_1_BYTE 13
+#define COAP_EXTENDED_2_BYTES 14
+#define COAP_EXTENDED_RESERVED 15
+#define COAP_EXTENDED_1_BYTE_BASE 13
+#define COAP_EXTENDED_2_BYTES_BASE 269
+
+static uint8_t extendedNibble(uint32_t value) {
+  return value < COAP_EXTENDED_1_BYTE_BASE ? value
+    : value < COAP_EXTENDED_2_BYTES_BASE ? COAP_EXTENDED_1_BYTE
+    : COAP_EXTENDED_2_BYTES;
+}
+
+// Reads the extra bytes of a delta or length nibble. False if the message
+// ends first or the nibble is the reserved one.
+static bool readExtended(uint8_t nibble, const uint8_t** position, const uint8_t* end, uint32_t* value) {
+  if (nibble < COAP_EXTENDED_1_BYTE) {
+    *value = nibble;
+    return true;
+  }
+  if (nibble == COAP_EXTENDED_1_BYTE && *position + 1 <= end) {
+    *value = COAP_EXTENDED_1_BYTE_BASE + (*position)[0];
+    *position += 1;
+    return true;
+  }
+  if (nibble == COAP_EXTENDED_2_BYTES && *position + 2 <= end) {
+    *value = COAP_EXTENDED_2_BYTES_BASE + ((*position)[0] << 8 | (*position)[1]);
+    *position += 2;
+    return true;
+  }
+  return false;
+}
+
+// Reads the option at `position`, which has to be no payload marker
+static bool readOption(const uint8_t** position, const uint8_t* end, uint16_t* number, CoapOption* option) {
+  uint8_t nibbles = *(*position)++;
+  uint32_t delta, length;
+  if (!readExtended(nibbles >> 4, position, end, &delta)
+    || !readExtended(nibbles & 0x0f, position, end, &length)
+    || length > (size_t) (end - *position)
+    || *number + delta > UINT16_MAX) {
+    return false;
+  }
+  *number += delta;
+  *option = { *number, *position, length };
+  *position += length;
+  return true;
+}
+
+/// CoapWriter
+
+CoapWriter::CoapWriter(uint8_t* buffer, size_t capacity)
+  : buffer(buffer), capacity(capacity) {}
+
+bool CoapWriter::write(const uint8_t* bytes, size_t count) {
+  if (full || count > capacity - written) {
+    full = true;
+    return false;
+  }
+  memcpy(buffer + written, bytes, count);
+  written += count;
+  return true;
+}
+
+bool CoapWriter::writeExtended(uint32_t value) {
+  if (value < COAP_EXTENDED_1_BYTE_BASE) {
+    return true;
+  }
+  if (value < COAP_EXTENDED_2_BYTES_BASE) {
+    uint8_t byte = value - COAP_EXTENDED_1_BYTE_BASE;
+    return write(&byte, 1);
+  }
+  value -= COAP_EXTENDED_2_BYTES_BASE;
+  uint8_t bytes[] = { (uint8_t) (value >> 8), (uint8_t) value };
+  return write(bytes, 2);
+}
+
+bool CoapWriter::begin(const CoapHeader& header) {
+  written = 0;
+  lastOption = 0;
+  full = header.tokenLength > COAP_TOKEN_MAX_BYTES;
+  uint8_t bytes[COAP_HEADER_BYTES] = {
+    (uint8_t) (COAP_VERSION << 6 | (header.type & 0x03) << 4 | header.tokenLength),
+    header.code,
+    (uint8_t) (header.messageId >> 8),
+    (uint8_t) header.messageId,
+  };
+  return write(bytes, sizeof(bytes)) && write(header.token, header.tokenLength);
+}
+
+bool CoapWriter::addOption(uint16_t number, const uint8_t* value, size_t length) {
+  if (number < lastOption || length > UINT16_MAX - COAP_EXTENDED_2_BYTES_BASE) {
+    full = true;
+    return false;
+  }
+  uint32_t delta = number - lastOption;
+  lastOption = number;
+  uint8_t nibbles = extendedNibble(delta) << 4 | extendedNibble(length);
+  return write(&nibbles, 1) && writeExtended(delta) && writeExtended(length) && write(value, length);
+}
+
+bool CoapWriter::addOption(uint16_t number, const char* value) {
+  return addOption(number, (const uint8_t*) value, strlen(value));
+}
+
+bool CoapWriter::addUintOption(uint16_t number, uint32_t value) {
+  uint8_t bytes[4];
+  size_t length = 0;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    if (length > 0 || (value >> shift) != 0) {
+      bytes[length++] = value >> shift;
+    }
+  }
+  return addOption(number, bytes, length);
+}
+
+bool CoapWriter::beginPayload() {
+  uint8_t marker = COAP_PAYLOAD_MARKER;
+  return write(&marker, 1);
+}
+
+size_t CoapWriter::length() const {
+  return written;
+}
+
+/// Decoding
+
+unsigned char coapDecode(const uint8_t* data, size_t length, CoapMessage* message) {
+  if (length < COAP_HEADER_BYTES || data[0] >> 6 != COAP_VERSION) {
+    return COAP_DECODE_MALFORMED;
+  }
+  CoapHeader* header = &message->header;
+  header->type = (data[0] >> 4) & 0x03;
+  header->tokenLength = data[0] & 0x0f;
+  header->code = data[1];
+  header->messageId = data[2] << 8 | data[3];
+  if (header->tokenLength > COAP_TOKEN_MAX_BYTES || (size_t) COAP_HEADER_BYTES + header->tokenLength > length) {
+    return COAP_DECODE_MALFORMED;
+  }
+  memcpy(header->token, data + COAP_HEADER_BYTES, header->tokenLength);
+
+  // Walked once here so the iterator can trust the options
+  const uint8_t* position = data + COAP_HEADER_BYTES + header->tokenLength;
+  const uint8_t* end = data + length;
+  message->options = position;
+  uint16_t number = 0;
+  CoapOption option;
+  while (position < end && *position != COAP_PAYLOAD_MARKER) {
+    if (!readOption(&position, end, &number, &option)) {
+      return COAP_DECODE_MALFORMED;
+    }
+  }
+  message->optionsLength = position - message->options;
+  message->payload = nullptr;
+  message->payloadLength = 0;
+  if (position < end) {
+    // A marker has to be followed by a payload
+    if (position + 1 == end) {
+      return COAP_DECODE_MALFORMED;
+    }
+    message->payload = position + 1;
+    message->payloadLength = end - position - 1;
+  }
+  return COAP_DECODE_OK;
+}
+
+CoapOptionIterator::CoapOptionIterator(const CoapMessage& message)
+  : position(message.options), end(message.options + message.optionsLength) {}
+
+bool CoapOptionIterator::next(CoapOption* option) {
+  return position < end && readOption(&position, end, &number, option);
+}
+
+uint32_t coapUintOptionValue(const CoapOption& option) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < option.length && i < 4; i++) {
+    value = value << 8 | option.value[i];
+  }
+  return value;
+}
+
+// NUM, then M, then SZX in the low 3 bits
+uint32_t coapEncodeBlock(const CoapBlock& block) {
+  return block.number << 4 | (block.more ? 0x08 : 0) | (block.szx & 0x07);
+}
+
+CoapBlock coapDecodeBlock(uint32_t value) {
+  return { value >> 4, (value & 0x08) != 0, (uint8_t) (value & 0x07) };
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+// CoAP messages (RFC 7252) and the Block1 option of block-wise transfers
+// (RFC 7959), as much as a confirmable upload needs. Plain C++ without
+// Arduino dependencies like lib/batch_codec, so the stand-in server in sim/
+// builds the same code.
+//
+// Layout:
+//   header            version (2 bits), type (2), token length (4),
+//                     code (8), message ID (16, big endian)
+//   token             0 to 8 bytes
+//   options           ascending by number, each as the delta to the
+//                     previous number and its length in one byte of
+//                     nibbles (13 and 14 extend them by 1 and 2 bytes),
+//                     then the value
+//   payload           0xff, then the payload up to the end of the datagram
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define COAP_VERSION 1
+
+#define COAP_TYPE_CONFIRMABLE 0
+#define COAP_TYPE_NON_CONFIRMABLE 1
+#define COAP_TYPE_ACKNOWLEDGEMENT 2
+#define COAP_TYPE_RESET 3
+
+// Written c.dd, the class in the top 3 bits
+#define COAP_CODE(class, detail) (((class) << 5) | (detail))
+#define COAP_CODE_CLASS(code) ((code) >> 5)
+#define COAP_CODE_DETAIL(code) ((code) & 0x1f)
+#define COAP_CODE_EMPTY COAP_CODE(0, 0)
+#define COAP_CODE_POST COAP_CODE(0, 2)
+#define COAP_CODE_CHANGED COAP_CODE(2, 4)
+#define COAP_CODE_CONTINUE COAP_CODE(2, 31)
+#define COAP_CODE_BAD_REQUEST COAP_CODE(4, 0)
+#define COAP_CODE_UNAUTHORIZED COAP_CODE(4, 1)
+#define COAP_CODE_NOT_FOUND COAP_CODE(4, 4)
+#define COAP_CODE_METHOD_NOT_ALLOWED COAP_CODE(4, 5)
+#define COAP_CODE_REQUEST_ENTITY_INCOMPLETE COAP_CODE(4, 8)
+
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_OPTION_URI_QUERY 15
+#define COAP_OPTION_BLOCK1 27
+
+#define COAP_CONTENT_FORMAT_JSON 50
+
+#define COAP_HEADER_BYTES 4
+#define COAP_TOKEN_MAX_BYTES 8
+#define COAP_PAYLOAD_MARKER 0xff
+
+#define COAP_DECODE_OK 0
+#define COAP_DECODE_MALFORMED 1
+
+// Block sizes are 2^(szx + 4), 16 to 1024 bytes
+#define COAP_BLOCK_BYTES(szx) (1u << ((szx) + 4))
+#define COAP_BLOCK_SZX_MAX 6
+
+struct CoapHeader {
+  uint8_t type;
+  uint8_t code;
+  uint16_t messageId;
+  uint8_t tokenLength;
+  uint8_t token[COAP_TOKEN_MAX_BYTES];
+};
+
+struct CoapOption {
+  uint16_t number;
+  const uint8_t* value;
+  size_t length;
+};
+
+// Points into the decoded datagram
+struct CoapMessage {
+  CoapHeader header;
+  const uint8_t* options;
+  size_t optionsLength;
+  const uint8_t* payload;
+  size_t payloadLength;
+};
+
+struct CoapBlock {
+  uint32_t number;
+  bool more;
+  uint8_t szx;
+};
+
+// Writes the header and the options into a fixed buffer, the payload goes
+// out after them without being copied. Every add returns false once the
+// buffer is full, and so does everything after it.
+class CoapWriter {
+public:
+  CoapWriter(uint8_t* buffer, size_t capacity);
+
+  bool begin(const CoapHeader& header);
+  // Options have to be added in ascending order of their number
+  bool addOption(uint16_t number, const uint8_t* value, size_t length);
+  bool addOption(uint16_t number, const char* value);
+  // In the fewest bytes, none for 0
+  bool addUintOption(uint16_t number, uint32_t value);
+  // The marker, only if a payload follows
+  bool beginPayload();
+  size_t length() const;
+
+private:
+  bool write(const uint8_t* bytes, size_t count);
+  bool writeExtended(uint32_t value);
+
+  uint8_t* buffer;
+  size_t capacity;
+  size_t written = 0;
+  uint16_t lastOption = 0;
+  bool full = false;
+};
+
+unsigned char coapDecode(const uint8_t* data, size_t length, CoapMessage* message);
+
+// Goes through the options of a message decoded by coapDecode()
+class CoapOptionIterator {
+public:
+  explicit CoapOptionIterator(const CoapMessage& message);
+
+  bool next(CoapOption* option);
+
+private:
+  const uint8_t* position;
+  const uint8_t* end;
+  uint16_t number = 0;
+};
+
+uint32_t coapUintOptionValue(const CoapOption& option);
+uint32_t coapEncodeBlock(const CoapBlock& block);
+CoapBlock coapDecodeBlock(uint32_t value);
@@ -0,0 +1,181 @@
+#include <string.h>
+#include "lzss_codec.h"
+
+
+#define LITERAL_BITS (1 + 8)
+
+/// LzssEncoder
+
+LzssEncoder::LzssEncoder(
+  uint8_t windowBits,
+  uint8_t lookaheadBits,
+  uint8_t* buffer,
+  LzssByteSink sink,
+  void* context
+) : windowBits(windowBits), lookaheadBits(lookaheadBits), buffer(buffer), sink(sink), context(context) {}
+
+void LzssEncoder::begin() {
+  position = 0;
+  fill = 0;
+  bits = 0;
+  nbroBits = 0;
+  nbroOutput = 0;
+  length = 0;
+}
+
+void LzssEncoder::write(const uint8_t* bytes, size_t count) {
+  size_t window = (size_t) 1 << windowBits;
+  size_t lookahead = (size_t) 1 << lookaheadBits;
+  size_t capacity = LZSS_ENCODER_BUFFER_BYTES(windowBits, lookaheadBits);
+  while (count > 0) {
+    if (fill == capacity) {
+      // Less than a lookahead is left to compress, keep one window before it
+      size_t dropped = position - window;
+      memmove(buffer, buffer + dropped, fill - dropped);
+      position -= dropped;
+      fill -= dropped;
+    }
+    size_t taken = count < capacity - fill ? count : capacity - fill;
+    memcpy(buffer + fill, bytes, taken);
+    fill += taken;
+    bytes += taken;
+    count -= taken;
+    // Only with a whole lookahead buffered is the longest match known
+    while (fill - position >= lookahead) {
+      encodeNext();
+    }
+  }
+}
+
+void LzssEncoder::encodeNext() {
+  size_t window = (size_t) 1 << windowBits;
+  size_t lookahead = (size_t) 1 << lookaheadBits;
+  size_t maxLength = fill - position < lookahead ? fill - position : lookahead;
+  size_t windowStart = position > window ? position - window : 0;
+  const uint8_t* next = buffer + position;
+
+  size_t bestLength = 0;
+  size_t bestOffset = 0;
+  // Nearest first, a match may run on into the bytes it copies
+  for (size_t candidate = position; candidate-- > windowStart && bestLength < maxLength;) {
+    const uint8_t* match = buffer + candidate;
+    if (match[bestLength] != next[bestLength] || match[0] != next[0]) continue;
+    size_t matched = 1;
+    while (matched < maxLength && match[matched] == next[matched]) {
+      matched++;
+    }
+    if (matched > bestLength) {
+      bestLength = matched;
+      bestOffset = position - candidate;
+    }
+  }
+
+  if (bestLength * LITERAL_BITS > 1u + windowBits + lookaheadBits) {
+    writeBits(0, 1);
+    writeBits(bestOffset - 1, windowBits);
+    writeBits(bestLength - 1, lookaheadBits);
+    position += bestLength;
+  } else {
+    writeBits(1, 1);
+    writeBits(*next, 8);
+    position++;
+  }
+}
+
+void LzssEncoder::writeBits(uint16_t value, uint8_t count) {
+  while (count > 0) {
+    count--;
+    bits = (bits << 1) | ((value >> count) & 1);
+    if (++nbroBits == 8) {
+      output[nbroOutput++] = bits;
+      bits = 0;
+      nbroBits = 0;
+      if (nbroOutput == sizeof(output)) {
+        flush();
+      }
+    }
+  }
+}
+
+void LzssEncoder::flush() {
+  if (nbroOutput == 0) return;
+  length += nbroOutput;
+  sink(output, nbroOutput, context);
+  nbroOutput = 0;
+}
+
+size_t LzssEncoder::finish() {
+  while (position < fill) {
+    encodeNext();
+  }
+  if (nbroBits > 0) {
+    writeBits(0, 8 - nbroBits);
+  }
+  flush();
+  return length;
+}
+
+/// Decoding
+
+struct BitReader {
+  const uint8_t* data;
+  size_t length;
+  size_t bitOffset;
+
+  size_t remaining() const {
+    return length * 8 - bitOffset;
+  }
+
+  uint16_t read(uint8_t count) {
+    uint16_t value = 0;
+    for (; count > 0; count--, bitOffset++) {
+      value = (value << 1) | ((data[bitOffset / 8] >> (7 - bitOffset % 8)) & 1);
+    }
+    return value;
+  }
+};
+
+unsigned char lzssDecode(
+  const uint8_t* data,
+  size_t length,
+  uint8_t windowBits,
+  uint8_t lookaheadBits,
+  uint8_t* out,
+  size_t capacity,
+  size_t* decodedLength
+) {
+  *decodedLength = 0;
+  BitReader reader = { data, length, 0 };
+  // No token is shorter than a byte, so less than that is the padding
+  while (reader.remaining() >= 8) {
+    if (reader.read(1) == 1) {
+      if (reader.remaining() < 8) {
+        return LZSS_DECODE_MALFORMED;
+      }
+      if (*decodedLength == capacity) {
+        return LZSS_DECODE_OVERFLOW;
+      }
+      out[(*decodedLength)++] = reader.read(8);
+      continue;
+    }
+    if (reader.remaining() < (size_t) windowBits + lookaheadBits) {
+      return LZSS_DECODE_MALFORMED;
+    }
+    size_t offset = reader.read(windowBits) + 1;
+    size_t count = reader.read(lookaheadBits) + 1;
+    if (offset > *decodedLength) {
+      return LZSS_DECODE_MALFORMED;
+    }
+    if (capacity - *decodedLength < count) {
+      return LZSS_DECODE_OVERFLOW;
+    }
+    // Byte by byte, the copy may overlap what it produces
+    for (size_t i = 0; i < count; i++, (*decodedLength)++) {
+      out[*decodedLength] = out[*decodedLength - offset];
+    }
+  }
+  if (reader.remaining() > 0 && reader.read(reader.remaining()) != 0) {
+    return LZSS_DECODE_MALFORMED;
+  }
+  return LZSS_DECODE_OK;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+// Streaming LZSS compression in the bit format of heatshrink
+// (https://github.com/atomicobject/heatshrink), so its decoders read the
+// output as is. Plain C++ without Arduino dependencies like lib/batch_codec,
+// and no heap: the encoder works in a buffer the caller sizes.
+//
+// Bit stream, most significant bit first:
+//   literal           1, then the byte (8 bits)
+//   back reference    0, then offset - 1 (window bits), then
+//                     length - 1 (lookahead bits)
+// The last byte is padded with zeros, too few bits for another token.
+//
+// A back reference reaches at most 2^windowBits bytes back and copies at
+// most 2^lookaheadBits bytes. Encoder and decoder have to agree on both.
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define LZSS_WINDOW_BITS_MIN 4
+#define LZSS_WINDOW_BITS_MAX 15
+#define LZSS_LOOKAHEAD_BITS_MIN 3
+
+// All the RAM an encoder needs besides itself: two windows, so the buffer
+// only shifts once a window, and the lookahead
+#define LZSS_ENCODER_BUFFER_BYTES(windowBits, lookaheadBits) \
+  ((2 << (windowBits)) + (1 << (lookaheadBits)))
+// Worst case size of `length` bytes compressed, all literals
+#define LZSS_MAX_BYTES(length) ((length) + ((length) + 7) / 8)
+
+#define LZSS_DECODE_OK 0
+#define LZSS_DECODE_OVERFLOW 1
+#define LZSS_DECODE_MALFORMED 2
+
+// Receives the compressed bytes as they are produced
+typedef void (*LzssByteSink)(const uint8_t* bytes, size_t length, void* context);
+
+// Compresses a stream of any length in a fixed buffer. Finds the longest
+// match by scanning the whole window, so the time per byte grows with the
+// window and the RAM with it.
+class LzssEncoder {
+public:
+  // `buffer` holds LZSS_ENCODER_BUFFER_BYTES(windowBits, lookaheadBits).
+  // heatshrink takes a `lookaheadBits` below `windowBits` only.
+  LzssEncoder(
+    uint8_t windowBits,
+    uint8_t lookaheadBits,
+    uint8_t* buffer,
+    LzssByteSink sink,
+    void* context
+  );
+
+  void begin();
+  void write(const uint8_t* bytes, size_t length);
+  // Compresses what is still buffered and pads the last byte. Returns the
+  // number of bytes produced since begin().
+  size_t finish();
+
+private:
+  void encodeNext();
+  void writeBits(uint16_t value, uint8_t count);
+  void flush();
+
+  uint8_t windowBits;
+  uint8_t lookaheadBits;
+  uint8_t* buffer;
+  LzssByteSink sink;
+  void* context;
+  // Everything before `position` is compressed, the window ends there
+  size_t position = 0;
+  size_t fill = 0;
+  uint8_t bits = 0;
+  uint8_t nbroBits = 0;
+  // Handed to the sink a few bytes at a time rather than byte by byte
+  uint8_t output[16];
+  size_t nbroOutput = 0;
+  size_t length = 0;
+};
+
+// Returns one of LZSS_DECODE_*. `decodedLength` is set to the number of
+// bytes decoded.
+unsigned char lzssDecode(
+  const uint8_t* data,
+  size_t length,
+  uint8_t windowBits,
+  uint8_t lookaheadBits,
+  uint8_t* out,
+  size_t capacity,
+  size_t* decodedLength
+);
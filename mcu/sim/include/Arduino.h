@@ -0,0 +1,268 @@
+#pragma once
+
+// Host stand-in for the subset of the Arduino-ESP32 core the firmware uses.
+// Only on the include path of the `native` environment; everything that
+// touches hardware ends up in sim/src/hal.cpp, which forwards it to the
+// simulated clock, UARTs, pins and modem.
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <math.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+using std::min;
+using std::max;
+
+#define _min(a, b) ((a) < (b) ? (a) : (b))
+#define _max(a, b) ((a) > (b) ? (a) : (b))
+#define _abs(x) ((x) > 0 ? (x) : -(x))
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+#define IRAM_ATTR
+
+// Pin numbers only need to be distinct in the simulator
+#define LED_BUILTIN 13
+#define A2 16
+#define A3 15
+#define A4 14
+#define A5 8
+
+#ifndef DST_NONE
+#define DST_NONE 0
+#endif
+
+// Collected in one section so the simulator can reset or corrupt RTC memory,
+// see sim/src/hal.cpp
+#define RTC_DATA_ATTR __attribute__((section("sim_rtc_data")))
+
+/// String
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper*>(string_literal))
+
+class String {
+public:
+  String(const char* cString = "") : value(cString == nullptr ? "" : cString) {}
+  String(const __FlashStringHelper* flashString)
+    : String(reinterpret_cast<const char*>(flashString)) {}
+  String(const std::string& string) : value(string) {}
+  explicit String(char c) : value(1, c) {}
+  explicit String(int number) : value(std::to_string(number)) {}
+  explicit String(unsigned int number) : value(std::to_string(number)) {}
+  explicit String(long number) : value(std::to_string(number)) {}
+  explicit String(unsigned long number) : value(std::to_string(number)) {}
+
+  unsigned int length() const { return value.length(); }
+  const char* c_str() const { return value.c_str(); }
+  bool reserve(unsigned int size) { value.reserve(size); return true; }
+  char charAt(unsigned int index) const {
+    return index < value.length() ? value[index] : 0;
+  }
+  char operator[](unsigned int index) const { return charAt(index); }
+
+  int indexOf(char c, unsigned int from = 0) const {
+    return find(value.find(c, from));
+  }
+  int indexOf(const String& string, unsigned int from = 0) const {
+    return find(value.find(string.value, from));
+  }
+  String substring(unsigned int from) const {
+    return from < value.length() ? String(value.substr(from)) : String();
+  }
+  String substring(unsigned int from, unsigned int to) const {
+    if (from > to) std::swap(from, to);
+    if (from >= value.length()) return String();
+    return String(value.substr(from, to - from));
+  }
+  void remove(unsigned int index) {
+    if (index < value.length()) value.erase(index);
+  }
+  void remove(unsigned int index, unsigned int count) {
+    if (index < value.length()) value.erase(index, count);
+  }
+  long toInt() const { return atol(value.c_str()); }
+
+  bool concat(const String& string) { value += string.value; return true; }
+  bool concat(const char* cString) { value += cString; return true; }
+  bool concat(char c) { value += c; return true; }
+  String& operator+=(const String& string) { concat(string); return *this; }
+  String& operator+=(const char* cString) { concat(cString); return *this; }
+  String& operator+=(char c) { concat(c); return *this; }
+
+  bool operator==(const String& other) const { return value == other.value; }
+  bool operator==(const char* other) const { return value == other; }
+  bool operator!=(const String& other) const { return value != other.value; }
+  bool operator!=(const char* other) const { return value != other; }
+
+private:
+  static int find(size_t index) {
+    return index == std::string::npos ? -1 : (int) index;
+  }
+
+  std::string value;
+};
+
+// Only needed so ArduinoJson's String adapters compile
+class StringSumHelper : public String {
+public:
+  using String::String;
+  StringSumHelper(const String& string) : String(string) {}
+};
+
+inline StringSumHelper operator+(const String& a, const String& b) {
+  StringSumHelper result(a);
+  result.concat(b);
+  return result;
+}
+inline StringSumHelper operator+(const String& a, const char* b) {
+  return a + String(b);
+}
+inline StringSumHelper operator+(const char* a, const String& b) {
+  return String(a) + b;
+}
+
+/// Print, Stream and HardwareSerial
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size);
+  size_t write(const char* cString) {
+    return write((const uint8_t*) cString, strlen(cString));
+  }
+
+  size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+  size_t print(const char* cString) { return write(cString); }
+  size_t print(const String& string) { return write(string.c_str()); }
+  size_t print(char c) { return write((uint8_t) c); }
+  size_t print(int number) { return printf("%d", number); }
+  size_t print(unsigned int number) { return printf("%u", number); }
+  size_t print(long number) { return printf("%ld", number); }
+  size_t print(unsigned long number) { return printf("%lu", number); }
+  size_t print(double number) { return printf("%.2f", number); }
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(const T& value) { return print(value) + println(); }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  void setTimeout(unsigned long timeoutMs) { timeout = timeoutMs; }
+  unsigned long getTimeout() const { return timeout; }
+  String readStringUntil(char terminator);
+  size_t readBytes(char* buffer, size_t length);
+
+protected:
+  int timedRead();
+
+  unsigned long timeout = 1000;
+};
+
+#define HW_FLOWCTRL_DISABLE 0x0
+#define HW_FLOWCTRL_CTS_RTS 0x3
+
+class HardwareSerial : public Stream {
+public:
+  explicit HardwareSerial(uint8_t uartNumber) : uartNumber(uartNumber) {}
+
+  void begin(unsigned long baud);
+  void end() {}
+  void flush() {}
+  void updateBaudRate(unsigned long baud);
+  uint32_t baudRate() const { return baud; }
+  bool setPins(int8_t rxPin, int8_t txPin, int8_t ctsPin = -1, int8_t rtsPin = -1) { return true; }
+  bool setHwFlowCtrlMode(uint8_t mode = HW_FLOWCTRL_CTS_RTS, uint8_t threshold = 64);
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t c) override;
+  using Print::write;
+
+private:
+  // Of a 10 bit frame at `baud`
+  uint64_t byteNs() const;
+
+  uint8_t uartNumber;
+  uint32_t baud = 115200;
+  uint8_t flowControl = HW_FLOWCTRL_DISABLE;
+  // What writes took short of a whole microsecond, carried to the next one
+  uint64_t pendingTxNs = 0;
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+/// Timing, GPIO and ADC
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+uint16_t analogRead(uint8_t pin);
+unsigned long pulseIn(uint8_t pin, uint8_t state, unsigned long timeout = 1000000L);
+
+#define digitalPinToInterrupt(pin) (pin)
+// The simulator calls `handler` right away, on the level change that triggers it
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode);
+void detachInterrupt(uint8_t pin);
+
+/// ESP-IDF system calls
+
+typedef enum {
+  ESP_RST_UNKNOWN,
+  ESP_RST_POWERON,
+  ESP_RST_EXT,
+  ESP_RST_SW,
+  ESP_RST_PANIC,
+  ESP_RST_INT_WDT,
+  ESP_RST_TASK_WDT,
+  ESP_RST_WDT,
+  ESP_RST_DEEPSLEEP,
+  ESP_RST_BROWNOUT,
+  ESP_RST_SDIO,
+} esp_reset_reason_t;
+
+esp_reset_reason_t esp_reset_reason();
+void esp_sleep_enable_timer_wakeup(uint64_t timeUs);
+[[noreturn]] void esp_deep_sleep_start();
+[[noreturn]] void esp_restart();
+
+// Route the firmware's wall clock through the simulated RTC. Declared after
+// the system headers so their own declarations are left alone.
+time_t simTime(time_t* result);
+int simGettimeofday(struct timeval* tv, void* tz);
+int simSettimeofday(const struct timeval* tv, const void* tz);
+#define time(result) simTime(result)
+#define gettimeofday(tv, tz) simGettimeofday(tv, tz)
+#define settimeofday(tv, tz) simSettimeofday(tv, tz)
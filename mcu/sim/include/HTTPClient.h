@@ -0,0 +1,26 @@
+#pragma once
+
+// Host stand-in for the Arduino-ESP32 HTTPClient. Requests go to
+// sim::WifiNetwork, which answers like the API does.
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+
+class HTTPClient {
+public:
+  bool begin(WiFiClient& client, const String& url);
+  void setReuse(bool reuse) {}
+  void setTimeout(uint16_t timeout) {}
+  void addHeader(const String& name, const String& value);
+  int POST(uint8_t* payload, size_t size);
+  // The body of the last response, its length or a HTTPC_ERROR_*
+  int writeToStream(Stream* stream);
+  void end();
+
+private:
+  bool begun = false;
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+// Host stand-in for the Arduino-ESP32 LittleFS wrapper. Files live in memory
+// (see sim/src/little_fs.cpp) and survive simulated deep sleeps, like flash.
+
+#include <Arduino.h>
+#include <memory>
+
+
+namespace sim {
+struct SimFile;
+}
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class File : public Stream {
+public:
+  File() {}
+  explicit File(std::shared_ptr<sim::SimFile> file) : file(file) {}
+
+  operator bool() const { return file != nullptr; }
+  size_t size() const;
+  size_t position() const;
+  bool seek(uint32_t position, SeekMode mode = SeekSet);
+  void flush();
+  void close();
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+  size_t readBytes(char* buffer, size_t length);
+
+private:
+  std::shared_ptr<sim::SimFile> file;
+};
+
+namespace fs {
+
+class LittleFSFS {
+public:
+  bool begin(
+    bool formatOnFail = false,
+    const char* basePath = "/littlefs",
+    uint8_t maxOpenFiles = 10,
+    const char* partitionLabel = "spiffs"
+  );
+  void end();
+  bool format();
+  File open(const String& path, const char* mode = "r", bool create = false);
+  bool exists(const String& path);
+  bool remove(const String& path);
+  size_t totalBytes();
+  size_t usedBytes();
+};
+
+}
+
+extern fs::LittleFSFS LittleFS;
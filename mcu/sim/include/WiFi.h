@@ -0,0 +1,54 @@
+#pragma once
+
+// Host stand-in for the Arduino-ESP32 WiFi station. Connecting, the access
+// point and its timing are simulated by sim::WifiNetwork, see sim_wifi.h.
+
+#include <Arduino.h>
+
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_SCAN_COMPLETED = 2,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6,
+} wl_status_t;
+
+typedef enum {
+  WIFI_OFF = 0,
+  WIFI_STA = 1,
+} wifi_mode_t;
+
+class WiFiClass {
+public:
+  bool mode(wifi_mode_t mode);
+  void persistent(bool persistent) {}
+  wl_status_t begin(
+    const char* ssid,
+    const char* passphrase = nullptr,
+    int32_t channel = 0,
+    const uint8_t* bssid = nullptr,
+    bool connect = true
+  );
+  wl_status_t status();
+  bool disconnect(bool wifiOff = false);
+  uint8_t* BSSID();
+  int32_t channel();
+  int8_t RSSI();
+};
+
+extern WiFiClass WiFi;
+
+// Only ever handed to HTTPClient, which talks to the simulated network itself
+class WiFiClient : public Stream {
+public:
+  virtual ~WiFiClient() {}
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  size_t write(uint8_t c) override { return 1; }
+  using Print::write;
+  void stop() {}
+};
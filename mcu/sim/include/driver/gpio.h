@@ -0,0 +1,18 @@
+#pragma once
+
+// Host stand-in for the ESP-IDF GPIO hold functions, see sim/src/hal.cpp
+
+#include <Arduino.h>
+// For esp_err_t
+#include <esp_timer.h>
+
+
+typedef int gpio_num_t;
+
+// A held pin keeps its level, digitalWrite() has no effect until released
+esp_err_t gpio_hold_en(gpio_num_t pin);
+esp_err_t gpio_hold_dis(gpio_num_t pin);
+// Holds keep through deep sleep, otherwise the wake resets them. Stays
+// enabled after the wake until disabled.
+void gpio_deep_sleep_hold_en();
+void gpio_deep_sleep_hold_dis();
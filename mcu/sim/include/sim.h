@@ -0,0 +1,112 @@
+#pragma once
+
+// Control surface of the host simulator: virtual clock, board inputs and the
+// counters the runner reports per wake. The firmware never includes this.
+
+#include <Arduino.h>
+#include <map>
+#include <vector>
+
+
+namespace sim {
+
+// Thrown out of the firmware to end a simulated wake
+struct WakeEnd {
+  enum Kind { DEEP_SLEEP, RESTART, TIME_LIMIT, POWER_LOSS } kind;
+};
+
+struct Clock {
+  // Monotonic, including deep sleeps. Peripherals schedule against this.
+  uint64_t totalUs = 0;
+  uint64_t wakeStartUs = 0;
+  // What time(nullptr) returns vs. what the server thinks the time is
+  int64_t deviceEpochUs = 0;
+  int64_t trueEpochUs = 0;
+  uint64_t wakeLimitUs = 15ULL * 60 * 1000000;
+};
+
+struct Board {
+  esp_reset_reason_t resetReason = ESP_RST_POWERON;
+  std::map<uint8_t, uint16_t> analogValues;
+  // 0 simulates a missed echo
+  unsigned long echoDistanceMM = 0;
+  // The next shots echo these instead, one each, like a reflection
+  std::vector<unsigned long> nextEchoesMM;
+  uint8_t modemPowerKeyPin = 0xff;
+  uint8_t modemDtrPin = 0xff;
+  // Ultrasonic sensor: a pulse on the trigger pin answers with an echo pulse
+  uint8_t sensorTriggerPin = 0xff;
+  uint8_t sensorEchoPin = 0xff;
+  uint64_t sleepTimeUs = 0;
+  // How much faster than real time the clock runs during deep sleep. Awake,
+  // it runs off the crystal and keeps time.
+  double rtcDriftPpm = 0;
+  bool verbose = false;
+  // Power is cut once this many more bytes have been written to flash,
+  // leaving the write in progress torn. -1 never cuts.
+  int64_t flashWriteBudgetBytes = -1;
+};
+
+struct Stats {
+  uint64_t uartTxBytes = 0;
+  uint64_t uartRxBytes = 0;
+  size_t heapBytes = 0;
+  size_t heapBaselineBytes = 0;
+  size_t heapPeakBytes = 0;
+  uint64_t heapAllocations = 0;
+  uint32_t flashMounts = 0;
+  uint32_t flashCommits = 0;
+  uint64_t flashBytesWritten = 0;
+};
+
+extern Clock clock;
+extern Board board;
+extern Stats stats;
+
+// Time spent polling an empty UART or calling millis(), so busy loops make
+// progress on the virtual clock
+#define SIM_CPU_CALL_US 1
+// Trigger to rising echo, while the sensor sends its burst
+#define SIM_ECHO_DELAY_US 450
+#define SIM_EVENTS_CAPACITY 16
+// How long the sensor holds the echo line when nothing comes back
+#define SIM_ECHO_MISSED_US 38000
+// Rough board currents for the charge estimates, the modem's are in
+// sim_modem.h
+#define SIM_MCU_ACTIVE_UA 30000
+#define SIM_MCU_DEEP_SLEEP_UA 25
+
+void advanceUs(uint64_t us);
+// Calls `run` once the clock passes `atUs`, like an interrupt would. Returns
+// an id for cancelEvent().
+typedef void (*EventHandler)(void* context, uint32_t value);
+uint64_t scheduleEvent(uint64_t atUs, EventHandler run, void* context, uint32_t value);
+void cancelEvent(uint64_t id);
+uint64_t awakeUs();
+void beginWake(esp_reset_reason_t resetReason);
+void sleepUs(uint64_t us);
+void trace(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+// Forget all files and mark the flash as unformatted
+void eraseFlash();
+// RTC_DATA_ATTR variables as after a power loss. beginWake() does this for
+// ESP_RST_POWERON.
+void resetRtcMemory();
+// GPIO levels and holds as after a power loss. beginWake() does this for
+// ESP_RST_POWERON.
+void resetGpio();
+// Flips every bit of RTC memory, like a panic in the middle of an update
+void corruptRtcMemory();
+
+// Host-side microbenchmarks, see sim/src/bench_*.cpp
+// Each returns false if one of its checks failed
+bool benchmarkLineReader();
+bool benchmarkBatchCodec();
+bool benchmarkUploadBody();
+bool benchmarkUploadCompression();
+bool benchmarkMeasurementLog();
+bool benchmarkIntervalScheduler();
+bool benchmarkDistanceFilter();
+bool benchmarkSensorUnits();
+
+}
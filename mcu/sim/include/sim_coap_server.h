@@ -0,0 +1,57 @@
+#pragma once
+
+// Stand-in for a CoAP endpoint of the API. The simulated modem hands it the
+// datagrams the firmware sends with AT+CIPSEND and pushes its answers back
+// as +IPD, so the CoAP transport runs end to end on the host without a
+// network. Built on lib/coap_codec, it answers like a server would: block-
+// wise bodies reassembled, duplicates answered from its cache, the upload
+// acknowledged with the same JSON the HTTP API sends minus the echo.
+
+#include <map>
+#include <string>
+#include <vector>
+
+
+namespace sim {
+
+struct CoapServerScript {
+  // The Uri-Query the firmware has to send, 4.01 otherwise
+  std::string tokenQuery;
+  // "{now}" and "{ack}" are replaced like in ModemScript::httpResponseBody
+  std::string responseBody = "{\"config\":{},\"now\":{now},\"ack\":{ack}}";
+  // Answer with an empty ACK and the response as a confirmable of its own
+  bool separateResponses = false;
+};
+
+class CoapServer {
+public:
+  void reset(const CoapServerScript& script);
+  // The datagrams answering one from the device, in order
+  std::vector<std::string> receive(const std::string& datagram, int64_t trueEpochS);
+  // Of the last complete upload, decompressed
+  const std::string& body() const { return lastBody; }
+  uint32_t nbroUploads() const { return uploads; }
+  // Requests answered again from the cache
+  uint32_t nbroDuplicates() const { return duplicates; }
+
+private:
+  CoapServerScript script;
+  // Message ID to the answer, for duplicates
+  std::map<uint16_t, std::vector<std::string>> answered;
+  std::string blocks;
+  uint32_t nextBlock = 0;
+  std::string lastBody;
+  uint16_t messageId = 0;
+  uint32_t uploads = 0;
+  uint32_t duplicates = 0;
+};
+
+extern CoapServer coapServer;
+
+// What the API does with an upload, shared with the HTTP stand-in in the
+// modem: the body as it was before `contentEncoding`, and the response
+// template with "{now}" and "{ack}" filled in from the body's "batch"
+std::string decodeUploadBody(const std::string& body, const std::string& contentEncoding);
+std::string fillUploadResponse(const std::string& response, int64_t epochS, const std::string& body);
+
+}
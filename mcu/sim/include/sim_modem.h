@@ -0,0 +1,232 @@
+#pragma once
+
+// Scriptable SIM7600 stand-in. It powers on and off from POWERKEY pulses,
+// boots with the usual URCs and answers the AT dialogue used by
+// src/cellular.cpp, src/http.cpp and src/udp.cpp over the simulated Serial1.
+// Datagrams go to the stand-in server of sim_coap_server.h. It also sleeps
+// on DTR after AT+CSCLK=1, knows the network time after AT+CTZU=1, switches
+// its UART to the rate of AT+IPR until it powers off and keeps track of the
+// charge it draws and the bytes it puts on the air.
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "sim_coap_server.h"
+
+
+namespace sim {
+
+// Rough SIM7600 supply currents by state, for comparing power off against
+// sleep rather than for absolute battery life
+#define SIM_MODEM_OFF_UA 20
+// AT+CSCLK=1 and DTR high, still registered and listening for paging
+#define SIM_MODEM_SLEEP_UA 2000
+// Booting, searching and registering
+#define SIM_MODEM_REGISTERING_UA 90000
+#define SIM_MODEM_IDLE_UA 25000
+// From AT+HTTPACTION to its result, and while a datagram or its answer is
+// on the way
+#define SIM_MODEM_RADIO_UA 150000
+// DTR low to the UART taking commands again
+#define SIM_MODEM_DTR_WAKE_US 20000
+// AT+CCLK? counts from 1980-01-06 after power on, until NITZ sets it
+#define SIM_MODEM_CLOCK_EPOCH_S 315964800
+// Of the local time in AT+CCLK?, in quarter hours east of UTC
+#define SIM_MODEM_TIME_ZONE_QUARTERS 8
+// What an HTTPS request costs on top of its URL, headers and bodies: TCP
+// and TLS handshakes with the server's certificate chain, the request and
+// status lines, TCP ACKs and teardown. Round trips from SYN to the response.
+#define SIM_HTTPS_OVERHEAD_BYTES 5500
+#define SIM_HTTPS_ROUND_TRIPS 4
+// IPv4 and UDP headers
+#define SIM_UDP_OVERHEAD_BYTES 28
+// Largest datagram AT+CIPSEND takes
+#define SIM_UDP_MAX_BYTES 1500
+// Where the UART starts after power on, AT+IPR doesn't outlive it
+#define SIM_MODEM_DEFAULT_BAUD 115200
+
+// Canned reply for commands starting with `commandPrefix`, checked before the
+// built-in handlers. Use "\r\n" in `response` like the modem does.
+struct ModemRule {
+  std::string commandPrefix;
+  std::string response;
+  uint32_t latencyMs;
+};
+
+struct ModemScript {
+  // POWERKEY release to UART ready ("RDY")
+  uint32_t bootMs = 12000;
+  // UART ready to network registered
+  uint32_t registrationMs = 4000;
+  // Power down indication after POWERKEY or AT+CPOF
+  uint32_t shutdownMs = 1900;
+  uint32_t commandLatencyMs = 5;
+  // SIM_HTTPS_ROUND_TRIPS and the server's time
+  uint32_t httpActionMs = 1500;
+  uint32_t networkRoundTripMs = 300;
+  // Between a complete upload reaching the server and its answer leaving,
+  // the blocks before it are answered right away
+  uint32_t serverMs = 300;
+  // AT+NETOPEN to the PDP context being up
+  uint32_t netOpenMs = 300;
+  // The first datagram on the air and every n-th after it, either way, are
+  // lost. 0 loses none.
+  uint32_t datagramLossEvery = 0;
+  CoapServerScript coapServer;
+  // Fastest rate AT+IPR takes
+  uint32_t maxUartBaud = 4000000;
+  // The wiring garbles every byte above this rate, both ways. 0 never does.
+  uint32_t uartMaxCleanBaud = 0;
+  bool bootUrcs = true;
+  int httpStatus = 200;
+  // "{now}" is replaced with the true epoch seconds, "{ack}" with the
+  // "batch" of the request like the API acknowledges it
+  std::string httpResponseBody =
+    "{\"measurements\":[],\"config\":{},\"now\":{now},\"ack\":{ack}}";
+  // The network drops a modem that sleeps longer, it registers again once
+  // woken. 0 never drops it.
+  uint32_t sleepDetachMs = 0;
+  // The network sends its time (NITZ) with the registration
+  bool networkTime = true;
+  std::vector<ModemRule> rules;
+};
+
+class Modem {
+public:
+  void reset(const ModemScript& script);
+  void setPowerKey(bool asserted);
+  // GPIOs are released during deep sleep without driving an edge
+  void floatPowerKey();
+  void setDtr(bool high);
+  bool isOn() const;
+  bool isAsleep() const;
+  // Drawn since reset()
+  double chargeMAs();
+  // Of the last AT+HTTPDATA, decompressed if it came with a heatshrink
+  // Content-Encoding
+  const std::string& httpBody() const { return httpData; }
+  // Taken by AT+HTTPDATA since reset(), as sent
+  uint64_t nbroHttpBodyBytes() const { return httpBodyBytes; }
+  uint32_t nbroHttpActions() const { return httpActions; }
+  // AT+HTTPREADs since reset()
+  uint32_t nbroHttpReads() const { return httpReads; }
+  // Of the current or last HTTP session
+  const std::string& httpRequestUrl() const { return httpUrl; }
+  // Set with AT+HTTPPARA="USERDATA", empty if there is no such header
+  std::string httpHeader(const std::string& name) const;
+  // Successful AT+HTTPINITs
+  uint32_t nbroHttpSessions() const { return httpSessions; }
+  // Like a server that is down for a while
+  void setHttpStatus(int status) { script.httpStatus = status; }
+  // AT commands since reset()
+  uint32_t nbroCommands() const { return commands; }
+  // Both ways, HTTPS and UDP, headers and handshakes included
+  uint64_t nbroAirBytes() const { return airBytes; }
+  // Waits for the network, SIM_HTTPS_ROUND_TRIPS per AT+HTTPACTION and one
+  // per confirmable datagram
+  uint32_t nbroNetworkRoundTrips() const { return networkRoundTrips; }
+  // Sent with AT+CIPSEND, lost ones included
+  uint32_t nbroDatagrams() const { return datagrams; }
+  // The UART's rate right now, a rate taken with AT+IPR once its OK is out
+  uint32_t uartBaud() const;
+  // Whether a host UART at `baud` gets bytes across
+  bool uartLinkWorks(uint32_t baud) const;
+  // Throws away the due bytes a host UART at `baud` would only see framing
+  // errors in
+  void dropGarbled(uint32_t baud);
+  // AT+IFC=2,2 since power on
+  bool hasFlowControl() const { return flowControl; }
+
+  void receive(uint8_t c);
+  int available();
+  int read();
+  int peek();
+
+private:
+  struct Byte {
+    uint64_t atUs;
+    uint8_t value;
+    // Sent at
+    uint32_t baud;
+  };
+
+  void powerOn();
+  void powerOff();
+  bool isUartReady() const;
+  bool isRegistered() const;
+  // The "yy/MM/dd,hh:mm:ss±zz" of AT+CCLK?
+  std::string clockString() const;
+  void handleCommand(const std::string& command);
+  void parseHttpHeaders(const std::string& userData);
+  void handleSocketCommand(const std::string& command);
+  // Over the air to the stand-in server, its answers come back as +IPD
+  void transmitDatagram();
+  bool loseDatagram();
+  void reply(const std::string& response, uint32_t latencyMs);
+  void replyAt(uint64_t atUs, const std::string& response);
+  void transmitDue();
+  uint32_t currentUAAt(uint64_t us) const;
+  // Integrates the current up to now, call before changing state
+  void account();
+
+  ModemScript script;
+  // Replies wait here until due, then go out over the UART one after the other
+  std::multimap<uint64_t, std::string> scheduled;
+  std::deque<Byte> output;
+  std::string line;
+  bool on = false;
+  bool echo = true;
+  // AT+CREG=<n>, 1 reports registration changes as URCs
+  int cregUrcMode = 0;
+  bool powerKeyAsserted = false;
+  uint64_t powerKeyChangedUs = 0;
+  uint64_t readyUs = 0;
+  uint64_t offUs = 0;
+  // Registered registrationMs after this
+  uint64_t registrationStartUs = 0;
+  // AT+CSCLK=<n>, 1 sleeps while DTR is high
+  int sleepClockMode = 0;
+  // AT+CTZU=<n>, kept in NV memory across power cycles
+  bool networkTimeUpdates = false;
+  bool dtrHigh = false;
+  uint32_t baud = SIM_MODEM_DEFAULT_BAUD;
+  // Taken by AT+IPR, in effect from newBaudUs
+  uint32_t newBaud = 0;
+  uint64_t newBaudUs = 0;
+  bool flowControl = false;
+  uint64_t sleepStartUs = 0;
+  uint64_t uartAwakeFromUs = 0;
+  uint64_t radioBusyUntilUs = 0;
+  uint64_t accountedUs = 0;
+  double chargeUAUs = 0;
+  bool httpInitialized = false;
+  size_t httpDataRemaining = 0;
+  uint64_t httpDataStartUs = 0;
+  std::string httpData;
+  std::string httpUrl;
+  std::map<std::string, std::string> httpHeaders;
+  uint64_t httpBodyBytes = 0;
+  size_t httpDataLength = 0;
+  std::string httpUserData;
+  std::string httpResponse;
+  uint32_t httpActions = 0;
+  uint32_t httpReads = 0;
+  uint32_t httpSessions = 0;
+  // AT+NETOPEN and AT+CIPOPEN
+  bool netOpen = false;
+  bool udpLinkOpen = false;
+  size_t datagramRemaining = 0;
+  uint64_t datagramStartUs = 0;
+  std::string datagram;
+  uint32_t commands = 0;
+  uint64_t airBytes = 0;
+  uint32_t networkRoundTrips = 0;
+  uint32_t datagrams = 0;
+  // Either way, for datagramLossEvery
+  uint32_t datagramsOnAir = 0;
+};
+
+extern Modem modem;
+
+}
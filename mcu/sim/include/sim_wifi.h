@@ -0,0 +1,105 @@
+#pragma once
+
+// Scriptable WiFi access point and the API behind it. The WiFi.h and
+// HTTPClient.h stand-ins talk to it: the station connects after a scan or,
+// given the right channel and BSSID, right away, and POSTs reach a server
+// that answers like the HTTP stand-in of the modem. Keeps track of the
+// charge the radio draws.
+
+#include <map>
+#include <string>
+
+
+namespace sim {
+
+// Rough ESP32-S2 radio currents on top of SIM_MCU_ACTIVE_UA
+#define SIM_WIFI_CONNECTING_UA 80000
+// Associated, listening for beacons between the requests
+#define SIM_WIFI_CONNECTED_UA 20000
+#define SIM_WIFI_BUSY_UA 90000
+#define SIM_WIFI_BSSID_BYTES 6
+
+struct WifiScript {
+  bool accessPointUp = true;
+  std::string ssid = "sim-ap";
+  std::string password = "";
+  uint8_t bssid[SIM_WIFI_BSSID_BYTES] = { 0x02, 0x00, 0x00, 0x5a, 0x1a, 0x01 };
+  int32_t channel = 6;
+  int8_t rssi = -62;
+  // Probing every channel, authentication and DHCP. A scan that finds
+  // nothing gives up after this too.
+  uint32_t scanConnectMs = 2800;
+  // Straight to the cached channel and BSSID. Giving up on them takes
+  // about as long.
+  uint32_t fastConnectMs = 350;
+  // TCP and TLS handshakes of the first request on a connection
+  uint32_t tlsHandshakeMs = 600;
+  // Round trip and the server's time, per request
+  uint32_t requestMs = 250;
+  int httpStatus = 200;
+  // Like ModemScript::httpResponseBody
+  std::string httpResponseBody =
+    "{\"measurements\":[],\"config\":{},\"now\":{now},\"ack\":{ack}}";
+};
+
+class WifiNetwork {
+public:
+  void reset(const WifiScript& script);
+  // Between wakes, like an access point that got another channel or went
+  // down
+  void moveAccessPoint(int32_t channel) { script.channel = channel; }
+  void setAccessPointUp(bool up) { script.accessPointUp = up; }
+  // The radio doesn't outlive a wake
+  void powerDown();
+  // Drawn since reset()
+  double chargeMAs();
+  // Of the last POST, decompressed like the modem's httpBody()
+  const std::string& httpBody() const { return body; }
+  std::string httpHeader(const std::string& name) const;
+  // Connects that went through a scan, and straight to the cached access
+  // point. Failed ones included.
+  uint32_t nbroScans() const { return scans; }
+  uint32_t nbroFastConnects() const { return fastConnects; }
+  uint32_t nbroPosts() const { return posts; }
+
+  // For WiFi.h and HTTPClient.h
+  void setStation(bool on);
+  void begin(const std::string& ssid, const std::string& password, int32_t channel, const uint8_t* bssid);
+  int status();
+  void disconnect();
+  uint8_t* bssid() { return script.bssid; }
+  int32_t channel() const { return script.channel; }
+  int8_t rssi() const { return script.rssi; }
+  void beginHttp(const std::string& url);
+  void addHttpHeader(const std::string& name, const std::string& value);
+  int post(const uint8_t* payload, size_t size);
+  // The last response, -1 if there was none
+  int writeResponse(Stream* stream);
+  void endHttp();
+
+private:
+  uint32_t currentUAAt(uint64_t us) const;
+  // Integrates the current up to now, call before changing state
+  void account();
+
+  WifiScript script;
+  bool stationOn = false;
+  // What begin() comes to once the clock passes settledUs
+  int outcome = 0;
+  uint64_t settledUs = 0;
+  uint64_t busyUntilUs = 0;
+  bool tlsOpen = false;
+  std::map<std::string, std::string> headers;
+  std::string body;
+  std::string response;
+  bool hasResponse = false;
+  uint64_t accountedUs = 0;
+  double chargeUAUs = 0;
+  uint32_t scans = 0;
+  uint32_t fastConnects = 0;
+  uint32_t posts = 0;
+};
+
+extern WifiNetwork wifi;
+
+}
@@ -0,0 +1,109 @@
+#include <Arduino.h>
+#include <chrono>
+#include <vector>
+#include "common_macros.h"
+#include "sim.h"
+#include "batch_codec.h"
+
+
+namespace sim {
+
+#define BATCH_RECORDS 30
+#define BATCH_ENCODINGS 20000
+
+// An hourly batch as main.cpp uploads it: the current measurement first,
+// then the saved ones from oldest to newest
+static std::vector<BatchRecord> typicalBatch() {
+  std::vector<BatchRecord> records;
+  uint32_t startS = 1700000000;
+  records.push_back({ startS + (BATCH_RECORDS - 1) * 3600, 1532, 3893 });
+  for (uint32_t i = 0; i < BATCH_RECORDS - 1; i++) {
+    records.push_back({ startS + i * 3600 + i % 3, 1500 + (i * 7) % 40, (uint16_t) (3950 - i * 2) });
+  }
+  return records;
+}
+
+static std::vector<BatchRecord> extremeBatch() {
+  return {
+    { 0, 0, 0 },
+    { UINT32_MAX, UINT32_MAX, UINT16_MAX },
+    { 0, 0, 0 },
+    { 0x80000000, 0x7fffffff, 1 },
+    { 1, 0x80000000, UINT16_MAX },
+  };
+}
+
+// Length of the JSON main.cpp sends for the same records
+static size_t jsonLength(const std::vector<BatchRecord>& records) {
+  size_t length = 2 + (records.size() > 0 ? records.size() - 1 : 0);
+  for (const BatchRecord& record : records) {
+    char object[96];
+    length += snprintf(
+      object, sizeof(object), "{\"timeS\":%u,\"distanceMM\":%u,\"batteryVoltage\":%.9g}",
+      record.timeS, record.distanceMM, record.batteryMV / 1000.0
+    );
+  }
+  return length;
+}
+
+static bool roundTrips(const char* name, const std::vector<BatchRecord>& records) {
+  std::vector<uint8_t> encoded(BATCH_CODEC_MAX_BYTES(records.size()));
+  size_t length = encodeBatch(records.data(), records.size(), encoded.data(), encoded.size());
+  std::vector<BatchRecord> decoded(records.size() + 1);
+  size_t nbroDecoded;
+  unsigned char ret = decodeBatch(encoded.data(), length, decoded.data(), decoded.size(), &nbroDecoded);
+  bool ok = length > 0 && ret == BATCH_DECODE_OK && nbroDecoded == records.size();
+  for (size_t i = 0; ok && i < records.size(); i++) {
+    ok = decoded[i].timeS == records[i].timeS
+      && decoded[i].distanceMM == records[i].distanceMM
+      && decoded[i].batteryMV == records[i].batteryMV;
+  }
+
+  // Every corruption the CRC or the framing has to catch
+  bool rejectsCorruption = true;
+  for (size_t i = 0; i < length; i++) {
+    encoded[i] ^= 0x10;
+    rejectsCorruption &= decodeBatch(encoded.data(), length, decoded.data(), decoded.size(), &nbroDecoded) != BATCH_DECODE_OK;
+    encoded[i] ^= 0x10;
+  }
+  for (size_t cut = 0; cut < length; cut++) {
+    rejectsCorruption &= decodeBatch(encoded.data(), cut, decoded.data(), decoded.size(), &nbroDecoded) != BATCH_DECODE_OK;
+  }
+  if (records.size() > 0) {
+    rejectsCorruption &= decodeBatch(encoded.data(), length, decoded.data(), records.size() - 1, &nbroDecoded)
+      == BATCH_DECODE_TOO_MANY_RECORDS;
+  }
+
+  printf(
+    "%-34s %8zu %8zu %10s %10s\n",
+    name, jsonLength(records), length, ok ? "ok" : "FAILED", rejectsCorruption ? "ok" : "FAILED"
+  );
+  return ok && rejectsCorruption;
+}
+
+bool benchmarkBatchCodec() {
+  beginWake(ESP_RST_DEEPSLEEP);
+  printf("%-34s %8s %8s %10s %10s\n", "batch codec", "json B", "binary B", "roundtrip", "corruption");
+  bool ok = roundTrips("empty", {});
+  ok &= roundTrips("single", { { 1700000000, 1500, 3900 } });
+  ok &= roundTrips("extremes", extremeBatch());
+  std::vector<BatchRecord> batch = typicalBatch();
+  ok &= roundTrips("hourly, " STRINGIFY(BATCH_RECORDS) " records", batch);
+
+  uint8_t encoded[BATCH_CODEC_MAX_BYTES(BATCH_RECORDS)];
+  size_t totalLength = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BATCH_ENCODINGS; i++) {
+    totalLength += encodeBatch(batch.data(), batch.size(), encoded, sizeof(encoded));
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  printf(
+    "%-34s %8.2f us/batch on the host\n",
+    "encode", elapsed.count() * 1e6 / BATCH_ENCODINGS
+  );
+  // Keeps the loop from being optimised away
+  if (totalLength == 0) printf("\n");
+  return ok;
+}
+
+}
@@ -0,0 +1,141 @@
+#include <Arduino.h>
+#include <chrono>
+#include <vector>
+#include "sim.h"
+#include "distance_filter.h"
+#include "deployed_config.h"
+
+
+namespace sim {
+
+#define DISTANCE_FILTER_RUNS 200000
+
+struct DistanceCase {
+  const char* name;
+  std::vector<unsigned long> echoesMM;
+  size_t nbroShots;
+  int16_t temperatureDeciC;
+  // Where the level really is
+  unsigned long expectedMM;
+  unsigned char minConfidence;
+  unsigned char maxConfidence;
+};
+
+static DistanceSamples toSamples(const DistanceCase& distanceCase) {
+  DistanceSamples samples = {};
+  samples.count = distanceCase.echoesMM.size();
+  samples.nbroShots = distanceCase.nbroShots;
+  samples.temperatureDeciC = distanceCase.temperatureDeciC;
+  std::copy(distanceCase.echoesMM.begin(), distanceCase.echoesMM.end(), samples.distancesMM);
+  return samples;
+}
+
+// What getDistanceMMAveraged() reported: the plain mean over all shots, a
+// missed echo counting as 0
+static unsigned long plainMeanMM(const DistanceCase& distanceCase) {
+  if (distanceCase.nbroShots == 0) return 0;
+  unsigned long sumMM = 0;
+  for (unsigned long echoMM : distanceCase.echoesMM) sumMM += echoMM;
+  return sumMM / distanceCase.nbroShots;
+}
+
+static std::vector<unsigned long> withJitter(unsigned long distanceMM, size_t count, unsigned long jitterMM) {
+  std::vector<unsigned long> echoesMM;
+  for (size_t i = 0; i < count; i++) {
+    echoesMM.push_back(distanceMM - jitterMM + (i * 7919) % (2 * jitterMM + 1));
+  }
+  return echoesMM;
+}
+
+static std::vector<unsigned long> withEchoes(std::vector<unsigned long> echoesMM, size_t at, std::vector<unsigned long> spurious) {
+  echoesMM.insert(echoesMM.begin() + at, spurious.begin(), spurious.end());
+  return echoesMM;
+}
+
+static unsigned long deviationMM(unsigned long a, unsigned long b) {
+  return a > b ? a - b : b - a;
+}
+
+static bool filtersCase(const DistanceCase& distanceCase) {
+  DistanceReading reading = DefaultDistanceFilter::apply(toSamples(distanceCase));
+  unsigned long meanMM = plainMeanMM(distanceCase);
+  // Far enough off to trigger an upload on its own
+  unsigned long triggerMM = DEFAULT_MAXIMUM_INTER_TRANSMIT_DISTANCE_MM;
+  bool ok = reading.confidence >= distanceCase.minConfidence
+    && reading.confidence <= distanceCase.maxConfidence;
+  // A reading confident enough to trigger an upload has to be right
+  if (reading.confidence >= 50) {
+    ok &= deviationMM(reading.distanceMM, distanceCase.expectedMM) < triggerMM;
+  }
+  printf(
+    "%-34s %8lu %8lu %8lu %10d %6s\n",
+    distanceCase.name, distanceCase.expectedMM, meanMM, reading.distanceMM,
+    reading.confidence, ok ? "ok" : "FAILED"
+  );
+  return ok;
+}
+
+template <typename Stage>
+static void timeStage(const char* name, const DistanceSamples& samples) {
+  unsigned long checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < DISTANCE_FILTER_RUNS; i++) {
+    DistanceSamples copy = samples;
+    // Keeps the compiler from hoisting the stage out of the loop
+    copy.distancesMM[i % copy.count] += i & 1;
+    Stage::apply(&copy);
+    checksum += copy.count + copy.distancesMM[0];
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  printf("%-34s %8.1f ns/run on the host\n", name, elapsed.count() * 1e9 / DISTANCE_FILTER_RUNS);
+  if (checksum == 0) printf("\n");
+}
+
+// Stands in for the whole chain in timeStage()
+struct WholeChain {
+  static void apply(DistanceSamples* samples) {
+    DistanceReading reading = DefaultDistanceFilter::apply(*samples);
+    samples->distancesMM[0] = reading.distanceMM;
+  }
+};
+
+bool benchmarkDistanceFilter() {
+  beginWake(ESP_RST_DEEPSLEEP);
+  std::vector<unsigned long> level = withJitter(1500, 10, 2);
+  std::vector<unsigned long> rippled = withJitter(1500, 10, 25);
+  std::vector<unsigned long> nineShots(level.begin(), level.begin() + 9);
+  std::vector<unsigned long> twoTargets = withEchoes(withJitter(1500, 5, 2), 2, withJitter(900, 5, 2));
+  const std::vector<DistanceCase> cases = {
+    { "steady level", level, 10, DISTANCE_TEMPERATURE_UNKNOWN, 1500, 90, 100 },
+    { "rippled surface, 25 mm", rippled, 10, DISTANCE_TEMPERATURE_UNKNOWN, 1500, 50, 100 },
+    { "one wall reflection", withEchoes(nineShots, 4, { 420 }), 10, DISTANCE_TEMPERATURE_UNKNOWN, 1500, 80, 100 },
+    { "one missed echo", nineShots, 10, DISTANCE_TEMPERATURE_UNKNOWN, 1500, 80, 100 },
+    {
+      "reflection in 3 shots in a row", withEchoes(std::vector<unsigned long>(level.begin(), level.begin() + 7), 3, { 620, 622, 619 }),
+      10, DISTANCE_TEMPERATURE_UNKNOWN, 1500, 50, 80
+    },
+    { "two targets, half each", twoTargets, 10, DISTANCE_TEMPERATURE_UNKNOWN, 1500, 0, 49 },
+    { "no echo", {}, 10, DISTANCE_TEMPERATURE_UNKNOWN, 0, 0, 0 },
+    // 331.3 m/s instead of the assumed 344 m/s
+    { "air at 0 C", level, 10, 0, 1445, 90, 100 },
+    // 349.5 m/s, 331.3 m/s plus 0.606 m/s per °C
+    { "air at 30 C", level, 10, 300, 1524, 90, 100 },
+  };
+
+  printf("%-34s %8s %8s %8s %10s %6s\n", "distance filter", "true mm", "mean mm", "filt mm", "confidence", "");
+  bool ok = true;
+  for (const DistanceCase& distanceCase : cases) {
+    ok &= filtersCase(distanceCase);
+  }
+
+  DistanceSamples samples = toSamples(cases[4]);
+  timeStage<MedianOfN<3>>("MedianOfN<3>", samples);
+  timeStage<RejectMadOutliers<30>>("RejectMadOutliers<30>", samples);
+  timeStage<TrimExtremes<10>>("TrimExtremes<10>", samples);
+  samples.temperatureDeciC = 150;
+  timeStage<CompensateTemperature>("CompensateTemperature", samples);
+  timeStage<WholeChain>("DefaultDistanceFilter", samples);
+  return ok;
+}
+
+}
@@ -0,0 +1,271 @@
+#include <Arduino.h>
+#include <math.h>
+#include <functional>
+#include <vector>
+#include "common_macros.h"
+#include "sim.h"
+#include "measurements.h"
+#include "interval_scheduler.h"
+#include "deployed_config.h"
+
+
+namespace sim {
+
+// Replays level curves through the interval scheduler and a fixed hourly
+// interval, and reports what each costs in wakes against how late it notices
+// a drawdown. The curves are synthetic, shaped like what the sensor records
+// on a well with a pump: the distance to the water grows while it pumps and
+// shrinks back as the well refills.
+
+#define REPLAY_START_S 1700000000UL
+#define REPLAY_DAYS 7
+#define SECONDS_PER_HOUR (60UL * 60)
+#define SECONDS_PER_DAY (24 * SECONDS_PER_HOUR)
+// Awake time of a store and a transmit wake, as the wake-cycles report has them
+#define REPLAY_STORE_WAKE_MS 3400
+#define REPLAY_TRANSMIT_WAKE_MS 48800
+// A drawdown counts as noticed once a wake measures this much of it
+#define REPLAY_DETECTION_MM 100
+// How late a drawdown is noticed depends on where the wakes happen to fall,
+// so each curve is replayed with the first wake this many times across an
+// hour
+#define REPLAY_PHASES 12
+
+struct LevelCurve {
+  const char* name;
+  // Distance from the sensor to the water at a time since the start
+  std::function<double(uint64_t)> distanceMM;
+  // When drawdowns start, since the start
+  std::vector<uint64_t> drawdownStartsS;
+  // Every nth wake gets no echo, 0 for none
+  size_t missedEchoEvery = 0;
+};
+
+struct ReplayResult {
+  double wakesPerDay;
+  double transmitsPerDay;
+  double awakeSPerDay;
+  double meanLatencyMin;
+  double maxLatencyMin;
+  // Between the true level and the last measured one, averaged over time
+  double meanTrackingErrorMM;
+  bool intervalsInBounds;
+};
+
+// A few mm of deterministic sensor noise
+static double noiseMM(uint64_t tS) {
+  uint32_t x = tS * 2654435761u;
+  x ^= x >> 15;
+  return (double) (x % 7) - 3.0;
+}
+
+// The pump lowers the level by `depthMM` over `durationS`, after which the
+// well refills exponentially with `refillTauS`
+static double drawdownMM(uint64_t sinceStartS, double depthMM, uint64_t durationS, double refillTauS) {
+  if (sinceStartS < durationS) {
+    return depthMM * sinceStartS / durationS;
+  }
+  return depthMM * exp(-(double) (sinceStartS - durationS) / refillTauS);
+}
+
+// Pumps don't start on the hour. Some minutes past `hour`, different ones
+// for each `phase`.
+static uint64_t aroundHourS(uint64_t day, uint64_t hour, uint64_t phase) {
+  uint32_t x = ((phase * REPLAY_DAYS + day) * 24 + hour) * 2654435761u;
+  x ^= x >> 13;
+  return day * SECONDS_PER_DAY + hour * SECONDS_PER_HOUR + (x % 60) * 60;
+}
+
+static std::vector<LevelCurve> levelCurves(uint64_t phase) {
+  std::vector<uint64_t> twiceDaily;
+  for (uint64_t day = 0; day < REPLAY_DAYS; day++) {
+    twiceDaily.push_back(aroundHourS(day, 7, phase));
+    twiceDaily.push_back(aroundHourS(day, 18, phase));
+  }
+  std::vector<uint64_t> everyOtherDay;
+  for (uint64_t day = 1; day < REPLAY_DAYS; day += 2) {
+    everyOtherDay.push_back(aroundHourS(day, 5, phase));
+  }
+  // The most recent drawdown dominates, earlier ones have refilled
+  auto withDrawdowns = [](std::vector<uint64_t> starts, double depthMM, uint64_t durationS, double refillTauS) {
+    return [=](uint64_t tS) {
+      double level = 1500;
+      for (uint64_t startS : starts) {
+        if (tS >= startS) level = 1500 + drawdownMM(tS - startS, depthMM, durationS, refillTauS);
+      }
+      return level + noiseMM(tS);
+    };
+  };
+  return {
+    { "flat", [](uint64_t tS) { return 1500 + noiseMM(tS); }, {} },
+    { "flat, every 3rd echo missed", [](uint64_t tS) { return 1500 + noiseMM(tS); }, {}, 3 },
+    { "slow decline", [](uint64_t tS) { return 1500 + 30.0 * tS / SECONDS_PER_DAY + noiseMM(tS); }, {} },
+    {
+      "pump twice a day",
+      withDrawdowns(twiceDaily, 1200, 45 * 60, 3 * SECONDS_PER_HOUR),
+      twiceDaily
+    },
+    {
+      "irrigation every other day",
+      withDrawdowns(everyOtherDay, 2500, 4 * SECONDS_PER_HOUR, 8 * SECONDS_PER_HOUR),
+      everyOtherDay
+    },
+  };
+}
+
+// nullptr replays a fixed interval of DEFAULT_MEASUREMENT_INTERVAL_S
+static ReplayResult replay(const LevelCurve& curve, IntervalScheduler* scheduler, uint64_t firstWakeS) {
+  IntervalSchedulerConfig config = makeIntervalSchedulerConfig(
+    DEFAULT_MEASUREMENT_INTERVAL_S, DEFAULT_MAXIMUM_MEASUREMENT_INTERVAL_S
+  );
+  ReplayResult result = { 0, 0, 0, 0, 0, 0, true };
+  MeasurementSummary pending = {};
+  size_t nbroWakes = 0;
+  // Of the wakes that got an echo
+  std::vector<uint64_t> wakesS;
+  std::vector<double> measuredMM;
+  uint64_t awakeMs = 0;
+  size_t transmits = 0;
+
+  for (uint64_t tS = firstWakeS; tS < REPLAY_DAYS * SECONDS_PER_DAY; ) {
+    Measurement current = { REPLAY_START_S + (unsigned long) tS, (unsigned long) curve.distanceMM(tS), 3900 };
+    unsigned char confidence = 100;
+    if (curve.missedEchoEvery != 0 && nbroWakes % curve.missedEchoEvery == curve.missedEchoEvery - 1) {
+      current.distanceMM = 0;
+      confidence = 0;
+    } else {
+      wakesS.push_back(tS);
+      measuredMM.push_back(current.distanceMM);
+    }
+    nbroWakes++;
+
+    MeasurementSummary withCurrent = pending;
+    addToSummary(&withCurrent, current);
+    unsigned long deltaMM = confidence < DISTANCE_MIN_CONFIDENCE ? 0 : _max(
+      current.distanceMM - withCurrent.smallestDistanceMM,
+      withCurrent.largestDistanceMM - current.distanceMM
+    );
+    // main.cpp's transmit triggers with the default config
+    bool transmit = withCurrent.count >= DEFAULT_MAXIMUM_INTER_TRANSMIT_MEASUREMENTS
+      || deltaMM > DEFAULT_MAXIMUM_INTER_TRANSMIT_DISTANCE_MM
+      || current.timeS - withCurrent.firstTimeS > DEFAULT_MAXIMUM_INTER_TRANSMIT_TIME_S;
+    uint32_t wakeMs = transmit ? REPLAY_TRANSMIT_WAKE_MS : REPLAY_STORE_WAKE_MS;
+    if (transmit) {
+      transmits++;
+      pending = {};
+    } else {
+      pending = withCurrent;
+    }
+    awakeMs += wakeMs;
+
+    uint32_t intervalS = scheduler == nullptr
+      ? DEFAULT_MEASUREMENT_INTERVAL_S
+      : nextMeasurementIntervalS(scheduler, config, current, confidence, wakeMs);
+    result.intervalsInBounds &= intervalS >= config.minIntervalS && intervalS <= config.maxIntervalS;
+    tS += wakeMs / 1000 + intervalS;
+  }
+
+  result.wakesPerDay = (double) nbroWakes / REPLAY_DAYS;
+  result.transmitsPerDay = (double) transmits / REPLAY_DAYS;
+  result.awakeSPerDay = awakeMs / 1000.0 / REPLAY_DAYS;
+
+  // When the true level first moved REPLAY_DETECTION_MM vs. the first wake
+  // that measured it
+  double latencySumS = 0;
+  size_t detected = 0;
+  for (uint64_t startS : curve.drawdownStartsS) {
+    double baseline = curve.distanceMM(startS);
+    uint64_t crossingS = startS;
+    while (fabs(curve.distanceMM(crossingS) - baseline) < REPLAY_DETECTION_MM) crossingS += 10;
+    for (size_t i = 0; i < wakesS.size(); i++) {
+      if (wakesS[i] >= crossingS && fabs(measuredMM[i] - baseline) >= REPLAY_DETECTION_MM) {
+        double latencyS = wakesS[i] - crossingS;
+        latencySumS += latencyS;
+        result.maxLatencyMin = _max(result.maxLatencyMin, latencyS / 60);
+        detected++;
+        break;
+      }
+    }
+  }
+  result.meanLatencyMin = detected == 0 ? 0 : latencySumS / detected / 60;
+
+  double errorSum = 0;
+  size_t samples = 0;
+  size_t wake = 0;
+  for (uint64_t tS = 0; tS < REPLAY_DAYS * SECONDS_PER_DAY; tS += 60, samples++) {
+    while (wake + 1 < wakesS.size() && wakesS[wake + 1] <= tS) wake++;
+    errorSum += fabs(curve.distanceMM(tS) - measuredMM[wake]);
+  }
+  result.meanTrackingErrorMM = errorSum / samples;
+  return result;
+}
+
+// The `curve`th level curve, averaged over REPLAY_PHASES except for the
+// worst detection
+static ReplayResult replayPhases(size_t curve, bool adaptive) {
+  ReplayResult total = { 0, 0, 0, 0, 0, 0, true };
+  for (uint64_t phase = 0; phase < REPLAY_PHASES; phase++) {
+    IntervalScheduler scheduler = {};
+    ReplayResult result = replay(
+      levelCurves(phase)[curve], adaptive ? &scheduler : nullptr, phase * SECONDS_PER_HOUR / REPLAY_PHASES
+    );
+    total.wakesPerDay += result.wakesPerDay / REPLAY_PHASES;
+    total.transmitsPerDay += result.transmitsPerDay / REPLAY_PHASES;
+    total.awakeSPerDay += result.awakeSPerDay / REPLAY_PHASES;
+    total.meanLatencyMin += result.meanLatencyMin / REPLAY_PHASES;
+    total.maxLatencyMin = _max(total.maxLatencyMin, result.maxLatencyMin);
+    total.meanTrackingErrorMM += result.meanTrackingErrorMM / REPLAY_PHASES;
+    total.intervalsInBounds &= result.intervalsInBounds;
+  }
+  return total;
+}
+
+static void printResult(const char* curve, const char* scheduler, const ReplayResult& result, bool drawdowns) {
+  char latency[32] = "-";
+  if (drawdowns) {
+    snprintf(latency, sizeof(latency), "%.1f / %.1f", result.meanLatencyMin, result.maxLatencyMin);
+  }
+  printf(
+    "%-28s %-8s %9.1f %11.1f %12.0f %14s %12.0f\n",
+    curve, scheduler, result.wakesPerDay, result.transmitsPerDay,
+    result.awakeSPerDay, latency, result.meanTrackingErrorMM
+  );
+}
+
+bool benchmarkIntervalScheduler() {
+  printf(
+    "%-28s %-8s %9s %11s %12s %14s %12s\n",
+    "level curve", "interval", "wakes/day", "uploads/day", "awake s/day",
+    "detect min", "tracking mm"
+  );
+  bool ok = true;
+  double flatWorstLatencyMin = (DEFAULT_MAXIMUM_MEASUREMENT_INTERVAL_S + REPLAY_TRANSMIT_WAKE_MS / 1000.0) / 60 + 1;
+  std::vector<LevelCurve> curves = levelCurves(0);
+  for (size_t i = 0; i < curves.size(); i++) {
+    ReplayResult fixed = replayPhases(i, false);
+    ReplayResult adaptive = replayPhases(i, true);
+    bool drawdowns = !curves[i].drawdownStartsS.empty();
+    printResult(curves[i].name, "hourly", fixed, drawdowns);
+    printResult("", "adaptive", adaptive, drawdowns);
+
+    ok &= adaptive.intervalsInBounds;
+    ok &= adaptive.awakeSPerDay * 1000 <= MEASUREMENT_AWAKE_BUDGET_MS_PER_DAY;
+    if (drawdowns) {
+      // Follows the drawdown closer than hourly wakes do. The stretched
+      // interval notices it at worst one flat maximum interval after an
+      // upload, and a minute more where the sensor noise blurs the crossing.
+      ok &= adaptive.meanTrackingErrorMM < fixed.meanTrackingErrorMM;
+      ok &= adaptive.maxLatencyMin <= flatWorstLatencyMin;
+    } else {
+      // Fewer wakes than hourly on a level that doesn't move
+      ok &= adaptive.wakesPerDay < fixed.wakesPerDay;
+    }
+  }
+  printf("(detect min: mean / max minutes from a %d mm drawdown to the wake that measures it)\n", REPLAY_DETECTION_MM);
+  if (!ok) {
+    printf("  adaptive interval out of bounds, over budget or worse than hourly\n");
+  }
+  return ok;
+}
+
+}
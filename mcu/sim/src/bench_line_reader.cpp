@@ -0,0 +1,103 @@
+#include <Arduino.h>
+#include <chrono>
+#include "sim.h"
+#include "stream_extensions.h"
+
+
+namespace sim {
+
+// Responses to AT+CREG? and AT+HTTPACTION=1, as readLine() sees them
+static const char AT_EXCHANGE[] =
+  "\r\n+CREG: 0,1\r\n\r\nOK\r\n"
+  "\r\nOK\r\n\r\n+HTTPACTION: 1,200,48\r\n";
+#define AT_EXCHANGE_LINES 8
+#define AT_EXCHANGES 200000
+
+class ReplayStream : public Stream {
+public:
+  int available() override {
+    return sizeof(AT_EXCHANGE) - 1 - position;
+  }
+  int read() override {
+    if (available() == 0) return -1;
+    return AT_EXCHANGE[position++];
+  }
+  int peek() override {
+    return available() == 0 ? -1 : AT_EXCHANGE[position];
+  }
+  size_t write(uint8_t c) override { return 1; }
+  void rewind() { position = 0; }
+
+private:
+  size_t position = 0;
+};
+
+// The previous String-based readLine(), polling millis() per character
+static bool readLineIntoString(Stream* stream, String* line) {
+  *line = "";
+  int c;
+  unsigned long startMillis = millis();
+  do {
+    c = stream->read();
+    if (c >= 0) {
+      if (c == '\n') {
+        if (line->length() > 0 && line->charAt(line->length() - 1) == '\r') {
+          line->remove(line->length() - 1);
+        }
+        return true;
+      }
+      *line += (char) c;
+    }
+  } while (millis() - startMillis < DEFAULT_TIMEOUT);
+  return false;
+}
+
+static void report(const char* name, double seconds, uint64_t allocations) {
+  printf(
+    "%-34s %12.0f %15.2f\n",
+    name,
+    AT_EXCHANGES * AT_EXCHANGE_LINES / seconds,
+    (double) allocations / AT_EXCHANGES
+  );
+}
+
+bool benchmarkLineReader() {
+  beginWake(ESP_RST_DEEPSLEEP);
+  printf("%-34s %12s %15s\n", "line reader", "lines/s", "allocs/exchange");
+
+  ReplayStream stream;
+  size_t totalLength = 0;
+  uint64_t allocationsBefore = stats.heapAllocations;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < AT_EXCHANGES; i++) {
+    stream.rewind();
+    for (int j = 0; j < AT_EXCHANGE_LINES; j++) {
+      // Callers used a fresh String per response line
+      String line;
+      readLineIntoString(&stream, &line);
+      totalLength += line.length();
+    }
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  report("String += per byte (previous)", elapsed.count(), stats.heapAllocations - allocationsBefore);
+
+  LineReader reader(&stream);
+  allocationsBefore = stats.heapAllocations;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < AT_EXCHANGES; i++) {
+    stream.rewind();
+    LineView line;
+    for (int j = 0; j < AT_EXCHANGE_LINES; j++) {
+      readLine(&reader, &line);
+      totalLength += line.length;
+    }
+  }
+  elapsed = std::chrono::steady_clock::now() - start;
+  report("LineReader ring buffer", elapsed.count(), stats.heapAllocations - allocationsBefore);
+
+  // Keeps the loops from being optimised away
+  if (totalLength == 0) printf("\n");
+  return true;
+}
+
+}
@@ -0,0 +1,264 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <vector>
+#include "common_macros.h"
+#include "sim.h"
+#include "measurements.h"
+#include "measurement_log.h"
+#include "rtc_batch.h"
+
+
+namespace sim {
+
+// Fault injection: replays a series of wakes that append to the log or mark
+// it uploaded, cutting power after every possible number of written bytes.
+// After each cut the log has to open without a format, hold exactly what a
+// model of the ring says it may, and keep working.
+
+#define FAULT_LOG_PATH "/fault_injection_log.bin"
+// Small so the series wraps around the ring twice
+#define FAULT_LOG_CAPACITY 8
+#define FAULT_WAKES 20
+#define FAULT_UPLOAD_EVERY_WAKES 6
+
+struct ModelSlot {
+  uint32_t sequence;
+  bool uploaded;
+  Measurement measurement;
+};
+
+typedef std::vector<ModelSlot> Model;
+
+static Measurement faultMeasurement(size_t i) {
+  return { 1700000000UL + i * 3600, 1000 + i, (uint16_t) (3700 + i) };
+}
+
+static bool isUploadWake(size_t wake) {
+  return wake % FAULT_UPLOAD_EVERY_WAKES == FAULT_UPLOAD_EVERY_WAKES - 1;
+}
+
+// What MeasurementLog may report as pending for these slot contents
+static std::vector<Measurement> modelPending(const Model& model) {
+  uint32_t newest = 0;
+  uint32_t newestUpload = 0;
+  for (const ModelSlot& slot : model) {
+    newest = std::max(newest, slot.sequence);
+    if (slot.uploaded) newestUpload = std::max(newestUpload, slot.sequence);
+  }
+  std::vector<Measurement> pending;
+  for (uint32_t sequence = newestUpload + 1; sequence <= newest; sequence++) {
+    const ModelSlot& slot = model[sequence % FAULT_LOG_CAPACITY];
+    if (slot.sequence == sequence && !slot.uploaded) {
+      pending.push_back(slot.measurement);
+    }
+  }
+  return pending;
+}
+
+static std::vector<Measurement> logPending(MeasurementLog* log) {
+  std::vector<Measurement> pending;
+  uint32_t sequence = log->firstPendingSequence();
+  Measurement measurement;
+  while (log->nextPending(&sequence, &measurement)) {
+    pending.push_back(measurement);
+  }
+  return pending;
+}
+
+static bool equal(const std::vector<Measurement>& a, const std::vector<Measurement>& b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); i++) {
+    if (
+      a[i].timeS != b[i].timeS
+      || a[i].distanceMM != b[i].distanceMM
+      || a[i].batteryMV != b[i].batteryMV
+    ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool sameSummary(const MeasurementSummary& summary, const std::vector<Measurement>& pending) {
+  MeasurementSummary expected = {};
+  for (const Measurement& measurement : pending) {
+    addToSummary(&expected, measurement);
+  }
+  return summary.count == expected.count
+    && summary.smallestDistanceMM == expected.smallestDistanceMM
+    && summary.largestDistanceMM == expected.largestDistanceMM
+    && summary.firstTimeS == expected.firstTimeS
+    && summary.lastTimeS == expected.lastTimeS
+    && summary.distanceSumMM == expected.distanceSumMM;
+}
+
+// The running summary has to agree with one built from the records
+static bool summaryMatches(MeasurementLog* log, const std::vector<Measurement>& pending) {
+  return sameSummary(log->pendingSummary(), pending);
+}
+
+static void mountFreshFlash() {
+  // Every run is a fresh device, also keeping clear of the wake time limit
+  beginWake(ESP_RST_POWERON);
+  eraseFlash();
+  LittleFS.format();
+  LittleFS.begin();
+}
+
+// Runs the wakes with power cut after `cutAfterBytes`. Returns false if
+// every wake completed. Otherwise `before` and `after` are the model around
+// the interrupted wake, and `recordWrite` whether it got as far as writing
+// its record rather than preallocating the ring.
+static bool runWakesUntilPowerLoss(
+  int64_t cutAfterBytes,
+  Model* before,
+  Model* after,
+  bool* recordWrite
+) {
+  Model model(FAULT_LOG_CAPACITY, { 0, false, { 0, 0, 0 } });
+  uint32_t sequence = 1;
+  *before = model;
+  *after = model;
+  *recordWrite = false;
+  board.flashWriteBudgetBytes = cutAfterBytes;
+  try {
+    for (size_t wake = 0; wake < FAULT_WAKES; wake++) {
+      MeasurementLog log(FAULT_LOG_PATH, FAULT_LOG_CAPACITY);
+      *before = model;
+      *after = model;
+      *recordWrite = false;
+      log.open();
+
+      ModelSlot written = { sequence, isUploadWake(wake), { 0, 0, 0 } };
+      if (!written.uploaded) written.measurement = faultMeasurement(wake);
+      (*after)[sequence % FAULT_LOG_CAPACITY] = written;
+      *recordWrite = true;
+      if (written.uploaded) {
+        log.markUploaded();
+      } else {
+        log.append(written.measurement);
+      }
+      log.close();
+      model = *after;
+      sequence++;
+    }
+  } catch (const WakeEnd& end) {
+    if (end.kind != WakeEnd::POWER_LOSS) throw;
+    return true;
+  }
+  board.flashWriteBudgetBytes = -1;
+  return false;
+}
+
+// Measurements appended past a full ring overwrite the oldest pending ones,
+// which have to drop out of the summary as well
+#define OVERFILL_RECORDS (FAULT_LOG_CAPACITY + 3)
+
+static bool overfillsRing() {
+  mountFreshFlash();
+  MeasurementLog log(FAULT_LOG_PATH, FAULT_LOG_CAPACITY);
+  bool ok = log.open() == RET_OK;
+  std::vector<Measurement> expected;
+  for (size_t i = 0; i < OVERFILL_RECORDS; i++) {
+    // Smallest first, so the evicted ones held the bound
+    Measurement measurement = faultMeasurement(i);
+    ok &= log.append(measurement) == RET_OK;
+    expected.push_back(measurement);
+  }
+  expected.erase(expected.begin(), expected.end() - FAULT_LOG_CAPACITY);
+  ok &= equal(logPending(&log), expected) && summaryMatches(&log, expected);
+  log.close();
+
+  // The same through the RTC batch, whose summary has to follow the log's
+  RtcBatch saved = rtcBatch;
+  LittleFS.remove(FAULT_LOG_PATH);
+  ok &= log.open() == RET_OK;
+  resetRtcBatch({});
+  for (size_t i = 0; i < OVERFILL_RECORDS; i++) {
+    appendToRtcBatch(faultMeasurement(i));
+  }
+  moveRtcBatchToLog(&log);
+  ok &= rtcBatchIsValid() && nbroPendingInLog() == FAULT_LOG_CAPACITY;
+  ok &= sameSummary(rtcBatch.pending, expected);
+  log.close();
+  rtcBatch = saved;
+  LittleFS.end();
+  eraseFlash();
+  return ok;
+}
+
+bool benchmarkMeasurementLog() {
+  size_t cuts = 0;
+  size_t failures = 0;
+  Model before, after;
+  bool recordWrite;
+  for (int64_t cutAfterBytes = 0; ; cutAfterBytes++) {
+    mountFreshFlash();
+    if (!runWakesUntilPowerLoss(cutAfterBytes, &before, &after, &recordWrite)) break;
+    cuts++;
+
+    // Next wake: mount as setup() does and recover
+    LittleFS.end();
+    bool ok = LittleFS.begin();
+    MeasurementLog log(FAULT_LOG_PATH, FAULT_LOG_CAPACITY);
+    ok &= log.open() == RET_OK;
+    std::vector<Measurement> pending = logPending(&log);
+
+    // The interrupted record is either fully written or lost, along with
+    // whatever its slot held before
+    Model torn = before;
+    if (recordWrite) {
+      size_t slot = 0;
+      for (size_t i = 0; i < FAULT_LOG_CAPACITY; i++) {
+        if (after[i].sequence != before[i].sequence) slot = i;
+      }
+      torn[slot] = { 0, false, { 0, 0, 0 } };
+    }
+    ok &= equal(pending, modelPending(before))
+      || equal(pending, modelPending(after))
+      || equal(pending, modelPending(torn));
+    ok &= summaryMatches(&log, pending);
+
+    // And the log carries on
+    Measurement probe = faultMeasurement(1000);
+    ok &= log.append(probe) == RET_OK;
+    pending.push_back(probe);
+    ok &= equal(logPending(&log), pending);
+    ok &= summaryMatches(&log, pending);
+    log.close();
+
+    if (!ok && failures++ == 0) {
+      printf("  first failure with power cut after %lld bytes\n", (long long) cutAfterBytes);
+    }
+  }
+
+  // Flash writes of a plain append wake, after the ring exists
+  mountFreshFlash();
+  MeasurementLog log(FAULT_LOG_PATH, FAULT_LOG_CAPACITY);
+  log.open();
+  log.close();
+  uint64_t bytesBefore = stats.flashBytesWritten;
+  uint32_t commitsBefore = stats.flashCommits;
+  log.open();
+  log.append(faultMeasurement(0));
+  log.close();
+  LittleFS.end();
+  eraseFlash();
+  bool overfillOk = overfillsRing();
+
+  printf("%-34s %10s %10s\n", "measurement log", "power cuts", "recovered");
+  printf("%-34s %10zu %10zu\n", "fault injection, every byte", cuts, cuts - failures);
+  printf(
+    "%-34s %10llu B in %u commit(s)\n",
+    "flash written per append",
+    (unsigned long long) (stats.flashBytesWritten - bytesBefore),
+    stats.flashCommits - commitsBefore
+  );
+  printf(
+    "%-34s %10d %10s\n",
+    "appended to a full ring", OVERFILL_RECORDS, overfillOk ? "summed" : "STALE"
+  );
+  return failures == 0 && overfillOk;
+}
+
+}
@@ -0,0 +1,375 @@
+#include <Arduino.h>
+#include <chrono>
+#include <math.h>
+#include <string>
+#include <type_traits>
+#include "sim.h"
+#include "measurements.h"
+#include "distance_sensor.h"
+#include "sensor_units.h"
+#include "deployed_config.h"
+
+
+namespace sim {
+
+// The integer conversions against the double ones main.cpp and the distance
+// sensor used before, which stay here as the reference. The host has an FPU,
+// so besides host timings the reference counts the calls into libgcc's
+// soft-float routines each double operation is on the ESP32-S2.
+
+#define SENSOR_UNITS_RUNS 1000000
+// Same dividers as in main.cpp
+#define BATTERY_RATIO_TENTHS 20
+#define USB_RATIO_TENTHS 32
+// Longest echo the sensor driver waits for, a 10 m reading
+#define ECHO_MAX_US 75000
+// Rough cycles of libgcc's soft-float double routines on the S2's LX7, the
+// call included. Only their order of magnitude matters here.
+#define SOFT_FLOAT_ADD_CYCLES 80
+#define SOFT_FLOAT_MUL_CYCLES 100
+#define SOFT_FLOAT_DIV_CYCLES 300
+#define SOFT_FLOAT_COMPARE_CYCLES 30
+#define SOFT_FLOAT_CONVERT_CYCLES 40
+
+struct SoftFloatCalls {
+  uint32_t addSub;
+  uint32_t mul;
+  uint32_t div;
+  uint32_t compare;
+  // Between integers and doubles, either way
+  uint32_t convert;
+
+  uint32_t total() const { return addSub + mul + div + compare + convert; }
+  uint32_t cycles() const {
+    return addSub * SOFT_FLOAT_ADD_CYCLES + mul * SOFT_FLOAT_MUL_CYCLES + div * SOFT_FLOAT_DIV_CYCLES
+      + compare * SOFT_FLOAT_COMPARE_CYCLES + convert * SOFT_FLOAT_CONVERT_CYCLES;
+  }
+};
+
+static SoftFloatCalls softFloatCalls;
+
+// A double that counts what it costs without an FPU. Constants are folded
+// by the compiler and cost nothing, integers converted at run time do.
+class SoftDouble {
+public:
+  SoftDouble(double constant) : value(constant) {}
+  template <typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+  SoftDouble(T integer) : value(integer) {
+    softFloatCalls.convert++;
+  }
+  template <typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+  explicit operator T() const {
+    softFloatCalls.convert++;
+    return (T) value;
+  }
+
+  friend SoftDouble operator+(SoftDouble a, SoftDouble b) { softFloatCalls.addSub++; return SoftDouble(a.value + b.value); }
+  friend SoftDouble operator-(SoftDouble a, SoftDouble b) { softFloatCalls.addSub++; return SoftDouble(a.value - b.value); }
+  friend SoftDouble operator*(SoftDouble a, SoftDouble b) { softFloatCalls.mul++; return SoftDouble(a.value * b.value); }
+  friend SoftDouble operator/(SoftDouble a, SoftDouble b) { softFloatCalls.div++; return SoftDouble(a.value / b.value); }
+  friend bool operator<(SoftDouble a, SoftDouble b) { softFloatCalls.compare++; return a.value < b.value; }
+  friend bool operator>(SoftDouble a, SoftDouble b) { softFloatCalls.compare++; return a.value > b.value; }
+
+private:
+  double value;
+};
+
+/// Reference, as it was
+
+template <typename Real>
+static Real adcValueToVoltage(uint16_t adcValue, Real voltageDividerRatio) {
+  return Real(adcValue) * Real(2.5 / 8191.0) * voltageDividerRatio;
+}
+
+template <typename Real>
+static Real voltageAveraged(const uint16_t* adcValues, unsigned char count, Real voltageDividerRatio) {
+  Real sum = 0.0;
+  for (unsigned char i = 0; i < count; i++) {
+    sum = sum + adcValueToVoltage(adcValues[i], voltageDividerRatio);
+  }
+  return sum / Real(count);
+}
+
+template <typename Real>
+static unsigned char batteryVoltageToPercentage(Real voltage) {
+  static const double voltages[] = {
+    4.17, 4.15, 4.10, 4.05, 4.00, 3.93, 3.85, 3.84, 3.83, 3.81, 3.80, 3.79, 3.75,
+    3.70, 3.65, 3.35
+  };
+  static const unsigned char percentages[] = {
+    100, 95, 89, 83, 75, 65, 50, 46, 42, 40, 36, 30, 25, 11, 5, 2
+  };
+  for (unsigned char i = 0; i < sizeof(voltages) / sizeof(double); i++) {
+    if (voltage > Real(voltages[i])) {
+      return percentages[i];
+    }
+  }
+  return 0;
+}
+
+// GCC turns the exact division by 2 into a multiplication, the + 0.0 of
+// DISTANCE_CORRECTION stays
+template <typename Real>
+static unsigned long pulseTimeToDistanceMM(unsigned long pulseTime) {
+  return (unsigned long) (Real(pulseTime) * Real(0.344) * Real(0.5) + Real(0.0));
+}
+
+template <typename Real>
+static unsigned long distanceToPulseTimeUs(unsigned long distanceMM) {
+  return (unsigned long) (Real(distanceMM * 2) / Real(0.344));
+}
+
+// measurements.cpp's printJsonDouble() for the positive numbers voltages
+// are, NaN checks are bit tests
+template <typename Real>
+static std::string printJsonDouble(Real value) {
+  uint32_t maxDecimalPart = 1000000000;
+  int8_t decimalPlaces = 9;
+  if (value < Real(0.0)) return "-";
+  uint32_t integral = (uint32_t) value;
+  for (uint32_t tmp = integral; tmp >= 10; tmp /= 10) {
+    maxDecimalPart /= 10;
+    decimalPlaces--;
+  }
+  Real remainder = (value - Real(integral)) * Real(maxDecimalPart);
+  uint32_t decimal = (uint32_t) remainder;
+  remainder = remainder - Real(decimal);
+  decimal += (uint32_t) (remainder * Real(2.0));
+  if (decimal >= maxDecimalPart) {
+    decimal = 0;
+    integral++;
+  }
+  while (decimal % 10 == 0 && decimalPlaces > 0) {
+    decimal /= 10;
+    decimalPlaces--;
+  }
+  std::string text = std::to_string(integral);
+  if (decimalPlaces > 0) {
+    std::string decimals = std::to_string(decimal);
+    text += "." + std::string(decimalPlaces - decimals.length(), '0') + decimals;
+  }
+  return text;
+}
+
+/// Checks
+
+class StringPrint : public Print {
+public:
+  size_t write(uint8_t c) override {
+    text += (char) c;
+    return 1;
+  }
+  using Print::write;
+
+  std::string text;
+};
+
+static double adcLsbMV(uint32_t ratioTenths) {
+  return (double) ADC_FULL_SCALE_MV * ratioTenths / 10 / ADC_MAX_COUNT;
+}
+
+static bool printCheck(const char* name, size_t cases, double maxError, double bound, const char* unit) {
+  bool ok = maxError <= bound;
+  printf("%-34s %8zu %9.2f %-3s %7.2f %-3s %6s\n", name, cases, maxError, unit, bound, unit, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+// Every sum `count` readings can add up to, spread over the readings as
+// evenly as it goes
+static bool adcWithinLsb(const char* name, uint32_t ratioTenths, uint8_t count) {
+  uint32_t scaleQ16 = adcMillivoltScaleQ16(ratioTenths);
+  double maxErrorMV = 0;
+  size_t cases = 0;
+  for (uint32_t adcSum = 0; adcSum <= (uint32_t) count * ADC_MAX_COUNT; adcSum++) {
+    uint16_t adcValues[8];
+    for (uint8_t i = 0; i < count; i++) {
+      adcValues[i] = adcSum / count + (i < adcSum % count ? 1 : 0);
+    }
+    double referenceMV = voltageAveraged<double>(adcValues, count, ratioTenths / 10.0) * 1000;
+    maxErrorMV = std::max(maxErrorMV, fabs(adcSumToMV(adcSum, count, scaleQ16) - referenceMV));
+    cases++;
+  }
+  return printCheck(name, cases, maxErrorMV, adcLsbMV(ratioTenths), "mV");
+}
+
+static double jsonBatteryVoltage(const std::string& json) {
+  const char* key = "\"batteryVoltage\":";
+  return strtod(json.c_str() + json.find(key) + strlen(key), nullptr);
+}
+
+// What the upload says, the whole way from the ADC
+static bool jsonWithinLsb() {
+  uint32_t scaleQ16 = adcMillivoltScaleQ16(BATTERY_RATIO_TENTHS);
+  double maxErrorMV = 0;
+  for (uint16_t adc = 0; adc <= ADC_MAX_COUNT; adc++) {
+    Measurement measurement = { 1700000000UL, 1500, adcSumToMV(adc, 1, scaleQ16) };
+    StringPrint json;
+    writeMeasurementsJson(&json, { &measurement, nullptr, nullptr, 0 });
+    std::string reference = printJsonDouble(voltageAveraged<double>(&adc, 1, BATTERY_RATIO_TENTHS / 10.0));
+    double errorMV = fabs(jsonBatteryVoltage(json.text) - strtod(reference.c_str(), nullptr)) * 1000;
+    maxErrorMV = std::max(maxErrorMV, errorMV);
+  }
+  return printCheck("battery in the upload JSON", ADC_MAX_COUNT + 1, maxErrorMV, adcLsbMV(BATTERY_RATIO_TENTHS), "mV");
+}
+
+static bool echoWithinLsb() {
+  double maxErrorMM = 0;
+  for (unsigned long pulseUs = 0; pulseUs <= ECHO_MAX_US; pulseUs++) {
+    long errorMM = (long) echoUsToMM(pulseUs) - (long) pulseTimeToDistanceMM<double>(pulseUs);
+    maxErrorMM = std::max(maxErrorMM, (double) labs(errorMM));
+  }
+  bool ok = printCheck("echo us to mm", ECHO_MAX_US + 1, maxErrorMM, 1, "mm");
+  double maxErrorUs = 0;
+  for (unsigned long distanceMM = 0; distanceMM <= DISTANCE_SENSOR_MAX_MM; distanceMM++) {
+    long errorUs = (long) mmToEchoUs(distanceMM) - (long) distanceToPulseTimeUs<double>(distanceMM);
+    maxErrorUs = std::max(maxErrorUs, (double) labs(errorUs));
+  }
+  return ok & printCheck("mm to echo us", DISTANCE_SENSOR_MAX_MM + 1, maxErrorUs, 1, "us");
+}
+
+static unsigned char referencePercentage(long mV) {
+  return batteryVoltageToPercentage<double>(mV / 1000.0);
+}
+
+// The next step up of the reference, at or above `mV`
+static unsigned char referenceStepAbove(long mV) {
+  unsigned char percentage = referencePercentage(mV);
+  while (referencePercentage(mV) == percentage && percentage < 100) mV++;
+  return referencePercentage(mV);
+}
+
+// The table interpolates between the reference's steps, so it has to stay
+// between the step a voltage is on and the next one up, give or take the
+// 10 mV of its rows. And never go down as the voltage goes up.
+static bool percentageBetweenSteps() {
+  size_t cases = 0;
+  size_t outside = 0;
+  uint8_t previous = 0;
+  for (long mV = 3000; mV <= 4400; mV++, cases++) {
+    uint8_t percentage = batteryMVToPercentage(mV);
+    bool ok = percentage >= referencePercentage(mV - 5)
+      && percentage <= referenceStepAbove(mV + 5)
+      && percentage >= previous;
+    if (!ok && outside++ == 0) {
+      printf("  first outside at %ld mV: %u%%, steps %u%% and %u%%\n", mV, percentage, referencePercentage(mV), referenceStepAbove(mV));
+    }
+    previous = percentage;
+  }
+  printf("%-34s %8zu %17s %10s\n", "battery percentage", cases, "between steps", outside == 0 ? "ok" : "FAILED");
+  return outside == 0;
+}
+
+/// Cost
+
+static void printCalls(const char* name, const SoftFloatCalls& calls) {
+  printf(
+    "%-34s %5u %5u %5u %5u %5u %7u %8u\n",
+    name, calls.addSub, calls.mul, calls.div, calls.compare, calls.convert, calls.total(), calls.cycles()
+  );
+}
+
+static void addCalls(SoftFloatCalls* sum, const SoftFloatCalls& calls) {
+  sum->addSub += calls.addSub;
+  sum->mul += calls.mul;
+  sum->div += calls.div;
+  sum->compare += calls.compare;
+  sum->convert += calls.convert;
+}
+
+// What a wake cost the double way: the USB check, the battery with its
+// percentage and cutoff, then the shots with their timeout and the early peek
+static void countWakeCalls() {
+  const uint16_t usbAdc[] = { 0, 1, 0 };
+  const uint16_t batteryAdc[] = { 6400, 6401, 6399, 6400, 6402 };
+  const unsigned long pulsesUs[] = { 8720, 8723, 8718, 8720, 8725, 8719, 8721, 8720, 8722, 8720 };
+  SoftFloatCalls wake = {};
+
+  softFloatCalls = {};
+  SoftDouble usbVoltage = voltageAveraged<SoftDouble>(usbAdc, 3, 3.2);
+  (void) (usbVoltage > 4.0);
+  printCalls("USB check, 3 readings", softFloatCalls);
+  addCalls(&wake, softFloatCalls);
+
+  softFloatCalls = {};
+  SoftDouble batteryVoltage = voltageAveraged<SoftDouble>(batteryAdc, 5, 2.0);
+  batteryVoltageToPercentage(batteryVoltage);
+  SoftDouble batteryCutoffVoltage = SoftDouble(DEFAULT_BATTERY_CUTOFF_MV) / 1000.0;
+  (void) (batteryVoltage < batteryCutoffVoltage);
+  printCalls("battery, 5 readings and cutoff", softFloatCalls);
+  addCalls(&wake, softFloatCalls);
+
+  softFloatCalls = {};
+  distanceToPulseTimeUs<SoftDouble>(DISTANCE_SENSOR_MAX_MM);
+  // peekDistanceMeasurement() converts the first echoes once more
+  for (size_t i = 0; i < 10 + 5; i++) {
+    pulseTimeToDistanceMM<SoftDouble>(pulsesUs[i % 10]);
+  }
+  printCalls("distance, 10 shots", softFloatCalls);
+  addCalls(&wake, softFloatCalls);
+  printCalls("whole wake", wake);
+
+  softFloatCalls = {};
+  printJsonDouble(batteryVoltage);
+  printCalls("per measurement uploaded", softFloatCalls);
+}
+
+template <typename Convert>
+static double hostNsPerRun(Convert convert) {
+  uint64_t checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < SENSOR_UNITS_RUNS; i++) {
+    checksum += convert(i);
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  if (checksum == 0) printf("\n");
+  return elapsed.count() * 1e9 / SENSOR_UNITS_RUNS;
+}
+
+static void printHostTiming(const char* name, double doubleNs, double integerNs) {
+  printf("%-34s %9.1f ns %9.1f ns on the host\n", name, doubleNs, integerNs);
+}
+
+bool benchmarkSensorUnits() {
+  beginWake(ESP_RST_DEEPSLEEP);
+  printf("%-34s %8s %13s %11s\n", "sensor units vs double", "cases", "max error", "bound");
+  bool ok = true;
+  ok &= adcWithinLsb("battery ADC to mV, 1 reading", BATTERY_RATIO_TENTHS, 1);
+  ok &= adcWithinLsb("battery ADC to mV, 5 readings", BATTERY_RATIO_TENTHS, 5);
+  ok &= adcWithinLsb("USB ADC to mV, 3 readings", USB_RATIO_TENTHS, 3);
+  ok &= jsonWithinLsb();
+  ok &= echoWithinLsb();
+  ok &= percentageBetweenSteps();
+
+  printf(
+    "\n%-34s %5s %5s %5s %5s %5s %7s %8s\n",
+    "soft-float calls of the doubles", "add", "mul", "div", "cmp", "conv", "calls", "~cycles"
+  );
+  countWakeCalls();
+  printf("(the integer versions make none, a few multiplies and a division each)\n\n");
+
+  uint32_t batteryScaleQ16 = adcMillivoltScaleQ16(BATTERY_RATIO_TENTHS);
+  printf("%-34s %12s %12s\n", "conversion", "double", "integer");
+  printHostTiming(
+    "ADC to mV, 5 readings",
+    hostNsPerRun([](uint32_t i) {
+      uint16_t adcValues[5] = { (uint16_t) (i & 8191), 6400, 6401, 6399, 6400 };
+      return (uint32_t) (voltageAveraged<double>(adcValues, 5, 2.0) * 1000 + 0.5);
+    }),
+    hostNsPerRun([batteryScaleQ16](uint32_t i) {
+      return (uint32_t) adcSumToMV((i & 8191) + 6400 + 6401 + 6399 + 6400, 5, batteryScaleQ16);
+    })
+  );
+  printHostTiming(
+    "echo us to mm",
+    hostNsPerRun([](uint32_t i) { return pulseTimeToDistanceMM<double>(i % ECHO_MAX_US); }),
+    hostNsPerRun([](uint32_t i) { return echoUsToMM(i % ECHO_MAX_US); })
+  );
+  printHostTiming(
+    "battery percentage",
+    hostNsPerRun([](uint32_t i) { return (uint32_t) batteryVoltageToPercentage<double>((3300 + i % 1000) / 1000.0); }),
+    hostNsPerRun([](uint32_t i) { return (uint32_t) batteryMVToPercentage(3300 + i % 1000); })
+  );
+  return ok;
+}
+
+}
@@ -0,0 +1,173 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <ArduinoJson.h>
+#include "common_macros.h"
+#include "sim.h"
+#include "stream_extensions.h"
+#include "measurements.h"
+#include "measurement_log.h"
+#include "sensor_units.h"
+
+
+namespace sim {
+
+#define UPLOAD_BODY_FILE_PATH "/upload_body_bench.bin"
+// What main.cpp sized its JsonDocument for
+#define JSON_DOCUMENT_RECORDS 30
+#define ADC_CODES 8192
+// Same divider as in main.cpp
+#define BATTERY_MV_SCALE_Q16 adcMillivoltScaleQ16(20)
+
+class StringPrint : public Print {
+public:
+  size_t write(uint8_t c) override {
+    text += (char) c;
+    return 1;
+  }
+  using Print::write;
+
+  std::string text;
+};
+
+static Measurement measurementAt(size_t i) {
+  // Battery voltages as main.cpp computes them from ADC counts
+  uint16_t adc = 6400 - i * 3;
+  return {
+    1700000000UL + i * 3600,
+    1500 + (i * 7) % 40,
+    adcSumToMV(adc, 1, BATTERY_MV_SCALE_Q16)
+  };
+}
+
+// Room for the largest batch below
+#define UPLOAD_BODY_LOG_CAPACITY 1024
+
+static void writeSavedMeasurements(MeasurementLog* log, const std::vector<Measurement>& saved) {
+  LittleFS.remove(UPLOAD_BODY_FILE_PATH);
+  log->open();
+  for (const Measurement& measurement : saved) {
+    log->append(measurement);
+  }
+}
+
+// The body main.cpp used to build with ArduinoJson
+static std::string referenceJson(
+  const Measurement& current,
+  const std::vector<Measurement>& saved
+) {
+  StaticJsonDocument<JSON_DOCUMENT_RECORDS * 64> json;
+  std::vector<Measurement> measurements = { current };
+  measurements.insert(measurements.end(), saved.begin(), saved.end());
+  for (const Measurement& measurement : measurements) {
+    JsonObject measurementJson = json.createNestedObject();
+    measurementJson["timeS"] = measurement.timeS;
+    measurementJson["distanceMM"] = measurement.distanceMM;
+    measurementJson["batteryVoltage"] = measurement.batteryMV / 1000.0;
+    measurementJson["hash"] = (unsigned long) measurementHash(measurement);
+  }
+  String jsonString;
+  serializeJson(json, jsonString);
+  return jsonString.c_str();
+}
+
+// The newest `nbroBuffered` saved measurements come from RTC memory
+static bool matchesReference(size_t nbroSaved, size_t nbroBuffered = 0) {
+  Measurement current = measurementAt(nbroSaved);
+  std::vector<Measurement> saved;
+  for (size_t i = 0; i < nbroSaved; i++) {
+    saved.push_back(measurementAt(i));
+  }
+  size_t nbroInLog = nbroSaved - nbroBuffered;
+  MeasurementLog log(UPLOAD_BODY_FILE_PATH, UPLOAD_BODY_LOG_CAPACITY);
+  writeSavedMeasurements(&log, std::vector<Measurement>(saved.begin(), saved.begin() + nbroInLog));
+  MeasurementBatch batch = { &current, &log, saved.data() + nbroInLog, nbroBuffered };
+  StringPrint streamed;
+  ByteCounter counter;
+  writeMeasurementsJson(&counter, batch);
+  size_t written = writeMeasurementsJson(&streamed, batch);
+  log.close();
+  std::string reference = referenceJson(current, saved);
+  bool ok = streamed.text == reference && written == reference.length()
+    && counter.count == reference.length();
+  std::string name = std::to_string(nbroSaved + 1) + " records";
+  if (nbroBuffered > 0) {
+    name += ", " + std::to_string(nbroBuffered) + " from RTC";
+  }
+  printf(
+    "%-34s %8zu %10s\n",
+    name.c_str(),
+    written,
+    ok ? "identical" : "DIFFERENT"
+  );
+  if (!ok) {
+    printf("  streamed:  %s\n  reference: %s\n", streamed.text.c_str(), reference.c_str());
+  }
+  return ok;
+}
+
+// Every battery voltage the ADC can produce, one record at a time
+static bool matchesReferenceForAllAdcCodes() {
+  size_t mismatches = 0;
+  for (uint32_t adc = 0; adc < ADC_CODES; adc++) {
+    Measurement current = { 1700000000UL, 1500, adcSumToMV(adc, 1, BATTERY_MV_SCALE_Q16) };
+    StringPrint streamed;
+    writeMeasurementsJson(&streamed, { &current, nullptr, nullptr, 0 });
+    if (streamed.text != referenceJson(current, {})) {
+      if (mismatches++ == 0) {
+        printf("  first mismatch at ADC %u: %s\n", adc, streamed.text.c_str());
+      }
+    }
+  }
+  printf(
+    "%-34s %8d %10s\n",
+    "all battery ADC codes", ADC_CODES, mismatches == 0 ? "identical" : "DIFFERENT"
+  );
+  return mismatches == 0;
+}
+
+static void reportHeapPeak(size_t nbroSaved) {
+  std::vector<Measurement> saved;
+  for (size_t i = 0; i < nbroSaved; i++) {
+    saved.push_back(measurementAt(i));
+  }
+  MeasurementLog log(UPLOAD_BODY_FILE_PATH, UPLOAD_BODY_LOG_CAPACITY);
+  writeSavedMeasurements(&log, saved);
+  ByteCounter json;
+  ByteCounter batch;
+  size_t heapBefore = stats.heapBytes;
+  stats.heapPeakBytes = heapBefore;
+  Measurement current = measurementAt(nbroSaved);
+  writeMeasurementsJson(&json, { &current, &log, nullptr, 0 });
+  writeMeasurementsBatch(&batch, { &current, &log, nullptr, 0 });
+  printf(
+    "%-34s %8zu B JSON, %zu B binary, heap peak %zu B\n",
+    (std::to_string(nbroSaved + 1) + " records streamed").c_str(),
+    json.count,
+    batch.count,
+    stats.heapPeakBytes - heapBefore
+  );
+  log.close();
+}
+
+bool benchmarkUploadBody() {
+  beginWake(ESP_RST_DEEPSLEEP);
+  eraseFlash();
+  LittleFS.format();
+  LittleFS.begin();
+
+  printf("%-34s %8s %10s\n", "upload body vs ArduinoJson", "bytes", "output");
+  bool ok = matchesReference(0);
+  ok &= matchesReference(3);
+  ok &= matchesReference(3, 2);
+  ok &= matchesReference(JSON_DOCUMENT_RECORDS - 1, JSON_DOCUMENT_RECORDS - 1);
+  ok &= matchesReference(JSON_DOCUMENT_RECORDS - 1);
+  ok &= matchesReferenceForAllAdcCodes();
+  reportHeapPeak(JSON_DOCUMENT_RECORDS - 1);
+  reportHeapPeak(999);
+
+  LittleFS.end();
+  eraseFlash();
+  return ok;
+}
+
+}
@@ -0,0 +1,232 @@
+#include <Arduino.h>
+#include <chrono>
+#include <math.h>
+#include <string>
+#include <vector>
+#include "common_macros.h"
+#include "sim.h"
+#include "measurements.h"
+#include "sensor_units.h"
+#include "upload_compression.h"
+#include "lzss_codec.h"
+
+
+namespace sim {
+
+// A week of hourly measurements, what a backlog after an outage looks like
+#define COMPRESSION_SERIES_LENGTH 168
+// Enough runs per window for a stable time per KB
+#define COMPRESSION_RUNS 20
+
+class BodyPrint : public Print {
+public:
+  size_t write(uint8_t c) override {
+    text += (char) c;
+    return 1;
+  }
+  using Print::write;
+
+  std::string text;
+};
+
+struct CompressionSeries {
+  const char* name;
+  std::vector<Measurement> measurements;
+};
+
+// Battery voltages as main.cpp computes them from ADC counts
+static uint16_t batteryMVAt(uint16_t adc) {
+  // Same divider as in main.cpp
+  return adcSumToMV(adc, 1, adcMillivoltScaleQ16(20));
+}
+
+// Deterministic noise in [-amplitude, amplitude], without a short period
+// the compressor could pick up
+static long noise(size_t i, long amplitude) {
+  uint32_t hash = (uint32_t) (i + 1) * 2654435761u;
+  hash ^= hash >> 15;
+  hash *= 0x2c1b3c6d;
+  hash ^= hash >> 12;
+  return (long) (hash % (2 * amplitude + 1)) - amplitude;
+}
+
+// No recordings in the tree, these mimic what the wells do: a level that
+// barely moves, one pumped every day and refilling overnight, and a dry
+// spell where the echo keeps getting lost
+static std::vector<CompressionSeries> compressionSeries() {
+  std::vector<CompressionSeries> series(4);
+  series[0].name = "hourly, steady";
+  series[1].name = "hourly, pumped daily";
+  series[2].name = "hourly, missed echoes";
+  series[3].name = "5 min, refilling";
+  for (size_t i = 0; i < COMPRESSION_SERIES_LENGTH; i++) {
+    unsigned long timeS = 1700000000UL + i * 3600 + noise(i, 2);
+    uint16_t batteryMV = batteryMVAt(6400 - i / 4 + noise(i, 2));
+    series[0].measurements.push_back({ timeS, (unsigned long) (1500 + noise(i, 3)), batteryMV });
+    double dailyMM = 300 * sin(2 * M_PI * (i % 24) / 24.0);
+    series[1].measurements.push_back({ timeS, (unsigned long) (1800 + dailyMM + noise(i, 4)), batteryMV });
+    unsigned long missedMM = i % 5 == 0 ? 0 : 4200 + noise(i, 40);
+    series[2].measurements.push_back({ timeS, missedMM, batteryMV });
+    series[3].measurements.push_back({
+      1700000000UL + i * 300, (unsigned long) (3000 - i * 6 + noise(i, 3)), batteryMV
+    });
+  }
+  return series;
+}
+
+static std::string jsonBody(const std::vector<Measurement>& measurements, size_t count) {
+  BodyPrint body;
+  MeasurementBatch batch = { &measurements[0], nullptr, measurements.data() + 1, count - 1 };
+  writeMeasurementsJson(&body, batch);
+  return body.text;
+}
+
+static std::string binaryBody(const std::vector<Measurement>& measurements, size_t count) {
+  BodyPrint body;
+  MeasurementBatch batch = { &measurements[0], nullptr, measurements.data() + 1, count - 1 };
+  writeMeasurementsBatch(&body, batch);
+  return body.text;
+}
+
+static void appendToString(const uint8_t* bytes, size_t length, void* context) {
+  ((std::string*) context)->append((const char*) bytes, length);
+}
+
+// Fed in the small pieces the Print functions write
+static std::string compress(const std::string& data, uint8_t windowBits, uint8_t lookaheadBits) {
+  std::vector<uint8_t> buffer(LZSS_ENCODER_BUFFER_BYTES(windowBits, lookaheadBits));
+  std::string compressed;
+  LzssEncoder encoder(windowBits, lookaheadBits, buffer.data(), appendToString, &compressed);
+  encoder.begin();
+  for (size_t offset = 0; offset < data.length(); offset += 7) {
+    size_t length = std::min((size_t) 7, data.length() - offset);
+    encoder.write((const uint8_t*) data.data() + offset, length);
+  }
+  encoder.finish();
+  return compressed;
+}
+
+static bool roundTrips(const std::string& data, uint8_t windowBits, uint8_t lookaheadBits) {
+  std::string compressed = compress(data, windowBits, lookaheadBits);
+  std::vector<uint8_t> decoded(data.length() + 1);
+  size_t decodedLength;
+  unsigned char ret = lzssDecode(
+    (const uint8_t*) compressed.data(), compressed.length(), windowBits, lookaheadBits,
+    decoded.data(), decoded.size(), &decodedLength
+  );
+  return ret == LZSS_DECODE_OK
+    && compressed.length() <= LZSS_MAX_BYTES(data.length())
+    && std::string((const char*) decoded.data(), decodedLength) == data;
+}
+
+// Runs, overlapping copies, the buffer shifting and nothing to find
+static bool roundTripsEdgeCases(uint8_t windowBits, uint8_t lookaheadBits) {
+  std::string random;
+  for (size_t i = 0; i < 3000; i++) {
+    random += (char) ((i * 2654435761u) >> 13);
+  }
+  std::string periodic;
+  for (size_t i = 0; i < 5000; i++) {
+    periodic += "abcdefg"[i % 7];
+  }
+  return roundTrips("", windowBits, lookaheadBits)
+    && roundTrips("x", windowBits, lookaheadBits)
+    && roundTrips(std::string(5000, 'a'), windowBits, lookaheadBits)
+    && roundTrips(random, windowBits, lookaheadBits)
+    && roundTrips(periodic, windowBits, lookaheadBits);
+}
+
+struct CompressionSetting {
+  uint8_t windowBits;
+  uint8_t lookaheadBits;
+};
+
+static const CompressionSetting COMPRESSION_SETTINGS[] = {
+  { 6, 3 },
+  { 8, 4 },
+  { 8, 5 },
+  { 10, 4 },
+  { 12, 4 },
+};
+
+static bool benchmarkSetting(
+  const CompressionSetting& setting,
+  const std::vector<CompressionSeries>& series
+) {
+  bool ok = roundTripsEdgeCases(setting.windowBits, setting.lookaheadBits);
+  size_t jsonBytes = 0, jsonCompressed = 0, binaryBytes = 0, binaryCompressed = 0;
+  double seconds = 0;
+  for (const CompressionSeries& one : series) {
+    std::string json = jsonBody(one.measurements, one.measurements.size());
+    std::string binary = binaryBody(one.measurements, one.measurements.size());
+    ok &= roundTrips(json, setting.windowBits, setting.lookaheadBits);
+    ok &= roundTrips(binary, setting.windowBits, setting.lookaheadBits);
+    jsonBytes += json.length();
+    binaryBytes += binary.length();
+    binaryCompressed += compress(binary, setting.windowBits, setting.lookaheadBits).length();
+    auto start = std::chrono::steady_clock::now();
+    size_t compressedLength = 0;
+    for (int i = 0; i < COMPRESSION_RUNS; i++) {
+      compressedLength = compress(json, setting.windowBits, setting.lookaheadBits).length();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    seconds += elapsed.count() / COMPRESSION_RUNS;
+    jsonCompressed += compressedLength;
+  }
+  std::string name = "w" + std::to_string(setting.windowBits) + " l" + std::to_string(setting.lookaheadBits);
+  bool chosen = setting.windowBits == UPLOAD_COMPRESSION_WINDOW_BITS
+    && setting.lookaheadBits == UPLOAD_COMPRESSION_LOOKAHEAD_BITS;
+  printf(
+    "%-10s %8d %9.1f%% %9.1f%% %11.1f %10s%s\n",
+    name.c_str(),
+    LZSS_ENCODER_BUFFER_BYTES(setting.windowBits, setting.lookaheadBits),
+    100.0 * jsonCompressed / jsonBytes,
+    100.0 * binaryCompressed / binaryBytes,
+    seconds * 1e6 / (jsonBytes / 1024.0),
+    ok ? "ok" : "FAILED",
+    chosen ? "  <- firmware" : ""
+  );
+  return ok;
+}
+
+// Fewest measurements for which the compressed body and its header are
+// smaller than the plain body
+static size_t breakEvenMeasurements(const std::vector<Measurement>& measurements) {
+  size_t headerBytes = strlen("Content-Encoding: " UPLOAD_COMPRESSION_CONTENT_ENCODING "\r\n");
+  for (size_t count = 1; count <= measurements.size(); count++) {
+    std::string json = jsonBody(measurements, count);
+    std::string compressed = compress(json, UPLOAD_COMPRESSION_WINDOW_BITS, UPLOAD_COMPRESSION_LOOKAHEAD_BITS);
+    if (compressed.length() + headerBytes < json.length()) {
+      return count;
+    }
+  }
+  return SIZE_MAX;
+}
+
+bool benchmarkUploadCompression() {
+  beginWake(ESP_RST_DEEPSLEEP);
+  std::vector<CompressionSeries> series = compressionSeries();
+  printf(
+    "%zu series of %d measurements, compressed size of the upload body\n\n",
+    series.size(), COMPRESSION_SERIES_LENGTH
+  );
+  printf(
+    "%-10s %8s %10s %10s %11s %10s\n",
+    "window", "RAM B", "JSON", "binary", "us/KB host", "roundtrip"
+  );
+  bool ok = true;
+  for (const CompressionSetting& setting : COMPRESSION_SETTINGS) {
+    ok &= benchmarkSetting(setting, series);
+  }
+
+  printf("\n%-24s %10s\n", "break even", "measurements");
+  for (const CompressionSeries& one : series) {
+    size_t breakEven = breakEvenMeasurements(one.measurements);
+    ok &= breakEven <= UPLOAD_COMPRESSION_MIN_MEASUREMENTS;
+    printf("%-24s %10zu\n", one.name, breakEven);
+  }
+  printf("Compressing from %d measurements on\n", UPLOAD_COMPRESSION_MIN_MEASUREMENTS);
+  return ok;
+}
+
+}
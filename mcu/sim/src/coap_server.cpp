@@ -0,0 +1,164 @@
+#include <Arduino.h>
+#include "sim.h"
+#include "sim_coap_server.h"
+#include "coap_codec.h"
+#include "lzss_codec.h"
+
+
+namespace sim {
+
+CoapServer coapServer;
+
+// Largest body the stand-in reassembles, like AT+HTTPDATA's limit
+#define COAP_SERVER_MAX_BODY_BYTES 153600
+#define COAP_SERVER_OPTIONS_BYTES 64
+
+std::string decodeUploadBody(const std::string& body, const std::string& contentEncoding) {
+  unsigned windowBits, lookaheadBits;
+  if (sscanf(contentEncoding.c_str(), "heatshrink-w%u-l%u", &windowBits, &lookaheadBits) != 2) {
+    return body;
+  }
+  std::string decoded(COAP_SERVER_MAX_BODY_BYTES * 4, '\0');
+  size_t decodedLength;
+  unsigned char ret = lzssDecode(
+    (const uint8_t*) body.data(), body.length(), windowBits, lookaheadBits,
+    (uint8_t*) &decoded[0], decoded.length(), &decodedLength
+  );
+  trace("api: decoded %zu of %zu bytes (%u)", decodedLength, body.length(), ret);
+  return ret == LZSS_DECODE_OK ? decoded.substr(0, decodedLength) : std::string();
+}
+
+std::string fillUploadResponse(const std::string& response, int64_t epochS, const std::string& body) {
+  std::string filled = response;
+  size_t nowIndex = filled.find("{now}");
+  if (nowIndex != std::string::npos) {
+    filled.replace(nowIndex, 5, std::to_string(epochS));
+  }
+  size_t ackIndex = filled.find("{ack}");
+  if (ackIndex != std::string::npos) {
+    size_t batchIndex = body.find("\"batch\":");
+    long batch = batchIndex != std::string::npos ? atol(body.c_str() + batchIndex + 8) : 0;
+    filled.replace(ackIndex, 5, std::to_string(batch));
+  }
+  return filled;
+}
+
+// Header and options into a string, then the payload if there is one
+static std::string encodeMessage(
+  const CoapHeader& header,
+  bool block1,
+  uint32_t block1Value,
+  bool json,
+  const std::string& payload
+) {
+  uint8_t buffer[COAP_HEADER_BYTES + COAP_TOKEN_MAX_BYTES + COAP_SERVER_OPTIONS_BYTES];
+  CoapWriter writer(buffer, sizeof(buffer));
+  writer.begin(header);
+  if (json) {
+    writer.addUintOption(COAP_OPTION_CONTENT_FORMAT, COAP_CONTENT_FORMAT_JSON);
+  }
+  if (block1) {
+    writer.addUintOption(COAP_OPTION_BLOCK1, block1Value);
+  }
+  if (!payload.empty()) {
+    writer.beginPayload();
+  }
+  return std::string((const char*) buffer, writer.length()) + payload;
+}
+
+void CoapServer::reset(const CoapServerScript& newScript) {
+  script = newScript;
+  answered.clear();
+  blocks.clear();
+  nextBlock = 0;
+  lastBody.clear();
+  messageId = 0;
+  uploads = 0;
+  duplicates = 0;
+}
+
+std::vector<std::string> CoapServer::receive(const std::string& datagram, int64_t trueEpochS) {
+  CoapMessage request;
+  if (coapDecode((const uint8_t*) datagram.data(), datagram.length(), &request) != COAP_DECODE_OK) {
+    trace("api: dropping malformed datagram of %zu bytes", datagram.length());
+    return {};
+  }
+  // ACKs of separate responses, nothing to answer
+  if (request.header.type != COAP_TYPE_CONFIRMABLE) {
+    return {};
+  }
+  auto cached = answered.find(request.header.messageId);
+  if (cached != answered.end()) {
+    duplicates++;
+    return cached->second;
+  }
+
+  CoapHeader reply = request.header;
+  reply.type = COAP_TYPE_ACKNOWLEDGEMENT;
+  std::string path, encoding;
+  bool authorized = false, block1 = false;
+  CoapBlock block = { 0, false, 0 };
+  uint32_t block1Value = 0;
+  CoapOptionIterator options(request);
+  CoapOption option;
+  while (options.next(&option)) {
+    std::string value((const char*) option.value, option.length);
+    if (option.number == COAP_OPTION_URI_PATH) {
+      path += "/" + value;
+    } else if (option.number == COAP_OPTION_URI_QUERY) {
+      authorized |= value == script.tokenQuery;
+      if (value.compare(0, 4, "enc=") == 0) {
+        encoding = value.substr(4);
+      }
+    } else if (option.number == COAP_OPTION_BLOCK1) {
+      block1 = true;
+      block1Value = coapUintOptionValue(option);
+      block = coapDecodeBlock(block1Value);
+    }
+  }
+  std::string payload((const char*) request.payload, request.payloadLength);
+
+  std::vector<std::string> replies;
+  if (request.header.code != COAP_CODE_POST) {
+    reply.code = COAP_CODE_METHOD_NOT_ALLOWED;
+  } else if (path != "/measurement") {
+    reply.code = COAP_CODE_NOT_FOUND;
+  } else if (!authorized) {
+    reply.code = COAP_CODE_UNAUTHORIZED;
+  } else if (block1 && (block.number != (block.number == 0 ? 0 : nextBlock)
+    || (block.more && payload.length() != COAP_BLOCK_BYTES(block.szx))
+    || blocks.length() + payload.length() > COAP_SERVER_MAX_BODY_BYTES)) {
+    reply.code = COAP_CODE_REQUEST_ENTITY_INCOMPLETE;
+    nextBlock = 0;
+  } else {
+    if (!block1 || block.number == 0) {
+      blocks.clear();
+    }
+    blocks += payload;
+    nextBlock = block.number + 1;
+    if (block1 && block.more) {
+      reply.code = COAP_CODE_CONTINUE;
+    } else {
+      lastBody = decodeUploadBody(blocks, encoding);
+      blocks.clear();
+      nextBlock = 0;
+      uploads++;
+      std::string response = fillUploadResponse(script.responseBody, trueEpochS, lastBody);
+      reply.code = COAP_CODE_CHANGED;
+      if (script.separateResponses) {
+        CoapHeader empty = { COAP_TYPE_ACKNOWLEDGEMENT, COAP_CODE_EMPTY, request.header.messageId, 0, {} };
+        replies.push_back(encodeMessage(empty, false, 0, false, ""));
+        reply.type = COAP_TYPE_CONFIRMABLE;
+        reply.messageId = ++messageId;
+      }
+      replies.push_back(encodeMessage(reply, block1, block1Value, true, response));
+      answered[request.header.messageId] = replies;
+      return replies;
+    }
+  }
+  replies.push_back(encodeMessage(reply, block1, block1Value, false, ""));
+  answered[request.header.messageId] = replies;
+  return replies;
+}
+
+}
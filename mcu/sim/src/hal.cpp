@@ -0,0 +1,556 @@
+#include <Arduino.h>
+#include <new>
+#include <vector>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+#include "sim.h"
+#include "sim_modem.h"
+#include "sim_wifi.h"
+
+
+// GPIO state, see "Timing, GPIO and ADC" below
+static void resetPins();
+
+namespace sim {
+
+Clock clock;
+Board board;
+Stats stats;
+
+// A fixed table rather than a container, so scheduling doesn't show up in
+// the firmware's heap stats
+struct ScheduledEvent {
+  uint64_t id;
+  uint64_t atUs;
+  EventHandler run;
+  void* context;
+  uint32_t value;
+};
+
+static ScheduledEvent events[SIM_EVENTS_CAPACITY];
+static uint64_t nextEventId = 1;
+static bool dispatchingEvent = false;
+
+static ScheduledEvent* nextEvent() {
+  ScheduledEvent* next = nullptr;
+  for (ScheduledEvent& event : events) {
+    if (event.id == 0) continue;
+    // Same deadline, first scheduled first
+    if (next == nullptr || event.atUs < next->atUs
+      || (event.atUs == next->atUs && event.id < next->id)) {
+      next = &event;
+    }
+  }
+  return next;
+}
+
+static void moveClockTo(uint64_t totalUs) {
+  if (totalUs <= clock.totalUs) return;
+  uint64_t us = totalUs - clock.totalUs;
+  clock.totalUs += us;
+  clock.deviceEpochUs += us;
+  clock.trueEpochUs += us;
+}
+
+void advanceUs(uint64_t us) {
+  uint64_t targetUs = clock.totalUs + us;
+  // Events don't interrupt each other, time an event takes just passes
+  ScheduledEvent* next;
+  while (!dispatchingEvent && (next = nextEvent()) != nullptr && next->atUs <= targetUs) {
+    moveClockTo(next->atUs);
+    ScheduledEvent event = *next;
+    next->id = 0;
+    dispatchingEvent = true;
+    try {
+      event.run(event.context, event.value);
+    } catch (...) {
+      dispatchingEvent = false;
+      throw;
+    }
+    dispatchingEvent = false;
+  }
+  moveClockTo(targetUs);
+  if (awakeUs() > clock.wakeLimitUs) {
+    throw WakeEnd { WakeEnd::TIME_LIMIT };
+  }
+}
+
+uint64_t scheduleEvent(uint64_t atUs, EventHandler run, void* context, uint32_t value) {
+  for (ScheduledEvent& event : events) {
+    if (event.id != 0) continue;
+    event = { nextEventId++, atUs, run, context, value };
+    return event.id;
+  }
+  fprintf(stderr, "sim: more than %d events scheduled\n", SIM_EVENTS_CAPACITY);
+  abort();
+}
+
+void cancelEvent(uint64_t id) {
+  for (ScheduledEvent& event : events) {
+    if (event.id == id) {
+      event.id = 0;
+    }
+  }
+}
+
+uint64_t awakeUs() {
+  return clock.totalUs - clock.wakeStartUs;
+}
+
+// Bounds of the RTC_DATA_ATTR section, null if the firmware has none
+extern "C" char __start_sim_rtc_data[] __attribute__((weak));
+extern "C" char __stop_sim_rtc_data[] __attribute__((weak));
+
+// The section as the firmware image initialises it
+static const std::vector<char>& rtcMemoryAtBoot() {
+  static const std::vector<char> image(__start_sim_rtc_data, __stop_sim_rtc_data);
+  return image;
+}
+// Taken before main() and so before any firmware code runs
+static const std::vector<char>& rtcMemoryImage = rtcMemoryAtBoot();
+
+void resetRtcMemory() {
+  const std::vector<char>& image = rtcMemoryAtBoot();
+  std::copy(image.begin(), image.end(), __start_sim_rtc_data);
+}
+
+void corruptRtcMemory() {
+  for (char* byte = __start_sim_rtc_data; byte < __stop_sim_rtc_data; byte++) {
+    *byte = ~*byte;
+  }
+}
+
+void beginWake(esp_reset_reason_t resetReason) {
+  board.resetReason = resetReason;
+  // Timers, interrupts and GPIO levels don't outlive a wake, unless a pin was
+  // held through deep sleep
+  for (ScheduledEvent& event : events) {
+    event.id = 0;
+  }
+  if (resetReason == ESP_RST_POWERON) {
+    resetGpio();
+    resetRtcMemory();
+  } else {
+    resetPins();
+  }
+  board.sleepTimeUs = 0;
+  clock.wakeStartUs = clock.totalUs;
+  modem.floatPowerKey();
+  wifi.powerDown();
+  Stats fresh;
+  fresh.heapBytes = stats.heapBytes;
+  fresh.heapBaselineBytes = stats.heapBytes;
+  fresh.heapPeakBytes = stats.heapBytes;
+  stats = fresh;
+}
+
+void sleepUs(uint64_t us) {
+  // The RTC timer counts `us` on the drifting slow clock
+  uint64_t realUs = (uint64_t) ((double) us * 1e6 / (1e6 + board.rtcDriftPpm));
+  clock.totalUs += realUs;
+  clock.deviceEpochUs += us;
+  clock.trueEpochUs += realUs;
+}
+
+void trace(const char* format, ...) {
+  if (!board.verbose) return;
+  fprintf(stderr, "[sim %10.3f s] ", awakeUs() / 1e6);
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
+
+}
+
+/// Print and Stream
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    write(buffer[i]);
+  }
+  return size;
+}
+
+size_t Print::printf(const char* format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (length < 0) return 0;
+  return write((const uint8_t*) buffer, min((size_t) length, sizeof(buffer) - 1));
+}
+
+int Stream::timedRead() {
+  unsigned long startMillis = millis();
+  do {
+    int c = read();
+    if (c >= 0) return c;
+  } while (millis() - startMillis < timeout);
+  return -1;
+}
+
+String Stream::readStringUntil(char terminator) {
+  String result;
+  int c = timedRead();
+  while (c >= 0 && c != terminator) {
+    result += (char) c;
+    c = timedRead();
+  }
+  return result;
+}
+
+size_t Stream::readBytes(char* buffer, size_t length) {
+  size_t count = 0;
+  while (count < length) {
+    int c = timedRead();
+    if (c < 0) break;
+    buffer[count++] = (char) c;
+  }
+  return count;
+}
+
+/// HardwareSerial: UART0 is the USB console, UART1 the modem
+
+HardwareSerial Serial(0);
+HardwareSerial Serial1(1);
+
+void HardwareSerial::begin(unsigned long newBaud) {
+  baud = newBaud;
+}
+
+void HardwareSerial::updateBaudRate(unsigned long newBaud) {
+  baud = newBaud;
+}
+
+bool HardwareSerial::setHwFlowCtrlMode(uint8_t mode, uint8_t threshold) {
+  flowControl = mode;
+  return true;
+}
+
+uint64_t HardwareSerial::byteNs() const {
+  return 10000000000ULL / baud;
+}
+
+int HardwareSerial::available() {
+  if (uartNumber == 1) {
+    // At different rates either side only sees framing errors
+    sim::modem.dropGarbled(baud);
+    int count = sim::modem.available();
+    if (count > 0) return count;
+  }
+  sim::advanceUs(SIM_CPU_CALL_US);
+  return 0;
+}
+
+int HardwareSerial::read() {
+  if (uartNumber == 1) {
+    sim::modem.dropGarbled(baud);
+    int c = sim::modem.read();
+    if (c >= 0) {
+      sim::stats.uartRxBytes++;
+      return c;
+    }
+  }
+  // Nothing can arrive sooner than one character time
+  sim::advanceUs(byteNs() / 1000 + 1);
+  return -1;
+}
+
+int HardwareSerial::peek() {
+  if (uartNumber != 1) return -1;
+  sim::modem.dropGarbled(baud);
+  return sim::modem.peek();
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  if (uartNumber == 1) {
+    sim::stats.uartTxBytes++;
+    // The TX FIFO is tiny, writes go at the line rate
+    pendingTxNs += byteNs();
+    sim::advanceUs(pendingTxNs / 1000);
+    pendingTxNs %= 1000;
+    if (sim::modem.uartLinkWorks(baud)) {
+      sim::modem.receive(c);
+    }
+  } else if (sim::board.verbose) {
+    fputc(c, stdout);
+  }
+  return 1;
+}
+
+/// Timing, GPIO and ADC
+
+unsigned long millis() {
+  sim::advanceUs(SIM_CPU_CALL_US);
+  return sim::awakeUs() / 1000;
+}
+
+unsigned long micros() {
+  sim::advanceUs(SIM_CPU_CALL_US);
+  return sim::awakeUs();
+}
+
+void delay(uint32_t ms) {
+  sim::advanceUs((uint64_t) ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us) {
+  sim::advanceUs(us);
+}
+
+void yield() {
+  sim::advanceUs(SIM_CPU_CALL_US);
+}
+
+struct InterruptHandler {
+  void (*handler)();
+  int mode;
+};
+
+// Indexed by pin, arrays so GPIO doesn't show up in the heap stats
+static uint8_t pinLevels[256];
+static InterruptHandler interruptHandlers[256];
+static bool pinHeld[256];
+static bool deepSleepHold = false;
+
+static void setPinLevel(uint8_t pin, uint8_t level) {
+  uint8_t previous = pinLevels[pin];
+  pinLevels[pin] = level;
+  const InterruptHandler& handler = interruptHandlers[pin];
+  if (handler.handler == nullptr || previous == level) return;
+  if ((level == HIGH && (handler.mode & RISING)) || (level == LOW && (handler.mode & FALLING))) {
+    handler.handler();
+  }
+}
+
+// `value` is the pin in the upper byte and its new level in the lower
+static void onPinEvent(void* context, uint32_t value) {
+  setPinLevel(value >> 8, value & 0xff);
+}
+
+static unsigned long nextEchoDistanceMM() {
+  std::vector<unsigned long>& next = sim::board.nextEchoesMM;
+  if (next.empty()) {
+    return sim::board.echoDistanceMM;
+  }
+  unsigned long distanceMM = next.front();
+  next.erase(next.begin());
+  return distanceMM;
+}
+
+// The sensor answers the falling edge of a trigger pulse with an echo pulse
+// as long as the sound took there and back, 0.344 mm/us
+static void echoTrigger() {
+  if (pinLevels[sim::board.sensorEchoPin] == HIGH) {
+    // Still busy with the previous shot
+    return;
+  }
+  unsigned long distanceMM = nextEchoDistanceMM();
+  uint64_t pulseUs = distanceMM == 0
+    ? SIM_ECHO_MISSED_US
+    : distanceMM * 2 * 1000 / 344;
+  uint64_t riseUs = sim::clock.totalUs + SIM_ECHO_DELAY_US;
+  sim::scheduleEvent(riseUs, onPinEvent, nullptr, sim::board.sensorEchoPin << 8 | HIGH);
+  sim::scheduleEvent(riseUs + pulseUs, onPinEvent, nullptr, sim::board.sensorEchoPin << 8 | LOW);
+}
+
+// The modem sees its DTR line whichever way it changes
+static void updateModemDtr() {
+  if (sim::board.modemDtrPin != 0xff) {
+    sim::modem.setDtr(pinLevels[sim::board.modemDtrPin] == HIGH);
+  }
+}
+
+static void resetPins() {
+  for (int pin = 0; pin < 256; pin++) {
+    // A hold outlives deep sleep only with gpio_deep_sleep_hold_en()
+    if (!(pinHeld[pin] && deepSleepHold)) {
+      pinLevels[pin] = LOW;
+      pinHeld[pin] = false;
+    }
+  }
+  memset(interruptHandlers, 0, sizeof(interruptHandlers));
+  updateModemDtr();
+}
+
+void sim::resetGpio() {
+  memset(pinHeld, 0, sizeof(pinHeld));
+  deepSleepHold = false;
+  resetPins();
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pinHeld[pin]) return;
+  uint8_t previous = pinLevels[pin];
+  setPinLevel(pin, value);
+  if (pin == sim::board.modemPowerKeyPin) {
+    sim::modem.setPowerKey(value == HIGH);
+  }
+  if (pin == sim::board.modemDtrPin) {
+    updateModemDtr();
+  }
+  if (pin == sim::board.sensorTriggerPin && previous == HIGH && value == LOW) {
+    echoTrigger();
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return pinLevels[pin];
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode) {
+  interruptHandlers[pin] = { handler, mode };
+}
+
+void detachInterrupt(uint8_t pin) {
+  interruptHandlers[pin] = { nullptr, 0 };
+}
+
+uint16_t analogRead(uint8_t pin) {
+  // Roughly one ADC conversion
+  sim::advanceUs(40);
+  return sim::board.analogValues[pin];
+}
+
+unsigned long pulseIn(uint8_t pin, uint8_t state, unsigned long timeout) {
+  unsigned long distanceMM = nextEchoDistanceMM();
+  if (distanceMM == 0) {
+    sim::advanceUs(timeout);
+    return 0;
+  }
+  // Inverse of pulseTimeToDistanceMM(): 0.344 mm/us, there and back
+  unsigned long pulseUs = distanceMM * 2 * 1000 / 344;
+  if (pulseUs > timeout) {
+    sim::advanceUs(timeout);
+    return 0;
+  }
+  sim::advanceUs(pulseUs);
+  return pulseUs;
+}
+
+esp_err_t gpio_hold_en(gpio_num_t pin) {
+  pinHeld[pin] = true;
+  return ESP_OK;
+}
+
+esp_err_t gpio_hold_dis(gpio_num_t pin) {
+  pinHeld[pin] = false;
+  return ESP_OK;
+}
+
+void gpio_deep_sleep_hold_en() {
+  deepSleepHold = true;
+}
+
+void gpio_deep_sleep_hold_dis() {
+  deepSleepHold = false;
+}
+
+/// ESP-IDF system calls
+
+struct esp_timer {
+  esp_timer_create_args_t args;
+  uint64_t eventId;
+};
+
+static void onTimerEvent(void* context, uint32_t value) {
+  esp_timer_handle_t timer = (esp_timer_handle_t) context;
+  timer->eventId = 0;
+  timer->args.callback(timer->args.arg);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* handle) {
+  *handle = new esp_timer { *args, 0 };
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeoutUs) {
+  if (timer->eventId != 0) return ESP_ERR_INVALID_STATE;
+  timer->eventId = sim::scheduleEvent(sim::clock.totalUs + timeoutUs, onTimerEvent, timer, 0);
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  if (timer->eventId == 0) return ESP_ERR_INVALID_STATE;
+  sim::cancelEvent(timer->eventId);
+  timer->eventId = 0;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+  if (timer->eventId != 0) sim::cancelEvent(timer->eventId);
+  delete timer;
+  return ESP_OK;
+}
+
+int64_t esp_timer_get_time() {
+  return sim::awakeUs();
+}
+
+esp_reset_reason_t esp_reset_reason() {
+  return sim::board.resetReason;
+}
+
+void esp_sleep_enable_timer_wakeup(uint64_t timeUs) {
+  sim::board.sleepTimeUs = timeUs;
+}
+
+void esp_deep_sleep_start() {
+  throw sim::WakeEnd { sim::WakeEnd::DEEP_SLEEP };
+}
+
+void esp_restart() {
+  throw sim::WakeEnd { sim::WakeEnd::RESTART };
+}
+
+time_t simTime(time_t* result) {
+  time_t now = sim::clock.deviceEpochUs / 1000000;
+  if (result != nullptr) *result = now;
+  return now;
+}
+
+int simGettimeofday(struct timeval* tv, void* tz) {
+  // Floored like time(), also before 1970
+  int64_t us = sim::clock.deviceEpochUs;
+  int64_t s = us >= 0 ? us / 1000000 : -((-us + 999999) / 1000000);
+  tv->tv_sec = s;
+  tv->tv_usec = us - s * 1000000;
+  return 0;
+}
+
+int simSettimeofday(const struct timeval* tv, const void* tz) {
+  sim::clock.deviceEpochUs = (int64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+  return 0;
+}
+
+/// Heap accounting for the per-wake peak
+
+static void* countedAlloc(size_t size) {
+  // Keep the size in front of the block, aligned like malloc
+  size_t* block = (size_t*) malloc(size + 16);
+  if (block == nullptr) throw std::bad_alloc();
+  *block = size;
+  sim::stats.heapBytes += size;
+  sim::stats.heapAllocations++;
+  sim::stats.heapPeakBytes = max(sim::stats.heapPeakBytes, sim::stats.heapBytes);
+  return (uint8_t*) block + 16;
+}
+
+static void countedFree(void* pointer) {
+  if (pointer == nullptr) return;
+  size_t* block = (size_t*) ((uint8_t*) pointer - 16);
+  sim::stats.heapBytes -= *block;
+  free(block);
+}
+
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void operator delete(void* pointer) noexcept { countedFree(pointer); }
+void operator delete[](void* pointer) noexcept { countedFree(pointer); }
+void operator delete(void* pointer, size_t) noexcept { countedFree(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { countedFree(pointer); }
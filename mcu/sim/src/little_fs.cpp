@@ -0,0 +1,201 @@
+#include <LittleFS.h>
+#include <vector>
+#include "sim.h"
+
+
+// Rough LittleFS-on-SPI-flash costs on the ESP32-S2, good enough to compare
+// code paths against each other
+#define FS_MOUNT_US 30000
+#define FS_FORMAT_US 900000
+#define FS_OPEN_US 2000
+#define FS_REMOVE_US 5000
+#define FS_COMMIT_US 8000
+#define FS_READ_US_PER_BYTE 1
+#define FS_PROGRAM_US_PER_BYTE 3
+#define FS_TOTAL_BYTES (1024 * 1024)
+
+namespace sim {
+
+struct SimFile {
+  std::shared_ptr<std::vector<uint8_t>> content;
+  size_t position = 0;
+  size_t unflushedBytes = 0;
+  bool readable = false;
+  bool writable = false;
+  bool append = false;
+};
+
+static std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> files;
+static bool formatted = false;
+static bool mounted = false;
+
+void eraseFlash() {
+  files.clear();
+  formatted = false;
+  mounted = false;
+}
+
+}
+
+fs::LittleFSFS LittleFS;
+
+/// File
+
+size_t File::size() const {
+  return file ? file->content->size() : 0;
+}
+
+size_t File::position() const {
+  return file ? file->position : 0;
+}
+
+bool File::seek(uint32_t position, SeekMode mode) {
+  if (!file) return false;
+  size_t base = mode == SeekSet ? 0 : mode == SeekCur ? file->position : size();
+  if (base + position > size()) return false;
+  file->position = base + position;
+  return true;
+}
+
+void File::flush() {
+  if (!file || file->unflushedBytes == 0) return;
+  sim::advanceUs(FS_COMMIT_US + file->unflushedBytes * FS_PROGRAM_US_PER_BYTE);
+  sim::stats.flashCommits++;
+  sim::stats.flashBytesWritten += file->unflushedBytes;
+  file->unflushedBytes = 0;
+}
+
+void File::close() {
+  flush();
+  file = nullptr;
+}
+
+int File::available() {
+  return file && file->readable ? size() - file->position : 0;
+}
+
+int File::read() {
+  if (available() <= 0) return -1;
+  sim::advanceUs(FS_READ_US_PER_BYTE);
+  return (*file->content)[file->position++];
+}
+
+int File::peek() {
+  if (available() <= 0) return -1;
+  return (*file->content)[file->position];
+}
+
+size_t File::readBytes(char* buffer, size_t length) {
+  size_t count = min(length, (size_t) max(available(), 0));
+  if (count == 0) return 0;
+  sim::advanceUs(count * FS_READ_US_PER_BYTE);
+  memcpy(buffer, file->content->data() + file->position, count);
+  file->position += count;
+  return count;
+}
+
+size_t File::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t File::write(const uint8_t* buffer, size_t size) {
+  if (!file || !file->writable) return 0;
+  std::vector<uint8_t>& content = *file->content;
+  size_t position = file->append ? content.size() : file->position;
+  // Torn writes are modelled per byte, as on raw flash. Real LittleFS is
+  // coarser, so this is the stricter test.
+  int64_t& budget = sim::board.flashWriteBudgetBytes;
+  bool powerLoss = budget >= 0 && (int64_t) size > budget;
+  size_t written = powerLoss ? budget : size;
+  if (position + written > content.size()) {
+    content.resize(position + written);
+  }
+  memcpy(content.data() + position, buffer, written);
+  file->position = position + written;
+  file->unflushedBytes += written;
+  if (budget >= 0) budget -= written;
+  if (powerLoss) {
+    budget = -1;
+    throw sim::WakeEnd{ sim::WakeEnd::POWER_LOSS };
+  }
+  return size;
+}
+
+/// LittleFSFS
+
+namespace fs {
+
+bool LittleFSFS::begin(
+  bool formatOnFail,
+  const char* basePath,
+  uint8_t maxOpenFiles,
+  const char* partitionLabel
+) {
+  sim::advanceUs(FS_MOUNT_US);
+  sim::stats.flashMounts++;
+  if (!sim::formatted && !(formatOnFail && format())) {
+    return false;
+  }
+  sim::mounted = true;
+  return true;
+}
+
+void LittleFSFS::end() {
+  sim::mounted = false;
+}
+
+bool LittleFSFS::format() {
+  sim::advanceUs(FS_FORMAT_US);
+  sim::files.clear();
+  sim::formatted = true;
+  return true;
+}
+
+File LittleFSFS::open(const String& path, const char* mode, bool create) {
+  if (!sim::mounted) return File();
+  sim::advanceUs(FS_OPEN_US);
+  std::string key = path.c_str();
+  auto existing = sim::files.find(key);
+  bool creates = mode[0] == 'w' || mode[0] == 'a';
+  if (existing == sim::files.end() && !creates) return File();
+
+  auto file = std::make_shared<sim::SimFile>();
+  if (existing == sim::files.end()) {
+    file->content = std::make_shared<std::vector<uint8_t>>();
+    sim::files[key] = file->content;
+  } else {
+    file->content = existing->second;
+  }
+  bool plus = strchr(mode, '+') != nullptr;
+  file->readable = mode[0] == 'r' || plus;
+  file->writable = mode[0] != 'r' || plus;
+  file->append = mode[0] == 'a';
+  if (mode[0] == 'w') {
+    file->content->clear();
+  }
+  return File(file);
+}
+
+bool LittleFSFS::exists(const String& path) {
+  return sim::mounted && sim::files.count(path.c_str()) > 0;
+}
+
+bool LittleFSFS::remove(const String& path) {
+  if (!sim::mounted) return false;
+  sim::advanceUs(FS_REMOVE_US);
+  return sim::files.erase(path.c_str()) > 0;
+}
+
+size_t LittleFSFS::totalBytes() {
+  return FS_TOTAL_BYTES;
+}
+
+size_t LittleFSFS::usedBytes() {
+  size_t used = 0;
+  for (auto& entry : sim::files) {
+    used += entry.second->size();
+  }
+  return used;
+}
+
+}
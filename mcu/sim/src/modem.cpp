@@ -0,0 +1,569 @@
+#include <Arduino.h>
+#include <algorithm>
+#include <iterator>
+#include "sim.h"
+#include "sim_modem.h"
+#include "sim_coap_server.h"
+#include "coap_codec.h"
+
+
+namespace sim {
+
+Modem modem;
+
+// POWERKEY hold times (SIM7600 hardware design manual)
+#define POWER_ON_PULSE_MS 50
+#define POWER_OFF_PULSE_MS 2500
+
+#define MS_TO_US(ms) ((uint64_t) (ms) * 1000)
+// Largest AT+HTTPDATA body (SIM7600 AT command manual)
+#define HTTP_DATA_MAX_BYTES 153600
+
+static bool startsWith(const std::string& string, const std::string& prefix) {
+  return string.compare(0, prefix.length(), prefix) == 0;
+}
+
+void Modem::reset(const ModemScript& newScript) {
+  script = newScript;
+  scheduled.clear();
+  output.clear();
+  line.clear();
+  on = false;
+  echo = true;
+  powerKeyAsserted = false;
+  powerKeyChangedUs = clock.totalUs;
+  httpInitialized = false;
+  httpDataRemaining = 0;
+  cregUrcMode = 0;
+  sleepClockMode = 0;
+  networkTimeUpdates = false;
+  dtrHigh = false;
+  baud = SIM_MODEM_DEFAULT_BAUD;
+  newBaud = 0;
+  flowControl = false;
+  uartAwakeFromUs = 0;
+  radioBusyUntilUs = 0;
+  accountedUs = clock.totalUs;
+  chargeUAUs = 0;
+  httpActions = 0;
+  httpSessions = 0;
+  httpHeaders.clear();
+  httpUrl.clear();
+  httpBodyBytes = 0;
+  httpReads = 0;
+  netOpen = false;
+  udpLinkOpen = false;
+  datagramRemaining = 0;
+  commands = 0;
+  airBytes = 0;
+  networkRoundTrips = 0;
+  datagrams = 0;
+  datagramsOnAir = 0;
+  coapServer.reset(script.coapServer);
+}
+
+void Modem::setPowerKey(bool asserted) {
+  if (asserted == powerKeyAsserted) return;
+  uint64_t heldUs = clock.totalUs - powerKeyChangedUs;
+  powerKeyAsserted = asserted;
+  powerKeyChangedUs = clock.totalUs;
+  if (asserted) return;
+  // Acts on release, depending on how long the key was held
+  if (!isOn() && heldUs >= MS_TO_US(POWER_ON_PULSE_MS)) {
+    powerOn();
+  } else if (isOn() && offUs == 0 && heldUs >= MS_TO_US(POWER_OFF_PULSE_MS)) {
+    powerOff();
+  }
+}
+
+void Modem::floatPowerKey() {
+  powerKeyAsserted = false;
+  powerKeyChangedUs = clock.totalUs;
+}
+
+void Modem::setDtr(bool high) {
+  if (high == dtrHigh) return;
+  account();
+  bool wasAsleep = isAsleep();
+  dtrHigh = high;
+  if (isAsleep()) {
+    trace("modem: sleeping");
+    sleepStartUs = clock.totalUs;
+  } else if (wasAsleep) {
+    uint64_t sleptUs = clock.totalUs - sleepStartUs;
+    trace("modem: woken after %llu s", (unsigned long long) (sleptUs / 1000000));
+    uartAwakeFromUs = clock.totalUs + SIM_MODEM_DTR_WAKE_US;
+    if (script.sleepDetachMs > 0 && sleptUs >= MS_TO_US(script.sleepDetachMs)) {
+      trace("modem: dropped by the network while asleep");
+      registrationStartUs = uartAwakeFromUs;
+      if (cregUrcMode > 0) {
+        replyAt(registrationStartUs + MS_TO_US(script.registrationMs), "\r\n+CREG: 1\r\n");
+      }
+    }
+  }
+}
+
+bool Modem::isOn() const {
+  return on && (offUs == 0 || clock.totalUs < offUs);
+}
+
+bool Modem::isAsleep() const {
+  return isOn() && sleepClockMode == 1 && dtrHigh;
+}
+
+bool Modem::isUartReady() const {
+  return isOn() && !isAsleep()
+    && clock.totalUs >= readyUs && clock.totalUs >= uartAwakeFromUs;
+}
+
+bool Modem::isRegistered() const {
+  return isUartReady()
+    && clock.totalUs >= registrationStartUs + MS_TO_US(script.registrationMs);
+}
+
+std::string Modem::clockString() const {
+  bool knowsNetworkTime = script.networkTime && networkTimeUpdates && isRegistered();
+  time_t localS = knowsNetworkTime
+    ? clock.trueEpochUs / 1000000 + SIM_MODEM_TIME_ZONE_QUARTERS * 15 * 60
+    : SIM_MODEM_CLOCK_EPOCH_S + (clock.totalUs - readyUs) / 1000000;
+  tm local;
+  gmtime_r(&localS, &local);
+  char formatted[32];
+  snprintf(
+    formatted, sizeof(formatted), "%02d/%02d/%02d,%02d:%02d:%02d%+03d",
+    local.tm_year % 100, local.tm_mon + 1, local.tm_mday,
+    local.tm_hour, local.tm_min, local.tm_sec,
+    knowsNetworkTime ? SIM_MODEM_TIME_ZONE_QUARTERS : 0
+  );
+  return formatted;
+}
+
+uint32_t Modem::currentUAAt(uint64_t us) const {
+  if (!on || (offUs != 0 && us >= offUs)) return SIM_MODEM_OFF_UA;
+  if (sleepClockMode == 1 && dtrHigh) return SIM_MODEM_SLEEP_UA;
+  if (us < radioBusyUntilUs) return SIM_MODEM_RADIO_UA;
+  if (us < registrationStartUs + MS_TO_US(script.registrationMs)) return SIM_MODEM_REGISTERING_UA;
+  return SIM_MODEM_IDLE_UA;
+}
+
+void Modem::account() {
+  while (accountedUs < clock.totalUs) {
+    // The current also changes on its own at these
+    uint64_t untilUs = clock.totalUs;
+    uint64_t boundariesUs[] = {
+      offUs, radioBusyUntilUs, registrationStartUs + MS_TO_US(script.registrationMs)
+    };
+    for (uint64_t boundaryUs : boundariesUs) {
+      if (boundaryUs > accountedUs && boundaryUs < untilUs) untilUs = boundaryUs;
+    }
+    chargeUAUs += (double) currentUAAt(accountedUs) * (untilUs - accountedUs);
+    accountedUs = untilUs;
+  }
+}
+
+double Modem::chargeMAs() {
+  account();
+  // uA * us = 1e-9 mA * s
+  return chargeUAUs / 1e9;
+}
+
+void Modem::powerOn() {
+  trace("modem: power on");
+  account();
+  on = true;
+  offUs = 0;
+  echo = true;
+  cregUrcMode = 0;
+  httpInitialized = false;
+  httpDataRemaining = 0;
+  netOpen = false;
+  udpLinkOpen = false;
+  datagramRemaining = 0;
+  line.clear();
+  sleepClockMode = 0;
+  baud = SIM_MODEM_DEFAULT_BAUD;
+  newBaud = 0;
+  flowControl = false;
+  uartAwakeFromUs = 0;
+  radioBusyUntilUs = 0;
+  readyUs = clock.totalUs + MS_TO_US(script.bootMs);
+  registrationStartUs = readyUs;
+  if (script.bootUrcs) {
+    replyAt(readyUs, "\r\nRDY\r\n");
+    replyAt(readyUs + MS_TO_US(1000), "\r\n+CPIN: READY\r\n");
+    replyAt(readyUs + MS_TO_US(3000), "\r\nSMS DONE\r\n");
+    replyAt(readyUs + MS_TO_US(3500), "\r\nPB DONE\r\n");
+  }
+}
+
+void Modem::powerOff() {
+  trace("modem: power off");
+  account();
+  offUs = clock.totalUs + MS_TO_US(script.shutdownMs);
+  // Whatever was still being prepared is lost
+  scheduled.erase(scheduled.lower_bound(offUs), scheduled.end());
+  while (!output.empty() && output.back().atUs >= offUs) {
+    output.pop_back();
+  }
+  replyAt(offUs - MS_TO_US(1), "\r\nNORMAL POWER DOWN\r\n");
+}
+
+void Modem::replyAt(uint64_t atUs, const std::string& response) {
+  scheduled.emplace(atUs, response);
+}
+
+void Modem::transmitDue() {
+  while (!scheduled.empty() && scheduled.begin()->first <= clock.totalUs) {
+    uint64_t atUs = scheduled.begin()->first;
+    // The UART sends one byte after the other, 10 bits each
+    uint32_t baud = uartBaud();
+    uint64_t byteNs = 10000000000ULL / baud;
+    if (!output.empty() && output.back().atUs + byteNs / 1000 > atUs) {
+      atUs = output.back().atUs + byteNs / 1000;
+    }
+    const std::string& response = scheduled.begin()->second;
+    for (size_t i = 0; i < response.size(); i++) {
+      output.push_back({ atUs + i * byteNs / 1000, (uint8_t) response[i], baud });
+    }
+    scheduled.erase(scheduled.begin());
+  }
+}
+
+uint32_t Modem::uartBaud() const {
+  return newBaud != 0 && clock.totalUs >= newBaudUs ? newBaud : baud;
+}
+
+static bool ratesMatch(uint32_t hostBaud, uint32_t modemBaud, uint32_t maxCleanBaud) {
+  return hostBaud == modemBaud && (maxCleanBaud == 0 || hostBaud <= maxCleanBaud);
+}
+
+bool Modem::uartLinkWorks(uint32_t hostBaud) const {
+  return ratesMatch(hostBaud, uartBaud(), script.uartMaxCleanBaud);
+}
+
+void Modem::dropGarbled(uint32_t hostBaud) {
+  transmitDue();
+  while (
+    !output.empty() && output.front().atUs <= clock.totalUs
+    && !ratesMatch(hostBaud, output.front().baud, script.uartMaxCleanBaud)
+  ) {
+    output.pop_front();
+  }
+}
+
+void Modem::reply(const std::string& response, uint32_t latencyMs) {
+  replyAt(clock.totalUs + MS_TO_US(latencyMs), response);
+}
+
+int Modem::available() {
+  transmitDue();
+  int count = 0;
+  for (const Byte& b : output) {
+    if (b.atUs > clock.totalUs) break;
+    count++;
+  }
+  return count;
+}
+
+int Modem::peek() {
+  transmitDue();
+  if (output.empty() || output.front().atUs > clock.totalUs) return -1;
+  return output.front().value;
+}
+
+int Modem::read() {
+  int c = peek();
+  if (c >= 0) output.pop_front();
+  return c;
+}
+
+void Modem::receive(uint8_t c) {
+  if (!isUartReady()) return;
+  if (httpDataRemaining > 0) {
+    // Anything sent before the DOWNLOAD prompt is not body data
+    if (clock.totalUs < httpDataStartUs) return;
+    httpData += (char) c;
+    httpBodyBytes++;
+    if (--httpDataRemaining == 0) {
+      httpData = decodeUploadBody(httpData, httpHeader("Content-Encoding"));
+      reply("\r\nOK\r\n", script.commandLatencyMs);
+    }
+    return;
+  }
+  if (datagramRemaining > 0) {
+    // Same for the send prompt
+    if (clock.totalUs < datagramStartUs) return;
+    datagram += (char) c;
+    if (--datagramRemaining == 0) {
+      transmitDatagram();
+    }
+    return;
+  }
+  if (echo) {
+    reply(std::string(1, (char) c), 0);
+  }
+  if (c != '\r' && c != '\n') {
+    line += (char) c;
+    return;
+  }
+  if (line.empty()) return;
+  std::string command = line;
+  line.clear();
+  trace("modem: > %s", command.c_str());
+  handleCommand(command);
+}
+
+// Like the API, which has to know the encoding to find the batch number.
+// Headers come separated by a literal \r\n, they replace the earlier ones
+void Modem::parseHttpHeaders(const std::string& userData) {
+  httpHeaders.clear();
+  size_t start = 0;
+  while (start < userData.length()) {
+    size_t end = userData.find("\\r\\n", start);
+    if (end == std::string::npos) {
+      end = userData.length();
+    }
+    std::string header = userData.substr(start, end - start);
+    size_t colon = header.find(": ");
+    if (colon != std::string::npos) {
+      httpHeaders[header.substr(0, colon)] = header.substr(colon + 2);
+    }
+    start = end + 4;
+  }
+}
+
+std::string Modem::httpHeader(const std::string& name) const {
+  auto header = httpHeaders.find(name);
+  return header != httpHeaders.end() ? header->second : std::string();
+}
+
+void Modem::handleCommand(const std::string& command) {
+  const uint32_t latency = script.commandLatencyMs;
+  commands++;
+  for (const ModemRule& rule : script.rules) {
+    if (startsWith(command, rule.commandPrefix)) {
+      reply(rule.response, rule.latencyMs);
+      return;
+    }
+  }
+
+  if (command == "AT") {
+    reply("\r\nOK\r\n", latency);
+  } else if (command == "ATE0" || command == "ATE1") {
+    echo = command == "ATE1";
+    reply("\r\nOK\r\n", latency);
+  } else if (command == "AT+CREG?") {
+    reply(
+      "\r\n+CREG: " + std::to_string(cregUrcMode) + "," + (isRegistered() ? "1" : "2")
+        + "\r\n\r\nOK\r\n",
+      latency
+    );
+  } else if (startsWith(command, "AT+CREG=")) {
+    int mode = atoi(command.c_str() + strlen("AT+CREG="));
+    reply("\r\nOK\r\n", latency);
+    if (mode > 0 && cregUrcMode == 0 && !isRegistered()) {
+      replyAt(registrationStartUs + MS_TO_US(script.registrationMs), "\r\n+CREG: 1\r\n");
+    }
+    cregUrcMode = mode;
+  } else if (startsWith(command, "AT+CSCLK=")) {
+    account();
+    sleepClockMode = atoi(command.c_str() + strlen("AT+CSCLK="));
+    reply("\r\nOK\r\n", latency);
+  } else if (startsWith(command, "AT+CTZU=")) {
+    networkTimeUpdates = atoi(command.c_str() + strlen("AT+CTZU=")) == 1;
+    reply("\r\nOK\r\n", latency);
+  } else if (startsWith(command, "AT+IPR=")) {
+    static const uint32_t RATES[] = {
+      9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 3000000, 3200000, 3686400, 4000000
+    };
+    uint32_t rate = strtoul(command.c_str() + strlen("AT+IPR="), nullptr, 10);
+    bool supported = std::find(std::begin(RATES), std::end(RATES), rate) != std::end(RATES);
+    if (!supported || rate > script.maxUartBaud) {
+      reply("\r\nERROR\r\n", latency);
+      return;
+    }
+    reply("\r\nOK\r\n", latency);
+    // Switches once the OK is out
+    baud = uartBaud();
+    newBaud = rate;
+    newBaudUs = clock.totalUs + MS_TO_US(latency + 1);
+    trace("modem: UART at %u baud", rate);
+  } else if (command == "AT+IPR?") {
+    reply("\r\n+IPR: " + std::to_string(uartBaud()) + "\r\n\r\nOK\r\n", latency);
+  } else if (startsWith(command, "AT+IFC=")) {
+    // AT+IFC=<DCE by DTE>,<DTE by DCE>, 2 is RTS and CTS
+    flowControl = command == "AT+IFC=2,2";
+    reply("\r\nOK\r\n", latency);
+  } else if (command == "AT+CCLK?") {
+    reply("\r\n+CCLK: \"" + clockString() + "\"\r\n\r\nOK\r\n", latency);
+  } else if (command == "AT+CPOF") {
+    reply("\r\nOK\r\n", latency);
+    powerOff();
+  } else if (command == "AT+CPIN?") {
+    reply("\r\n+CPIN: READY\r\n\r\nOK\r\n", latency);
+  } else if (startsWith(command, "AT+CPIN=")) {
+    reply("\r\nOK\r\n", latency);
+  } else if (command == "AT+CCHSTART") {
+    reply("\r\nOK\r\n\r\n+CCHSTART: 0\r\n", latency);
+  } else if (command == "AT+HTTPINIT") {
+    reply(httpInitialized ? "\r\nERROR\r\n" : "\r\nOK\r\n", latency);
+    httpSessions += !httpInitialized;
+    httpInitialized = true;
+    httpHeaders.clear();
+    httpUrl.clear();
+    httpUserData.clear();
+  } else if (command == "AT+HTTPTERM") {
+    reply(httpInitialized ? "\r\nOK\r\n" : "\r\nERROR\r\n", latency);
+    httpInitialized = false;
+  } else if (startsWith(command, "AT+HTTPPARA=")) {
+    const char* urlPrefix = "AT+HTTPPARA=\"URL\",\"";
+    const char* userDataPrefix = "AT+HTTPPARA=\"USERDATA\",\"";
+    if (httpInitialized && startsWith(command, urlPrefix)) {
+      httpUrl = command.substr(strlen(urlPrefix), command.length() - strlen(urlPrefix) - 1);
+    } else if (httpInitialized && startsWith(command, userDataPrefix)) {
+      httpUserData = command.substr(strlen(userDataPrefix), command.length() - strlen(userDataPrefix) - 1);
+      parseHttpHeaders(httpUserData);
+    }
+    reply(httpInitialized ? "\r\nOK\r\n" : "\r\nERROR\r\n", latency);
+  } else if (startsWith(command, "AT+HTTPDATA=")) {
+    size_t length = atol(command.c_str() + strlen("AT+HTTPDATA="));
+    if (!httpInitialized || length == 0 || length > HTTP_DATA_MAX_BYTES) {
+      reply("\r\nERROR\r\n", latency);
+      return;
+    }
+    httpDataRemaining = length;
+    httpDataLength = length;
+    httpData.clear();
+    httpDataStartUs = clock.totalUs + MS_TO_US(latency);
+    reply("\r\nDOWNLOAD\r\n", latency);
+  } else if (startsWith(command, "AT+HTTPACTION=")) {
+    if (!httpInitialized) {
+      reply("\r\nERROR\r\n", latency);
+      return;
+    }
+    int method = atoi(command.c_str() + strlen("AT+HTTPACTION="));
+    reply("\r\nOK\r\n", latency);
+    account();
+    radioBusyUntilUs = clock.totalUs + MS_TO_US(script.httpActionMs);
+    int status = isRegistered() ? script.httpStatus : 713;
+    uint64_t responseEpochUs = clock.trueEpochUs + MS_TO_US(script.httpActionMs);
+    httpResponse = fillUploadResponse(script.httpResponseBody, responseEpochUs / 1000000, httpData);
+    httpActions++;
+    if (isRegistered()) {
+      networkRoundTrips += SIM_HTTPS_ROUND_TRIPS;
+      airBytes += SIM_HTTPS_OVERHEAD_BYTES + httpUrl.length() + httpUserData.length()
+        + (method == 1 ? httpDataLength : 0) + httpResponse.length();
+    }
+    reply(
+      "\r\n+HTTPACTION: " + std::to_string(method) + "," + std::to_string(status)
+        + "," + std::to_string(httpResponse.length()) + "\r\n",
+      script.httpActionMs
+    );
+  } else if (startsWith(command, "AT+HTTPREAD=")) {
+    // Either AT+HTTPREAD=<length> or AT+HTTPREAD=<offset>,<length>
+    const char* arguments = command.c_str() + strlen("AT+HTTPREAD=");
+    size_t offset = 0;
+    size_t length = atol(arguments);
+    const char* comma = strchr(arguments, ',');
+    if (comma != nullptr) {
+      offset = length;
+      length = atol(comma + 1);
+    }
+    if (!httpInitialized || offset > httpResponse.length()) {
+      reply("\r\nERROR\r\n", latency);
+      return;
+    }
+    httpReads++;
+    std::string data = httpResponse.substr(offset, length);
+    reply(
+      "\r\nOK\r\n\r\n+HTTPREAD: " + std::to_string(data.length()) + "\r\n"
+        + data + "\r\n+HTTPREAD: 0\r\n",
+      latency
+    );
+  } else if (startsWith(command, "AT+NET") || startsWith(command, "AT+CIP")) {
+    handleSocketCommand(command);
+  } else {
+    reply("\r\nERROR\r\n", latency);
+  }
+}
+
+void Modem::handleSocketCommand(const std::string& command) {
+  const uint32_t latency = script.commandLatencyMs;
+  if (command == "AT+NETOPEN") {
+    if (netOpen) {
+      reply("\r\n+IP ERROR: Network is already opened\r\n\r\nERROR\r\n", latency);
+      return;
+    }
+    netOpen = isRegistered();
+    reply("\r\nOK\r\n", latency);
+    reply(netOpen ? "\r\n+NETOPEN: 0\r\n" : "\r\n+NETOPEN: 1\r\n", script.netOpenMs);
+  } else if (command == "AT+NETCLOSE") {
+    reply(netOpen ? "\r\nOK\r\n\r\n+NETCLOSE: 0\r\n" : "\r\n+NETCLOSE: 2\r\n\r\nERROR\r\n", latency);
+    netOpen = false;
+    udpLinkOpen = false;
+  } else if (startsWith(command, "AT+CIPOPEN=0,\"UDP\"")) {
+    if (!netOpen || udpLinkOpen) {
+      reply("\r\nOK\r\n\r\n+CIPOPEN: 0,4\r\n", latency);
+      return;
+    }
+    udpLinkOpen = true;
+    reply("\r\nOK\r\n\r\n+CIPOPEN: 0,0\r\n", latency);
+  } else if (command == "AT+CIPCLOSE=0") {
+    reply(udpLinkOpen ? "\r\nOK\r\n\r\n+CIPCLOSE: 0,0\r\n" : "\r\n+CIPCLOSE: 0,4\r\n\r\nERROR\r\n", latency);
+    udpLinkOpen = false;
+  } else if (startsWith(command, "AT+CIPSEND=0,")) {
+    // AT+CIPSEND=0,<length>,"<host>",<port>
+    size_t length = atol(command.c_str() + strlen("AT+CIPSEND=0,"));
+    if (!udpLinkOpen || length == 0 || length > SIM_UDP_MAX_BYTES) {
+      reply("\r\nERROR\r\n", latency);
+      return;
+    }
+    datagramRemaining = length;
+    datagram.clear();
+    datagramStartUs = clock.totalUs + MS_TO_US(latency);
+    reply("\r\n>", latency);
+  } else {
+    reply("\r\nERROR\r\n", latency);
+  }
+}
+
+bool Modem::loseDatagram() {
+  return script.datagramLossEvery > 0 && datagramsOnAir++ % script.datagramLossEvery == 0;
+}
+
+void Modem::transmitDatagram() {
+  const uint32_t latency = script.commandLatencyMs;
+  reply(
+    "\r\nOK\r\n\r\n+CIPSEND: 0," + std::to_string(datagram.length()) + ","
+      + std::to_string(datagram.length()) + "\r\n",
+    latency
+  );
+  account();
+  datagrams++;
+  airBytes += datagram.length() + SIM_UDP_OVERHEAD_BYTES;
+  CoapMessage message;
+  bool confirmable = coapDecode((const uint8_t*) datagram.data(), datagram.length(), &message) == COAP_DECODE_OK
+    && message.header.type == COAP_TYPE_CONFIRMABLE;
+  networkRoundTrips += confirmable;
+  uint64_t arrivalUs = clock.totalUs + MS_TO_US(latency + script.networkRoundTripMs / 2);
+  radioBusyUntilUs = std::max(radioBusyUntilUs, arrivalUs);
+  if (!isRegistered() || loseDatagram()) {
+    trace("modem: datagram of %zu bytes lost", datagram.length());
+    return;
+  }
+  int64_t serverEpochS = (clock.trueEpochUs + (arrivalUs - clock.totalUs)) / 1000000;
+  for (const std::string& answer : coapServer.receive(datagram, serverEpochS)) {
+    bool continued = coapDecode((const uint8_t*) answer.data(), answer.length(), &message) == COAP_DECODE_OK
+      && message.header.code == COAP_CODE_CONTINUE;
+    uint64_t answerUs = arrivalUs + MS_TO_US((continued ? 0 : script.serverMs) + script.networkRoundTripMs / 2);
+    airBytes += answer.length() + SIM_UDP_OVERHEAD_BYTES;
+    radioBusyUntilUs = std::max(radioBusyUntilUs, answerUs);
+    if (loseDatagram()) {
+      trace("modem: answer of %zu bytes lost", answer.length());
+      continue;
+    }
+    replyAt(answerUs, "\r\n+IPD" + std::to_string(answer.length()) + "\r\n" + answer);
+  }
+}
+
+}
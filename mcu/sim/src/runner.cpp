@@ -0,0 +1,1260 @@
+// Replays every decision branch of setup() against the simulated board and
+// modem and reports what each wake costs, followed by the host benchmarks.
+// Run with `pio run -e native -t exec` and set SIM_VERBOSE=1 to also see the
+// console and the AT dialogue. Pass report names to run only those.
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "sim.h"
+#include "sim_modem.h"
+#include "sim_wifi.h"
+#include "cellular.h"
+#include "distance_sensor.h"
+#include "json_scanner.h"
+#include "wake_profile.h"
+#include "clock_sync.h"
+#include "rtc_batch.h"
+#include "upload_outbox.h"
+#include "measurement_log.h"
+#include "http.h"
+#include "upload_transport.h"
+#include "uplink.h"
+#include "wifi_link.h"
+#include "deployed_config.h"
+#include "build_time.h"
+#include "api_secrets.h"
+
+
+void setup();
+extern bool overlapCellularBoot;
+extern bool earlyGuessAwaitsShots;
+extern bool uploadInOneSession;
+extern uint8_t uploadTransport;
+extern uint32_t cellularUartTargetBaud;
+extern bool cellularUartFlowControl;
+
+// Same dividers as in main.cpp, inverted to produce ADC counts
+#define BATTERY_VOLTAGE_DIVIDER_RATIO 2.0
+#define USB_VOLTAGE_DIVIDER_RATIO (1.0+2.2)
+#define PIN_BATTERY_VOLTAGE_DIVIDER A3
+#define PIN_USB_VOLTAGE_DIVIDER A2
+
+#define SIM_TRUE_EPOCH_S ((int64_t) BUILD_TIME_UNIX_S + 7 * 24 * 60 * 60)
+
+struct Scenario {
+  const char* name;
+  // Device clock was set by an earlier upload
+  bool timeSynced;
+  bool flashFormatted;
+  double usbVoltage;
+  double batteryVoltage;
+  // Distances measured by earlier wakes, which run first
+  std::vector<unsigned long> earlierDistancesMM;
+  unsigned long distanceMM;
+  sim::ModemScript modem;
+  // Only reachable with wifiSsid set
+  sim::WifiScript wifi;
+  // Like a panic during the wake before the measured one
+  bool corruptRtcMemory = false;
+  // What the first shots of the measured wake echo instead of distanceMM
+  std::vector<unsigned long> firstEchoesMM;
+  // Only the RTC batch is lost, the rest of RTC memory survives
+  bool corruptRtcBatch = false;
+};
+
+struct WakeResult {
+  const char* outcome;
+  uint64_t awakeUs;
+  uint64_t sleepS;
+  sim::Stats stats;
+  // Of the last powerOffCellular() during the wake, -1 if there was none
+  int64_t shutdownMs;
+  // Drawn by the MCU, the modem and the WiFi radio while awake
+  double chargeMAs;
+  // Drawn by the modem during the deep sleep that follows, on average
+  double modemSleepUA;
+  // When the wake started, by the server's clock
+  int64_t trueStartUs;
+};
+
+static uint16_t voltageToAdc(double voltage, double dividerRatio) {
+  return voltage / dividerRatio / 2.5 * 8191.0;
+}
+
+static WakeResult runWake(
+  const Scenario& scenario,
+  unsigned long distanceMM,
+  esp_reset_reason_t resetReason
+) {
+  sim::board.analogValues[PIN_USB_VOLTAGE_DIVIDER] =
+    voltageToAdc(scenario.usbVoltage, USB_VOLTAGE_DIVIDER_RATIO);
+  sim::board.analogValues[PIN_BATTERY_VOLTAGE_DIVIDER] =
+    voltageToAdc(scenario.batteryVoltage, BATTERY_VOLTAGE_DIVIDER_RATIO);
+  sim::board.echoDistanceMM = distanceMM;
+  double modemChargeMAs = sim::modem.chargeMAs();
+  sim::beginWake(resetReason);
+  double wifiChargeMAs = sim::wifi.chargeMAs();
+
+  WakeResult result = { "stays awake", 0, 0, {}, -1, 0, 0, sim::clock.trueEpochUs };
+  uint32_t nbroShutdowns = cellularShutdownStats.nbroShutdowns;
+  try {
+    setup();
+  } catch (const sim::WakeEnd& end) {
+    result.outcome = end.kind == sim::WakeEnd::DEEP_SLEEP ? "deep sleep"
+      : end.kind == sim::WakeEnd::RESTART ? "restart"
+      : end.kind == sim::WakeEnd::POWER_LOSS ? "power loss"
+      : "time limit";
+    result.sleepS = sim::board.sleepTimeUs / 1000000;
+  }
+  result.awakeUs = sim::awakeUs();
+  if (cellularShutdownStats.nbroShutdowns != nbroShutdowns) {
+    result.shutdownMs = cellularShutdownStats.lastLatencyMs;
+  }
+  result.stats = sim::stats;
+  double wakeModemMAs = sim::modem.chargeMAs() - modemChargeMAs;
+  double wakeWifiMAs = sim::wifi.chargeMAs() - wifiChargeMAs;
+  result.chargeMAs = wakeModemMAs + wakeWifiMAs + (double) result.awakeUs * SIM_MCU_ACTIVE_UA / 1e9;
+  modemChargeMAs = sim::modem.chargeMAs();
+  sim::sleepUs(sim::board.sleepTimeUs);
+  if (sim::board.sleepTimeUs > 0) {
+    result.modemSleepUA = (sim::modem.chargeMAs() - modemChargeMAs) * 1e9 / sim::board.sleepTimeUs;
+  }
+  return result;
+}
+
+// Fresh board, flash and modem as the scenario asks for. Returns the reset
+// reason of its first wake.
+static esp_reset_reason_t beginScenario(const Scenario& scenario) {
+  sim::clock = sim::Clock();
+  sim::clock.trueEpochUs = SIM_TRUE_EPOCH_S * 1000000;
+  sim::clock.deviceEpochUs = scenario.timeSynced ? sim::clock.trueEpochUs : 0;
+  sim::board.nextEchoesMM.clear();
+  sim::eraseFlash();
+  sim::resetRtcMemory();
+  if (scenario.flashFormatted) {
+    LittleFS.format();
+  }
+  sim::modem.reset(scenario.modem);
+  sim::wifi.reset(scenario.wifi);
+  sim::resetGpio();
+  return scenario.timeSynced ? ESP_RST_DEEPSLEEP : ESP_RST_POWERON;
+}
+
+// The earlier wakes followed by the measured one
+static std::vector<WakeResult> runWakes(const Scenario& scenario) {
+  esp_reset_reason_t resetReason = beginScenario(scenario);
+  std::vector<WakeResult> results;
+  for (unsigned long distanceMM : scenario.earlierDistancesMM) {
+    results.push_back(runWake(scenario, distanceMM, resetReason));
+    resetReason = ESP_RST_DEEPSLEEP;
+  }
+  if (scenario.corruptRtcMemory) {
+    sim::corruptRtcMemory();
+  }
+  if (scenario.corruptRtcBatch) {
+    rtcBatch.checksum = ~rtcBatch.checksum;
+  }
+  sim::board.nextEchoesMM = scenario.firstEchoesMM;
+  sim::trace("--- measured wake of \"%s\" ---", scenario.name);
+  results.push_back(runWake(scenario, scenario.distanceMM, resetReason));
+  return results;
+}
+
+static WakeResult runScenario(const Scenario& scenario) {
+  return runWakes(scenario).back();
+}
+
+// An upload response as the API sends it, with its deployed config
+static sim::ModemScript withDeployedConfig(const std::string& config) {
+  sim::ModemScript script;
+  script.httpResponseBody =
+    "{\"measurements\":[{\"timeS\":1700000000,\"distanceMM\":1500,\"batteryVoltage\":3.9}],"
+    "\"config\":{" + config + "},\"now\":{now},\"ack\":{ack}}";
+  return script;
+}
+
+static std::vector<unsigned long> repeat(unsigned long distanceMM, size_t count) {
+  return std::vector<unsigned long>(count, distanceMM);
+}
+
+static bool reportWakeCycles() {
+  const std::vector<Scenario> scenarios = {
+    { "usb-powered", true, true, 5.0, 4.1, {}, 1500 },
+    { "battery-cutoff", true, true, 0.0, 3.4, {}, 1500 },
+    { "store", true, true, 0.0, 3.9, repeat(1500, 3), 1500 },
+    { "store/rtc-corrupted", true, true, 0.0, 3.9, repeat(1500, 3), 1500, {}, {}, true },
+    { "store/rtc-batch-lost", true, true, 0.0, 3.9, repeat(1500, 3), 1500, {}, {}, false, {}, true },
+    // Nothing comes back, each shot ends when the sensor lets go of the line
+    { "store/missed-echo", true, true, 0.0, 3.9, repeat(0, 3), 0 },
+    // The first shots hit a reflection the full measurement filters out, it
+    // mustn't power the modem on
+    { "store/reflection", true, true, 0.0, 3.9, repeat(1500, 3), 1500, {}, {}, false, { 1200, 1200, 1200, 1200 } },
+    // No clock yet, that alone no longer powers the modem
+    { "store/cold-boot", false, true, 0.0, 3.9, {}, 1500 },
+    { "transmit/cold-boot", false, true, 0.0, 3.9, repeat(1500, 3), 1600 },
+    {
+      "transmit/server-config", false, true, 0.0, 3.9, repeat(1500, 3), 1600,
+      withDeployedConfig(
+        "\"measurementIntervalS\":{\"unit\":\"s\",\"value\":1800},"
+        "\"numberOfMeasurementsToSkipBetweenUploads\":{\"unit\":\"naturalNumber\",\"value\":0}"
+      )
+    },
+    { "transmit/distance-delta", true, true, 0.0, 3.9, repeat(1500, 3), 1600 },
+    {
+      "transmit/no-cpof", true, true, 0.0, 3.9, repeat(1500, 3), 1600,
+      sim::ModemScript { .rules = { { "AT+CPOF", "\r\nERROR\r\n", 5 } } }
+    },
+    // A flat level stretches the interval, so MAXIMUM_INTER_TRANSMIT_TIME_S
+    // is reached long before a full batch
+    { "transmit/batch-age", true, true, 0.0, 3.9, repeat(1500, 13), 1500 },
+  };
+
+  printf(
+    "%-26s %-12s %10s %9s %10s %10s %11s %6s %9s %7s %8s\n",
+    "scenario", "outcome", "awake ms", "sleep s", "uart tx B", "uart rx B",
+    "heap peak B", "mounts", "flash w B", "off ms", "mAs"
+  );
+  std::map<std::string, WakeResult> results;
+  for (const Scenario& scenario : scenarios) {
+    WakeResult result = runScenario(scenario);
+    results[scenario.name] = result;
+    char shutdown[24] = "-";
+    if (result.shutdownMs >= 0) {
+      snprintf(shutdown, sizeof(shutdown), "%lld", (long long) result.shutdownMs);
+    }
+    printf(
+      "%-26s %-12s %10.1f %9llu %10llu %10llu %11zu %6u %9llu %7s %8.1f\n",
+      scenario.name,
+      result.outcome,
+      result.awakeUs / 1000.0,
+      (unsigned long long) result.sleepS,
+      (unsigned long long) result.stats.uartTxBytes,
+      (unsigned long long) result.stats.uartRxBytes,
+      result.stats.heapPeakBytes - result.stats.heapBaselineBytes,
+      result.stats.flashMounts,
+      (unsigned long long) result.stats.flashBytesWritten,
+      shutdown,
+      result.chargeMAs
+    );
+  }
+
+  // A store wake mounted LittleFS and scanned the log before the RTC batch,
+  // as one still does when the batch is lost. Before the RTC off marker it
+  // also checked whether the modem was on, as one does when all of RTC
+  // memory is lost.
+  const WakeResult& store = results["store"];
+  const WakeResult& mounted = results["store/rtc-batch-lost"];
+  const WakeResult& probed = results["store/rtc-corrupted"];
+  int64_t rtcSavedUs = (int64_t) mounted.awakeUs - (int64_t) store.awakeUs;
+  int64_t markerSavedUs = (int64_t) probed.awakeUs - (int64_t) mounted.awakeUs;
+  printf(
+    "\nRTC batch: a store wake is awake %.1f ms instead of %.1f ms with a mount and scan (-%.1f ms)\n",
+    store.awakeUs / 1000.0,
+    mounted.awakeUs / 1000.0,
+    rtcSavedUs / 1000.0
+  );
+  printf(
+    "RTC memory: %.1f ms once all of it is lost and the modem is probed as well (-%.1f ms more)\n",
+    probed.awakeUs / 1000.0,
+    markerSavedUs / 1000.0
+  );
+
+  // The same uploads with the modem powered on only once the wake decided
+  // RTC memory and the overlap each have to save time
+  bool ok = rtcSavedUs > 0 && markerSavedUs > 0;
+  printf("\n%-26s %10s %10s %10s %10s\n", "modem boot overlap", "awake ms", "serial ms", "saved ms", "saved mAs");
+  double savedMAs = 0;
+  for (const Scenario& scenario : scenarios) {
+    if (strncmp(scenario.name, "transmit/", 9) != 0) continue;
+    overlapCellularBoot = false;
+    WakeResult serial = runScenario(scenario);
+    overlapCellularBoot = true;
+    const WakeResult& overlapped = results[scenario.name];
+    int64_t savedUs = (int64_t) serial.awakeUs - (int64_t) overlapped.awakeUs;
+    ok &= savedUs > 0;
+    // Of a guess that hinges on the distance
+    if (strcmp(scenario.name, "transmit/distance-delta") == 0) {
+      savedMAs = serial.chargeMAs - overlapped.chargeMAs;
+    }
+    printf(
+      "%-26s %10.1f %10.1f %10.1f %10.1f\n",
+      scenario.name, overlapped.awakeUs / 1000.0, serial.awakeUs / 1000.0, savedUs / 1000.0,
+      serial.chargeMAs - overlapped.chargeMAs
+    );
+  }
+
+  // A wrong early guess costs a modem boot and its power off. The guess has
+  // to wait for enough shots that the reflection can't fool it, and waiting
+  // has to cost less than a right guess saves.
+  const WakeResult& reflection = results["store/reflection"];
+  earlyGuessAwaitsShots = false;
+  WakeResult fooled = runScenario(*std::find_if(
+    scenarios.begin(), scenarios.end(),
+    [](const Scenario& scenario) { return strcmp(scenario.name, "store/reflection") == 0; }
+  ));
+  earlyGuessAwaitsShots = true;
+  double waitMAs = reflection.chargeMAs - store.chargeMAs;
+  double wrongMAs = fooled.chargeMAs - store.chargeMAs;
+  printf(
+    "\nReflection: a store wake is awake %.1f ms instead of %.1f ms (+%.1f mAs), "
+    "%.1f ms (+%.1f mAs) guessing from the first shots\n",
+    reflection.awakeUs / 1000.0, store.awakeUs / 1000.0, waitMAs,
+    fooled.awakeUs / 1000.0, wrongMAs
+  );
+  printf("A right guess on the distance saves %.1f mAs, a wrong one costs as much as %.0f save\n", savedMAs, wrongMAs / savedMAs);
+  ok &= waitMAs < savedMAs;
+  return ok;
+}
+
+static void countProfiledWakes(const LineView* path, size_t depth, long value, void* context) {
+  if (depth == 2 && path[0].equals("wakeProfile") && path[1].equals("wakes")) {
+    *(long*) context = value;
+  }
+}
+
+#define WAKE_PHASE_TIMER_PAIRS 1000000
+
+static bool reportWakeProfile() {
+  // Three stores, then the upload that carries them
+  const Scenario scenarios[] = {
+    { "store", true, true, 0.0, 3.9, repeat(1500, 3), 1500 },
+    { "transmit/cold-boot", false, true, 0.0, 3.9, repeat(1500, 3), 1600 },
+    { "transmit/distance-delta", true, true, 0.0, 3.9, repeat(1500, 3), 1600 },
+  };
+  const size_t nbroScenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+  uint32_t phaseUs[nbroScenarios][WAKE_PHASES];
+  uint64_t awakeUs[nbroScenarios];
+  long uploadedWakes = -1;
+  for (size_t i = 0; i < nbroScenarios; i++) {
+    WakeResult result = runScenario(scenarios[i]);
+    awakeUs[i] = result.awakeUs;
+    for (size_t phase = 0; phase < WAKE_PHASES; phase++) {
+      phaseUs[i][phase] = wakePhaseUs((WakePhase) phase);
+    }
+    if (i == nbroScenarios - 1) {
+      const std::string& body = sim::modem.httpBody();
+      scanJsonNumbers(body.c_str(), body.length(), countProfiledWakes, &uploadedWakes);
+    }
+  }
+
+  printf("%-18s", "wake profile ms");
+  for (const Scenario& scenario : scenarios) {
+    printf(" %24s", scenario.name);
+  }
+  printf("\n");
+  bool withinWake = true;
+  for (size_t phase = 0; phase < WAKE_PHASES; phase++) {
+    printf("%-18s", wakePhaseName((WakePhase) phase));
+    for (size_t i = 0; i < nbroScenarios; i++) {
+      printf(" %24.1f", phaseUs[i][phase] / 1000.0);
+      withinWake &= phaseUs[i][phase] <= awakeUs[i];
+    }
+    printf("\n");
+  }
+  printf("%-18s", "awake");
+  for (size_t i = 0; i < nbroScenarios; i++) {
+    printf(" %24.1f", awakeUs[i] / 1000.0);
+  }
+  printf("\n");
+
+  // The upload carries the three store wakes before it
+  bool uploaded = uploadedWakes == 3;
+  printf("\nUpload after 3 stores carries a profile of %ld wakes\n", uploadedWakes);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < WAKE_PHASE_TIMER_PAIRS; i++) {
+    startWakePhase(WAKE_PHASE_BLINK);
+    stopWakePhase(WAKE_PHASE_BLINK);
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  printf(
+    "Start and stop of a phase on the host: %.1f ns\n",
+    elapsed.count() * 1e9 / WAKE_PHASE_TIMER_PAIRS
+  );
+  return withinWake && uploaded;
+}
+
+static void collectUploadedTimes(const LineView* path, size_t depth, long value, void* context) {
+  if (depth == 2 && path[0].equals("measurements") && path[1].equals("timeS")) {
+    ((std::vector<long>*) context)->push_back(value);
+  }
+}
+
+// Largest difference between the uploaded timestamps and the server's clock
+// when their wakes started. The current measurement goes first, then the
+// saved ones in order. `relative` compares the offsets to the current one
+// instead, for timestamps that went out unsynced.
+static double uploadedTimeErrorS(const std::vector<WakeResult>& wakes, bool relative) {
+  std::vector<long> times;
+  const std::string& body = sim::modem.httpBody();
+  scanJsonNumbers(body.c_str(), body.length(), collectUploadedTimes, &times);
+  if (times.size() != wakes.size()) {
+    return INFINITY;
+  }
+  double worstS = 0;
+  for (size_t i = 0; i < times.size(); i++) {
+    const WakeResult& wake = i == 0 ? wakes.back() : wakes[i - 1];
+    double errorS = relative
+      ? (times[i] - times[0]) - (wake.trueStartUs - wakes.back().trueStartUs) / 1e6
+      : times[i] - wake.trueStartUs / 1e6;
+    worstS = _max(worstS, fabs(errorS));
+  }
+  return worstS;
+}
+
+#define CLOCK_DRIFT_CYCLES 8
+// Cycles before the estimate counts, the first two syncs only set the clock
+#define CLOCK_DRIFT_SETTLING_CYCLES 2
+
+// Stores at one level, then an upload a step higher, over and over on a clock
+// that drifts by `driftPpm` in deep sleep. Returns how far the stored
+// timestamps were off at worst once the estimate settled.
+static double storedTimeErrorS(double driftPpm, bool correct) {
+  Scenario scenario = { "clock-drift", true, true, 0.0, 3.9, {}, 1500 };
+  esp_reset_reason_t resetReason = beginScenario(scenario);
+  sim::board.rtcDriftPpm = driftPpm;
+  clockDriftCorrection = correct;
+  double worstS = 0;
+  for (size_t cycle = 0; cycle < CLOCK_DRIFT_CYCLES; cycle++) {
+    unsigned long levelMM = 1500 + cycle * 100;
+    for (int i = 0; i < 3; i++) {
+      WakeResult store = runWake(scenario, levelMM, resetReason);
+      resetReason = ESP_RST_DEEPSLEEP;
+      if (cycle < CLOCK_DRIFT_SETTLING_CYCLES) continue;
+      const Measurement& stored = rtcBatch.measurements[rtcBatch.nbroMeasurements - 1];
+      worstS = _max(worstS, fabs(stored.timeS - store.trueStartUs / 1e6));
+    }
+    runWake(scenario, levelMM + 100, ESP_RST_DEEPSLEEP);
+  }
+  sim::board.rtcDriftPpm = 0;
+  clockDriftCorrection = true;
+  return worstS;
+}
+
+static bool reportClockSync() {
+  bool passed = true;
+  // A power loss, three stores with a clock counting from 0, then the
+  // upload that syncs it
+  Scenario coldBoot = { "cold-boot", false, true, 0.0, 3.9, repeat(1500, 3), 1600 };
+  printf("%-28s %-26s %8s\n", "backfill after power loss", "timestamps", "worst s");
+  for (bool networkTime : { true, false }) {
+    coldBoot.modem.networkTime = networkTime;
+    std::vector<WakeResult> wakes = runWakes(coldBoot);
+    // Without network time the clock is only set by the response, after
+    // the body went out. The offsets since power on still have to be right
+    // for the API, it shifts the batch to its own clock.
+    double worstS = uploadedTimeErrorS(wakes, !networkTime);
+    passed &= worstS <= 1.5;
+    printf(
+      "%-28s %-26s %8.1f\n", networkTime ? "network time" : "no network time",
+      networkTime ? "backfilled" : "since power on, relative", worstS
+    );
+  }
+
+  // Nothing to upload yet, the wake must not power the modem just for the time
+  Scenario unsynced = { "store/cold-boot", false, true, 0.0, 3.9, {}, 1500 };
+  WakeResult store = runScenario(unsynced);
+  bool radioOff = store.stats.uartRxBytes == 0;
+  passed &= radioOff;
+  printf("\nUnsynced store wake: %s, awake %.1f ms\n", radioOff ? "modem stays off" : "MODEM POWERED", store.awakeUs / 1000.0);
+
+  printf(
+    "\n%-12s %14s %14s %14s\n",
+    "drift ppm", "estimate ppm", "uncorrected s", "corrected s"
+  );
+  for (double driftPpm : { 200.0, 1000.0, -3000.0 }) {
+    double uncorrectedS = storedTimeErrorS(driftPpm, false);
+    double correctedS = storedTimeErrorS(driftPpm, true);
+    passed &= correctedS <= 2.0 && correctedS <= uncorrectedS;
+    printf(
+      "%-12.0f %14ld %14.1f %14.1f\n",
+      driftPpm, (long) clockSync.driftPpm, uncorrectedS, correctedS
+    );
+  }
+  return passed;
+}
+
+static void collectUploadedHashes(const LineView* path, size_t depth, long value, void* context) {
+  if (depth == 2 && path[0].equals("measurements") && path[1].equals("hash")) {
+    ((std::vector<long>*) context)->push_back(value);
+  }
+}
+
+static std::vector<long> uploadedHashes() {
+  std::vector<long> hashes;
+  const std::string& body = sim::modem.httpBody();
+  scanJsonNumbers(body.c_str(), body.length(), collectUploadedHashes, &hashes);
+  return hashes;
+}
+
+#define OUTBOX_OUTAGE_WAKES 24
+// Gives up on the server coming back after this many wakes
+#define OUTBOX_MAX_WAKES 64
+
+struct OutageCost {
+  uint32_t failedUploads;
+  // From the server coming back to the acknowledged upload
+  uint32_t wakesToDeliver;
+  size_t nbroMeasurements;
+  size_t nbroDelivered;
+  // Everything the first failed upload carried went out again
+  bool hashesStable;
+  double chargeMAs;
+};
+
+// Every wake wants to upload, the server answers 503 for the first
+// OUTBOX_OUTAGE_WAKES of them
+static OutageCost measureOutage(bool backoff) {
+  Scenario scenario = { "outbox", true, true, 0.0, 3.9, {}, 1500 };
+  esp_reset_reason_t resetReason = beginScenario(scenario);
+  uploadBackoff = backoff;
+  sim::modem.setHttpStatus(503);
+  OutageCost cost = {};
+  std::vector<long> firstHashes;
+  uint32_t sequence = uploadBatchSequence();
+  size_t wake = 0;
+  for (; wake < OUTBOX_MAX_WAKES && uploadBatchSequence() == sequence; wake++) {
+    if (wake == OUTBOX_OUTAGE_WAKES) {
+      cost.failedUploads = sim::modem.nbroHttpActions();
+      sim::modem.setHttpStatus(200);
+    }
+    // Alternating levels, each one a distance delta
+    uint32_t nbroHttpActions = sim::modem.nbroHttpActions();
+    cost.chargeMAs += runWake(scenario, wake % 2 == 0 ? 1500 : 1600, resetReason).chargeMAs;
+    resetReason = ESP_RST_DEEPSLEEP;
+    if (firstHashes.empty() && sim::modem.nbroHttpActions() != nbroHttpActions) {
+      firstHashes = uploadedHashes();
+    }
+  }
+  uploadBackoff = true;
+  cost.wakesToDeliver = wake - OUTBOX_OUTAGE_WAKES;
+  cost.nbroMeasurements = wake;
+  std::vector<long> delivered = uploadedHashes();
+  cost.nbroDelivered = delivered.size();
+  cost.hashesStable = !firstHashes.empty();
+  for (long hash : firstHashes) {
+    cost.hashesStable &= std::find(delivered.begin(), delivered.end(), hash) != delivered.end();
+  }
+  return cost;
+}
+
+static bool reportUploadOutbox() {
+  bool passed = true;
+  printf(
+    "%-18s %14s %16s %12s %8s %10s\n",
+    "server down", "failed uploads", "wakes to deliver", "delivered", "hashes", "awake mAs"
+  );
+  OutageCost costs[2];
+  for (bool backoff : { false, true }) {
+    OutageCost cost = measureOutage(backoff);
+    costs[backoff] = cost;
+    // Nothing lost and the retries dedupe
+    passed &= cost.nbroDelivered == cost.nbroMeasurements && cost.hashesStable;
+    printf(
+      "%-18s %14u %16u %6zu of %2zu %8s %10.1f\n",
+      backoff ? "backoff" : "retry every wake",
+      cost.failedUploads, cost.wakesToDeliver, cost.nbroDelivered, cost.nbroMeasurements,
+      cost.hashesStable ? "stable" : "CHANGED", cost.chargeMAs
+    );
+  }
+  passed &= costs[true].failedUploads < costs[false].failedUploads;
+  printf(
+    "\n%u wakes of outage: %u modem sessions instead of %u, %.0f mAs saved\n",
+    OUTBOX_OUTAGE_WAKES, costs[true].failedUploads, costs[false].failedUploads,
+    costs[false].chargeMAs - costs[true].chargeMAs
+  );
+  return passed;
+}
+
+// A week of hourly measurements the server never got
+#define BACKLOG_MEASUREMENTS (7 * 24 - 1)
+
+struct BacklogDrain {
+  const char* name;
+  bool oneSession;
+  bool compressed;
+  uint32_t nbroRequests;
+  uint32_t nbroSessions;
+  uint64_t bytesSent;
+  uint32_t requestsMs;
+  uint32_t slowestRequestMs;
+  uint32_t httpMs;
+  double chargeMAs;
+  bool delivered;
+};
+
+// The backlog is in flash and the RTC memory lost, so the next wake rebuilds
+// its batch from the log and uploads it for being a week old
+static void writeBacklog(bool compressed) {
+  LittleFS.begin();
+  MeasurementLog log;
+  log.open();
+  unsigned long nowS = sim::clock.trueEpochUs / 1000000;
+  for (size_t i = 0; i < BACKLOG_MEASUREMENTS; i++) {
+    unsigned long timeS = nowS - (BACKLOG_MEASUREMENTS - i) * 3600;
+    log.append({ timeS, 1500 + (unsigned long) i % 40, 3900 });
+  }
+  log.close();
+  // As if the server had asked for compression with an earlier upload
+  loadDeployedConfig();
+  DeployedConfig config = beginDeployedConfigUpdate();
+  config.uploadEncoding = compressed ? UPLOAD_ENCODING_HEATSHRINK : UPLOAD_ENCODING_IDENTITY;
+  commitDeployedConfigUpdate(&config);
+  saveDeployedConfig();
+  LittleFS.end();
+}
+
+static void measureBacklogDrain(BacklogDrain* drain) {
+  Scenario scenario = { "backlog", true, true, 0.0, 3.9, {}, 1500 };
+  esp_reset_reason_t resetReason = beginScenario(scenario);
+  writeBacklog(drain->compressed);
+
+  uploadInOneSession = drain->oneSession;
+  uint32_t sequence = uploadBatchSequence();
+  WakeResult wake = runWake(scenario, 1500, resetReason);
+  uploadInOneSession = true;
+  drain->nbroRequests = sim::modem.nbroHttpActions();
+  drain->nbroSessions = sim::modem.nbroHttpSessions();
+  drain->bytesSent = sim::modem.nbroHttpBodyBytes();
+  // Only a session keeps the per-request stats across requests
+  drain->requestsMs = httpSessionStats.requestsMs;
+  drain->slowestRequestMs = httpSessionStats.slowestRequestMs;
+  drain->httpMs = wakePhaseUs(WAKE_PHASE_HTTP) / 1000;
+  drain->chargeMAs = wake.chargeMAs;
+  drain->delivered = uploadBatchSequence() != sequence && nbroPendingInLog() == 0;
+}
+
+static bool reportBacklogDrain() {
+  BacklogDrain drains[] = {
+    { "session each", false, false },
+    { "one session", true, false },
+    { "compressed", true, true },
+  };
+  size_t nbroMeasurements = BACKLOG_MEASUREMENTS + 1;
+  printf("%zu measurements\n\n", nbroMeasurements);
+  printf(
+    "%-14s %9s %9s %9s %9s %8s %11s %10s %10s\n",
+    "", "requests", "sessions", "bytes", "http ms", "B/s", "slowest ms", "awake mAs", "delivered"
+  );
+  bool passed = true;
+  for (BacklogDrain& drain : drains) {
+    measureBacklogDrain(&drain);
+    passed &= drain.delivered;
+    passed &= drain.nbroRequests == (nbroMeasurements + RTC_BATCH_CAPACITY) / (RTC_BATCH_CAPACITY + 1);
+    printf(
+      "%-14s %9u %9u %9llu %9u %8llu %11s %10.1f %10s\n",
+      drain.name, drain.nbroRequests, drain.nbroSessions, (unsigned long long) drain.bytesSent, drain.httpMs,
+      drain.httpMs > 0 ? (unsigned long long) (drain.bytesSent * 1000 / drain.httpMs) : 0ULL,
+      drain.oneSession ? std::to_string(drain.slowestRequestMs).c_str() : "-",
+      drain.chargeMAs, drain.delivered ? "yes" : "NO"
+    );
+  }
+  const BacklogDrain& sessionEach = drains[0];
+  const BacklogDrain& oneSession = drains[1];
+  const BacklogDrain& compressed = drains[2];
+  passed &= oneSession.nbroSessions == 1 && compressed.nbroSessions == 1;
+  passed &= oneSession.httpMs < sessionEach.httpMs;
+  passed &= compressed.bytesSent < oneSession.bytesSent;
+  printf(
+    "\nMean request %u ms, %u ms of HTTP setup saved, compression sends %.0f%% of the bytes\n",
+    oneSession.requestsMs / oneSession.nbroRequests, sessionEach.httpMs - oneSession.httpMs,
+    100.0 * compressed.bytesSent / oneSession.bytesSent
+  );
+  return passed;
+}
+
+// An upload response echoing `nbroEchoed` measurements ahead of the ack, the
+// way the API answers a large upload
+static std::string echoingResponse(size_t nbroEchoed) {
+  std::string body = "{\"measurements\":[";
+  for (size_t i = 0; i < nbroEchoed; i++) {
+    body += i > 0 ? "," : "";
+    body += "{\"timeS\":" + std::to_string(1700000000 + i * 3600)
+      + ",\"distanceMM\":" + std::to_string(1500 + i % 40) + ",\"batteryVoltage\":3.9}";
+  }
+  return body + "],\"config\":{},\"now\":{now},\"ack\":{ack}}";
+}
+
+struct ResponseRead {
+  size_t nbroEchoed;
+  size_t responseBytes;
+  uint32_t nbroReads;
+  uint32_t httpMs;
+  bool delivered;
+};
+
+static void measureResponseRead(ResponseRead* read, std::string* authorization, std::string* url) {
+  Scenario scenario = { "response", true, true, 0.0, 3.9, repeat(1500, 3), 1600 };
+  scenario.modem.httpResponseBody = echoingResponse(read->nbroEchoed);
+  esp_reset_reason_t resetReason = beginScenario(scenario);
+  for (unsigned long distanceMM : scenario.earlierDistancesMM) {
+    runWake(scenario, distanceMM, resetReason);
+    resetReason = ESP_RST_DEEPSLEEP;
+  }
+  uint32_t sequence = uploadBatchSequence();
+  runWake(scenario, scenario.distanceMM, resetReason);
+  read->responseBytes = httpSessionStats.bytesReceived;
+  read->nbroReads = sim::modem.nbroHttpReads();
+  read->httpMs = wakePhaseUs(WAKE_PHASE_HTTP) / 1000;
+  read->delivered = uploadBatchSequence() != sequence;
+  *authorization = sim::modem.httpHeader("Authorization");
+  *url = sim::modem.httpRequestUrl();
+}
+
+struct ResponseNumbers {
+  long now;
+  long ack;
+  size_t count;
+};
+
+static void countResponseNumber(const LineView* path, size_t depth, long value, void* context) {
+  ResponseNumbers* numbers = (ResponseNumbers*) context;
+  numbers->count++;
+  if (depth == 1 && path[0].equals("now")) numbers->now = value;
+  if (depth == 1 && path[0].equals("ack")) numbers->ack = value;
+}
+
+// The same numbers whether the text comes in one piece or in `pieceLength`
+// byte pieces, split inside names and numbers alike
+static bool scansInPieces(const std::string& json, size_t pieceLength) {
+  ResponseNumbers whole = {};
+  bool wholeOk = scanJsonNumbers(json.data(), json.length(), countResponseNumber, &whole);
+  ResponseNumbers pieces = {};
+  JsonNumberScanner scanner(countResponseNumber, &pieces);
+  for (size_t offset = 0; offset < json.length(); offset += pieceLength) {
+    scanner.feed(json.data() + offset, std::min(pieceLength, json.length() - offset));
+  }
+  bool piecesOk = scanner.finish();
+  return wholeOk && piecesOk && whole.count == pieces.count
+    && whole.now == pieces.now && whole.ack == pieces.ack && whole.ack == 42;
+}
+
+static bool reportHttpResponse() {
+  ResponseRead reads[] = { { 0 }, { 24 }, { 168 }, { 1000 } };
+  printf("Read %d bytes per AT+HTTPREAD into a buffer of that size\n\n", HTTP_READ_CHUNK_BYTES);
+  printf("%-10s %10s %8s %9s %10s\n", "echoed", "bytes", "reads", "http ms", "delivered");
+  bool passed = true;
+  std::string authorization, url;
+  for (ResponseRead& read : reads) {
+    measureResponseRead(&read, &authorization, &url);
+    passed &= read.delivered;
+    passed &= read.nbroReads == (read.responseBytes + HTTP_READ_CHUNK_BYTES - 1) / HTTP_READ_CHUNK_BYTES;
+    printf(
+      "%-10zu %10zu %8u %9u %10s\n",
+      read.nbroEchoed, read.responseBytes, read.nbroReads, read.httpMs, read.delivered ? "yes" : "NO"
+    );
+  }
+  bool headerToken = authorization == "Bearer " HTTP_API_WRITE_TOKEN && url.find("token=") == std::string::npos;
+  passed &= headerToken;
+  printf("\nWrite token %s\n", headerToken ? "in the Authorization header only" : "NOT IN THE HEADER ONLY");
+
+  std::string json = echoingResponse(168);
+  json.replace(json.find("{now}"), 5, "1700000000");
+  json.replace(json.find("{ack}"), 5, "42");
+  printf("\n%-24s %10s\n", "scanned in pieces of", "same");
+  for (size_t pieceLength : { (size_t) 1, (size_t) 3, (size_t) 64, (size_t) 256 }) {
+    bool same = scansInPieces(json, pieceLength);
+    passed &= same;
+    printf("%-24zu %10s\n", pieceLength, same ? "yes" : "NO");
+  }
+
+  struct StatusCase {
+    int status;
+    HttpStatusClass expected;
+    const char* name;
+  };
+  const StatusCase statuses[] = {
+    { 200, HTTP_STATUS_SUCCESS, "success" },
+    { 204, HTTP_STATUS_SUCCESS, "success" },
+    { 301, HTTP_STATUS_REDIRECT, "redirect" },
+    { 401, HTTP_STATUS_CLIENT_ERROR, "client error" },
+    { 503, HTTP_STATUS_SERVER_ERROR, "server error" },
+    { 713, HTTP_STATUS_MODEM_ERROR, "modem error" },
+    { 0, HTTP_STATUS_NONE, "none" },
+  };
+  printf("\n%-8s %s\n", "status", "class");
+  for (const StatusCase& status : statuses) {
+    bool typed = httpStatusClass(status.status) == status.expected;
+    passed &= typed;
+    printf("%-8d %s%s\n", status.status, status.name, typed ? "" : " MISMATCH");
+  }
+  return passed;
+}
+
+struct TransportCost {
+  const char* name;
+  uint8_t transport;
+  // Of the datagrams on the air, 0 loses none
+  uint32_t datagramLossEvery;
+  bool separateResponses;
+  uint32_t nbroCommands;
+  uint32_t nbroRoundTrips;
+  uint64_t airBytes;
+  uint32_t uploadMs;
+  double chargeMAs;
+  bool delivered;
+};
+
+// The distance-delta upload of three earlier measurements, or the backlog
+// of a week in chunks. Counts the measured wake only.
+static void measureUploadTransport(TransportCost* cost, bool backlog) {
+  Scenario scenario = backlog
+    ? Scenario { "transport/backlog", true, true, 0.0, 3.9, {}, 1500 }
+    : Scenario { "transport/distance-delta", true, true, 0.0, 3.9, repeat(1500, 3), 1600 };
+  scenario.modem.coapServer.tokenQuery = "token=" HTTP_API_WRITE_TOKEN;
+  scenario.modem.datagramLossEvery = cost->datagramLossEvery;
+  scenario.modem.coapServer.separateResponses = cost->separateResponses;
+  esp_reset_reason_t resetReason = beginScenario(scenario);
+  if (backlog) {
+    writeBacklog(false);
+  }
+  for (unsigned long distanceMM : scenario.earlierDistancesMM) {
+    runWake(scenario, distanceMM, resetReason);
+    resetReason = ESP_RST_DEEPSLEEP;
+  }
+  uint32_t sequence = uploadBatchSequence();
+  uint32_t nbroCommands = sim::modem.nbroCommands();
+  uint32_t nbroRoundTrips = sim::modem.nbroNetworkRoundTrips();
+  uint64_t airBytes = sim::modem.nbroAirBytes();
+  uploadTransport = cost->transport;
+  WakeResult wake = runWake(scenario, scenario.distanceMM, resetReason);
+  uploadTransport = UPLOAD_TRANSPORT_HTTP;
+  cost->nbroCommands = sim::modem.nbroCommands() - nbroCommands;
+  cost->nbroRoundTrips = sim::modem.nbroNetworkRoundTrips() - nbroRoundTrips;
+  cost->airBytes = sim::modem.nbroAirBytes() - airBytes;
+  cost->uploadMs = wakePhaseUs(WAKE_PHASE_HTTP) / 1000;
+  cost->chargeMAs = wake.chargeMAs;
+  cost->delivered = uploadBatchSequence() != sequence && nbroPendingInLog() == 0;
+  if (cost->transport == UPLOAD_TRANSPORT_COAP) {
+    cost->delivered &= sim::coapServer.nbroUploads() > 0 && sim::modem.nbroHttpActions() == 0;
+  }
+}
+
+static bool reportUploadTransport() {
+  bool passed = true;
+  for (bool backlog : { false, true }) {
+    TransportCost costs[] = {
+      { "https", UPLOAD_TRANSPORT_HTTP, 0, false },
+      { "coap", UPLOAD_TRANSPORT_COAP, 0, false },
+      { "coap, 1 in 3 lost", UPLOAD_TRANSPORT_COAP, 3, false },
+      { "coap, separate", UPLOAD_TRANSPORT_COAP, 0, true },
+    };
+    printf(
+      "%s%-20s %9s %12s %10s %10s %10s %10s\n", backlog ? "\n" : "",
+      backlog ? "week of backlog" : "4 measurements",
+      "commands", "round trips", "air bytes", "upload ms", "awake mAs", "delivered"
+    );
+    for (TransportCost& cost : costs) {
+      measureUploadTransport(&cost, backlog);
+      passed &= cost.delivered;
+      printf(
+        "%-20s %9u %12u %10llu %10u %10.1f %10s\n",
+        cost.name, cost.nbroCommands, cost.nbroRoundTrips, (unsigned long long) cost.airBytes,
+        cost.uploadMs, cost.chargeMAs, cost.delivered ? "yes" : "NO"
+      );
+    }
+    const TransportCost& https = costs[0];
+    const TransportCost& coap = costs[1];
+    passed &= coap.nbroRoundTrips < https.nbroRoundTrips && coap.airBytes < https.airBytes;
+    printf(
+      "cheaper: %s, %.0f%% of the bytes and %.1f mAs less\n",
+      coap.chargeMAs < https.chargeMAs ? "coap" : "https",
+      100.0 * coap.airBytes / https.airBytes, https.chargeMAs - coap.chargeMAs
+    );
+  }
+  return passed;
+}
+
+struct UplinkCost {
+  const char* name;
+  // Of the upload as the server got it
+  std::string link;
+  bool fallback;
+  uint32_t connectMs;
+  uint32_t uploadMs;
+  double chargeMAs;
+  uint32_t nbroScans;
+  uint32_t nbroFastConnects;
+  bool delivered;
+};
+
+// A wake that stores a measurement and one that uploads it along with a
+// distance delta. Counts the second, the link as its upload reported it.
+static UplinkCost measureUplinkWake(const char* name, const Scenario& scenario, esp_reset_reason_t resetReason) {
+  UplinkCost cost = { name };
+  runWake(scenario, 1500, resetReason);
+  uint32_t sequence = uploadBatchSequence();
+  uint32_t nbroHttpActions = sim::modem.nbroHttpActions();
+  uint32_t nbroPosts = sim::wifi.nbroPosts();
+  uint32_t nbroScans = sim::wifi.nbroScans();
+  uint32_t nbroFastConnects = sim::wifi.nbroFastConnects();
+  WakeResult wake = runWake(scenario, 1600, ESP_RST_DEEPSLEEP);
+  bool overWifi = sim::wifi.nbroPosts() != nbroPosts;
+  bool overCellular = sim::modem.nbroHttpActions() != nbroHttpActions;
+  const std::string& body = overWifi ? sim::wifi.httpBody() : sim::modem.httpBody();
+  size_t link = body.find("\"uplink\":{\"link\":\"");
+  if (link != std::string::npos) {
+    link += strlen("\"uplink\":{\"link\":\"");
+    cost.link = body.substr(link, body.find('"', link) - link);
+  }
+  cost.fallback = body.find("\"fallback\":true") != std::string::npos;
+  cost.connectMs = (
+    wakePhaseUs(WAKE_PHASE_WIFI) + wakePhaseUs(WAKE_PHASE_MODEM_BOOT) + wakePhaseUs(WAKE_PHASE_REGISTRATION)
+  ) / 1000;
+  cost.uploadMs = wakePhaseUs(WAKE_PHASE_HTTP) / 1000;
+  cost.chargeMAs = wake.chargeMAs;
+  cost.nbroScans = sim::wifi.nbroScans() - nbroScans;
+  cost.nbroFastConnects = sim::wifi.nbroFastConnects() - nbroFastConnects;
+  // Over exactly one link, and the one the upload says
+  cost.delivered = uploadBatchSequence() != sequence && overWifi != overCellular
+    && cost.link == (overWifi ? "wifi" : "cellular");
+  return cost;
+}
+
+// The same site with and without a known access point, every wake an upload.
+// The access point then moves to another channel and goes down for good.
+static bool reportUplink() {
+  std::vector<UplinkCost> costs;
+  Scenario scenario = { "uplink", true, true, 0.0, 3.9, {}, 1500 };
+  esp_reset_reason_t resetReason = beginScenario(scenario);
+  costs.push_back(measureUplinkWake("cellular only", scenario, resetReason));
+
+  const char* configuredSsid = wifiSsid;
+  wifiSsid = scenario.wifi.ssid.c_str();
+  resetReason = beginScenario(scenario);
+  costs.push_back(measureUplinkWake("wifi, scan", scenario, resetReason));
+  resetReason = ESP_RST_DEEPSLEEP;
+  costs.push_back(measureUplinkWake("wifi, cached", scenario, resetReason));
+  sim::wifi.moveAccessPoint(scenario.wifi.channel + 5);
+  costs.push_back(measureUplinkWake("ap moved", scenario, resetReason));
+  costs.push_back(measureUplinkWake("ap moved, cached", scenario, resetReason));
+  sim::wifi.setAccessPointUp(false);
+  costs.push_back(measureUplinkWake("ap down", scenario, resetReason));
+  costs.push_back(measureUplinkWake("ap down, passed over", scenario, resetReason));
+  costs.push_back(measureUplinkWake("ap down, retried", scenario, resetReason));
+  wifiSsid = configuredSsid;
+
+  bool passed = true;
+  printf(
+    "%-22s %9s %9s %11s %10s %10s %6s %6s %10s\n",
+    "", "link", "fallback", "connect ms", "upload ms", "awake mAs", "scans", "fast", "delivered"
+  );
+  for (const UplinkCost& cost : costs) {
+    passed &= cost.delivered;
+    printf(
+      "%-22s %9s %9s %11u %10u %10.1f %6u %6u %10s\n",
+      cost.name, cost.link.c_str(), cost.fallback ? "yes" : "no", cost.connectMs, cost.uploadMs,
+      cost.chargeMAs, cost.nbroScans, cost.nbroFastConnects, cost.delivered ? "yes" : "NO"
+    );
+  }
+  const UplinkCost& cellular = costs[0];
+  const UplinkCost& scan = costs[1];
+  const UplinkCost& cached = costs[2];
+  const UplinkCost& moved = costs[3];
+  const UplinkCost& down = costs[5];
+  const UplinkCost& passedOver = costs[6];
+  passed &= cellular.link == "cellular" && scan.link == "wifi" && cached.link == "wifi";
+  passed &= cached.nbroFastConnects == 1 && cached.nbroScans == 0 && cached.connectMs < scan.connectMs;
+  passed &= cached.chargeMAs < scan.chargeMAs && scan.chargeMAs < cellular.chargeMAs;
+  // A failed fast connect falls back to a scan, not to cellular
+  passed &= moved.link == "wifi" && moved.nbroFastConnects == 1 && moved.nbroScans == 1;
+  passed &= costs[4].nbroFastConnects == 1 && costs[4].nbroScans == 0;
+  passed &= down.link == "cellular" && down.fallback;
+  passed &= passedOver.link == "cellular" && passedOver.nbroScans + passedOver.nbroFastConnects == 0;
+  passed &= costs[7].nbroScans == 1;
+  printf(
+    "wifi, cached: %.0f%% of the cellular charge, %.1f mAs less than a scan\n",
+    100.0 * cached.chargeMAs / cellular.chargeMAs, scan.chargeMAs - cached.chargeMAs
+  );
+  return passed;
+}
+
+struct UartCost {
+  const char* name;
+  uint32_t targetBaud;
+  bool flowControl;
+  // Of the modem, see ModemScript
+  uint32_t maxUartBaud;
+  uint32_t uartMaxCleanBaud;
+  // The backlog went with an earlier upload that parked the modem, the
+  // measured one carries a distance delta
+  bool parked;
+  // Of the measured upload
+  ModemUartTransfer transfer;
+  uint32_t uploadMs;
+  uint32_t awakeMs;
+  double chargeMAs;
+  // AT+IFC=2,2 went through
+  bool modemFlowControl;
+  // Over the whole run
+  uint16_t nbroNegotiations;
+  uint16_t nbroFallbacks;
+  bool delivered;
+};
+
+// The modem parked between uploads, the server deploys it with the first
+static void deployParking() {
+  LittleFS.begin();
+  loadDeployedConfig();
+  DeployedConfig config = beginDeployedConfigUpdate();
+  config.modemSleepMode = CELLULAR_SLEEP_MODE_DTR;
+  commitDeployedConfigUpdate(&config);
+  saveDeployedConfig();
+  LittleFS.end();
+}
+
+// Uploads a week of backlog uncompressed, so the UART has a lot to move.
+// Counts the measured wake only.
+static void measureModemUart(UartCost* cost) {
+  Scenario scenario = { "modem-uart", true, true, 0.0, 3.9, {}, 1500 };
+  scenario.modem.maxUartBaud = cost->maxUartBaud;
+  scenario.modem.uartMaxCleanBaud = cost->uartMaxCleanBaud;
+  cellularUartTargetBaud = cost->targetBaud;
+  cellularUartFlowControl = cost->flowControl;
+  esp_reset_reason_t resetReason = beginScenario(scenario);
+  writeBacklog(false);
+  unsigned long distanceMM = 1500;
+  if (cost->parked) {
+    deployParking();
+    runWake(scenario, 1500, resetReason);
+    runWake(scenario, 1500, ESP_RST_DEEPSLEEP);
+    resetReason = ESP_RST_DEEPSLEEP;
+    distanceMM = 1600;
+  }
+  uint32_t sequence = uploadBatchSequence();
+  WakeResult wake = runWake(scenario, distanceMM, resetReason);
+  cellularUartTargetBaud = CELLULAR_UART_FAST_BAUD;
+  cellularUartFlowControl = CELLULAR_UART_FLOW_CONTROL;
+  cost->transfer = wakeModemUartTransfer();
+  cost->uploadMs = wakePhaseUs(WAKE_PHASE_HTTP) / 1000;
+  cost->awakeMs = wake.awakeUs / 1000;
+  cost->chargeMAs = wake.chargeMAs;
+  cost->modemFlowControl = sim::modem.hasFlowControl();
+  cost->nbroNegotiations = cellularUartConfig.nbroNegotiations;
+  cost->nbroFallbacks = cellularUartConfig.nbroFallbacks;
+  cost->delivered = uploadBatchSequence() != sequence && nbroPendingInLog() == 0
+    && (!cost->parked || sim::modem.isAsleep());
+}
+
+static bool reportModemUart() {
+  UartCost costs[] = {
+    { "115200", 115200, false, 4000000, 0, false },
+    { "460800", 460800, false, 4000000, 0, false },
+    { "921600, RTS/CTS", 921600, true, 4000000, 0, false },
+    { "460800, parked", 460800, false, 4000000, 0, true },
+    { "3M, modem tops out", 3000000, false, 921600, 0, false },
+    { "921600, line garbles", 921600, false, 4000000, 230400, false },
+  };
+  printf(
+    "%-20s %8s %8s %9s %10s %10s %10s %5s %9s %10s\n",
+    "", "baud", "bytes", "B/s", "upload ms", "awake ms", "awake mAs", "asks", "fallbacks", "delivered"
+  );
+  bool passed = true;
+  for (UartCost& cost : costs) {
+    measureModemUart(&cost);
+    passed &= cost.delivered;
+    printf(
+      "%-20s %8u %8u %9u %10u %10u %10.1f %5u %9u %10s\n",
+      cost.name, cost.transfer.baud, cost.transfer.bytes,
+      cost.transfer.us > 0 ? (unsigned) ((uint64_t) cost.transfer.bytes * 1000000 / cost.transfer.us) : 0,
+      cost.uploadMs, cost.awakeMs, cost.chargeMAs, cost.nbroNegotiations, cost.nbroFallbacks,
+      cost.delivered ? "yes" : "NO"
+    );
+  }
+  const UartCost& slow = costs[0];
+  const UartCost& fast = costs[1];
+  const UartCost& flowControl = costs[2];
+  const UartCost& parked = costs[3];
+  // Faster through the body and the whole upload
+  passed &= fast.transfer.baud == 460800 && fast.transfer.us < slow.transfer.us && fast.uploadMs < slow.uploadMs;
+  passed &= flowControl.transfer.baud == 921600 && flowControl.modemFlowControl && !fast.modemFlowControl;
+  // Resumed at the rate of the boot before, without asking again
+  passed &= parked.transfer.baud == 460800 && parked.nbroNegotiations == 1;
+  for (const UartCost* fallback : { &costs[4], &costs[5] }) {
+    passed &= fallback->transfer.baud == CELLULAR_UART_DEFAULT_BAUD && fallback->nbroFallbacks == 1;
+  }
+  printf(
+    "460800: body %.1fx as fast, upload %u ms shorter\n",
+    (double) slow.transfer.us / fast.transfer.us, slow.uploadMs - fast.uploadMs
+  );
+  return passed;
+}
+
+// Where the modem has to register and how long the network keeps it
+struct ModemSite {
+  const char* name;
+  uint32_t registrationMs;
+  uint32_t sleepDetachMs;
+};
+
+static const ModemSite MODEM_SITES[] = {
+  { "strong signal", 4000, 0 },
+  { "weak signal", 30000, 0 },
+  { "weak, drops idle", 30000, 10 * 60 * 1000 },
+};
+
+struct UploadProfile {
+  unsigned long measurementIntervalS;
+  unsigned long uploadsPerDay;
+};
+
+static const UploadProfile UPLOAD_PROFILES[] = {
+  { 60 * 60, 1 },
+  { 60 * 60, 24 },
+  { 15 * 60, 96 },
+  { 5 * 60, 288 },
+};
+
+// A steady upload and store wake with the modem in `sleepMode`, and what it
+// draws asleep in between
+struct ModemSleepCost {
+  WakeResult upload;
+  WakeResult store;
+};
+
+static ModemSleepCost measureModemSleep(const ModemSite& site, int sleepMode, Scenario* scenario) {
+  *scenario = {
+    "modem-sleep", true, true, 0.0, 3.9,
+    // Stores and uploads take turns, the first upload deploys the mode
+    { 1500, 1600, 1500, 1600, 1500 }, 1600,
+    withDeployedConfig(
+      "\"modemSleepMode\":{\"unit\":\"naturalNumber\",\"value\":" + std::to_string(sleepMode) + "}"
+    )
+  };
+  scenario->modem.registrationMs = site.registrationMs;
+  scenario->modem.sleepDetachMs = site.sleepDetachMs;
+  std::vector<WakeResult> results = runWakes(*scenario);
+  return { results[5], results[4] };
+}
+
+static double dailyChargeMAh(const ModemSleepCost& cost, const UploadProfile& profile) {
+  double wakes = 24.0 * 60 * 60 / profile.measurementIntervalS;
+  double uploads = _min((double) profile.uploadsPerDay, wakes);
+  double stores = wakes - uploads;
+  double awakeS = (uploads * cost.upload.awakeUs + stores * cost.store.awakeUs) / 1e6;
+  double asleepS = _max(24.0 * 60 * 60 - awakeS, 0.0);
+  // uA * s = 1e-3 mA * s
+  double sleepMAs = asleepS * (SIM_MCU_DEEP_SLEEP_UA + cost.store.modemSleepUA) / 1000;
+  return (uploads * cost.upload.chargeMAs + stores * cost.store.chargeMAs + sleepMAs) / 3600;
+}
+
+static bool reportModemSleep() {
+  bool passed = true;
+  printf(
+    "%-18s %-9s %10s %11s %10s %10s %9s\n",
+    "modem sleep", "mode", "upload ms", "upload mAs", "store ms", "store mAs", "sleep uA"
+  );
+  ModemSleepCost costs[sizeof(MODEM_SITES) / sizeof(MODEM_SITES[0])][2];
+  Scenario scenario;
+  for (size_t i = 0; i < sizeof(MODEM_SITES) / sizeof(MODEM_SITES[0]); i++) {
+    for (int mode = CELLULAR_SLEEP_MODE_POWER_OFF; mode <= CELLULAR_SLEEP_MODE_DTR; mode++) {
+      ModemSleepCost cost = measureModemSleep(MODEM_SITES[i], mode, &scenario);
+      costs[i][mode] = cost;
+      // Uploads resume the parked modem, stores leave it asleep. The stats
+      // start over with the scenario's RTC memory.
+      bool resumed = cellularSleepStats.nbroResumes > 0;
+      if (resumed != (mode == CELLULAR_SLEEP_MODE_DTR)) {
+        passed = false;
+      }
+      printf(
+        "%-18s %-9s %10.1f %11.1f %10.1f %10.1f %9.0f\n",
+        MODEM_SITES[i].name,
+        mode == CELLULAR_SLEEP_MODE_DTR ? "dtr sleep" : "power off",
+        cost.upload.awakeUs / 1000.0, cost.upload.chargeMAs,
+        cost.store.awakeUs / 1000.0, cost.store.chargeMAs,
+        cost.store.modemSleepUA
+      );
+    }
+    // Skipping the boot has to show, where the network keeps the modem
+    if (MODEM_SITES[i].sleepDetachMs == 0
+      && costs[i][CELLULAR_SLEEP_MODE_DTR].upload.awakeUs >= costs[i][CELLULAR_SLEEP_MODE_POWER_OFF].upload.awakeUs) {
+      passed = false;
+    }
+  }
+
+  // The parked modem lost power in the meantime, the next upload cold boots
+  measureModemSleep(MODEM_SITES[0], CELLULAR_SLEEP_MODE_DTR, &scenario);
+  sim::modem.reset(scenario.modem);
+  uint32_t nbroFallbacks = cellularSleepStats.nbroColdBootFallbacks;
+  runWake(scenario, 1500, ESP_RST_DEEPSLEEP);
+  WakeResult fallback = runWake(scenario, 1600, ESP_RST_DEEPSLEEP);
+  bool fellBack = cellularSleepStats.nbroColdBootFallbacks == nbroFallbacks + 1
+    && strcmp(fallback.outcome, "deep sleep") == 0;
+  passed &= fellBack;
+  printf(
+    "\nParked modem lost power: %s, upload awake %.1f ms\n",
+    fellBack ? "cold boot fallback" : "NO FALLBACK", fallback.awakeUs / 1000.0
+  );
+
+  printf(
+    "\n%-18s %10s %11s %11s %11s %-9s\n",
+    "mAh per day", "interval s", "uploads/day", "power off", "dtr sleep", "pick"
+  );
+  for (size_t i = 0; i < sizeof(MODEM_SITES) / sizeof(MODEM_SITES[0]); i++) {
+    for (const UploadProfile& profile : UPLOAD_PROFILES) {
+      double powerOffMAh = dailyChargeMAh(costs[i][CELLULAR_SLEEP_MODE_POWER_OFF], profile);
+      double dtrSleepMAh = dailyChargeMAh(costs[i][CELLULAR_SLEEP_MODE_DTR], profile);
+      printf(
+        "%-18s %10lu %11lu %11.1f %11.1f %-9s\n",
+        MODEM_SITES[i].name, profile.measurementIntervalS, profile.uploadsPerDay,
+        powerOffMAh, dtrSleepMAh, dtrSleepMAh < powerOffMAh ? "dtr sleep" : "power off"
+      );
+    }
+  }
+  return passed;
+}
+
+struct Report {
+  const char* name;
+  // False if one of the report's checks failed
+  bool (*run)();
+};
+
+static const Report REPORTS[] = {
+  { "wake-cycles", reportWakeCycles },
+  { "modem-sleep", reportModemSleep },
+  { "wake-profile", reportWakeProfile },
+  { "clock-sync", reportClockSync },
+  { "upload-outbox", reportUploadOutbox },
+  { "backlog-drain", reportBacklogDrain },
+  { "http-response", reportHttpResponse },
+  { "upload-transport", reportUploadTransport },
+  { "uplink", reportUplink },
+  { "modem-uart", reportModemUart },
+  { "line-reader", sim::benchmarkLineReader },
+  { "batch-codec", sim::benchmarkBatchCodec },
+  { "upload-body", sim::benchmarkUploadBody },
+  { "upload-compression", sim::benchmarkUploadCompression },
+  { "measurement-log", sim::benchmarkMeasurementLog },
+  { "interval-scheduler", sim::benchmarkIntervalScheduler },
+  { "distance-filter", sim::benchmarkDistanceFilter },
+  { "sensor-units", sim::benchmarkSensorUnits },
+};
+
+int main(int argc, char** argv) {
+  const char* verbose = getenv("SIM_VERBOSE");
+  sim::board.verbose = verbose != nullptr && strcmp(verbose, "0") != 0;
+  sim::board.modemPowerKeyPin = PIN_CELLULAR_PWR;
+  sim::board.modemDtrPin = PIN_CELLULAR_DTR;
+  sim::board.sensorTriggerPin = PIN_DISTANCE_TRIGGER;
+  sim::board.sensorEchoPin = PIN_DISTANCE_ECHO;
+
+  bool first = true;
+  bool passed = true;
+  for (const Report& report : REPORTS) {
+    bool selected = argc < 2;
+    for (int i = 1; i < argc; i++) {
+      selected |= strcmp(argv[i], report.name) == 0;
+    }
+    if (!selected) continue;
+    if (!first) printf("\n");
+    first = false;
+    passed &= report.run();
+  }
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,220 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <HTTPClient.h>
+#include <string.h>
+#include "sim.h"
+#include "sim_wifi.h"
+#include "sim_coap_server.h"
+
+
+#define MS_TO_US(ms) ((uint64_t) (ms) * 1000)
+
+namespace sim {
+
+WifiNetwork wifi;
+
+void WifiNetwork::reset(const WifiScript& newScript) {
+  script = newScript;
+  stationOn = false;
+  outcome = WL_IDLE_STATUS;
+  settledUs = 0;
+  busyUntilUs = 0;
+  tlsOpen = false;
+  headers.clear();
+  body.clear();
+  response.clear();
+  hasResponse = false;
+  accountedUs = clock.totalUs;
+  chargeUAUs = 0;
+  scans = 0;
+  fastConnects = 0;
+  posts = 0;
+}
+
+uint32_t WifiNetwork::currentUAAt(uint64_t us) const {
+  if (!stationOn) return 0;
+  if (us < busyUntilUs) return SIM_WIFI_BUSY_UA;
+  if (us < settledUs || outcome != WL_CONNECTED) return SIM_WIFI_CONNECTING_UA;
+  return SIM_WIFI_CONNECTED_UA;
+}
+
+void WifiNetwork::account() {
+  while (accountedUs < clock.totalUs) {
+    uint64_t untilUs = clock.totalUs;
+    for (uint64_t boundaryUs : { settledUs, busyUntilUs }) {
+      if (boundaryUs > accountedUs && boundaryUs < untilUs) untilUs = boundaryUs;
+    }
+    chargeUAUs += (double) currentUAAt(accountedUs) * (untilUs - accountedUs);
+    accountedUs = untilUs;
+  }
+}
+
+double WifiNetwork::chargeMAs() {
+  account();
+  return chargeUAUs / 1e9;
+}
+
+void WifiNetwork::powerDown() {
+  setStation(false);
+}
+
+std::string WifiNetwork::httpHeader(const std::string& name) const {
+  auto header = headers.find(name);
+  return header != headers.end() ? header->second : "";
+}
+
+void WifiNetwork::setStation(bool on) {
+  account();
+  if (on == stationOn) return;
+  trace("wifi: station %s", on ? "on" : "off");
+  stationOn = on;
+  if (!on) disconnect();
+}
+
+void WifiNetwork::begin(
+  const std::string& ssid,
+  const std::string& password,
+  int32_t channel,
+  const uint8_t* bssid
+) {
+  account();
+  if (!stationOn) return;
+  tlsOpen = false;
+  bool fast = channel != 0 && bssid != nullptr;
+  bool found = script.accessPointUp && ssid == script.ssid;
+  if (fast) {
+    fastConnects++;
+    found &= channel == script.channel && memcmp(bssid, script.bssid, SIM_WIFI_BSSID_BYTES) == 0;
+  } else {
+    scans++;
+  }
+  settledUs = clock.totalUs + MS_TO_US(fast ? script.fastConnectMs : script.scanConnectMs);
+  outcome = !found ? WL_NO_SSID_AVAIL : password != script.password ? WL_CONNECT_FAILED : WL_CONNECTED;
+  trace("wifi: %s for %s, status %d in %u ms", fast ? "connecting" : "scanning", ssid.c_str(), outcome,
+    fast ? script.fastConnectMs : script.scanConnectMs);
+}
+
+int WifiNetwork::status() {
+  account();
+  if (!stationOn) return WL_DISCONNECTED;
+  if (outcome == WL_IDLE_STATUS) return WL_IDLE_STATUS;
+  return clock.totalUs < settledUs ? WL_DISCONNECTED : outcome;
+}
+
+void WifiNetwork::disconnect() {
+  account();
+  outcome = WL_IDLE_STATUS;
+  settledUs = 0;
+  tlsOpen = false;
+}
+
+void WifiNetwork::beginHttp(const std::string& url) {
+  headers.clear();
+  hasResponse = false;
+}
+
+void WifiNetwork::addHttpHeader(const std::string& name, const std::string& value) {
+  headers[name] = value;
+}
+
+int WifiNetwork::post(const uint8_t* payload, size_t size) {
+  hasResponse = false;
+  if (status() != WL_CONNECTED) return HTTPC_ERROR_NOT_CONNECTED;
+  posts++;
+  uint32_t requestMs = script.requestMs + (tlsOpen ? 0 : script.tlsHandshakeMs);
+  tlsOpen = true;
+  busyUntilUs = clock.totalUs + MS_TO_US(requestMs);
+  advanceUs(MS_TO_US(requestMs));
+  account();
+  body = decodeUploadBody(std::string((const char*) payload, size), httpHeader("Content-Encoding"));
+  response = fillUploadResponse(script.httpResponseBody, clock.trueEpochUs / 1000000, body);
+  hasResponse = true;
+  trace("wifi: POST of %zu bytes answered %d after %u ms", size, script.httpStatus, requestMs);
+  return script.httpStatus;
+}
+
+int WifiNetwork::writeResponse(Stream* stream) {
+  if (!hasResponse) return HTTPC_ERROR_NOT_CONNECTED;
+  stream->write((const uint8_t*) response.data(), response.size());
+  return (int) response.size();
+}
+
+void WifiNetwork::endHttp() {
+  tlsOpen = false;
+  hasResponse = false;
+}
+
+}
+
+WiFiClass WiFi;
+
+/// WiFiClass
+
+bool WiFiClass::mode(wifi_mode_t mode) {
+  sim::wifi.setStation(mode == WIFI_STA);
+  return true;
+}
+
+wl_status_t WiFiClass::begin(
+  const char* ssid,
+  const char* passphrase,
+  int32_t channel,
+  const uint8_t* bssid,
+  bool connect
+) {
+  sim::advanceUs(SIM_CPU_CALL_US);
+  sim::wifi.begin(ssid, passphrase != nullptr ? passphrase : "", channel, bssid);
+  return status();
+}
+
+wl_status_t WiFiClass::status() {
+  sim::advanceUs(SIM_CPU_CALL_US);
+  return (wl_status_t) sim::wifi.status();
+}
+
+bool WiFiClass::disconnect(bool wifiOff) {
+  sim::wifi.disconnect();
+  if (wifiOff) {
+    sim::wifi.setStation(false);
+  }
+  return true;
+}
+
+uint8_t* WiFiClass::BSSID() {
+  return sim::wifi.bssid();
+}
+
+int32_t WiFiClass::channel() {
+  return sim::wifi.channel();
+}
+
+int8_t WiFiClass::RSSI() {
+  return sim::wifi.rssi();
+}
+
+/// HTTPClient
+
+bool HTTPClient::begin(WiFiClient& client, const String& url) {
+  sim::wifi.beginHttp(url.c_str());
+  begun = true;
+  return true;
+}
+
+void HTTPClient::addHeader(const String& name, const String& value) {
+  sim::wifi.addHttpHeader(name.c_str(), value.c_str());
+}
+
+int HTTPClient::POST(uint8_t* payload, size_t size) {
+  return begun ? sim::wifi.post(payload, size) : HTTPC_ERROR_CONNECTION_REFUSED;
+}
+
+int HTTPClient::writeToStream(Stream* stream) {
+  return sim::wifi.writeResponse(stream);
+}
+
+void HTTPClient::end() {
+  if (begun) {
+    sim::wifi.endHttp();
+  }
+  begun = false;
+}
@@ -1,40 +1,71 @@
 #include <Arduino.h>
+#include <driver/gpio.h>
 #include "common_macros.h"
 #include "stream_extensions.h"
 #include "fast_blink.h"
+#include "wake_profile.h"
 #include "cellular.h"
+#include "rtc_sealed.h"
 
 
-unsigned char sendNoResponseCommand(Stream* modemStream, String command) {
-  modemStream->println(command);
-  String atResponseLine;
-  unsigned char ret;
-  OK_OR_RETURN(readEmptyLine(modemStream));
-  OK_OR_RETURN(readLine(modemStream, &atResponseLine));
-  if (atResponseLine.indexOf("OK") >= 0) {
+LineReader modemReader(&Serial1);
+ModemChannel modemChannel(&modemReader);
+
+// What the modem has announced through URCs since it was powered on
+struct CellularState {
+  bool uartReady;
+  bool simReady;
+  bool registered;
+};
+
+static CellularState cellularState = { false, false, false };
+
+// Where setupCellular() is at, it can be split around other work
+enum CellularSetupPhase {
+  CELLULAR_SETUP_IDLE,
+  // Powered on, booting and registering on its own
+  CELLULAR_SETUP_BOOTING,
+  // Woken from parking, still registered unless the network dropped it
+  CELLULAR_SETUP_RESUMING,
+  CELLULAR_SETUP_DONE,
+};
+
+static CellularSetupPhase cellularSetupPhase = CELLULAR_SETUP_IDLE;
+
+// A POWERKEY pulse left running by cancelCellularSetup(), powerOffCellular()
+// ends it
+static bool powerKeyPressed = false;
+static unsigned long powerKeyPressedMillis = 0;
+
+// Survive deep sleep, so a wake that doesn't use the modem needn't check
+// whether it is still on. CELLULAR_CONFIRMED_OFF or CELLULAR_PARKED, anything
+// else means unknown, like after a power loss.
+static RTC_DATA_ATTR uint32_t cellularPowerMarker;
+RTC_DATA_ATTR CellularShutdownStats cellularShutdownStats;
+RTC_DATA_ATTR CellularSleepStats cellularSleepStats;
+RTC_DATA_ATTR CellularUartConfig cellularUartConfig;
+
+// What a cold boot negotiates. The simulator changes them to compare.
+uint32_t cellularUartTargetBaud = CELLULAR_UART_FAST_BAUD;
+bool cellularUartFlowControl = CELLULAR_UART_FLOW_CONTROL;
+
+// Serial1's side, this boot
+static uint32_t uartBaud = CELLULAR_UART_DEFAULT_BAUD;
+static bool uartFlowControl = false;
+
+unsigned char sendNoResponseCommand(ModemChannel* modem, const String& command) {
+  unsigned char status = modem->sendCommand(command);
+  if (status == AT_OK_STATUS) {
     LOGLN("Status OK");
-    return AT_OK_STATUS;
-  } else if (atResponseLine.indexOf("ERROR") >= 0) {
-    LOGLN("Status ERROR");
-    return AT_ERROR_STATUS;
   }
-  LOGLN("Error receiving AT status.");
-  return ERROR_RECEIVING_AT_STATUS;
+  return status;
 }
 
 unsigned char sendStatusAndTextResponseCommand(
-  Stream* modemStream, String command, String* textResponse
+  ModemChannel* modem, const String& command, char* textResponse, size_t capacity
 ) {
-  modemStream->println(command);
-  *textResponse = modemStream->readStringUntil('\n');
-  if (textResponse->indexOf("ERROR") >= 0) {
-    return AT_ERROR_STATUS;
-  }
-  String statusResponse = modemStream->readStringUntil('\n');
-  if (statusResponse.indexOf("OK") >= 0) {
-    return AT_OK_STATUS;
-  }
-  return ERROR_RECEIVING_AT_STATUS;
+  textResponse[0] = '\0';
+  return modem->sendCommand(command, DEFAULT_TIMEOUT, "", textResponse, capacity);
 }
 
 String sendData(String command, const int timeout, boolean debug)
@@ -72,135 +103,360 @@ void sendSMS() {
   Serial.println("SMS sent.");
 }
 
+/// UART rate
+
+static bool cellularUartConfigIsValid() {
+  return rtcIsValid(cellularUartConfig, CELLULAR_UART_CONFIG_MAGIC, CELLULAR_UART_CONFIG_VERSION);
+}
+
+static CellularUartConfig* validCellularUartConfig() {
+  if (!cellularUartConfigIsValid()) {
+    resetRtc(&cellularUartConfig, CELLULAR_UART_CONFIG_MAGIC, CELLULAR_UART_CONFIG_VERSION);
+    cellularUartConfig.baud = cellularUartTargetBaud;
+    sealRtc(&cellularUartConfig);
+  }
+  return &cellularUartConfig;
+}
+
+uint32_t cellularUartBaud() {
+  return uartBaud;
+}
+
+static void setCellularUart(uint32_t baud, bool flowControl) {
+  if (baud != uartBaud) {
+    Serial1.updateBaudRate(baud);
+    uartBaud = baud;
+  }
+  if (flowControl != uartFlowControl) {
+    if (flowControl) {
+      Serial1.setPins(-1, -1, PIN_CELLULAR_CTS, PIN_CELLULAR_RTS);
+    }
+    Serial1.setHwFlowCtrlMode(flowControl ? HW_FLOWCTRL_CTS_RTS : HW_FLOWCTRL_DISABLE);
+    uartFlowControl = flowControl;
+  }
+}
+
+// A parked modem kept the rate it was left at
+static void setParkedCellularUart() {
+  if (cellularUartConfigIsValid()) {
+    setCellularUart(cellularUartConfig.baud, cellularUartConfig.flowControl);
+  } else {
+    setCellularUart(CELLULAR_UART_DEFAULT_BAUD, false);
+  }
+}
+
+// The first bytes after a switch may be garbled, so a few tries
+static unsigned char probeCellularUart() {
+  delay(CELLULAR_UART_SETTLE_MS);
+  for (int i = 0; i < CELLULAR_UART_PROBES; i++) {
+    modemReader.clear();
+    if (modemChannel.sendCommand("AT", CELLULAR_UART_PROBE_TIMEOUT_MS) == AT_OK_STATUS) {
+      return RET_OK;
+    }
+  }
+  return RET_TIMEOUT;
+}
+
+// Right after a cold boot, with the modem at CELLULAR_UART_DEFAULT_BAUD. The
+// rate in the config is asked for, the default once a faster one failed.
+// RET_ERROR if neither end can be understood anymore, only a power cycle
+// sets the modem back then.
+static unsigned char negotiateCellularUart() {
+  CellularUartConfig* config = validCellularUartConfig();
+  config->flowControl = cellularUartFlowControl
+    && sendNoResponseCommand(&modemChannel, "AT+IFC=2,2") == AT_OK_STATUS;
+  setCellularUart(CELLULAR_UART_DEFAULT_BAUD, config->flowControl);
+  sealRtc(&cellularUartConfig);
+  uint32_t baud = config->baud;
+  if (baud == CELLULAR_UART_DEFAULT_BAUD) {
+    return RET_OK;
+  }
+
+  config->nbroNegotiations++;
+  sealRtc(&cellularUartConfig);
+  char command[24];
+  snprintf(command, sizeof(command), "AT+IPR=%lu", (unsigned long) baud);
+  if (sendNoResponseCommand(&modemChannel, command) == AT_OK_STATUS) {
+    setCellularUart(baud, config->flowControl);
+    if (probeCellularUart() == RET_OK) {
+      LOGF("[INF|Cellular/UART] At %lu baud%s\n", (unsigned long) baud, config->flowControl ? " with RTS/CTS" : "");
+      return RET_OK;
+    }
+    LOGF("[WRN|Cellular/UART] No answer at %lu baud\n", (unsigned long) baud);
+    // Gets through if only the modem's answers are garbled
+    modemChannel.sendCommand("AT+IPR=" STRINGIFY(CELLULAR_UART_DEFAULT_BAUD), CELLULAR_UART_PROBE_TIMEOUT_MS);
+  } else {
+    LOGF("[WRN|Cellular/UART] Modem won't take %lu baud\n", (unsigned long) baud);
+  }
+  // Not again until a power loss
+  config->baud = CELLULAR_UART_DEFAULT_BAUD;
+  config->nbroFallbacks++;
+  sealRtc(&cellularUartConfig);
+  setCellularUart(CELLULAR_UART_DEFAULT_BAUD, config->flowControl);
+  if (probeCellularUart() != RET_OK) {
+    LOGLN("[ERR|Cellular/UART] Lost the modem switching back to the default rate");
+    return RET_ERROR;
+  }
+  LOGLN("[INF|Cellular/UART] Back at the default rate");
+  return RET_OK;
+}
+
 unsigned char tryDisableEcho(unsigned long timeout) {
-  unsigned long streamTimeoutBackup = Serial1.getTimeout();
   unsigned long startTime = millis();
   while (millis() - startTime < timeout) {
-    Serial1.println("ATE0");
-    Serial1.setTimeout(min(timeout - (millis() - startTime), (unsigned long) 200));
-    String response = Serial1.readStringUntil('\n');
-    if (response.indexOf("OK") >= 0) {
-      Serial1.setTimeout(streamTimeoutBackup);
-      return RET_OK;
-    }
-    if (response.indexOf("ATE0") >= 0) {
-      Serial1.setTimeout(streamTimeoutBackup);
+    // Nothing answers before the modem is up, RDY is dispatched while waiting
+    unsigned long attemptTimeout = min(timeout - (millis() - startTime), (unsigned long) 200);
+    if (modemChannel.sendCommand("ATE0", attemptTimeout) == AT_OK_STATUS) {
+      cellularState.uartReady = true;
       return RET_OK;
     }
   }
   return RET_TIMEOUT;
 }
 
-String CREG_RESPONSE_LINE_PREFIX = F("+CREG: ");
+#define CREG_RESPONSE_LINE_PREFIX "+CREG: "
 
 #define CREG_STATUS_REGISTERED_HOME 1
 #define CREG_STATUS_REGISTERED_ROAMING 5
 
-bool isCregResponseIndicatingNetworkRegistration(String response) {
-  if (response.indexOf(CREG_RESPONSE_LINE_PREFIX) >= 0) {
-    response.remove(0, CREG_RESPONSE_LINE_PREFIX.length());
-    unsigned int secondArgIndex = response.indexOf(',');
-    if (secondArgIndex < 0) {
-      // LOGLN("CREG response has no comma after first argument.");
-      LOGLN("[ERR|Cellular/NetworkRegistration] CREG response has no comma after first argument.");
-      return false;
-    }
-    unsigned int thirdArgIndex = response.indexOf(',', secondArgIndex + 1);
-    if (thirdArgIndex < 0) {
-      thirdArgIndex = response.length();
-    }
-    unsigned int status = response.substring(secondArgIndex + 1, thirdArgIndex).toInt();
-    if (status == CREG_STATUS_REGISTERED_HOME) {
-      LOGLN("[INF|Cellular/NetworkRegistration] CREG status: registered home (" STRINGIFY(CREG_STATUS_REGISTERED_HOME) ")");
-      return true;
-    } else if (status == CREG_STATUS_REGISTERED_ROAMING) {
-      LOGLN("[INF|Cellular/NetworkRegistration] CREG status: registered roaming (" STRINGIFY(CREG_STATUS_REGISTERED_ROAMING) ")");
-      return true;
-    }
-    LOGF("[INF|Cellular/NetworkRegistration] CREG status: not registered (%d)\n", status);
+// Handles both the reply to AT+CREG? ("+CREG: <n>,<stat>") and the URC
+// enabled by AT+CREG=1 ("+CREG: <stat>")
+bool isCregResponseIndicatingNetworkRegistration(const LineView& response) {
+  if (!response.startsWith(CREG_RESPONSE_LINE_PREFIX)) {
+    LOGF(
+      "[ERR|Cellular/NetworkRegistration] CREG response line does not start with \"%s\"\n",
+      CREG_RESPONSE_LINE_PREFIX
+    );
+    return false;
   }
-  LOGF(
-    "[ERR|Cellular/NetworkRegistration] CREG response line does not start with \"%s\"\n",
-    CREG_RESPONSE_LINE_PREFIX.c_str()
-  );
+  int statusIndex = response.indexOf(',', strlen(CREG_RESPONSE_LINE_PREFIX));
+  statusIndex = statusIndex >= 0 ? statusIndex + 1 : strlen(CREG_RESPONSE_LINE_PREFIX);
+  long status = response.toLong(statusIndex);
+  if (status == CREG_STATUS_REGISTERED_HOME) {
+    LOGLN("[INF|Cellular/NetworkRegistration] CREG status: registered home (" STRINGIFY(CREG_STATUS_REGISTERED_HOME) ")");
+    return true;
+  } else if (status == CREG_STATUS_REGISTERED_ROAMING) {
+    LOGLN("[INF|Cellular/NetworkRegistration] CREG status: registered roaming (" STRINGIFY(CREG_STATUS_REGISTERED_ROAMING) ")");
+    return true;
+  }
+  LOGF("[INF|Cellular/NetworkRegistration] CREG status: not registered (%ld)\n", status);
   return false;
 }
 
+static void onReadyUrc(const LineView& line) {
+  cellularState.uartReady = true;
+}
+
+static void onCpinUrc(const LineView& line) {
+  cellularState.simReady = line.contains("READY");
+}
+
+static void onCregUrc(const LineView& line) {
+  cellularState.registered = isCregResponseIndicatingNetworkRegistration(line);
+}
+
+static void onBootProgressUrc(const LineView& line) {}
+
+static bool isCellularNetworkRegistered() {
+  return cellularState.registered;
+}
+
 #define DEFAULT_NETWORK_REGISTRATION_TIMEOUT 30000
+// Registration is reported by URC, the query is only repeated in case one
+// got lost
+#define NETWORK_REGISTRATION_QUERY_INTERVAL_MS 5000
+#define CREG_RESPONSE_CAPACITY 32
 
 unsigned char waitUntilCellularNetworkRegistered(
   unsigned long timeout = DEFAULT_NETWORK_REGISTRATION_TIMEOUT
 ) {
+  WakePhaseTimer timer(WAKE_PHASE_REGISTRATION);
+  if (sendNoResponseCommand(&modemChannel, "AT+CREG=1") != AT_OK_STATUS) {
+    LOGLN("[ERR|Cellular/NetworkRegistration] Could not enable CREG URCs");
+  }
   unsigned long startTime = millis();
   while (millis() - startTime < timeout) {
-    fastBlink(3);
-    Serial1.println("AT+CREG?");
-    String response;
-    unsigned char ret = readLine(&Serial1, &response);
-    if (ret != RET_OK) {
-      LOGLN("[ERR|Cellular/NetworkRegistration] CREG: error reading response");
-      continue;
-    }
-    if (response.length() == 0) {
-      readLine(&Serial1, &response);
-    }
-    if (response.indexOf("ERROR") >= 0) {
+    char response[CREG_RESPONSE_CAPACITY] = "";
+    unsigned char status = modemChannel.sendCommand(
+      "AT+CREG?", DEFAULT_TIMEOUT, CREG_RESPONSE_LINE_PREFIX, response, sizeof(response)
+    );
+    if (status != AT_OK_STATUS) {
       LOGLN("[ERR|Cellular/NetworkRegistration] CREG: AT error");
-    } else if (isCregResponseIndicatingNetworkRegistration(response)) {
-      return RET_OK;
+    } else {
+      onCregUrc({ response, strlen(response) });
     }
-    LOGLN("[INF|Cellular/NetworkRegistration] Not registered, retrying in 700 ms...");
-    LOGLN("[INF|Cellular/NetworkRegistration] \\/ \\/ Flushing UART buffer... \\/\\/");
-    unsigned long flushStartTime = millis();
-    while (millis() - flushStartTime < 1000) {
-      while (Serial1.available()) {
-        Serial.write(Serial1.read());
-      }
+    unsigned long elapsed = millis() - startTime;
+    if (elapsed >= timeout) break;
+    unsigned long waitTimeout = min(timeout - elapsed, (unsigned long) NETWORK_REGISTRATION_QUERY_INTERVAL_MS);
+    if (modemChannel.waitUntil(isCellularNetworkRegistered, waitTimeout) == RET_OK) {
+      return RET_OK;
     }
-    LOGLN("[INF|Cellular/NetworkRegistration] /\\ /\\ UART buffer flushed /\\/");
+    LOGLN("[INF|Cellular/NetworkRegistration] Not registered yet, querying again...");
   }
   return RET_TIMEOUT;
 }
 
 unsigned char checkIfCellularIsOn(unsigned long timeout, bool* isOn) {
-  // Clear UART buffer
-  while (Serial1.available()) {
-    Serial1.read();
+  // Asleep it wouldn't answer
+  if (cellularIsParked()) {
+    *isOn = true;
+    return RET_OK;
   }
+  modemReader.clear();
 
   Serial1.println("ATE0");
   unsigned long startTime = millis();
   while (millis() - startTime < timeout) {
     // If any response is received, the module is on
-    if (Serial1.available()) {
-      // Clear UART buffer
-      while (Serial1.available()) {
-        Serial1.read();
-      }
+    if (modemReader.available() > 0) {
+      modemReader.clear();
+      cellularPowerMarker = 0;
+      cellularState.uartReady = true;
       *isOn = true;
       return RET_OK;
     }
+    delay(LINE_READER_POLL_MS);
   }
+  cellularPowerMarker = CELLULAR_CONFIRMED_OFF;
   *isOn = false;
   return RET_TIMEOUT;
 }
 
-void powerOffCellular() {
+static void recordShutdown(unsigned long latencyMs, bool usedPowerKey, bool confirmed) {
+  CellularShutdownStats* stats = &cellularShutdownStats;
+  stats->nbroShutdowns++;
+  stats->nbroPowerKeyFallbacks += usedPowerKey ? 1 : 0;
+  stats->nbroUnconfirmed += confirmed ? 0 : 1;
+  stats->lastLatencyMs = latencyMs;
+  size_t bucket = min(
+    latencyMs / CELLULAR_SHUTDOWN_HISTOGRAM_BUCKET_MS,
+    (unsigned long) CELLULAR_SHUTDOWN_HISTOGRAM_BUCKETS - 1
+  );
+  stats->latencyHistogram[bucket]++;
+  LOGF(
+    "[INF|Cellular] Power off %s after %lu ms (%s)\n",
+    confirmed ? "confirmed" : "not confirmed", latencyMs, usedPowerKey ? "POWERKEY" : "AT+CPOF"
+  );
+}
+
+// The modem says goodbye with NORMAL POWER DOWN. If that got lost, an AT that
+// goes unanswered tells as much.
+static unsigned char waitForPowerDown() {
+  LineView line;
+  if (modemChannel.waitForLine("NORMAL POWER DOWN", &line, CELLULAR_POWER_DOWN_TIMEOUT_MS) == RET_OK) {
+    return RET_OK;
+  }
+  bool isOn = true;
+  checkIfCellularIsOn(CELLULAR_SILENCE_PROBE_MS, &isOn);
+  return isOn ? RET_ERROR : RET_OK;
+}
+
+// DTR low wakes a parked modem and keeps it awake
+static void wakeParkedCellular() {
+  // Parking held DTR, and with it every digital pad, through deep sleep. The
+  // holds outlive the wake, the pins ignore every write until released.
+  gpio_deep_sleep_hold_dis();
+  gpio_hold_dis((gpio_num_t) PIN_CELLULAR_DTR);
+  gpio_hold_dis((gpio_num_t) PIN_CELLULAR_PWR);
+  pinMode(PIN_CELLULAR_DTR, OUTPUT);
+  digitalWrite(PIN_CELLULAR_DTR, LOW);
+  cellularPowerMarker = 0;
+  setParkedCellularUart();
+  delay(CELLULAR_DTR_WAKE_MS);
+}
+
+static void pressPowerKey() {
   pinMode(PIN_CELLULAR_PWR, OUTPUT);
-  // Pulse high for at least 2.5 seconds
   digitalWrite(PIN_CELLULAR_PWR, HIGH);
-  delay(3000);
+  powerKeyPressed = true;
+  powerKeyPressedMillis = millis();
+}
+
+unsigned char powerOffCellular() {
+  WakePhaseTimer timer(WAKE_PHASE_MODEM_OFF);
+  cellularSetupPhase = CELLULAR_SETUP_IDLE;
+  setupCellularIO();
+  unsigned long startMillis = powerKeyPressed ? powerKeyPressedMillis : millis();
+  if (cellularIsParked()) {
+    wakeParkedCellular();
+    // It had been registered, so it can take AT+CPOF
+    cellularState.uartReady = true;
+  }
+
+  // Only a modem that got as far as its UART can take AT+CPOF
+  if (cellularState.uartReady && !powerKeyPressed) {
+    modemReader.clear();
+    if (
+      modemChannel.sendCommand("AT+CPOF", CELLULAR_SOFT_POWER_OFF_TIMEOUT_MS) == AT_OK_STATUS
+      && waitForPowerDown() == RET_OK
+    ) {
+      // Held HIGH like after the POWERKEY pulse below, so it stays off
+      digitalWrite(PIN_CELLULAR_PWR, HIGH);
+      cellularPowerMarker = CELLULAR_CONFIRMED_OFF;
+      recordShutdown(millis() - startMillis, false, true);
+      return RET_OK;
+    }
+    LOGLN("[WRN|Cellular] AT+CPOF failed, falling back to POWERKEY");
+  }
+
+  // Pulse high for at least 2.5 seconds
+  if (!powerKeyPressed) {
+    pressPowerKey();
+  }
+  unsigned long heldMs = millis() - powerKeyPressedMillis;
+  if (heldMs < CELLULAR_POWER_OFF_PULSE_MS) {
+    delay(CELLULAR_POWER_OFF_PULSE_MS - heldMs);
+  }
   digitalWrite(PIN_CELLULAR_PWR, LOW);
-  // Wait for 1.9 seconds to power off + 2 seconds buffer
-  delay(2700);
+  powerKeyPressed = false;
+  unsigned char ret = waitForPowerDown();
   // Keeping POWERKEY HIGH seems to be necessary to prevent the module from
   // powering on again. Don't know why.
   digitalWrite(PIN_CELLULAR_PWR, HIGH);
-  delay(1000);
-  // pinMode(PIN_CELLULAR_PWR, INPUT);
+  if (ret == RET_OK) {
+    cellularPowerMarker = CELLULAR_CONFIRMED_OFF;
+  }
+  recordShutdown(millis() - startMillis, true, ret == RET_OK);
+  return ret;
+}
+
+bool cellularIsConfirmedOff() {
+  return cellularPowerMarker == CELLULAR_CONFIRMED_OFF;
+}
+
+bool cellularIsPoweringOff() {
+  return powerKeyPressed;
+}
+
+unsigned char parkCellular() {
+  WakePhaseTimer timer(WAKE_PHASE_MODEM_OFF);
+  setupCellularIO();
+  if (sendNoResponseCommand(&modemChannel, "AT+CSCLK=1") != AT_OK_STATUS) {
+    LOGLN("[WRN|Cellular] Modem won't sleep, powering it off instead");
+    return powerOffCellular();
+  }
+  // The modem sleeps while DTR is high, which has to last through deep sleep
+  pinMode(PIN_CELLULAR_DTR, OUTPUT);
+  digitalWrite(PIN_CELLULAR_DTR, HIGH);
+  gpio_hold_en((gpio_num_t) PIN_CELLULAR_DTR);
+  gpio_deep_sleep_hold_en();
+  cellularPowerMarker = CELLULAR_PARKED;
+  cellularSetupPhase = CELLULAR_SETUP_IDLE;
+  cellularSleepStats.nbroParks++;
+  LOGLN("[INF|Cellular] Parked, registered and asleep");
+  return RET_OK;
+}
+
+bool cellularIsParked() {
+  return cellularPowerMarker == CELLULAR_PARKED;
 }
 
 void powerOnCellular() {
+  cellularState = { false, false, false };
+  cellularPowerMarker = 0;
+  powerKeyPressed = false;
+  // AT+IPR and AT+IFC don't outlive a power cycle
+  setCellularUart(CELLULAR_UART_DEFAULT_BAUD, false);
   // Go back to LOW in case POWERKEY was HIGH because of explicit power off
   pinMode(PIN_CELLULAR_PWR, OUTPUT);
   digitalWrite(PIN_CELLULAR_PWR, LOW);
@@ -209,8 +465,7 @@ void powerOnCellular() {
   digitalWrite(PIN_CELLULAR_PWR, HIGH);
   delay(50);
   digitalWrite(PIN_CELLULAR_PWR, LOW);
-  // Wait for power on (should verify with AT command after)
-  delay(500);
+  // No need to wait, tryCellularUARTSetup() polls until the modem answers
 }
 
 void rebootCellular() {
@@ -227,11 +482,16 @@ bool tryCellularUARTSetup() {
     LOGLN("[ERR|Cellular] Could not disable echo");
     return false;
   }
+  stopWakePhase(WAKE_PHASE_MODEM_BOOT);
   LOGLN("[INF|Cellular] Echo disabled");
   fastBlink(2);
 
+  if (negotiateCellularUart() != RET_OK) {
+    return false;
+  }
+
   if (false) {
-    if (sendNoResponseCommand(&Serial1, "AT+CPIN=3653") != AT_OK_STATUS) {
+    if (sendNoResponseCommand(&modemChannel, "AT+CPIN=3653") != AT_OK_STATUS) {
       LOGLN("[ERR|Cellular] Error entering PIN");
       return false;
     }
@@ -239,6 +499,12 @@ bool tryCellularUARTSetup() {
     LOGLN("[INF|Cellular] Did not enter PIN");
   }
 
+  // Network time (NITZ) sets the modem clock on registration, see
+  // syncClockFromModem(). Kept in its NV memory, so this is for a fresh modem.
+  if (sendNoResponseCommand(&modemChannel, "AT+CTZU=1") != AT_OK_STATUS) {
+    LOGLN("[WRN|Cellular] Could not enable network time updates");
+  }
+
   LOGLN("[INF|Cellular] Waiting for network registration...");
   unsigned char ret = waitUntilCellularNetworkRegistered();
   if (ret != RET_OK) {
@@ -251,17 +517,80 @@ bool tryCellularUARTSetup() {
   return true;
 }
 
+// A parked modem kept its settings, only the registration has to be checked
+static bool tryResumeCellular() {
+  if (tryDisableEcho(CELLULAR_RESUME_UART_TIMEOUT_MS) != RET_OK) {
+    LOGLN("[ERR|Cellular] Parked modem does not answer");
+    return false;
+  }
+  stopWakePhase(WAKE_PHASE_MODEM_BOOT);
+  if (waitUntilCellularNetworkRegistered(CELLULAR_RESUME_REGISTRATION_TIMEOUT_MS) != RET_OK) {
+    LOGLN("[ERR|Cellular] Parked modem lost its registration");
+    return false;
+  }
+  LOGLN("[INF|Cellular] Resumed parked modem");
+  return true;
+}
+
 void setupCellularIO() {
+  static bool ioSetUp = false;
+  if (ioSetUp) {
+    return;
+  }
+  ioSetUp = true;
   pinMode(PIN_CELLULAR_PWR, OUTPUT);
   digitalWrite(PIN_CELLULAR_PWR, LOW);
-  Serial1.begin(115200);
+  Serial1.begin(CELLULAR_UART_DEFAULT_BAUD);
+  uartBaud = CELLULAR_UART_DEFAULT_BAUD;
+  uartFlowControl = false;
+  modemChannel.onUrc("RDY", onReadyUrc);
+  modemChannel.onUrc("+CPIN: ", onCpinUrc);
+  modemChannel.onUrc(CREG_RESPONSE_LINE_PREFIX, onCregUrc);
+  modemChannel.onUrc("SMS DONE", onBootProgressUrc);
+  modemChannel.onUrc("PB DONE", onBootProgressUrc);
 }
 
-void setupCellular() {
+void beginCellularSetup() {
+  if (cellularSetupPhase != CELLULAR_SETUP_IDLE) {
+    return;
+  }
+  setupCellularIO();
+  // Until the modem answers, across a reboot if it takes one
+  startWakePhase(WAKE_PHASE_MODEM_BOOT);
+  if (cellularIsParked()) {
+    wakeParkedCellular();
+    LOGLN("[INF|Cellular] Woke parked cellular module");
+    cellularSetupPhase = CELLULAR_SETUP_RESUMING;
+    return;
+  }
   powerOnCellular();
   LOGLN("[INF|Cellular] Signaled cellular module to power on");
+  cellularSetupPhase = CELLULAR_SETUP_BOOTING;
+}
+
+void finishCellularSetup() {
+  beginCellularSetup();
+  if (cellularSetupPhase == CELLULAR_SETUP_DONE) {
+    return;
+  }
   fastBlink(1);
 
+  if (cellularSetupPhase == CELLULAR_SETUP_RESUMING) {
+    if (tryResumeCellular()) {
+      cellularSleepStats.nbroResumes++;
+      cellularSetupPhase = CELLULAR_SETUP_DONE;
+      return;
+    }
+    LOGLN("[WRN|Cellular] Parked session is gone, cold booting...");
+    cellularSleepStats.nbroColdBootFallbacks++;
+    // Silence mostly means it lost power while parked
+    if (cellularState.uartReady) {
+      rebootCellular();
+    } else {
+      powerOnCellular();
+    }
+  }
+
   while (1) {
     if (tryCellularUARTSetup()) {
       break;
@@ -269,4 +598,31 @@ void setupCellular() {
     LOGLN("[ERR|Cellular] Error setting up cellular module over UART, rebooting module...");
     rebootCellular();
   }
+  cellularSetupPhase = CELLULAR_SETUP_DONE;
+}
+
+void cancelCellularSetup() {
+  if (cellularSetupPhase == CELLULAR_SETUP_IDLE) {
+    return;
+  }
+  if (cellularSetupPhase == CELLULAR_SETUP_RESUMING) {
+    LOGLN("[INF|Cellular] Setup cancelled, parking again...");
+    parkCellular();
+    return;
+  }
+  if (cellularState.uartReady) {
+    LOGLN("[INF|Cellular] Setup cancelled, powering off...");
+    powerOffCellular();
+    return;
+  }
+  // Still booting, it won't take AT+CPOF. The POWERKEY pulse runs while the
+  // wake goes on, the next powerOffCellular() ends it.
+  LOGLN("[INF|Cellular] Setup cancelled, pressing POWERKEY...");
+  cellularSetupPhase = CELLULAR_SETUP_IDLE;
+  pressPowerKey();
+}
+
+void setupCellular() {
+  beginCellularSetup();
+  finishCellularSetup();
 }
@@ -0,0 +1,145 @@
+#include <Arduino.h>
+#include "common_macros.h"
+#include "clock_sync.h"
+#include "build_time.h"
+#include "rtc_sealed.h"
+
+
+RTC_DATA_ATTR ClockSync clockSync;
+bool clockDriftCorrection = true;
+
+static bool clockSyncIsValid() {
+  return rtcIsValid(clockSync, CLOCK_SYNC_MAGIC, CLOCK_SYNC_VERSION);
+}
+
+static bool driftIsCorrected() {
+  return clockDriftCorrection && clockSyncIsValid() && clockSync.driftKnown;
+}
+
+/// Reading the clock
+
+bool clockIsSynced() {
+  timeval raw;
+  gettimeofday(&raw, nullptr);
+  return raw.tv_sec > BUILD_TIME_UNIX_S;
+}
+
+unsigned long clockNowS() {
+  timeval raw;
+  gettimeofday(&raw, nullptr);
+  if (raw.tv_sec <= BUILD_TIME_UNIX_S) {
+    return raw.tv_sec;
+  }
+  // To the nearest second, truncating would make every timestamp early
+  int64_t nowUs = (int64_t) raw.tv_sec * 1000000 + raw.tv_usec;
+  if (driftIsCorrected()) {
+    int64_t sinceSyncS = (int64_t) raw.tv_sec - clockSync.lastSyncS;
+    nowUs -= sinceSyncS * clockSync.driftPpm;
+  }
+  return (nowUs + 500000) / 1000000;
+}
+
+unsigned long backfilledTimeS(unsigned long timeS) {
+  if (timeS > BUILD_TIME_UNIX_S || !clockSyncIsValid() || !clockSync.hasBackfill) {
+    return timeS;
+  }
+  return timeS + clockSync.backfillOffsetS;
+}
+
+uint64_t clockSleepUs(unsigned long sleepS) {
+  if (!driftIsCorrected()) {
+    return (uint64_t) sleepS * 1000000;
+  }
+  return (uint64_t) sleepS * (1000000 + clockSync.driftPpm);
+}
+
+/// Syncing
+
+static void setClock(uint32_t nowS, long nowUs) {
+  if (!clockSyncIsValid()) {
+    resetRtc(&clockSync, CLOCK_SYNC_MAGIC, CLOCK_SYNC_VERSION);
+  }
+  timeval device;
+  gettimeofday(&device, nullptr);
+  time_t deviceS = device.tv_sec;
+  if (deviceS <= BUILD_TIME_UNIX_S) {
+    // First sync since power on, the clock counted from 0 until now
+    clockSync.backfillOffsetS = nowS - deviceS;
+    clockSync.hasBackfill = true;
+    LOGF("[INF|Clock] First sync, %lu s after power on\n", (unsigned long) deviceS);
+  } else if (clockSync.lastSyncS != 0 && nowS >= clockSync.lastSyncS + CLOCK_DRIFT_MIN_ELAPSED_S) {
+    // The clock itself is never corrected between syncs, so whatever it is
+    // off by now is all drift
+    uint32_t elapsedS = nowS - clockSync.lastSyncS;
+    int64_t sampleUs = ((int64_t) deviceS - nowS) * 1000000 + device.tv_usec - nowUs;
+    int32_t samplePpm = sampleUs / elapsedS;
+    if (samplePpm > CLOCK_DRIFT_MAX_PPM || samplePpm < -CLOCK_DRIFT_MAX_PPM) {
+      LOGF("[WRN|Clock] Ignoring a drift of %ld ppm\n", (long) samplePpm);
+    } else {
+      clockSync.driftPpm = clockSync.driftKnown
+        ? (3 * clockSync.driftPpm + samplePpm) / 4
+        : samplePpm;
+      clockSync.driftKnown = true;
+      LOGF("[INF|Clock] Drift %ld ppm over %lu s, estimate %ld ppm\n", (long) samplePpm, (unsigned long) elapsedS, (long) clockSync.driftPpm);
+    }
+  }
+  clockSync.lastSyncS = nowS;
+  sealRtc(&clockSync);
+
+  timeval tv = { .tv_sec = (time_t) nowS, .tv_usec = nowUs };
+  settimeofday(&tv, DST_NONE);
+  LOGF("[INF|Clock] Set to %lu (was %ld)\n", (unsigned long) nowS, (long) deviceS);
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date, after
+// http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+static long daysFromCivil(int year, int month, int day) {
+  year -= month <= 2;
+  long era = (year >= 0 ? year : year - 399) / 400;
+  long yearOfEra = year - era * 400;
+  long dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  long dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  return era * 146097 + dayOfEra - 719468;
+}
+
+unsigned char syncClockFromModem(ModemChannel* modem) {
+  char response[CLOCK_CCLK_RESPONSE_CAPACITY] = "";
+  unsigned char status = modem->sendCommand(
+    "AT+CCLK?", DEFAULT_TIMEOUT, "+CCLK: ", response, sizeof(response)
+  );
+  if (status != AT_OK_STATUS) {
+    LOGLN("[ERR|Clock] CCLK: AT error");
+    return RET_ERROR;
+  }
+  // +CCLK: "yy/MM/dd,hh:mm:ss±zz", local time and its offset from UTC in
+  // quarter hours
+  int year, month, day, hour, minute, second, zoneQuarters;
+  char zoneSign;
+  int parsed = sscanf(
+    response, "+CCLK: \"%d/%d/%d,%d:%d:%d%c%d\"",
+    &year, &month, &day, &hour, &minute, &second, &zoneSign, &zoneQuarters
+  );
+  if (parsed != 8 || (zoneSign != '+' && zoneSign != '-')) {
+    LOGF("[ERR|Clock] Malformed CCLK response \"%s\"\n", response);
+    return RET_ERROR;
+  }
+  long localS = daysFromCivil(2000 + year, month, day) * 86400L
+    + hour * 3600L + minute * 60L + second;
+  long zoneS = zoneQuarters * 15L * 60;
+  long nowS = zoneSign == '+' ? localS - zoneS : localS + zoneS;
+  // Its clock starts in 1980 at power on and stays there without NITZ
+  if (nowS <= BUILD_TIME_UNIX_S) {
+    LOGF("[WRN|Clock] Modem doesn't know the time yet (%s)\n", response);
+    return RET_ERROR;
+  }
+  // Somewhere within the second it reported
+  setClock(nowS, 500000);
+  return RET_OK;
+}
+
+void syncClockFromServer(long nowS, unsigned long requestMs) {
+  // The server truncates to the second somewhere during the request. Add a
+  // third of its duration because a bit late is better than too early.
+  uint64_t nowUs = (uint64_t) nowS * 1000000 + 500000 + (uint64_t) requestMs * 1000 / 3;
+  setClock(nowUs / 1000000, nowUs % 1000000);
+}
@@ -0,0 +1,226 @@
+#include <Arduino.h>
+#include <coap_codec.h>
+#include "common_macros.h"
+#include "stream_extensions.h"
+#include "udp.h"
+#include "coap_transport.h"
+
+
+// Keeps counting across deep sleep, so a server that still remembers the
+// last wake's message IDs does not take a new message for a duplicate
+static RTC_DATA_ATTR uint16_t coapMessageId;
+
+static uint8_t coapReceiveBuffer[COAP_RECEIVE_MAX_BYTES];
+
+// The bytes of the body in [offset, offset + length), the rest is skipped.
+// Lets a block go out straight from the body writer.
+class BodyWindow : public Print {
+public:
+  BodyWindow(Print* out, size_t offset, size_t length)
+    : out(out), offset(offset), length(length) {}
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t* buffer, size_t size) override {
+    size_t end = position + size;
+    size_t from = max(position, offset);
+    size_t to = min(end, offset + length);
+    if (from < to) {
+      written += out->write(buffer + (from - position), to - from);
+    }
+    position = end;
+    return size;
+  }
+  using Print::write;
+
+  size_t written = 0;
+
+private:
+  Print* out;
+  size_t offset;
+  size_t length;
+  size_t position = 0;
+};
+
+struct CoapDatagram {
+  uint8_t header[COAP_REQUEST_HEADER_MAX_BYTES];
+  size_t headerLength;
+  const UploadRequest* request;
+  size_t offset;
+  size_t length;
+};
+
+static size_t writeCoapDatagram(Print* out, void* context) {
+  CoapDatagram* datagram = (CoapDatagram*) context;
+  size_t written = out->write(datagram->header, datagram->headerLength);
+  if (datagram->length > 0) {
+    BodyWindow window(out, datagram->offset, datagram->length);
+    datagram->request->writeBody(&window, datagram->request->bodyContext);
+    written += window.written;
+  }
+  return written;
+}
+
+// The message ID doubles as the token, two bytes big endian
+static bool isOwnToken(const CoapHeader& header, uint16_t messageId) {
+  return header.tokenLength == 2
+    && header.token[0] == (uint8_t) (messageId >> 8)
+    && header.token[1] == (uint8_t) messageId;
+}
+
+CoapUploadTransport::CoapUploadTransport(const char* host, uint16_t port, const char* tokenQuery)
+  : host(host), port(port), tokenQuery(tokenQuery) {}
+
+unsigned char CoapUploadTransport::begin(const UploadRequest& request) {
+  LOGF("[INF|Cellular/CoAP] Uploading to %s:%u\n", host, port);
+  return openUdpSocket(COAP_DEFAULT_PORT, coapReceiveBuffer, sizeof(coapReceiveBuffer));
+}
+
+unsigned char CoapUploadTransport::send(
+  const UploadRequest& request,
+  HttpResponseSink sink,
+  void* sinkContext,
+  HttpResult* result
+) {
+  unsigned char ret;
+  *result = { 0, HTTP_STATUS_NONE, 0 };
+  ByteCounter counter;
+  size_t bodyLength = request.writeBody(&counter, request.bodyContext);
+  size_t blockBytes = COAP_BLOCK_BYTES(COAP_UPLOAD_BLOCK_SZX);
+  bool blockWise = bodyLength > blockBytes;
+  char encodingQuery[48] = "";
+  if (request.contentEncoding != nullptr) {
+    snprintf(encodingQuery, sizeof(encodingQuery), "enc=%s", request.contentEncoding);
+  }
+
+  CoapDatagram datagram;
+  datagram.request = &request;
+  for (uint32_t number = 0;; number++) {
+    datagram.offset = number * blockBytes;
+    datagram.length = min(blockBytes, bodyLength - datagram.offset);
+    bool more = datagram.offset + datagram.length < bodyLength;
+    uint16_t messageId = ++coapMessageId;
+    CoapHeader header = {
+      COAP_TYPE_CONFIRMABLE, COAP_CODE_POST, messageId, 2,
+      { (uint8_t) (messageId >> 8), (uint8_t) messageId }
+    };
+    CoapWriter writer(datagram.header, sizeof(datagram.header));
+    writer.begin(header);
+    writer.addOption(COAP_OPTION_URI_PATH, COAP_UPLOAD_PATH);
+    writer.addUintOption(
+      COAP_OPTION_CONTENT_FORMAT,
+      request.contentType == nullptr ? COAP_CONTENT_FORMAT_JSON : COAP_CONTENT_FORMAT_BATCH
+    );
+    writer.addOption(COAP_OPTION_URI_QUERY, tokenQuery);
+    if (request.contentEncoding != nullptr) {
+      writer.addOption(COAP_OPTION_URI_QUERY, encodingQuery);
+    }
+    if (blockWise) {
+      writer.addUintOption(COAP_OPTION_BLOCK1, coapEncodeBlock({ number, more, COAP_UPLOAD_BLOCK_SZX }));
+    }
+    if (datagram.length > 0 && !writer.beginPayload()) {
+      LOGLN("[ERR|Cellular/CoAP] Request options do not fit");
+      return RET_ERROR;
+    }
+    datagram.headerLength = writer.length();
+
+    CoapMessage answer;
+    OK_OR_RETURN(exchange(&datagram, messageId, &answer));
+    uint8_t code = answer.header.code;
+    result->status = COAP_CODE_CLASS(code) * 100 + COAP_CODE_DETAIL(code);
+    result->statusClass = httpStatusClass(result->status);
+    bool continued = more && code == COAP_CODE_CONTINUE;
+    if (!continued) {
+      result->bodyLength = answer.payloadLength;
+      if (sink != nullptr && answer.payloadLength > 0) {
+        sink((const char*) answer.payload, answer.payloadLength, sinkContext);
+      }
+    }
+    // Only once the payload has been used, the ACK lets the next datagram in
+    if (answer.header.type == COAP_TYPE_CONFIRMABLE) {
+      OK_OR_RETURN(acknowledge(answer.header.messageId));
+    }
+    if (!continued) {
+      if (more && result->statusClass == HTTP_STATUS_SUCCESS) {
+        LOGF("[ERR|Cellular/CoAP] Block %lu answered with %d instead of 231\n", (unsigned long) number, result->status);
+        return RET_ERROR;
+      }
+      LOGF(
+        "[INF|Cellular/CoAP] %lu bytes in %lu blocks, status %d\n",
+        (unsigned long) bodyLength, (unsigned long) number + 1, result->status
+      );
+      return RET_OK;
+    }
+  }
+}
+
+unsigned char CoapUploadTransport::end() {
+  return closeUdpSocket();
+}
+
+// Sends the datagram until it is answered, with the timeout doubling after
+// every try. The answer points into the receive buffer.
+unsigned char CoapUploadTransport::exchange(CoapDatagram* datagram, uint16_t messageId, CoapMessage* answer) {
+  unsigned char ret;
+  // Spread by the message ID rather than a random number, so devices that
+  // lost the same datagram do not all retry at once
+  unsigned long timeout = COAP_ACK_TIMEOUT_MS + messageId % (COAP_ACK_TIMEOUT_MS / 2);
+  for (int attempt = 0; attempt <= COAP_MAX_RETRANSMIT; attempt++, timeout *= 2) {
+    OK_OR_RETURN(sendUdpDatagram(host, port, writeCoapDatagram, datagram));
+    ret = awaitAnswer(messageId, timeout, answer);
+    if (ret != RET_TIMEOUT) {
+      return ret;
+    }
+    LOGF("[WRN|Cellular/CoAP] No answer to %u within %lu ms\n", messageId, timeout);
+  }
+  return RET_TIMEOUT;
+}
+
+// Skips whatever is not the answer to `messageId`: late duplicates of
+// earlier answers and datagrams that do not decode
+unsigned char CoapUploadTransport::awaitAnswer(uint16_t messageId, unsigned long timeout, CoapMessage* answer) {
+  unsigned long startMillis = millis();
+  // After an empty ACK the server has the request, resending is no use
+  bool acknowledged = false;
+  while (true) {
+    unsigned long elapsed = millis() - startMillis;
+    if (elapsed >= timeout) {
+      return acknowledged ? RET_ERROR : RET_TIMEOUT;
+    }
+    size_t length;
+    if (receiveUdpDatagram(&length, timeout - elapsed) != RET_OK
+      || coapDecode(coapReceiveBuffer, length, answer) != COAP_DECODE_OK) {
+      continue;
+    }
+    const CoapHeader& header = answer->header;
+    bool reply = header.type == COAP_TYPE_ACKNOWLEDGEMENT || header.type == COAP_TYPE_RESET;
+    if (reply && header.messageId == messageId) {
+      if (header.type == COAP_TYPE_RESET) {
+        LOGF("[ERR|Cellular/CoAP] Server reset %u\n", messageId);
+        return RET_ERROR;
+      }
+      if (header.code != COAP_CODE_EMPTY) {
+        return RET_OK;
+      }
+      acknowledged = true;
+      startMillis = millis();
+      timeout = COAP_SEPARATE_RESPONSE_TIMEOUT_MS;
+    } else if (!reply && header.code != COAP_CODE_EMPTY && isOwnToken(header, messageId)) {
+      // A separate response
+      return RET_OK;
+    }
+  }
+}
+
+unsigned char CoapUploadTransport::acknowledge(uint16_t messageId) {
+  CoapDatagram ack;
+  CoapWriter writer(ack.header, sizeof(ack.header));
+  writer.begin({ COAP_TYPE_ACKNOWLEDGEMENT, COAP_CODE_EMPTY, messageId, 0, {} });
+  ack.headerLength = writer.length();
+  ack.request = nullptr;
+  ack.offset = 0;
+  ack.length = 0;
+  return sendUdpDatagram(host, port, writeCoapDatagram, &ack);
+}
@@ -0,0 +1,160 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <stddef.h>
+#include "common_macros.h"
+#include "distance_sensor.h"
+#include "interval_scheduler.h"
+#include "measurement_log.h"
+#include "deployed_config.h"
+#include "rtc_sealed.h"
+
+
+RTC_DATA_ATTR DeployedConfig deployedConfig;
+
+struct DeployedConfigKey {
+  const char* name;
+  size_t offset;
+  uint32_t minimum;
+  uint32_t maximum;
+};
+
+// Anything else in the response is ignored
+static const DeployedConfigKey DEPLOYED_CONFIG_KEYS[] = {
+  {
+    "measurementIntervalS",
+    offsetof(DeployedConfig, measurementIntervalS),
+    MEASUREMENT_INTERVAL_MIN_S, MEASUREMENT_INTERVAL_MAX_S
+  },
+  {
+    "maximumMeasurementIntervalS",
+    offsetof(DeployedConfig, maximumMeasurementIntervalS),
+    MEASUREMENT_INTERVAL_MIN_S, MEASUREMENT_INTERVAL_MAX_S
+  },
+  {
+    "maximumInterTransmitDistanceMM",
+    offsetof(DeployedConfig, maximumInterTransmitDistanceMM),
+    1, 10000
+  },
+  {
+    "maximumInterTransmitMeasurements",
+    offsetof(DeployedConfig, maximumInterTransmitMeasurements),
+    // The log has to hold a whole batch
+    1, MEASUREMENT_LOG_CAPACITY
+  },
+  {
+    "maximumInterTransmitTimeS",
+    offsetof(DeployedConfig, maximumInterTransmitTimeS),
+    60 * 60, 7 * 24 * 60 * 60
+  },
+  {
+    "batteryCutoffMV",
+    offsetof(DeployedConfig, batteryCutoffMV),
+    3000, 4000
+  },
+  {
+    "sensorDistanceFromBottomMM",
+    offsetof(DeployedConfig, sensorDistanceFromBottomMM),
+    DISTANCE_SENSOR_MIN_MM, DISTANCE_SENSOR_MAX_MM
+  },
+  {
+    "modemSleepMode",
+    offsetof(DeployedConfig, modemSleepMode),
+    CELLULAR_SLEEP_MODE_POWER_OFF, CELLULAR_SLEEP_MODE_DTR
+  },
+  {
+    "uploadEncoding",
+    offsetof(DeployedConfig, uploadEncoding),
+    UPLOAD_ENCODING_IDENTITY, UPLOAD_ENCODING_HEATSHRINK
+  },
+};
+
+static bool isValid(const DeployedConfig& config) {
+  return rtcIsValid(config, DEPLOYED_CONFIG_MAGIC, DEPLOYED_CONFIG_VERSION);
+}
+
+static DeployedConfig defaultDeployedConfig() {
+  DeployedConfig config = {
+    .magic = DEPLOYED_CONFIG_MAGIC,
+    .version = DEPLOYED_CONFIG_VERSION,
+    .reserved = 0,
+    .measurementIntervalS = DEFAULT_MEASUREMENT_INTERVAL_S,
+    .maximumMeasurementIntervalS = DEFAULT_MAXIMUM_MEASUREMENT_INTERVAL_S,
+    .maximumInterTransmitDistanceMM = DEFAULT_MAXIMUM_INTER_TRANSMIT_DISTANCE_MM,
+    .maximumInterTransmitMeasurements = DEFAULT_MAXIMUM_INTER_TRANSMIT_MEASUREMENTS,
+    .maximumInterTransmitTimeS = DEFAULT_MAXIMUM_INTER_TRANSMIT_TIME_S,
+    .batteryCutoffMV = DEFAULT_BATTERY_CUTOFF_MV,
+    .sensorDistanceFromBottomMM = DEFAULT_SENSOR_DISTANCE_FROM_BOTTOM_MM,
+    .modemSleepMode = DEFAULT_MODEM_SLEEP_MODE,
+    .uploadEncoding = DEFAULT_UPLOAD_ENCODING,
+    .checksum = 0
+  };
+  sealRtc(&config);
+  return config;
+}
+
+bool deployedConfigIsValid() {
+  return isValid(deployedConfig);
+}
+
+void loadDeployedConfig() {
+  DeployedConfig saved;
+  File file = LittleFS.open(DEPLOYED_CONFIG_FILE_PATH, "r");
+  bool read = file && file.readBytes((char*) &saved, sizeof(saved)) == sizeof(saved);
+  file.close();
+  if (read && isValid(saved)) {
+    LOGLN("[INF|Config] Loaded deployed config from flash");
+    deployedConfig = saved;
+  } else {
+    LOGLN("[WRN|Config] No valid deployed config in flash, using defaults");
+    deployedConfig = defaultDeployedConfig();
+  }
+}
+
+unsigned char saveDeployedConfig() {
+  File file = LittleFS.open(DEPLOYED_CONFIG_FILE_PATH, "w", true);
+  if (!file) {
+    LOGLN("[ERR|Config] Failed to open deployed config file");
+    return RET_ERROR;
+  }
+  // A torn write fails the checksum and falls back to the defaults
+  size_t written = file.write((const uint8_t*) &deployedConfig, sizeof(deployedConfig));
+  file.close();
+  return written == sizeof(deployedConfig) ? RET_OK : RET_ERROR;
+}
+
+DeployedConfig beginDeployedConfigUpdate() {
+  return deployedConfig;
+}
+
+bool setDeployedConfigValue(DeployedConfig* candidate, const LineView& key, long value) {
+  for (const DeployedConfigKey& configKey : DEPLOYED_CONFIG_KEYS) {
+    if (!key.equals(configKey.name)) continue;
+    if (value < (long) configKey.minimum || (unsigned long) value > configKey.maximum) {
+      LOGF("[WRN|Config] Ignoring %s = %ld, out of bounds\n", configKey.name, value);
+      return false;
+    }
+    *(uint32_t*) ((uint8_t*) candidate + configKey.offset) = value;
+    return true;
+  }
+  return false;
+}
+
+bool commitDeployedConfigUpdate(DeployedConfig* candidate) {
+  sealRtc(candidate);
+  if (memcmp(candidate, &deployedConfig, sizeof(DeployedConfig)) == 0) {
+    return false;
+  }
+  LOGF(
+    "[INF|Config] Interval %lu s, up to %lu s when flat, transmit after %lu mm, %lu measurements or %lu s, cutoff %lu mV, depth %lu mm, modem sleep mode %lu\n",
+    (unsigned long) candidate->measurementIntervalS,
+    (unsigned long) candidate->maximumMeasurementIntervalS,
+    (unsigned long) candidate->maximumInterTransmitDistanceMM,
+    (unsigned long) candidate->maximumInterTransmitMeasurements,
+    (unsigned long) candidate->maximumInterTransmitTimeS,
+    (unsigned long) candidate->batteryCutoffMV,
+    (unsigned long) candidate->sensorDistanceFromBottomMM,
+    (unsigned long) candidate->modemSleepMode
+  );
+  deployedConfig = *candidate;
+  return true;
+}
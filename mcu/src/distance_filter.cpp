@@ -0,0 +1,57 @@
+#include <Arduino.h>
+#include "distance_filter.h"
+
+
+void sortDistances(unsigned long* distancesMM, size_t count) {
+  // Insertion sort, there are never more than DISTANCE_SAMPLES_CAPACITY
+  for (size_t i = 1; i < count; i++) {
+    unsigned long distanceMM = distancesMM[i];
+    size_t j = i;
+    for (; j > 0 && distancesMM[j - 1] > distanceMM; j--) {
+      distancesMM[j] = distancesMM[j - 1];
+    }
+    distancesMM[j] = distanceMM;
+  }
+}
+
+static unsigned long medianOfSorted(const unsigned long* sorted, size_t count) {
+  if (count == 0) return 0;
+  if (count % 2 == 1) return sorted[count / 2];
+  return (sorted[count / 2 - 1] + sorted[count / 2] + 1) / 2;
+}
+
+unsigned long medianDistanceMM(const DistanceSamples& samples) {
+  unsigned long sorted[DISTANCE_SAMPLES_CAPACITY];
+  memcpy(sorted, samples.distancesMM, samples.count * sizeof(unsigned long));
+  sortDistances(sorted, samples.count);
+  return medianOfSorted(sorted, samples.count);
+}
+
+unsigned long distanceMadMM(const DistanceSamples& samples, unsigned long medianMM) {
+  unsigned long deviations[DISTANCE_SAMPLES_CAPACITY];
+  for (size_t i = 0; i < samples.count; i++) {
+    unsigned long distanceMM = samples.distancesMM[i];
+    deviations[i] = distanceMM > medianMM ? distanceMM - medianMM : medianMM - distanceMM;
+  }
+  sortDistances(deviations, samples.count);
+  return medianOfSorted(deviations, samples.count);
+}
+
+DistanceReading summarizeDistanceSamples(const DistanceSamples& samples) {
+  size_t nbroCounted = samples.nbroShots - samples.nbroTrimmed;
+  if (samples.count == 0 || nbroCounted == 0) {
+    return { 0, 0 };
+  }
+  uint64_t sumMM = 0;
+  for (size_t i = 0; i < samples.count; i++) {
+    sumMM += samples.distancesMM[i];
+  }
+  unsigned long meanMM = (sumMM + samples.count / 2) / samples.count;
+
+  unsigned long confidence = min(samples.count * 100 / nbroCounted, (size_t) 100);
+  unsigned long spreadMM = distanceMadMM(samples, medianDistanceMM(samples));
+  if (spreadMM > DISTANCE_FILTER_SPREAD_TOLERANCE_MM) {
+    confidence = confidence * DISTANCE_FILTER_SPREAD_TOLERANCE_MM / spreadMM;
+  }
+  return { meanMM, (unsigned char) confidence };
+}
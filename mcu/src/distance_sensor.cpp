@@ -1,39 +1,211 @@
 #include <Arduino.h>
+#include <esp_timer.h>
 #include "common_macros.h"
+#include "distance_filter.h"
+#include "distance_sensor.h"
+#include "sensor_units.h"
+#include "wake_profile.h"
 
 
-#define PIN_TRIGGER A5
-#define PIN_ECHO A4
+#define DISTANCE_CORRECTION_MM 0
 
-#define DISTANCE_CORRECTION 0.0
+// Where a shot is at. Only the echo interrupt and the shot timer change it.
+enum ShotPhase {
+  SHOTS_IDLE,
+  // Trigger sent, the timer fires if no echo ends in time
+  SHOT_WAITING_FOR_ECHO,
+  // Timed out with the echo line still high, the sensor holds it for a while
+  SHOT_WAITING_FOR_RELEASE,
+  // Echo over, the timer fires the next shot
+  SHOT_SETTLING,
+};
 
-void setupDistanceSensor() {
-  pinMode(PIN_TRIGGER, OUTPUT);
-  pinMode(PIN_ECHO, INPUT);
+struct DistanceShots {
+  volatile ShotPhase phase;
+  volatile unsigned char shotsLeft;
+  unsigned char nbroShots;
+  volatile unsigned char nbroEchoes;
+  volatile unsigned long echoRiseUs;
+  volatile unsigned long pulsesUs[DISTANCE_SAMPLES_CAPACITY];
+  unsigned long echoTimeoutUs;
+};
+
+static DistanceShots shots;
+static esp_timer_handle_t shotTimer = nullptr;
+
+static unsigned long pulseTimeToDistanceMM(unsigned long pulseTime) {
+  return echoUsToMM(pulseTime) + DISTANCE_CORRECTION_MM;
+}
+
+static unsigned long distanceToPulseTimeUs(unsigned long distanceMM) {
+  return mmToEchoUs(distanceMM);
 }
 
-unsigned long getPulseTime() {
-  digitalWrite(PIN_TRIGGER, LOW);
+static void startShotTimer(uint64_t timeoutUs) {
+  esp_timer_stop(shotTimer);
+  esp_timer_start_once(shotTimer, timeoutUs);
+}
+
+static void fireShot() {
+  if (shots.shotsLeft == 0) {
+    shots.phase = SHOTS_IDLE;
+    stopWakePhase(WAKE_PHASE_DISTANCE);
+    return;
+  }
+  shots.shotsLeft--;
+  shots.echoRiseUs = 0;
+  shots.phase = SHOT_WAITING_FOR_ECHO;
+  digitalWrite(PIN_DISTANCE_TRIGGER, LOW);
   delayMicroseconds(2);
-  digitalWrite(PIN_TRIGGER, HIGH);
+  digitalWrite(PIN_DISTANCE_TRIGGER, HIGH);
   delayMicroseconds(10);
-  digitalWrite(PIN_TRIGGER, LOW);
-  return pulseIn(PIN_ECHO, HIGH);
+  digitalWrite(PIN_DISTANCE_TRIGGER, LOW);
+  startShotTimer(shots.echoTimeoutUs);
 }
 
-unsigned long getDistanceMM() {
-  unsigned long pulseTime = getPulseTime();
-  unsigned long distance = ((pulseTime * 0.344) / 2) + DISTANCE_CORRECTION;
-  return distance;
+static void onShotTimer(void* arg) {
+  switch (shots.phase) {
+    case SHOT_WAITING_FOR_ECHO:
+      if (digitalRead(PIN_DISTANCE_ECHO) == HIGH) {
+        // Too far or no echo at all. The next shot has to wait for the sensor
+        // to let go of the line, the interrupt catches that.
+        shots.phase = SHOT_WAITING_FOR_RELEASE;
+        startShotTimer(DISTANCE_ECHO_HOLD_MAX_US);
+        return;
+      }
+      shots.phase = SHOT_SETTLING;
+      startShotTimer(DISTANCE_SHOT_SETTLE_US);
+      return;
+    case SHOT_WAITING_FOR_RELEASE:
+    case SHOT_SETTLING:
+      fireShot();
+      return;
+    case SHOTS_IDLE:
+      return;
+  }
 }
 
-unsigned long getDistanceMMAveraged(
-    unsigned char count
-) {
-  unsigned long long sum = 0;
-  for (unsigned char i = 0; i < count; i++) {
-    sum += getDistanceMM();
-    delay(10);
+static void IRAM_ATTR onEchoEdge() {
+  unsigned long nowUs = micros();
+  if (digitalRead(PIN_DISTANCE_ECHO) == HIGH) {
+    shots.echoRiseUs = nowUs;
+    return;
   }
-  return sum / count;
+  if (shots.phase == SHOT_WAITING_FOR_ECHO && shots.echoRiseUs != 0) {
+    // Stored before it is counted, peekDistanceMeasurement() may be reading
+    unsigned char index = shots.nbroEchoes;
+    shots.pulsesUs[index] = nowUs - shots.echoRiseUs;
+    shots.nbroEchoes = index + 1;
+  } else if (shots.phase != SHOT_WAITING_FOR_RELEASE) {
+    return;
+  }
+  shots.phase = SHOT_SETTLING;
+  startShotTimer(DISTANCE_SHOT_SETTLE_US);
+}
+
+void setupDistanceSensor() {
+  pinMode(PIN_DISTANCE_TRIGGER, OUTPUT);
+  pinMode(PIN_DISTANCE_ECHO, INPUT);
+  if (shotTimer == nullptr) {
+    esp_timer_create_args_t timerArgs = {
+      .callback = onShotTimer,
+      .arg = nullptr,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "distance_shot",
+      .skip_unhandled_events = false
+    };
+    esp_timer_create(&timerArgs, &shotTimer);
+  }
+  attachInterrupt(digitalPinToInterrupt(PIN_DISTANCE_ECHO), onEchoEdge, CHANGE);
+}
+
+void startDistanceMeasurement(unsigned char count, unsigned long maximumDistanceMM) {
+  // A quarter more for the pulse to still end while the timer task catches up
+  unsigned long maximumPulseUs = distanceToPulseTimeUs(maximumDistanceMM);
+  count = min(count, (unsigned char) DISTANCE_SAMPLES_CAPACITY);
+  shots.phase = SHOT_SETTLING;
+  shots.shotsLeft = count;
+  shots.nbroShots = count;
+  shots.nbroEchoes = 0;
+  shots.echoRiseUs = 0;
+  shots.echoTimeoutUs = DISTANCE_ECHO_DELAY_MAX_US + maximumPulseUs + maximumPulseUs / 4;
+  // Until the last shot is over, whatever the wake does meanwhile
+  startWakePhase(WAKE_PHASE_DISTANCE);
+  fireShot();
+}
+
+bool distanceMeasurementDone() {
+  return shots.phase == SHOTS_IDLE;
+}
+
+// Filters the echoes received so far out of `nbroShots` shots
+static DistanceReading filterEchoes(size_t nbroShots) {
+  DistanceSamples samples = {};
+  samples.count = shots.nbroEchoes;
+  samples.nbroShots = nbroShots;
+  samples.temperatureDeciC = DISTANCE_TEMPERATURE_UNKNOWN;
+  for (size_t i = 0; i < samples.count; i++) {
+    samples.distancesMM[i] = pulseTimeToDistanceMM(shots.pulsesUs[i]);
+  }
+  return DefaultDistanceFilter::apply(samples);
+}
+
+static size_t nbroShotsDone() {
+  size_t nbroDone = shots.nbroShots - shots.shotsLeft;
+  ShotPhase phase = shots.phase;
+  if (phase == SHOT_WAITING_FOR_ECHO || phase == SHOT_WAITING_FOR_RELEASE) {
+    nbroDone--;
+  }
+  return nbroDone;
+}
+
+// Every shot left timing out and the sensor holding the line each time, in
+// case the timer stops firing
+static unsigned long shotsLeftWorstCaseMs() {
+  return (shots.shotsLeft + 1) * (
+    shots.echoTimeoutUs + DISTANCE_ECHO_HOLD_MAX_US + DISTANCE_SHOT_SETTLE_US
+  ) / 1000 + 1;
+}
+
+DistanceReading peekDistanceMeasurement() {
+  return filterEchoes(nbroShotsDone());
+}
+
+DistanceReading awaitDistanceShots(unsigned char count) {
+  unsigned long worstCaseMs = shotsLeftWorstCaseMs();
+  unsigned long startMillis = millis();
+  while (
+    nbroShotsDone() < count && !distanceMeasurementDone() && millis() - startMillis < worstCaseMs
+  ) {
+    delay(1);
+  }
+  return filterEchoes(shots.nbroShots);
+}
+
+DistanceReading finishDistanceMeasurement() {
+  unsigned long worstCaseMs = shotsLeftWorstCaseMs();
+  unsigned long startMillis = millis();
+  while (!distanceMeasurementDone() && millis() - startMillis < worstCaseMs) {
+    delay(1);
+  }
+  if (!distanceMeasurementDone()) {
+    LOGLN("[ERR|Distance] Shots did not finish in time");
+    esp_timer_stop(shotTimer);
+    shots.phase = SHOTS_IDLE;
+    stopWakePhase(WAKE_PHASE_DISTANCE);
+  }
+  DistanceReading reading = filterEchoes(shots.nbroShots);
+  LOGF(
+    "[INF|Distance] %d of %d shots echoed, %lu mm, confidence %d%%\n",
+    shots.nbroEchoes, shots.nbroShots, reading.distanceMM, reading.confidence
+  );
+  return reading;
+}
+
+DistanceReading measureDistance(
+    unsigned char count,
+    unsigned long maximumDistanceMM
+) {
+  startDistanceMeasurement(count, maximumDistanceMM);
+  return finishDistanceMeasurement();
 }
@@ -1,7 +1,9 @@
 #include <Arduino.h>
+#include "wake_profile.h"
 
 
 void fastBlink(unsigned char count) {
+  WakePhaseTimer timer(WAKE_PHASE_BLINK);
   for (unsigned char i = 0; i < count; i++) {
     digitalWrite(LED_BUILTIN, HIGH);
     delay(200);
@@ -2,223 +2,227 @@
 #include "common_macros.h"
 #include "stream_extensions.h"
 #include "cellular.h"
+#include "wake_profile.h"
+#include "http.h"
 
 
-String HTTP_RESPONSE_STATUS_LINE_PREFIX = F("+HTTPACTION: ");
+#define HTTP_RESPONSE_STATUS_LINE_PREFIX "+HTTPACTION: "
+#define HTTP_READ_RESPONSE_LINE_PREFIX "+HTTPREAD: "
+#define HTTP_READ_END_LINE HTTP_READ_RESPONSE_LINE_PREFIX "0"
 
-unsigned char httpGetDemo() {
-  Serial.println("Sending HTTP GET request...");
-  delay(1000);
-  while (Serial1.available()) {
-    Serial1.read();
-  }
-  Serial.println("Maybe terminating HTTP service from previous request...");
-  if (sendNoResponseCommand(&Serial1, "AT+HTTPTERM") == ERROR_RECEIVING_AT_STATUS) {
-    Serial.println("Error terminating HTTP service.");
-    return RET_OK;
-  }
-  Serial.println("Initializing HTTP service...");
-  if (sendNoResponseCommand(&Serial1, "AT+HTTPINIT") != AT_OK_STATUS) {
-    Serial.println("Error initializing HTTP service.");
-    return RET_OK;
-  }
-  Serial.println("Setting HTTP parameters...");
-  String url = String("http://water.requestcatcher.com");
-  if (sendNoResponseCommand(&Serial1, "AT+HTTPPARA=\"URL\",\"" + url + "\"") != AT_OK_STATUS) {
-    Serial.println("Error setting URL.");
-    return RET_OK;
-  }
-  Serial.println("Setting HTTP action...");
-  if (sendNoResponseCommand(&Serial1, "AT+HTTPACTION=0") != AT_OK_STATUS) {
-    Serial.println("Error sending HTTP action.");
-    return RET_OK;
+// Filled in by the +HTTPACTION URC, which can arrive long after the command
+struct HttpActionResult {
+  bool received;
+  int httpStatus;
+  int dataLength;
+};
+
+static HttpActionResult httpActionResult;
+HttpSessionStats httpSessionStats;
+
+static void onHttpActionUrc(const LineView& line) {
+  int httpStatusArgIndex = line.indexOf(',');
+  int lengthArgIndex = line.indexOf(',', httpStatusArgIndex + 1);
+  if (httpStatusArgIndex < 0 || lengthArgIndex < 0) {
+    LOGF("[ERR|Cellular/HTTP] Malformed HTTP response status line \"%.*s\"\n", (int) line.length, line.data);
+    return;
   }
-  String httpResponseStatusLine;
+  httpActionResult.httpStatus = line.toLong(httpStatusArgIndex + 1);
+  httpActionResult.dataLength = line.toLong(lengthArgIndex + 1);
+  httpActionResult.received = true;
+}
+
+static bool isHttpActionResultReceived() {
+  return httpActionResult.received;
+}
+
+// Sends AT+HTTPACTION and waits for its URC
+static unsigned char sendHttpAction(int method, unsigned long timeout) {
   unsigned char ret;
-  OK_OR_RETURN(readEmptyLine(&Serial1));
-  readLine(&Serial1, &httpResponseStatusLine);
-  if (httpResponseStatusLine.indexOf(HTTP_RESPONSE_STATUS_LINE_PREFIX) != 0) {
-    LOGF("Expected HTTP response status line, got \"%s\"\n", httpResponseStatusLine.c_str());
-    return RET_OK;
-  }
-  httpResponseStatusLine.remove(0, HTTP_RESPONSE_STATUS_LINE_PREFIX.length());
-  int httpStatuesArgIndex = httpResponseStatusLine.indexOf(',');
-  int lengthArgIndex = httpResponseStatusLine.indexOf(',', httpStatuesArgIndex + 1);
-  int httpStatus = httpResponseStatusLine.substring(httpStatuesArgIndex + 1, lengthArgIndex).toInt();
-  int dataLength = httpResponseStatusLine.substring(lengthArgIndex + 1).toInt();
-  LOGF("HTTP status: %d, data length: %d\n", httpStatus, dataLength);
-  if (sendNoResponseCommand(&Serial1, "AT+HTTPREAD=" + String(dataLength)) != AT_OK_STATUS) {
-    Serial.println("Error reading HTTP response data.");
-    return RET_OK;
+  modemChannel.onUrc(HTTP_RESPONSE_STATUS_LINE_PREFIX, onHttpActionUrc);
+  httpActionResult = { false, 0, 0 };
+  OK_OR_RETURN(sendNoResponseCommand(&modemChannel, "AT+HTTPACTION=" + String(method)));
+  LOGLN("[INF|Cellular/HTTP] HTTP action sent.");
+  OK_OR_RETURN(modemChannel.waitUntil(isHttpActionResultReceived, timeout));
+  LOGF(
+    "[INF|Cellular/HTTP] HTTP status: %d, data length: %d\n",
+    httpActionResult.httpStatus, httpActionResult.dataLength
+  );
+  return RET_OK;
+}
+
+
+// Reads the response body announced by the +HTTPACTION URC a chunk at a
+// time, so the buffer stays the same size whatever the server sends
+static unsigned char readHttpResponseBody(uint32_t dataLength, HttpResponseSink sink, void* context) {
+  unsigned char ret;
+  char chunk[HTTP_READ_CHUNK_BYTES];
+  for (uint32_t offset = 0; offset < dataLength;) {
+    size_t length = min((uint32_t) HTTP_READ_CHUNK_BYTES, dataLength - offset);
+    OK_OR_RETURN(sendNoResponseCommand(
+      &modemChannel, "AT+HTTPREAD=" + String(offset) + "," + String(length)
+    ));
+    LineView line;
+    OK_OR_RETURN(modemChannel.waitForLine(HTTP_READ_RESPONSE_LINE_PREFIX, &line, DEFAULT_TIMEOUT));
+    long readLength = line.toLong(strlen(HTTP_READ_RESPONSE_LINE_PREFIX));
+    if (readLength <= 0 || readLength > (long) length) {
+      LOGF("[ERR|Cellular/HTTP] Unexpected HTTP read response line \"%.*s\"\n", (int) line.length, line.data);
+      return RET_ERROR;
+    }
+    OK_OR_RETURN(readExactly(&modemReader, chunk, readLength));
+    LOGF("[INF|Cellular/HTTP] HTTP response at %lu: \"%.*s\"\n", (unsigned long) offset, (int) readLength, chunk);
+    OK_OR_RETURN(modemChannel.waitForLine(HTTP_READ_END_LINE, &line, DEFAULT_TIMEOUT));
+    sink(chunk, readLength, context);
+    offset += readLength;
   }
-  String httpReadResponseLine;
-  OK_OR_RETURN(readEmptyLine(&Serial1));
-  ret = readLine(&Serial1, &httpReadResponseLine);
-  LOGF("HTTP read response line: \"%s\"\n", httpReadResponseLine.c_str());
-  if (ret != RET_OK) {
-    Serial.println("Error reading HTTP response data.");
-    return RET_OK;
+  return RET_OK;
+}
+
+HttpStatusClass httpStatusClass(int status) {
+  switch (status / 100) {
+    case 2: return HTTP_STATUS_SUCCESS;
+    case 3: return HTTP_STATUS_REDIRECT;
+    case 4: return HTTP_STATUS_CLIENT_ERROR;
+    case 5: return HTTP_STATUS_SERVER_ERROR;
+    case 6:
+    case 7: return HTTP_STATUS_MODEM_ERROR;
+    default: return HTTP_STATUS_NONE;
   }
-  char httpResponseBody[dataLength + 1];
-  httpResponseBody[dataLength] = '\0';
-  ret = readExactly(&Serial1, httpResponseBody, dataLength);
-  if (ret != RET_OK) {
-    Serial.println("Error reading HTTP response data.");
-    return RET_OK;
+}
+
+unsigned char sendHttpData(ModemChannel* modem, HttpBodyWriter writeBody, void* context, size_t* sentLength) {
+  ByteCounter counter;
+  size_t length = writeBody(&counter, context);
+  *sentLength = length;
+  LOGF("Sending HTTP data, bytes: %lu\n", (unsigned long) length);
+  if (length > HTTP_DATA_MAX_BYTES) {
+    LOGF("HTTP body of %lu bytes is over the modem's limit\n", (unsigned long) length);
+    return AT_ERROR_STATUS;
   }
-  LOGF("HTTP response body: \"%s\"\n", httpResponseBody);
-  OK_OR_RETURN(readEmptyLine(&Serial1));
-  ret = readLine(&Serial1, &httpReadResponseLine);
-  LOGF("HTTP read response line: \"%s\"\n", httpReadResponseLine.c_str());
-  if (ret != RET_OK) {
-    Serial.println("Error reading HTTP response data.");
-    return RET_OK;
+  modem->stream()->printf("AT+HTTPDATA=%lu,10000\r\n", (unsigned long) length);
+  LineView atResponseLine;
+  if (modem->waitForLine("DOWNLOAD", &atResponseLine, DEFAULT_TIMEOUT) != RET_OK) {
+    LOGLN("Expected DOWNLOAD");
+    return AT_ERROR_STATUS;
   }
-  if (sendNoResponseCommand(&Serial1, "AT+HTTPTERM") != AT_OK_STATUS) {
-    Serial.println("Error terminating HTTP service.");
-    return RET_OK;
+  // The modem takes exactly `length` bytes, no line ending
+  unsigned long beforeWriteUs = micros();
+  size_t written = writeBody(modem->stream(), context);
+  recordModemUartTransfer(cellularUartBaud(), written, micros() - beforeWriteUs);
+  if (written != length) {
+    // The modem would wait for the missing bytes or take the surplus as
+    // commands, nothing to do but fail
+    LOGF("HTTP body changed between passes, %lu instead of %lu bytes\n", (unsigned long) written, (unsigned long) length);
+    return AT_ERROR_STATUS;
   }
-  Serial.println("HTTP GET request sent.");
+  unsigned char status = modem->readResult();
+  LOGF("HTTP data sent, status %d\n", status);
+  return status;
 }
 
-unsigned char httpGet(
-    String url,
-    String* response,
-    unsigned long timeout
-) {
-    delay(1000);
-    while (Serial1.available()) {
-        Serial1.read();
+// All headers in one AT+HTTPPARA="USERDATA", where the modem takes a literal
+// \r\n between them. Written piece by piece rather than built in a String.
+static unsigned char sendHttpHeaders(const HttpHeader* headers, size_t nbroHeaders) {
+  Stream* stream = modemChannel.stream();
+  stream->print("AT+HTTPPARA=\"USERDATA\",\"");
+  for (size_t i = 0; i < nbroHeaders; i++) {
+    if (i > 0) {
+      stream->print("\\r\\n");
     }
-    LOGF("[INF|Cellular/HTTP] Sending HTTP POST request to \"%s\"...\n", url.c_str());
+    stream->print(headers[i].name);
+    stream->print(": ");
+    stream->print(headers[i].value);
+  }
+  stream->print("\"\r\n");
+  return modemChannel.readResult();
+}
+
+unsigned char beginHttpSession(const HttpRequest& request) {
+    httpSessionStats = {};
+    // Handle whatever URCs arrived since the last command
+    modemChannel.poll();
+    LOGF("[INF|Cellular/HTTP] Starting HTTP session with \"%s\"...\n", request.url);
     LOGF("[INF|Cellular/HTTP] Maybe terminating HTTP service from previous request...\n");
-    if (sendNoResponseCommand(&Serial1, "AT+HTTPTERM") == ERROR_RECEIVING_AT_STATUS) {
+    if (sendNoResponseCommand(&modemChannel, "AT+HTTPTERM") == ERROR_RECEIVING_AT_STATUS) {
         LOGF("[ERR|Cellular/HTTP] Error terminating HTTP service.\n");
         return RET_ERROR;
     }
     unsigned char ret;
     LOGF("[INF|Cellular/HTTP] Initializing HTTP service...\n");
-    OK_OR_RETURN(sendNoResponseCommand(&Serial1, "AT+HTTPINIT"));
+    OK_OR_RETURN(sendNoResponseCommand(&modemChannel, "AT+HTTPINIT"));
     LOGLN("[INF|Cellular/HTTP] HTTP service initialized.");
-    OK_OR_RETURN(sendNoResponseCommand(&Serial1, "AT+HTTPPARA=\"URL\",\"" + url + "\""));
-    LOGLN("[INF|Cellular/HTTP] HTTP parameters set.");
-    OK_OR_RETURN(sendNoResponseCommand(&Serial1, "AT+HTTPACTION=0"));
-    LOGLN("[INF|Cellular/HTTP] HTTP action sent.");
-    OK_OR_RETURN(readEmptyLine(&Serial1));
-    LOGLN("[INF|Cellular/HTTP] Reading HTTP response status line...");
-    String httpResponseStatusLine;
-    OK_OR_RETURN(readLine(&Serial1, &httpResponseStatusLine));
-    if (httpResponseStatusLine.indexOf(HTTP_RESPONSE_STATUS_LINE_PREFIX) != 0) {
-        LOGF("[ERR|Cellular/HTTP] Expected HTTP response status line, got \"%s\"\n", httpResponseStatusLine.c_str());
-        return RET_ERROR;
+    OK_OR_RETURN(sendNoResponseCommand(&modemChannel, "AT+HTTPPARA=\"URL\",\"" + String(request.url) + "\""));
+    if (request.contentType != nullptr) {
+        OK_OR_RETURN(sendNoResponseCommand(&modemChannel, "AT+HTTPPARA=\"CONTENT\",\"" + String(request.contentType) + "\""));
     }
-    httpResponseStatusLine.remove(0, HTTP_RESPONSE_STATUS_LINE_PREFIX.length());
-    int httpStatusArgIndex = httpResponseStatusLine.indexOf(',');
-    int lengthArgIndex = httpResponseStatusLine.indexOf(',', httpStatusArgIndex + 1);
-    int httpStatus = httpResponseStatusLine.substring(httpStatusArgIndex + 1, lengthArgIndex).toInt();
-    int dataLength = httpResponseStatusLine.substring(lengthArgIndex + 1).toInt();
-    LOGF("[INF|Cellular/HTTP] HTTP status: %d, data length: %d\n", httpStatus, dataLength);
-    OK_OR_RETURN(sendNoResponseCommand(&Serial1, "AT+HTTPREAD=" + String(dataLength)));
-    OK_OR_RETURN(readEmptyLine(&Serial1));
-    OK_OR_RETURN(readLine(&Serial1, &httpResponseStatusLine));
-    LOGF("[INF|Cellular/HTTP] HTTP read response line: \"%s\"\n", httpResponseStatusLine.c_str());
-    char httpResponseBody[dataLength + 1];
-    httpResponseBody[dataLength] = '\0';
-    OK_OR_RETURN(readExactly(&Serial1, httpResponseBody, dataLength));
-    LOGF("[INF|Cellular/HTTP] HTTP response body: \"%s\"\n", httpResponseBody);
-    OK_OR_RETURN(readEmptyLine(&Serial1));
-    OK_OR_RETURN(readLine(&Serial1, &httpResponseStatusLine));
-    LOGF("[INF|Cellular/HTTP] HTTP read response line: \"%s\"\n", httpResponseStatusLine.c_str());
-    OK_OR_RETURN(sendNoResponseCommand(&Serial1, "AT+HTTPTERM"));
-    LOGF("[INF|Cellular/HTTP] HTTP POST request sent.\n");
-    *response = String(httpResponseBody);
+    if (request.nbroHeaders > 0) {
+        OK_OR_RETURN(sendHttpHeaders(request.headers, request.nbroHeaders));
+    }
+    LOGLN("[INF|Cellular/HTTP] HTTP parameters set.");
     return RET_OK;
 }
 
-unsigned char sendHttpData(Stream* modemStream, String* data) {
-  LOGF("Sending HTTP data, bytes: %d\n", data->length());
-  modemStream->printf("AT+HTTPDATA=%d,10000\r\n", data->length());
-  String atResponseLine;
-  unsigned char ret;
-  OK_OR_RETURN(readEmptyLine(modemStream));
-  OK_OR_RETURN(readLine(modemStream, &atResponseLine));
-  LOGF("Requested to send HTTP data, got \"%s\"\n", atResponseLine.c_str());
-  if (atResponseLine.indexOf("DOWNLOAD") < 0) {
-    LOGLN("Expected DOWNLOAD, got " + atResponseLine);
-    return AT_ERROR_STATUS;
-  }
-  auto cString = data->c_str();
-  LOGF("Sending HTTP data \"%s\"\n", cString);
-  modemStream->println(cString);
-  OK_OR_RETURN(readEmptyLine(modemStream));
-  OK_OR_RETURN(readLine(modemStream, &atResponseLine));
-  LOGF("HTTP data sent, got \"%s\"\n", atResponseLine.c_str());
-  if (atResponseLine.indexOf("OK") < 0) {
-    LOGLN("Expected OK, got " + atResponseLine);
-    return AT_ERROR_STATUS;
-  }
-  return AT_OK_STATUS;
-}
-
-unsigned char httpPost(
-    String url,
-    String* body,
-    String* response,
-    unsigned long timeout
+unsigned char httpSessionRequest(
+    const HttpRequest& request,
+    HttpResponseSink sink,
+    void* sinkContext,
+    HttpResult* result
 ) {
-    delay(1000);
-    while (Serial1.available()) {
-        Serial1.read();
-    }
-    LOGF("[INF|Cellular/HTTP] Sending HTTP POST request to \"%s\"...\n", url.c_str());
-    LOGF("[INF|Cellular/HTTP] Maybe terminating HTTP service from previous request...\n");
-    if (sendNoResponseCommand(&Serial1, "AT+HTTPTERM") == ERROR_RECEIVING_AT_STATUS) {
-        LOGF("[ERR|Cellular/HTTP] Error terminating HTTP service.\n");
-        return RET_ERROR;
-    }
     unsigned char ret;
-    LOGF("[INF|Cellular/HTTP] Initializing HTTP service...\n");
-    OK_OR_RETURN(sendNoResponseCommand(&Serial1, "AT+HTTPINIT"));
-    LOGLN("[INF|Cellular/HTTP] HTTP service initialized.");
-    OK_OR_RETURN(sendNoResponseCommand(&Serial1, "AT+HTTPPARA=\"URL\",\"" + url + "\""));
-    LOGLN("[INF|Cellular/HTTP] HTTP parameters set.");
-    OK_OR_RETURN(sendHttpData(&Serial1, body));
-    LOGLN("[INF|Cellular/HTTP] HTTP data sent.");
-    OK_OR_RETURN(sendNoResponseCommand(&Serial1, "AT+HTTPACTION=1"));
-    LOGLN("[INF|Cellular/HTTP] HTTP action sent.");
-    OK_OR_RETURN(readEmptyLine(&Serial1));
-    LOGLN("[INF|Cellular/HTTP] Reading HTTP response status line...");
-    String httpResponseStatusLine;
-    OK_OR_RETURN(readLine(&Serial1, &httpResponseStatusLine));
-    if (httpResponseStatusLine.indexOf(HTTP_RESPONSE_STATUS_LINE_PREFIX) != 0) {
-        LOGF("[ERR|Cellular/HTTP] Expected HTTP response status line, got \"%s\"\n", httpResponseStatusLine.c_str());
-        return RET_ERROR;
+    *result = { 0, HTTP_STATUS_NONE, 0 };
+    unsigned long startMillis = millis();
+    size_t length = 0;
+    if (request.writeBody != nullptr) {
+        OK_OR_RETURN(sendHttpData(&modemChannel, request.writeBody, request.bodyContext, &length));
+        LOGLN("[INF|Cellular/HTTP] HTTP data sent.");
     }
-    httpResponseStatusLine.remove(0, HTTP_RESPONSE_STATUS_LINE_PREFIX.length());
-    int httpStatusArgIndex = httpResponseStatusLine.indexOf(',');
-    int lengthArgIndex = httpResponseStatusLine.indexOf(',', httpStatusArgIndex + 1);
-    int httpStatus = httpResponseStatusLine.substring(httpStatusArgIndex + 1, lengthArgIndex).toInt();
-    int dataLength = httpResponseStatusLine.substring(lengthArgIndex + 1).toInt();
-    LOGF("[INF|Cellular/HTTP] HTTP status: %d, data length: %d\n", httpStatus, dataLength);
-    OK_OR_RETURN(sendNoResponseCommand(&Serial1, "AT+HTTPREAD=" + String(dataLength)));
-    OK_OR_RETURN(readEmptyLine(&Serial1));
-    OK_OR_RETURN(readLine(&Serial1, &httpResponseStatusLine));
-    LOGF("[INF|Cellular/HTTP] HTTP read response line: \"%s\"\n", httpResponseStatusLine.c_str());
-    char httpResponseBody[dataLength + 1];
-    httpResponseBody[dataLength] = '\0';
-    OK_OR_RETURN(readExactly(&Serial1, httpResponseBody, dataLength));
-    LOGF("[INF|Cellular/HTTP] HTTP response body: \"%s\"\n", httpResponseBody);
-    OK_OR_RETURN(readEmptyLine(&Serial1));
-    OK_OR_RETURN(readLine(&Serial1, &httpResponseStatusLine));
-    LOGF("[INF|Cellular/HTTP] HTTP read response line: \"%s\"\n", httpResponseStatusLine.c_str());
-    OK_OR_RETURN(sendNoResponseCommand(&Serial1, "AT+HTTPTERM"));
-    LOGF("[INF|Cellular/HTTP] HTTP POST request sent.\n");
-    *response = String(httpResponseBody);
-    // Check if status is 400 or 500 range
-    int httpStatusRange = httpStatus / 100;
-    if (httpStatusRange == 4 || httpStatusRange == 5) {
-        LOGF("[ERR|Cellular/HTTP] HTTP status range is %dxx\n", httpStatusRange);
-        return RET_ERROR;
+    OK_OR_RETURN(sendHttpAction(request.method, DEFAULT_TIMEOUT));
+    result->status = httpActionResult.httpStatus;
+    result->statusClass = httpStatusClass(result->status);
+    result->bodyLength = max(httpActionResult.dataLength, 0);
+    // Left with the modem otherwise, the next request replaces it
+    if (sink != nullptr) {
+        OK_OR_RETURN(readHttpResponseBody(result->bodyLength, sink, sinkContext));
+        httpSessionStats.bytesReceived += result->bodyLength;
+    }
+
+    unsigned long requestMs = millis() - startMillis;
+    httpSessionStats.nbroRequests++;
+    httpSessionStats.bytesSent += length;
+    httpSessionStats.requestsMs += requestMs;
+    httpSessionStats.slowestRequestMs = max(httpSessionStats.slowestRequestMs, (uint32_t) requestMs);
+    LOGF(
+        "[INF|Cellular/HTTP] Request %u: %lu bytes in %lu ms, %lu B/s\n",
+        httpSessionStats.nbroRequests, (unsigned long) length, requestMs,
+        requestMs > 0 ? (unsigned long) length * 1000UL / requestMs : 0UL
+    );
+    if (result->statusClass != HTTP_STATUS_SUCCESS) {
+        LOGF("[ERR|Cellular/HTTP] HTTP status %d\n", result->status);
     }
     return RET_OK;
 }
+
+unsigned char endHttpSession() {
+    unsigned char ret;
+    OK_OR_RETURN(sendNoResponseCommand(&modemChannel, "AT+HTTPTERM"));
+    LOGF(
+        "[INF|Cellular/HTTP] HTTP session done, %u requests, %lu bytes in %lu ms\n",
+        httpSessionStats.nbroRequests, (unsigned long) httpSessionStats.bytesSent,
+        (unsigned long) httpSessionStats.requestsMs
+    );
+    return RET_OK;
+}
+
+unsigned char httpRequest(
+    const HttpRequest& request,
+    HttpResponseSink sink,
+    void* sinkContext,
+    HttpResult* result
+) {
+    unsigned char ret;
+    *result = { 0, HTTP_STATUS_NONE, 0 };
+    OK_OR_RETURN(beginHttpSession(request));
+    unsigned char requestRet = httpSessionRequest(request, sink, sinkContext, result);
+    OK_OR_RETURN(endHttpSession());
+    return requestRet;
+}
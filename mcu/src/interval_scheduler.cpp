@@ -0,0 +1,101 @@
+#include <Arduino.h>
+#include "common_macros.h"
+#include "interval_scheduler.h"
+#include "rtc_sealed.h"
+
+
+#define SECONDS_PER_DAY (24UL * 60 * 60)
+
+IntervalSchedulerConfig makeIntervalSchedulerConfig(uint32_t configuredIntervalS, uint32_t flatMaxIntervalS) {
+  return {
+    .intervalS = configuredIntervalS,
+    .flatMaxIntervalS = _max(flatMaxIntervalS, configuredIntervalS),
+    .minIntervalS = MEASUREMENT_INTERVAL_MIN_S,
+    .maxIntervalS = MEASUREMENT_INTERVAL_MAX_S,
+    .awakeBudgetMsPerDay = MEASUREMENT_AWAKE_BUDGET_MS_PER_DAY
+  };
+}
+
+static uint32_t clampInterval(uint64_t intervalS, const IntervalSchedulerConfig& config) {
+  if (intervalS < config.minIntervalS) return config.minIntervalS;
+  if (intervalS > config.maxIntervalS) return config.maxIntervalS;
+  return intervalS;
+}
+
+// What the level alone asks for
+static uint32_t levelIntervalS(
+  const IntervalScheduler& scheduler,
+  const IntervalSchedulerConfig& config,
+  const Measurement& current
+) {
+  uint32_t configuredS = clampInterval(config.intervalS, config);
+  bool hasHistory = scheduler.intervalS != 0
+    && scheduler.lastTimeS != 0
+    && current.timeS > scheduler.lastTimeS;
+  if (!hasHistory) {
+    return configuredS;
+  }
+  unsigned long elapsedS = current.timeS - scheduler.lastTimeS;
+  unsigned long changeMM = current.distanceMM > scheduler.lastDistanceMM
+    ? current.distanceMM - scheduler.lastDistanceMM
+    : scheduler.lastDistanceMM - current.distanceMM;
+  if (changeMM <= MEASUREMENT_FLAT_CHANGE_MM) {
+    // Sleeping longer notices the next drawdown later, by at most
+    // flatMaxIntervalS
+    uint64_t stretchedS = (uint64_t) _max(scheduler.intervalS, configuredS)
+      * MEASUREMENT_FLAT_STRETCH_PERCENT / 100;
+    return clampInterval(_min(stretchedS, (uint64_t) config.flatMaxIntervalS), config);
+  }
+  // Sleep as long as the current rate takes to move the target amount
+  uint64_t targetS = (uint64_t) MEASUREMENT_TARGET_CHANGE_MM * elapsedS / changeMM;
+  return clampInterval(_min(targetS, (uint64_t) configuredS), config);
+}
+
+uint32_t nextMeasurementIntervalS(
+  IntervalScheduler* scheduler,
+  const IntervalSchedulerConfig& config,
+  const Measurement& current,
+  unsigned char confidence,
+  uint32_t awakeMs
+) {
+  int64_t creditCapMs = config.awakeBudgetMsPerDay / 4;
+  if (scheduler->checksum != rtcChecksum(*scheduler)) {
+    LOGLN("[WRN|Scheduler] State lost or corrupted, starting over");
+    memset(scheduler, 0, sizeof(IntervalScheduler));
+    scheduler->awakeCreditMs = creditCapMs;
+  }
+  bool trusted = current.distanceMM != 0 && confidence >= DISTANCE_MIN_CONFIDENCE;
+  uint32_t intervalS = scheduler->intervalS != 0
+    ? clampInterval(scheduler->intervalS, config)
+    : clampInterval(config.intervalS, config);
+  if (trusted) {
+    intervalS = levelIntervalS(*scheduler, config, current);
+  } else {
+    LOGF("[INF|Scheduler] Reading not trusted (confidence %d%%), keeping the interval\n", confidence);
+  }
+
+  // Sleep at least long enough to pay back what this wake overspent
+  int64_t creditMs = (int64_t) scheduler->awakeCreditMs - awakeMs;
+  if (creditMs < 0 && config.awakeBudgetMsPerDay > 0) {
+    uint64_t repayS = (-creditMs * SECONDS_PER_DAY + config.awakeBudgetMsPerDay - 1)
+      / config.awakeBudgetMsPerDay;
+    if (repayS > intervalS) {
+      LOGF("[INF|Scheduler] Over the awake budget, sleeping %lu s\n", (unsigned long) repayS);
+      intervalS = clampInterval(repayS, config);
+    }
+  }
+  creditMs += (int64_t) ((uint64_t) config.awakeBudgetMsPerDay * intervalS / SECONDS_PER_DAY);
+
+  if (trusted) {
+    scheduler->lastTimeS = current.timeS;
+    scheduler->lastDistanceMM = current.distanceMM;
+  }
+  scheduler->intervalS = intervalS;
+  scheduler->awakeCreditMs = _max(_min(creditMs, creditCapMs), (int64_t) INT32_MIN);
+  sealRtc(scheduler);
+  LOGF(
+    "[INF|Scheduler] Next interval %lu s, awake credit %ld ms\n",
+    (unsigned long) intervalS, (long) scheduler->awakeCreditMs
+  );
+  return intervalS;
+}
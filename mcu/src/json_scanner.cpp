@@ -0,0 +1,152 @@
+#include <Arduino.h>
+#include <limits.h>
+#include "json_scanner.h"
+
+
+static bool isJsonWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool isJsonNumberChar(char c) {
+  return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+JsonNumberScanner::JsonNumberScanner(JsonNumberHandler handler, void* context)
+  : handler(handler), context(context) {
+  begin();
+}
+
+void JsonNumberScanner::begin() {
+  state = STATE_VALUE;
+  malformed = false;
+  pathDepth = 0;
+  namedLevels = 0;
+  nesting = 0;
+  stringLength = 0;
+  nameLength = 0;
+  hasName = false;
+}
+
+bool JsonNumberScanner::feed(const char* json, size_t length) {
+  for (size_t i = 0; i < length && !malformed; i++) {
+    // A character that ends a string or number is looked at again as the
+    // start of what follows
+    while (!scan(json[i])) {}
+  }
+  return !malformed;
+}
+
+bool JsonNumberScanner::finish() {
+  if (state == STATE_NUMBER) {
+    reportNumber();
+    state = STATE_VALUE;
+  } else if (state == STATE_AFTER_STRING) {
+    state = STATE_VALUE;
+  }
+  return !malformed && nesting == 0 && state == STATE_VALUE;
+}
+
+// Returns false if `c` still has to be scanned in the new state
+bool JsonNumberScanner::scan(char c) {
+  switch (state) {
+    case STATE_STRING:
+    case STATE_STRING_ESCAPE:
+      if (state == STATE_STRING && c == '"') {
+        state = STATE_AFTER_STRING;
+        return true;
+      }
+      state = state == STATE_STRING && c == '\\' ? STATE_STRING_ESCAPE : STATE_STRING;
+      if (stringLength < JSON_SCANNER_MAX_NAME) {
+        string[stringLength++] = c;
+      }
+      return true;
+    case STATE_AFTER_STRING:
+      if (isJsonWhitespace(c)) {
+        return true;
+      }
+      state = STATE_VALUE;
+      hasName = c == ':';
+      if (!hasName) {
+        return false;
+      }
+      memcpy(name, string, stringLength);
+      nameLength = stringLength;
+      return true;
+    case STATE_NUMBER:
+      if (c >= '0' && c <= '9' && !fraction) {
+        int digit = c - '0';
+        number = number > (LONG_MAX - digit) / 10 ? LONG_MAX : number * 10 + digit;
+        return true;
+      }
+      if (isJsonNumberChar(c)) {
+        // Fraction and exponent
+        fraction = true;
+        return true;
+      }
+      reportNumber();
+      state = STATE_VALUE;
+      return false;
+    case STATE_VALUE:
+      break;
+  }
+
+  if (c == '"') {
+    state = STATE_STRING;
+    stringLength = 0;
+  } else if (c == '{' || c == '[') {
+    if (nesting == JSON_SCANNER_MAX_NESTING) {
+      malformed = true;
+      return true;
+    }
+    bool named = hasName && pathDepth < JSON_SCANNER_MAX_PATH;
+    if (named) {
+      memcpy(path[pathDepth], name, nameLength);
+      pathLengths[pathDepth++] = nameLength;
+      namedLevels |= 1UL << nesting;
+    } else {
+      namedLevels &= ~(1UL << nesting);
+    }
+    nesting++;
+    hasName = false;
+  } else if (c == '}' || c == ']') {
+    if (nesting == 0) {
+      malformed = true;
+      return true;
+    }
+    nesting--;
+    if (namedLevels & (1UL << nesting)) pathDepth--;
+    hasName = false;
+  } else if (c == '-' || (c >= '0' && c <= '9')) {
+    state = STATE_NUMBER;
+    negative = c == '-';
+    number = negative ? 0 : c - '0';
+    fraction = false;
+  } else if (c == ',') {
+    // Separators, whitespace and true/false/null leave the name alone
+    hasName = false;
+  }
+  return true;
+}
+
+void JsonNumberScanner::reportNumber() {
+  if (hasName && pathDepth < JSON_SCANNER_MAX_PATH) {
+    LineView names[JSON_SCANNER_MAX_PATH];
+    for (size_t i = 0; i < pathDepth; i++) {
+      names[i] = { path[i], pathLengths[i] };
+    }
+    names[pathDepth] = { name, nameLength };
+    handler(names, pathDepth + 1, negative ? -number : number, context);
+  }
+  hasName = false;
+}
+
+bool scanJsonNumbers(
+  const char* json,
+  size_t length,
+  JsonNumberHandler handler,
+  void* context
+) {
+  JsonNumberScanner scanner(handler, context);
+  scanner.feed(json, length);
+  return scanner.finish();
+}
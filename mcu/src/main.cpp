@@ -3,11 +3,25 @@
 #include "common_macros.h"
 #include "cellular.h"
 #include "http.h"
+#include "upload_transport.h"
+#include "coap_transport.h"
+#include "wifi_transport.h"
+#include "uplink.h"
 #include "distance_sensor.h"
+#include "sensor_units.h"
 #include "fast_blink.h"
 #include "stream_extensions.h"
-#include <ArduinoJson.h>
-#include "build_time.h"
+#include <batch_codec.h>
+#include "measurements.h"
+#include "measurement_log.h"
+#include "rtc_batch.h"
+#include "interval_scheduler.h"
+#include "json_scanner.h"
+#include "deployed_config.h"
+#include "wake_profile.h"
+#include "clock_sync.h"
+#include "upload_outbox.h"
+#include "upload_compression.h"
 #include "api_secrets.h"
 
 
@@ -16,193 +30,381 @@
 #define PIN_USB_VOLTAGE_DIVIDER A2
 
 /// Params
-#define BATTERY_VOLTAGE_DIVIDER_RATIO 2.0
-#define USB_VOLTAGE_DIVIDER_RATIO (1.0+2.2)
-#define BATTER_CUTOFF_VOLTAGE 3.5
-#define MAXIMUM_INTER_TRANSMIT_DISTANCE_MM 30
-// In other words: maximum number of measurements to send in batch
-#define MAXIMUM_INTER_TRANSMIT_MEASUREMENTS 30
-#define MAXIMUM_INTER_TRANSMIT_TIME_S 60 * 60 * 24
-
-
-bool timeIsSet() {
-  time_t now = time(nullptr);
-  return now > BUILD_TIME_UNIX_S;
-}
+// In tenths, 1.0 + 2.2 for USB
+#define BATTERY_VOLTAGE_DIVIDER_RATIO_TENTHS 20
+#define USB_VOLTAGE_DIVIDER_RATIO_TENTHS (10 + 22)
+// Above this the board is on USB power
+#define USB_POWER_MIN_MV 4000
+#define DISTANCE_SHOTS 10
+// The transmit triggers and the battery cutoff are in DeployedConfig, the
+// server can retune them
+// Upload batches in the compact binary format of lib/batch_codec instead of
+// JSON. The API has to understand BATCH_CODEC_CONTENT_TYPE first.
+#define UPLOAD_BINARY_BATCHES false
+// Power the modem on as soon as the first shots show this wake will upload,
+// so it boots while the rest of the wake runs. The simulator turns this off
+// to measure what it saves.
+bool overlapCellularBoot = true;
+// A wrong guess costs the modem a boot and a POWERKEY power off, as much as
+// 17 right ones save. So a distance delta is only guessed once more than
+// half the shots agree on it, the rest can't outvote them. The simulator
+// turns this off to measure what a wrong guess costs.
+#define EARLY_GUESS_MIN_SHOTS (DISTANCE_SHOTS / 2 + 1)
+bool earlyGuessAwaitsShots = true;
+// Measurements per upload request. The API echoes every measurement it
+// gets, a chunk keeps that echo to a few seconds of AT+HTTPREAD. One RTC
+// batch plus the current one goes in a single request.
+#define UPLOAD_CHUNK_MEASUREMENTS (RTC_BATCH_CAPACITY + 1)
+static_assert(
+  UPLOAD_CHUNK_MEASUREMENTS * MEASUREMENT_JSON_MAX_BYTES < HTTP_DATA_MAX_BYTES,
+  "Upload chunks would not fit AT+HTTPDATA"
+);
+// Post all chunks of an upload in one HTTP session rather than one session
+// each. The simulator turns this off to measure what it saves.
+bool uploadInOneSession = true;
+// HTTPS to the API. CoAP over UDP takes fewer round trips and bytes, see the
+// upload-transport report of the simulator, but needs a CoAP endpoint and
+// goes unencrypted. The simulator switches to compare.
+uint8_t uploadTransport = UPLOAD_TRANSPORT_HTTP;
+// Where CoAP uploads go, api_secrets.h can point them elsewhere
+#ifndef COAP_API_HOST
+#define COAP_API_HOST "127.0.0.1"
+#endif
+#ifndef COAP_API_PORT
+#define COAP_API_PORT COAP_DEFAULT_PORT
+#endif
+
+// Survives deep sleep, starts over after a power loss
+RTC_DATA_ATTR IntervalScheduler intervalScheduler;
+
 
 void setupVoltageDividers() {
   pinMode(PIN_BATTERY_VOLTAGE_DIVIDER, INPUT);
   pinMode(PIN_USB_VOLTAGE_DIVIDER, INPUT);
 }
 
-double adcValueToVoltage(uint16_t adcValue, double voltageDividerRatio) {
-  // ADC_ATTEN_DB_11
-  // https://docs.espressif.com/projects/esp-idf/en/v4.4.2/esp32s2/api-reference/peripherals/adc.html#adc-attenuation
-  return adcValue * (2.5 / 8191.0) * voltageDividerRatio;
-}
+static const uint32_t BATTERY_MV_SCALE_Q16 = adcMillivoltScaleQ16(BATTERY_VOLTAGE_DIVIDER_RATIO_TENTHS);
+static const uint32_t USB_MV_SCALE_Q16 = adcMillivoltScaleQ16(USB_VOLTAGE_DIVIDER_RATIO_TENTHS);
 
-double getBatteryVoltage() {
-  uint16_t voltage_divider_adc = analogRead(PIN_BATTERY_VOLTAGE_DIVIDER);  
-  return adcValueToVoltage(voltage_divider_adc, BATTERY_VOLTAGE_DIVIDER_RATIO);
+uint16_t getBatteryAdc() {
+  return analogRead(PIN_BATTERY_VOLTAGE_DIVIDER);
 }
 
-double getBatteryVoltageAveraged(unsigned char count) {
-  double sum = 0;
+// The readings are summed up and converted once
+uint16_t getBatteryMVAveraged(unsigned char count) {
+  uint32_t adcSum = 0;
   for (unsigned char i = 0; i < count; i++) {
     delay(1);
-    sum += getBatteryVoltage();
+    adcSum += getBatteryAdc();
     delay(9);
   }
-  return sum / count;
+  return adcSumToMV(adcSum, count, BATTERY_MV_SCALE_Q16);
 }
 
-double getUsbVoltage() {
+uint16_t getUsbAdc() {
   uint16_t voltage_divider_adc = analogRead(PIN_USB_VOLTAGE_DIVIDER);  
   LOGF("[INF|Main] USB voltage divider ADC value: %d\n", voltage_divider_adc);
-  return adcValueToVoltage(voltage_divider_adc, USB_VOLTAGE_DIVIDER_RATIO);
+  return voltage_divider_adc;
 }
 
-double getUsbVoltageAveraged(unsigned char count) {
-  double sum = 0;
+uint16_t getUsbMVAveraged(unsigned char count) {
+  uint32_t adcSum = 0;
   for (unsigned char i = 0; i < count; i++) {
     delay(1);
-    sum += getUsbVoltage();
+    adcSum += getUsbAdc();
     delay(9);
   }
-  return sum / count;
+  return adcSumToMV(adcSum, count, USB_MV_SCALE_Q16);
 }
 
-unsigned char batteryVoltageToPercentage(double voltage) {
-  double voltages[] = {
-    4.17, 4.15, 4.10, 4.05, 4.00, 3.93, 3.85, 3.84, 3.83, 3.81, 3.80, 3.79, 3.75,
-    3.70, 3.65, 3.35
-  };
-  unsigned char percentages[] = {
-    100, 95, 89, 83, 75, 65, 50, 46, 42, 40, 36, 30, 25, 11, 5, 2
-  };
-  for (unsigned char i = 0; i < sizeof(voltages) / sizeof(double); i++) {
-    if (voltage > voltages[i]) {
-      return percentages[i];
-    }
+// Where measurements were saved before the measurement log
+const __FlashStringHelper* LEGACY_SAVED_MEASUREMENTS_FILE_PATH = F("/last_measurements.txt");
+
+// Moves measurements saved by older firmware into the log, once
+void importLegacyMeasurements(MeasurementLog* measurementLog) {
+  if (!LittleFS.exists(LEGACY_SAVED_MEASUREMENTS_FILE_PATH)) {
+    return;
   }
-  return 0;
+  File legacyFile = LittleFS.open(LEGACY_SAVED_MEASUREMENTS_FILE_PATH, "r");
+  Measurement measurement;
+  while (readMeasurementFromFile(&legacyFile, &measurement)) {
+    measurementLog->append(measurement);
+  }
+  legacyFile.close();
+  LittleFS.remove(LEGACY_SAVED_MEASUREMENTS_FILE_PATH);
+  LOGLN("[INF|Main] Imported legacy saved measurements");
 }
 
-const __FlashStringHelper* SAVED_MEASUREMENTS_FILE_PATH = F("/last_measurements.txt");
-
-struct Measurement {
-  unsigned long timeS;
-  unsigned long distanceMM;
-  double batteryVoltage;
-};
+void mountFileSystem(bool* mounted) {
+  if (*mounted) {
+    return;
+  }
+  WakePhaseTimer timer(WAKE_PHASE_FLASH);
+  LOGF("[INF|Main] Setting up LittleFS...\n");
+  if (!LittleFS.begin()){
+    LOGF("[ERR|Main] Failed to mount file system. Trying to format...\n");
+    if (!LittleFS.format()) {
+      LOGF("[ERR|Main] Failed to format file system. Rebooting...\n");
+      // TODO: Handle... somehow
+      esp_restart();
+    }
+  }
+  // No format after a panic anymore, the measurement log recovers from
+  // whatever write the panic interrupted
+  LOGF("[INF|Main] LittleFS setup done\n");
+  *mounted = true;
+}
 
-bool readMeasurementFromFile(File* file, Measurement* measurement) {  
-  u_int size = sizeof(Measurement);
-  size_t bytesRead = file->readBytes((char*) measurement, size);
-  return bytesRead == size;
+void openMeasurementLog(MeasurementLog* measurementLog, bool* fileSystemMounted) {
+  WakePhaseTimer timer(WAKE_PHASE_FLASH);
+  mountFileSystem(fileSystemMounted);
+  if (measurementLog->open() != RET_OK) {
+    LOGF("[ERR|Main] Failed to open measurement log. Rebooting...\n");
+    esp_restart();
+  }
+  importLegacyMeasurements(measurementLog);
 }
 
-size_t readSavedMeasurements(
-  File* file,
-  Measurement measurements[],
-  size_t maxSavedMeasurements,
-  unsigned long* smallestDistance,
-  unsigned long* largestDistance
-) {
-  file->seek(0);
-  size_t nbroSavedMeasurements = 0;
-  while (
-    nbroSavedMeasurements < maxSavedMeasurements
-    && readMeasurementFromFile(
-      file,
-      &measurements[nbroSavedMeasurements]
-    )
-  ) {
-    auto distance = measurements[nbroSavedMeasurements].distanceMM;
-    LOGF("[INF|Main] Saved measurement %d: %d mm\n", nbroSavedMeasurements, distance);
-    if (distance < *smallestDistance) {
-      *smallestDistance = distance;
-    }
-    if (distance > *largestDistance) {
-      *largestDistance = distance;
-    }
-    nbroSavedMeasurements++;
+// The wake profile and the batch sequence go along with JSON uploads only,
+// the binary batch format has no room for them. Every chunk carries the
+// sequence, the profile and the link it went over go with the first.
+size_t writeMeasurementBatchJson(Print* out, void* context) {
+  const MeasurementBatch* batch = (const MeasurementBatch*) context;
+  size_t written = out->print("{\"batch\":");
+  written += out->print((unsigned long) uploadBatchSequence());
+  // Real times stay as they are, the API moves unsynced ones to its own clock
+  written += out->print(",\"clockSynced\":");
+  written += out->print(clockIsSynced() ? "true" : "false");
+  written += out->print(",\"measurements\":");
+  written += writeMeasurementsJson(out, *batch);
+  if (batch->first == 0) {
+    written += out->print(",\"wakeProfile\":");
+    written += writeWakeProfileJson(out);
+    written += out->print(",\"uplink\":");
+    written += writeUplinkJson(out);
   }
-  return nbroSavedMeasurements;
+  written += out->print('}');
+  return written;
 }
 
-uint8_t transmitMeasurements(Measurement measurements[], size_t nbroMeasurements) {
-  LOGLN("[INF|Main] Setting up cellular...");
-  setupCellularIO();
-  setupCellular();
-  LOGLN("[INF|Main] Cellular setup done");
+size_t writeMeasurementBatchBinary(Print* out, void* context) {
+  return writeMeasurementsBatch(out, *(MeasurementBatch*) context);
+}
 
-  LOGLN("[INF|Main] Sending HTTP request...");
-  Serial1.println("AT+CCHSTART");
-  delay(2000);
-  while(Serial1.available()) {
-    Serial.write(Serial1.read());
-  }
+// What transmitMeasurements() takes from the response
+struct UploadResponse {
+  long now;
+  long ack;
+  DeployedConfig config;
+};
 
-  StaticJsonDocument<MAXIMUM_INTER_TRANSMIT_MEASUREMENTS * 64> json;
-  
-  for (size_t i; i < nbroMeasurements; i++) {
-    auto measurement = measurements[i];
-    JsonObject measurementJson = json.createNestedObject();
-    measurementJson["timeS"] = measurement.timeS;
-    measurementJson["distanceMM"] = measurement.distanceMM;
-    measurementJson["batteryVoltage"] = measurement.batteryVoltage;
+// The API answers {"measurements":[...],"config":{"<key>":{"unit":...,
+// "value":<number>},...},"now":<number>,"ack":<batch>}
+void handleUploadResponseNumber(const LineView* path, size_t depth, long value, void* context) {
+  UploadResponse* response = (UploadResponse*) context;
+  if (depth == 1 && path[0].equals("now")) {
+    response->now = value;
+  } else if (depth == 1 && path[0].equals("ack")) {
+    response->ack = value;
+  } else if (depth == 3 && path[0].equals("config") && path[2].equals("value")) {
+    setDeployedConfigValue(&response->config, path[1], value);
   }
+}
+
+void scanUploadResponse(const char* data, size_t length, void* context) {
+  ((JsonNumberScanner*) context)->feed(data, length);
+}
 
-  String jsonString;
-  serializeJson(json, jsonString);
+uint8_t transmitMeasurements(MeasurementBatch* batch, bool* configChanged) {
+  *configChanged = false;
+  LOGLN("[INF|Main] Connecting...");
+  // Picks up where an early beginUplink() got to
+  uint8_t link = connectUplink();
+  LOGF("[INF|Main] Connected over %s\n", link == UPLINK_WIFI ? "WiFi" : "cellular");
+  // Before the body is written, so it can backfill timestamps taken before the
+  // first sync. Over WiFi the response's time has to do.
+  bool clockSyncedFromModem = link == UPLINK_CELLULAR && syncClockFromModem(&modemChannel) == RET_OK;
 
-  LOGF("[INF|Main] JSON: %s\n", jsonString.c_str());
+  LOGLN("[INF|Main] Sending HTTP request...");
+  if (DEBUG) {
+    Serial.print("[INF|Main] JSON: ");
+    writeMeasurementBatchJson(&Serial, batch);
+    Serial.println();
+  }
 
-  String response;
-  unsigned long beforeSendMilli = millis();
-  uint8_t res = httpPost(
-    HTTP_API_BASE_URL "/measurement?"
-    // "distanceMM=" + String(currentDistance) +
-    // "&batteryVoltage=" + String(batteryVoltage) +
-    "token=" HTTP_API_WRITE_TOKEN,
-    &jsonString,
-    &response,
-    10000
+  // Over HTTPS the token goes in a header rather than the query string,
+  // where the modem and any proxy would log it with the URL
+  HttpUploadTransport httpTransport(
+    HTTP_API_BASE_URL "/measurement", "Bearer " HTTP_API_WRITE_TOKEN, uploadInOneSession
   );
-  unsigned long afterSendMilli = millis();
+  CoapUploadTransport coapTransport(COAP_API_HOST, COAP_API_PORT, "token=" HTTP_API_WRITE_TOKEN);
+  WifiHttpUploadTransport wifiTransport(HTTP_API_BASE_URL "/measurement", "Bearer " HTTP_API_WRITE_TOKEN);
+  UploadTransport* transport = uploadTransport == UPLOAD_TRANSPORT_COAP
+    ? (UploadTransport*) &coapTransport
+    : (UploadTransport*) &httpTransport;
+  // The modem's transports need the modem
+  if (link == UPLINK_WIFI) {
+    transport = &wifiTransport;
+  }
+  UploadRequest request = {
+    UPLOAD_BINARY_BATCHES ? writeMeasurementBatchBinary : writeMeasurementBatchJson,
+    batch,
+    UPLOAD_BINARY_BATCHES ? BATCH_CODEC_CONTENT_TYPE : nullptr,
+    nullptr
+  };
+  size_t nbroMeasurements = countMeasurements(*batch);
+  // Decided for the whole upload, its last chunk may be a small one
+  CompressedBody compressedBody = { request.writeBody, batch };
+  if (shouldCompressUpload(nbroMeasurements)) {
+    request.writeBody = writeCompressedBody;
+    request.bodyContext = &compressedBody;
+    request.contentEncoding = UPLOAD_COMPRESSION_CONTENT_ENCODING;
+  }
+  UploadResponse parsed = { 0, 0, beginDeployedConfigUpdate() };
+  // One pass over each response as it is read for the time, the config and
+  // the ack, the measurements it echoes are skipped
+  JsonNumberScanner responseScanner(handleUploadResponseNumber, &parsed);
+  bool acknowledged = true;
+  unsigned long requestMs = 0;
+  uint8_t res = RET_OK;
+
+  startWakePhase(WAKE_PHASE_HTTP);
+  res = transport->begin(request);
+  // A chunk that fails fails the whole upload, the API dedupes the chunks
+  // before it on their hashes when the batch is retried
+  batch->count = UPLOAD_CHUNK_MEASUREMENTS;
+  for (batch->first = 0; res == RET_OK && acknowledged && batch->first < nbroMeasurements; batch->first += batch->count) {
+    HttpResult result;
+    parsed.ack = 0;
+    responseScanner.begin();
+    unsigned long beforeSendMilli = millis();
+    res = transport->send(request, scanUploadResponse, &responseScanner, &result);
+    requestMs = millis() - beforeSendMilli;
+    if (res == RET_OK && result.statusClass != HTTP_STATUS_SUCCESS) {
+      LOGF("[ERR|Main] Upload answered with status %d\n", result.status);
+      res = RET_ERROR;
+    }
+    if (res != RET_OK) {
+      break;
+    }
+    if (!responseScanner.finish()) {
+      LOGLN("[WRN|Main] Malformed response");
+    }
+    // Anything but the echo may be a proxy or a server that dropped the
+    // batch. Binary batches carry no sequence, the status has to do for them.
+    acknowledged = UPLOAD_BINARY_BATCHES || parsed.ack == (long) uploadBatchSequence();
+  }
+  unsigned char endRes = transport->end();
+  if (res == RET_OK) {
+    res = endRes;
+  }
+  batch->first = 0;
+  batch->count = 0;
+  stopWakePhase(WAKE_PHASE_HTTP);
   if (res != 0) {
     LOGF("[ERR|Main] HTTP request failed with code %d\n", res);
     return RET_ERROR;
   }
 
-  // Get current time from response
-  // Parsing response JSON is a little overkill though
-  int nowIndex = response.indexOf("\"now\":");
-  int nowEndIndex = _min(
-    response.indexOf(",", nowIndex),
-    response.indexOf("}", nowIndex)
-  );
-  String nowString = response.substring(nowIndex + 6, nowEndIndex);
-  LOGF("[INF|Main] Got time from response: %s\n", nowString.c_str());
-  unsigned long sendDurationMilli = afterSendMilli - beforeSendMilli;
-  // Add 1/3 of the send duration to the time because time being a bit late is
-  // better than too early
-  time_t now = atol(nowString.c_str()) + (sendDurationMilli / 3);
-  LOGF("[INF|Main] Setting time to %d\n", now);
-  timeval tv = { .tv_sec = now, .tv_usec = 0 };
-  settimeofday(&tv, DST_NONE);
+  *configChanged = commitDeployedConfigUpdate(&parsed.config);
+
+  // The last response's, timed by its own request
+  if (!clockSyncedFromModem && parsed.now > 0) {
+    LOGF("[INF|Main] Got time from response: %ld\n", parsed.now);
+    syncClockFromServer(parsed.now, requestMs);
+  }
+
+  if (!acknowledged) {
+    LOGF("[ERR|Main] Upload not acknowledged (ack %ld, batch %lu)\n", parsed.ack, (unsigned long) uploadBatchSequence());
+    return RET_ERROR;
+  }
 
   LOGLN("[INF|Main] HTTP request done");
   return RET_OK;
 }
 
+enum TransmitReason {
+  TRANSMIT_NOT_NEEDED,
+  TRANSMIT_BATCH_FULL,
+  TRANSMIT_DISTANCE_DELTA,
+  TRANSMIT_BATCH_AGE,
+};
+
+struct TransmitDecision {
+  TransmitReason reason;
+  uint32_t nbroMeasurements;
+  unsigned long distanceDeltaMM;
+  unsigned long ageOfOldestMeasurementS;
+  // What would have triggered an upload during a backoff
+  TransmitReason deferredReason;
+};
+
+// `pending` are the saved measurements, without `current`. Also makes the
+// early guess with the shots done so far.
+TransmitDecision decideTransmit(
+  MeasurementSummary pending,
+  const Measurement& current,
+  unsigned char distanceConfidence
+) {
+  addToSummary(&pending, current);
+  TransmitDecision decision = { TRANSMIT_NOT_NEEDED, pending.count, 0, 0, TRANSMIT_NOT_NEEDED };
+  // Measurements from before the first sync count from power on. The clock
+  // may also have been set back by a sync since.
+  unsigned long firstTimeS = backfilledTimeS(pending.firstTimeS);
+  unsigned long currentTimeS = backfilledTimeS(current.timeS);
+  if (currentTimeS > firstTimeS) {
+    decision.ageOfOldestMeasurementS = currentTimeS - firstTimeS;
+  }
+  // The summary includes the current distance, so it is within the bounds.
+  // Missed echoes are 0 and not part of them.
+  if (distanceConfidence >= DISTANCE_MIN_CONFIDENCE) {
+    decision.distanceDeltaMM = _max(
+      current.distanceMM - pending.smallestDistanceMM,
+      pending.largestDistanceMM - current.distanceMM
+    );
+  }
+
+  if (decision.nbroMeasurements >= deployedConfig.maximumInterTransmitMeasurements) {
+    decision.reason = TRANSMIT_BATCH_FULL;
+  } else if (decision.distanceDeltaMM > deployedConfig.maximumInterTransmitDistanceMM) {
+    decision.reason = TRANSMIT_DISTANCE_DELTA;
+  } else if (decision.ageOfOldestMeasurementS > deployedConfig.maximumInterTransmitTimeS) {
+    decision.reason = TRANSMIT_BATCH_AGE;
+  }
+  // After failed uploads the measurements pile up in the outbox for a while
+  if (decision.reason != TRANSMIT_NOT_NEEDED && uploadIsBackingOff()) {
+    decision.deferredReason = decision.reason;
+    decision.reason = TRANSMIT_NOT_NEEDED;
+  }
+  return decision;
+}
+
+void logTransmitDecision(const TransmitDecision& decision) {
+  switch (decision.reason) {
+    case TRANSMIT_BATCH_FULL:
+      LOGF("[INF|Main] Transmitting because we have %lu measurements (> %lu)\n", (unsigned long) decision.nbroMeasurements, (unsigned long) deployedConfig.maximumInterTransmitMeasurements);
+      break;
+    case TRANSMIT_DISTANCE_DELTA:
+      LOGF("[INF|Main] Transmitting because distance delta is %lu mm (> %lu)\n", decision.distanceDeltaMM, (unsigned long) deployedConfig.maximumInterTransmitDistanceMM);
+      break;
+    case TRANSMIT_BATCH_AGE:
+      LOGF("[INF|Main] Transmitting because the oldest measurement is %lu seconds old (> %lu)\n", decision.ageOfOldestMeasurementS, (unsigned long) deployedConfig.maximumInterTransmitTimeS);
+      break;
+    case TRANSMIT_NOT_NEEDED:
+      if (decision.deferredReason != TRANSMIT_NOT_NEEDED) {
+        LOGF("[INF|Main] Backing off after failed uploads (reason %d), saving measurement instead\n", decision.deferredReason);
+      } else {
+        LOGLN("[INF|Main] No need to transmit, saving measurement instead");
+      }
+      break;
+  }
+}
+
 void setup() {
   pinMode(LED_BUILTIN, OUTPUT);
   Serial.begin(9600);
   Serial.println("");
-
-  fastBlink(1);
+  beginWakeProfile();
 
   esp_reset_reason_t reset_reason = esp_reset_reason();
   if (reset_reason == ESP_RST_DEEPSLEEP) {
@@ -215,187 +417,277 @@ void setup() {
 
   setupVoltageDividers();
 
-  double usbVoltage = getUsbVoltageAveraged(3);
-  LOGF("[INF|Main] USB voltage: %f\n", usbVoltage);
-  if (usbVoltage > 4.0) {
-    LOGF("[INF|Main] USB power connected, voltage: %f\n", usbVoltage);
+  startWakePhase(WAKE_PHASE_USB_CHECK);
+  uint16_t usbMV = getUsbMVAveraged(3);
+  stopWakePhase(WAKE_PHASE_USB_CHECK);
+  LOGF("[INF|Main] USB voltage: %u mV\n", usbMV);
+  if (usbMV > USB_POWER_MIN_MV) {
+    LOGF("[INF|Main] USB power connected, voltage: %u mV\n", usbMV);
     bool cellularIsOn = false;
     checkIfCellularIsOn(5000, &cellularIsOn);
     if (cellularIsOn) {
       LOGF("[INF|Main] Cellular is on. Powering cellular off...\n");
       powerOffCellular();
     }
+    fastBlink(1);
     LOGF("[INF|Main] Staying awake to charge battery...\n");
     return;
   }
 
+  // LittleFS is only mounted when RTC memory can't stand in for it
+  bool fileSystemMounted = false;
+  if (!deployedConfigIsValid()) {
+    LOGLN("[WRN|Main] Deployed config lost or corrupted, loading it from flash");
+    WakePhaseTimer timer(WAKE_PHASE_FLASH);
+    mountFileSystem(&fileSystemMounted);
+    loadDeployedConfig();
+  }
+
+  // The shots run from interrupts while the battery is measured
+  setupDistanceSensor();
+  // Not set until the first upload after a power loss, the upload backfills
+  // it then
+  time_t measurementTime = clockNowS();
+  startDistanceMeasurement(DISTANCE_SHOTS, deployedConfig.sensorDistanceFromBottomMM);
+
   delay(2);
-  double batteryVoltage = getBatteryVoltageAveraged(5);
-  unsigned char batteryPercentage = batteryVoltageToPercentage(batteryVoltage);
+  startWakePhase(WAKE_PHASE_BATTERY);
+  uint16_t batteryMV = getBatteryMVAveraged(5);
+  stopWakePhase(WAKE_PHASE_BATTERY);
+  unsigned char batteryPercentage = batteryMVToPercentage(batteryMV);
   LOGF(
-    "[INF|Main] Battery voltage: %f, percentage estimate: %d\n",
-    batteryVoltage, batteryPercentage
+    "[INF|Main] Battery voltage: %u mV, percentage estimate: %d\n",
+    batteryMV, batteryPercentage
   );
-  if (batteryVoltage < BATTER_CUTOFF_VOLTAGE) {
+  if (batteryMV < deployedConfig.batteryCutoffMV) {
     LOGF(
-      "[INF|Main] Battery voltage below cutoff (%f < %f), sleeping for 24 hours...\n",
-      batteryVoltage, BATTER_CUTOFF_VOLTAGE
+      "[INF|Main] Battery voltage below cutoff (%u < %lu mV), sleeping for 24 hours...\n",
+      batteryMV, (unsigned long) deployedConfig.batteryCutoffMV
     );
+    if (fileSystemMounted) {
+      LittleFS.end();
+    }
+    fastBlink(1);
+    finishWakeProfile();
     esp_sleep_enable_timer_wakeup((uint64_t) 24 * 60 * 60 * 1000000);
     esp_deep_sleep_start();
   }
 
-  setupDistanceSensor();
-
-  time_t measurementTime = time(nullptr);
-  unsigned long currentDistance = getDistanceMMAveraged(10);
-  LOGF("[INF|Main] Distance: %lu mm, time: %d\n", currentDistance, measurementTime);
-
-  LOGF("[INF|Main] Setting up LittleFS...\n");
-  if (!LittleFS.begin()){
-    LOGF("[ERR|Main] Failed to mount file system. Trying to format...\n");
-    if (!LittleFS.format()) {
-      LOGF("[ERR|Main] Failed to format file system. Rebooting...\n");
-      // TODO: Handle... somehow
-      esp_restart();
+  // Wake cycle: guess from the shots done so far whether this wake uploads.
+  // If so the modem boots while the measurement finishes and flash is read,
+  // a wrong guess costs a power off. The uplink is WiFi rather than the modem
+  // when that is cheaper.
+  bool uplinkStartedEarly = false;
+  if (overlapCellularBoot) {
+    // Without the RTC batch, the guess goes by this measurement alone
+    MeasurementSummary earlyPending = {};
+    if (rtcBatchIsValid()) {
+      earlyPending = rtcBatch.pending;
     }
-  }
-  if (reset_reason == ESP_RST_PANIC) {
-    LOGLN("[INF|Main] Formatting file system out of precaution because of previous panic reset...");
-    if (!LittleFS.format()) {
-      LOGF("[ERR|Main] Failed to format file system. Rebooting...\n");
-      esp_restart();
+    DistanceReading earlyReading = peekDistanceMeasurement();
+    Measurement earlyMeasurement = {
+      .timeS = static_cast<unsigned long>(measurementTime),
+      .distanceMM = earlyReading.distanceMM,
+      .batteryMV = batteryMV
+    };
+    TransmitDecision guess = decideTransmit(earlyPending, earlyMeasurement, earlyReading.confidence);
+    // The other reasons don't depend on the shots still to come
+    if (guess.reason == TRANSMIT_DISTANCE_DELTA && earlyGuessAwaitsShots) {
+      earlyReading = awaitDistanceShots(EARLY_GUESS_MIN_SHOTS);
+      earlyMeasurement.distanceMM = earlyReading.distanceMM;
+      if (earlyReading.confidence * DISTANCE_SHOTS < EARLY_GUESS_MIN_SHOTS * 100) {
+        guess.reason = TRANSMIT_NOT_NEEDED;
+      } else {
+        guess = decideTransmit(earlyPending, earlyMeasurement, earlyReading.confidence);
+      }
+    }
+    if (guess.reason != TRANSMIT_NOT_NEEDED) {
+      LOGF("[INF|Main] Expecting to transmit (reason %d), connecting early\n", guess.reason);
+      beginUplink();
+      uplinkStartedEarly = true;
     }
   }
-  LOGF("[INF|Main] LittleFS setup done\n");
-
-  File savedMeasurementsFile = LittleFS.open(SAVED_MEASUREMENTS_FILE_PATH, "a+", true);
-  if (!savedMeasurementsFile) {
-    LOGF("[ERR|Main] Failed to open saved measurements file. Rebooting...\n");
-    esp_restart();
+  // While the shots go on. With the uplink started early the blink waits
+  // for the decision, and covers the POWERKEY pulse if it was a wrong guess.
+  if (!uplinkStartedEarly) {
+    fastBlink(1);
   }
-  LOGF("[INF|Main] Saved measurements file size: %d\n", savedMeasurementsFile.size());
-  
-  // Not including the current measurement
-  const auto maxCachedMeasurements = MAXIMUM_INTER_TRANSMIT_MEASUREMENTS - 1;
-  auto savedMeasurements = new Measurement[MAXIMUM_INTER_TRANSMIT_MEASUREMENTS];
-  
-  savedMeasurements[0] = {
+
+  DistanceReading distanceReading = finishDistanceMeasurement();
+  unsigned long currentDistance = distanceReading.distanceMM;
+  LOGF(
+    "[INF|Main] Distance: %lu mm (confidence %d%%), time: %lu\n",
+    currentDistance, distanceReading.confidence, (unsigned long) measurementTime
+  );
+
+  Measurement currentMeasurement = {
     .timeS = static_cast<unsigned long>(measurementTime),
     .distanceMM = currentDistance,
-    .batteryVoltage = batteryVoltage
+    .batteryMV = batteryMV
   };
-  auto smallestDistance = currentDistance;
-  auto largestDistance = currentDistance;
-  auto nbroSavedMessages = readSavedMeasurements(
-    &savedMeasurementsFile,
-    &savedMeasurements[1],
-    MAXIMUM_INTER_TRANSMIT_MEASUREMENTS,
-    &smallestDistance,
-    &largestDistance
-  );
 
-  LOGF("[INF|Main] Read %d saved measurements from file\n", nbroSavedMessages);
-
-  auto nbroMessagesToTransit = nbroSavedMessages + 1;
+  MeasurementLog measurementLog;
+  bool measurementLogOpen = false;
+  if (!rtcBatchIsValid()) {
+    LOGLN("[WRN|Main] RTC batch lost or corrupted, rebuilding it from flash");
+    openMeasurementLog(&measurementLog, &fileSystemMounted);
+    measurementLogOpen = true;
+    resetRtcBatch(measurementLog.pendingSummary());
+  }
 
-  unsigned long timeOfOldestMeasurement = savedMeasurements[0].timeS;
-  unsigned long distanceDelta = _max(
-    _abs(currentDistance - smallestDistance),
-    _abs(currentDistance - largestDistance)
+  LOGF(
+    "[INF|Main] %d saved measurements, %d of them in flash, mean distance %lu mm\n",
+    rtcBatch.pending.count, nbroPendingInLog(), meanDistanceMM(rtcBatch.pending)
   );
 
   LOGF("[INF|Main] Checking if we should transmit...\n");
-  bool shouldTransmit = false;
-  if (nbroMessagesToTransit >= MAXIMUM_INTER_TRANSMIT_MEASUREMENTS) {
-    LOGF("[INF|Main] Transmitting because we have %d measurements (> %d)\n", nbroMessagesToTransit, MAXIMUM_INTER_TRANSMIT_MEASUREMENTS);
-    shouldTransmit = true;
-  } else if (
-    distanceDelta > MAXIMUM_INTER_TRANSMIT_DISTANCE_MM
-  ) {
-    LOGF("[INF|Main] Transmitting because distance delta is %d mm (> %d)\n", distanceDelta, MAXIMUM_INTER_TRANSMIT_DISTANCE_MM);
-    shouldTransmit = true;
-  } else if (!timeIsSet()) {
-    LOGF("[INF|Main] Transmitting because time is not set\n");
-    shouldTransmit = true;
-  } else if (millis() > MAXIMUM_INTER_TRANSMIT_TIME_S * 1000) {
-    LOGF("[INF|Main] Transmitting because we have been awake for %d seconds (> %d)\n", millis() / 1000, MAXIMUM_INTER_TRANSMIT_TIME_S);
-    shouldTransmit = true;
-  } else {
-    LOGLN("[INF|Main] No need to transmit, saving measurement to flash instead");
+  TransmitDecision decision = decideTransmit(rtcBatch.pending, currentMeasurement, distanceReading.confidence);
+  logTransmitDecision(decision);
+  bool shouldTransmit = decision.reason != TRANSMIT_NOT_NEEDED;
+  if (uplinkStartedEarly && !shouldTransmit) {
+    LOGLN("[INF|Main] Expected to transmit after all, disconnecting");
+    cancelUplink();
+  }
+  if (uplinkStartedEarly) {
+    fastBlink(1);
   }
 
   if (shouldTransmit) {
     Serial.println("Transmitting...");
-    transmitMeasurements(savedMeasurements, nbroMessagesToTransit);
-
-    LOGF("[INF|Main] Clearing saved measurements file...\n");
-    savedMeasurementsFile.close();
-    LittleFS.remove(SAVED_MEASUREMENTS_FILE_PATH);
+    bool logHasPending = nbroPendingInLog() > 0;
+    if (logHasPending && !measurementLogOpen) {
+      openMeasurementLog(&measurementLog, &fileSystemMounted);
+      measurementLogOpen = true;
+    }
+    MeasurementBatch batch = {
+      &currentMeasurement,
+      logHasPending ? &measurementLog : nullptr,
+      rtcBatch.measurements,
+      rtcBatch.nbroMeasurements
+    };
+    bool configChanged = false;
+    if (transmitMeasurements(&batch, &configChanged) == RET_OK) {
+      // Acknowledged, only now may the measurements go. The wake profile
+      // went along with them.
+      acknowledgeUpload();
+      clearWakeProfile();
+      if (logHasPending) {
+        WakePhaseTimer timer(WAKE_PHASE_FLASH);
+        LOGF("[INF|Main] Marking saved measurements as uploaded...\n");
+        measurementLog.markUploaded();
+      }
+      resetRtcBatch({});
+    } else {
+      // Kept for the retry, in flash in case the power goes before then
+      failUpload();
+      WakePhaseTimer timer(WAKE_PHASE_FLASH);
+      if (!measurementLogOpen) {
+        openMeasurementLog(&measurementLog, &fileSystemMounted);
+        measurementLogOpen = true;
+      }
+      if (rtcBatchIsFull()) {
+        moveRtcBatchToLog(&measurementLog);
+      }
+      appendToRtcBatch(currentMeasurement);
+      moveRtcBatchToLog(&measurementLog);
+    }
+    if (configChanged) {
+      WakePhaseTimer timer(WAKE_PHASE_FLASH);
+      mountFileSystem(&fileSystemMounted);
+      saveDeployedConfig();
+    }
 
-    LOGLN("[INF|Main] Powering off cellular...");
-    powerOffCellular();
+    releaseUplink();
 
+    startWakePhase(WAKE_PHASE_BLINK);
     for (int i = 0; i < 3; i++) {
       fastBlink(5);
       delay(1000);
     }
+    stopWakePhase(WAKE_PHASE_BLINK);
   } else {
     Serial.println("Not transmitting");
     LOGF("[INF|Main] Not transmitting\n");
-    LOGF("[INF|Main] Saving measurement to file (%d MM, %d S)...\n", currentDistance, measurementTime);
-    savedMeasurementsFile.close();
-    savedMeasurementsFile = LittleFS.open(SAVED_MEASUREMENTS_FILE_PATH, "a", true);
-    savedMeasurementsFile.write((const uint8_t*) &savedMeasurements[0], sizeof(Measurement));
-    savedMeasurementsFile.flush();
-    savedMeasurementsFile.close();
+    if (rtcBatchIsFull()) {
+      WakePhaseTimer timer(WAKE_PHASE_FLASH);
+      if (!measurementLogOpen) {
+        openMeasurementLog(&measurementLog, &fileSystemMounted);
+        measurementLogOpen = true;
+      }
+      moveRtcBatchToLog(&measurementLog);
+    }
+    LOGF("[INF|Main] Saving measurement to RTC memory (%lu MM, %lu S)...\n", currentDistance, (unsigned long) measurementTime);
+    appendToRtcBatch(currentMeasurement);
+    passUploadBackoffWake();
+  }
+  if (measurementLogOpen) {
+    WakePhaseTimer timer(WAKE_PHASE_FLASH);
+    measurementLog.close();
+  }
+  if (fileSystemMounted) {
+    WakePhaseTimer timer(WAKE_PHASE_FLASH);
+    LittleFS.end();
   }
-  LittleFS.end();
 
-  while (true) {
+  if (cellularIsPoweringOff()) {
+    powerOffCellular();
+  }
+  // Nothing to check if powerOffCellular() or an earlier wake already
+  // confirmed it, or if it was parked on purpose
+  while (!cellularIsConfirmedOff() && !cellularIsParked()) {
     bool cellularIsOn = false;
-    uint32_t cellularOnCheckTimeout = shouldTransmit ? 10000 : 2000;
-    checkIfCellularIsOn(cellularOnCheckTimeout, &cellularIsOn);
+    checkIfCellularIsOn(2000, &cellularIsOn);
     if (cellularIsOn) {
       LOGF("[ERR|Main] Cellular is still on. Trying again to turn off...\n");
       powerOffCellular();
-      delay(2000);
-    } else {
-      LOGLN("[INF|Main] Confirmed cellular is off.");
-      break;
     }
   }
-
-  unsigned long sleepTimeS = 60 * 60;
-  // unsigned long sleepTimeS = 10;
-  LOGF("[INF|Main] Getting sleepy... Dozing off for %d seconds...\n", sleepTimeS);
-  esp_sleep_enable_timer_wakeup((uint64_t) sleepTimeS * 1000000);
+  LOGLN(cellularIsParked() ? "[INF|Main] Cellular is parked." : "[INF|Main] Confirmed cellular is off.");
+
+  unsigned long sleepTimeS = nextMeasurementIntervalS(
+    &intervalScheduler,
+    makeIntervalSchedulerConfig(
+      deployedConfig.measurementIntervalS, deployedConfig.maximumMeasurementIntervalS
+    ),
+    currentMeasurement,
+    distanceReading.confidence,
+    millis()
+  );
+  finishWakeProfile();
+  if (DEBUG) {
+    printWakeProfile(&Serial);
+  }
+  LOGF("[INF|Main] Getting sleepy... Dozing off for %lu seconds...\n", sleepTimeS);
+  esp_sleep_enable_timer_wakeup(clockSleepUs(sleepTimeS));
   esp_deep_sleep_start();
 }
 
+LineReader consoleReader(&Serial);
+
 void loop() {
-  if (Serial.available()) {
-    String line;
-    readLine(&Serial, &line);
-    if (line == ">sms") {
+  if (consoleReader.available()) {
+    LineView line;
+    if (readLine(&consoleReader, &line) != RET_OK) {
+      return;
+    }
+    if (line.equals(">sms")) {
       // sendSMS();
-    } else if (line == ">http") {
-      // httpGetDemo();
-    } else if (line == ">off") {
+    } else if (line.equals(">off")) {
       Serial.println("Powering off modem...");
       powerOffCellular();
-    } else if (line == ">on") {
+    } else if (line.equals(">on")) {
       Serial.println("Powering on modem...");
       powerOnCellular();
-    } else if (line == ">0") {
+    } else if (line.equals(">0")) {
       Serial.println("Setting POWERKEY to LOW");
       digitalWrite(PIN_CELLULAR_PWR, LOW);
-    } else if (line == ">1") {
+    } else if (line.equals(">1")) {
       Serial.println("Setting POWERKEY to HIGH");
       digitalWrite(PIN_CELLULAR_PWR, HIGH);
     }
 
-    Serial1.println(line);
+    Serial1.write((const uint8_t*) line.data, line.length);
+    Serial1.println();
   }
 
   if (Serial1.available()) {
@@ -0,0 +1,172 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <batch_codec.h>
+#include "common_macros.h"
+#include "measurement_log.h"
+
+
+#define RECORD_KIND_MEASUREMENT 1
+#define RECORD_KIND_UPLOADED 2
+
+// Record layout, little endian
+#define RECORD_SEQUENCE_OFFSET 0
+#define RECORD_KIND_OFFSET 4
+#define RECORD_TIME_OFFSET 8
+#define RECORD_DISTANCE_OFFSET 12
+#define RECORD_BATTERY_MV_OFFSET 16
+#define RECORD_CRC_OFFSET 28
+
+static void putUint32(uint8_t* bytes, uint32_t value) {
+  for (size_t i = 0; i < 4; i++) {
+    bytes[i] = value >> (8 * i);
+  }
+}
+
+static uint32_t getUint32(const uint8_t* bytes) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < 4; i++) {
+    value |= (uint32_t) bytes[i] << (8 * i);
+  }
+  return value;
+}
+
+MeasurementLog::MeasurementLog(const char* path, size_t capacity)
+  : path(path), capacity(capacity) {}
+
+unsigned char MeasurementLog::preallocate() {
+  LOGF("[INF|Log] Preallocating %lu records in %s\n", (unsigned long) capacity, path);
+  file = LittleFS.open(path, "w+", true);
+  if (!file) return RET_ERROR;
+  // All zeros never passes the CRC, so every slot starts out empty
+  uint8_t empty[MEASUREMENT_LOG_RECORD_BYTES] = {};
+  for (size_t slot = 0; slot < capacity; slot++) {
+    if (file.write(empty, sizeof(empty)) != sizeof(empty)) return RET_ERROR;
+  }
+  file.flush();
+  return RET_OK;
+}
+
+unsigned char MeasurementLog::open() {
+  nextSequence = 1;
+  pendingSequence = 1;
+  summary = {};
+  file = LittleFS.open(path, "r+");
+  if (!file || file.size() != capacity * MEASUREMENT_LOG_RECORD_BYTES) {
+    // First use, a different capacity or a power loss while preallocating
+    file.close();
+    return preallocate();
+  }
+
+  uint32_t newestSequence = 0;
+  uint32_t newestUploadSequence = 0;
+  Record record;
+  for (size_t slot = 0; slot < capacity; slot++) {
+    if (!readRecord(slot, &record)) continue;
+    newestSequence = max(newestSequence, record.sequence);
+    if (record.kind == RECORD_KIND_UPLOADED) {
+      newestUploadSequence = max(newestUploadSequence, record.sequence);
+    }
+  }
+  nextSequence = newestSequence + 1;
+  pendingSequence = newestUploadSequence + 1;
+  rebuildSummary();
+  LOGF(
+    "[INF|Log] Next sequence %lu, pending from %lu\n",
+    (unsigned long) nextSequence, (unsigned long) pendingSequence
+  );
+  return RET_OK;
+}
+
+void MeasurementLog::rebuildSummary() {
+  summary = {};
+  uint32_t sequence = firstPendingSequence();
+  Measurement measurement;
+  while (nextPending(&sequence, &measurement)) {
+    addToSummary(&summary, measurement);
+  }
+}
+
+void MeasurementLog::close() {
+  file.close();
+}
+
+bool MeasurementLog::readRecord(size_t slot, Record* record) {
+  uint8_t bytes[MEASUREMENT_LOG_RECORD_BYTES];
+  if (!file.seek(slot * MEASUREMENT_LOG_RECORD_BYTES)) return false;
+  if (file.readBytes((char*) bytes, sizeof(bytes)) != sizeof(bytes)) return false;
+  if (batchCrc32(0, bytes, RECORD_CRC_OFFSET) != getUint32(bytes + RECORD_CRC_OFFSET)) {
+    return false;
+  }
+  record->sequence = getUint32(bytes + RECORD_SEQUENCE_OFFSET);
+  record->kind = bytes[RECORD_KIND_OFFSET];
+  record->measurement.timeS = getUint32(bytes + RECORD_TIME_OFFSET);
+  record->measurement.distanceMM = getUint32(bytes + RECORD_DISTANCE_OFFSET);
+  record->measurement.batteryMV = bytes[RECORD_BATTERY_MV_OFFSET] | bytes[RECORD_BATTERY_MV_OFFSET + 1] << 8;
+  // A record left in the wrong slot is from a log of another capacity
+  return record->sequence != 0 && record->sequence % capacity == slot;
+}
+
+unsigned char MeasurementLog::writeRecord(const Record& record) {
+  uint8_t bytes[MEASUREMENT_LOG_RECORD_BYTES] = {};
+  putUint32(bytes + RECORD_SEQUENCE_OFFSET, record.sequence);
+  bytes[RECORD_KIND_OFFSET] = record.kind;
+  putUint32(bytes + RECORD_TIME_OFFSET, record.measurement.timeS);
+  putUint32(bytes + RECORD_DISTANCE_OFFSET, record.measurement.distanceMM);
+  bytes[RECORD_BATTERY_MV_OFFSET] = record.measurement.batteryMV;
+  bytes[RECORD_BATTERY_MV_OFFSET + 1] = record.measurement.batteryMV >> 8;
+  putUint32(bytes + RECORD_CRC_OFFSET, batchCrc32(0, bytes, RECORD_CRC_OFFSET));
+
+  if (!file.seek((record.sequence % capacity) * MEASUREMENT_LOG_RECORD_BYTES)) return RET_ERROR;
+  if (file.write(bytes, sizeof(bytes)) != sizeof(bytes)) return RET_ERROR;
+  file.flush();
+  nextSequence = record.sequence + 1;
+  return RET_OK;
+}
+
+unsigned char MeasurementLog::append(const Measurement& measurement) {
+  unsigned char ret;
+  // Once the ring is full of pending records the oldest one is overwritten
+  bool evictsPending = nextSequence >= pendingSequence + capacity;
+  OK_OR_RETURN(writeRecord({ nextSequence, RECORD_KIND_MEASUREMENT, measurement }));
+  if (evictsPending) {
+    // Its distance may have been a bound, which can't be taken back
+    rebuildSummary();
+  } else {
+    addToSummary(&summary, measurement);
+  }
+  return RET_OK;
+}
+
+unsigned char MeasurementLog::markUploaded() {
+  unsigned char ret;
+  OK_OR_RETURN(writeRecord({ nextSequence, RECORD_KIND_UPLOADED, { 0, 0, 0 } }));
+  pendingSequence = nextSequence;
+  summary = {};
+  return RET_OK;
+}
+
+const MeasurementSummary& MeasurementLog::pendingSummary() const {
+  return summary;
+}
+
+uint32_t MeasurementLog::firstPendingSequence() const {
+  // Anything older has been overwritten
+  uint32_t oldestInRing = nextSequence > capacity ? nextSequence - capacity : 1;
+  return max(pendingSequence, oldestInRing);
+}
+
+bool MeasurementLog::nextPending(uint32_t* sequence, Measurement* measurement) {
+  Record record;
+  for (; *sequence < nextSequence; (*sequence)++) {
+    if (
+      readRecord(*sequence % capacity, &record)
+      && record.sequence == *sequence
+      && record.kind == RECORD_KIND_MEASUREMENT
+    ) {
+      *measurement = record.measurement;
+      (*sequence)++;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,206 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <batch_codec.h>
+#include "common_macros.h"
+#include "measurements.h"
+#include "measurement_log.h"
+#include "clock_sync.h"
+
+
+// Measurement as it was before the battery voltage went to millivolts
+struct LegacyMeasurement {
+  unsigned long timeS;
+  unsigned long distanceMM;
+  double batteryVoltage;
+};
+
+bool readMeasurementFromFile(File* file, Measurement* measurement) {  
+  LegacyMeasurement legacy;
+  u_int size = sizeof(LegacyMeasurement);
+  if (file->readBytes((char*) &legacy, size) != size) {
+    // The end of the file or a torn record, `legacy` isn't all read
+    return false;
+  }
+  *measurement = { legacy.timeS, legacy.distanceMM, voltsToMV(legacy.batteryVoltage) };
+  return true;
+}
+
+uint16_t voltsToMV(double volts) {
+  return (uint16_t) (volts * 1000 + 0.5);
+}
+
+uint32_t measurementHash(const Measurement& measurement) {
+  // Little endian like the log, independent of padding
+  uint8_t bytes[4 + 4 + 2];
+  for (size_t i = 0; i < 4; i++) {
+    bytes[i] = (uint32_t) measurement.timeS >> (8 * i);
+    bytes[4 + i] = (uint32_t) measurement.distanceMM >> (8 * i);
+  }
+  bytes[8] = measurement.batteryMV;
+  bytes[9] = measurement.batteryMV >> 8;
+  return batchCrc32(0, bytes, sizeof(bytes));
+}
+
+/// Summary
+
+void addToSummary(MeasurementSummary* summary, const Measurement& measurement) {
+  unsigned long distance = measurement.distanceMM;
+  if (summary->count == 0) {
+    summary->smallestDistanceMM = distance;
+    summary->largestDistanceMM = distance;
+    summary->firstTimeS = measurement.timeS;
+  }
+  // A missed echo reads 0, which is no bound on the level. Until an echo
+  // comes back both bounds stay 0.
+  if (distance != 0) {
+    summary->smallestDistanceMM = summary->smallestDistanceMM == 0
+      ? distance
+      : min(summary->smallestDistanceMM, distance);
+    summary->largestDistanceMM = max(summary->largestDistanceMM, distance);
+  }
+  summary->lastTimeS = measurement.timeS;
+  summary->distanceSumMM += distance;
+  summary->count++;
+}
+
+unsigned long meanDistanceMM(const MeasurementSummary& summary) {
+  if (summary.count == 0) return 0;
+  return (summary.distanceSumMM + summary.count / 2) / summary.count;
+}
+
+/// Batch
+
+size_t countMeasurements(const MeasurementBatch& batch) {
+  size_t nbroInLog = batch.log != nullptr ? batch.log->pendingSummary().count : 0;
+  return 1 + nbroInLog + batch.nbroBuffered;
+}
+
+// Walks the chunk of a batch: the current measurement, the log's, then the
+// buffered ones
+struct BatchCursor {
+  const MeasurementBatch* batch;
+  // Of the next measurement in the whole batch
+  size_t index;
+  uint32_t sequence;
+  size_t bufferedIndex;
+};
+
+static BatchCursor beginBatch(const MeasurementBatch& batch) {
+  uint32_t sequence = batch.log != nullptr ? batch.log->firstPendingSequence() : 0;
+  return { &batch, 0, sequence, 0 };
+}
+
+static bool nextInBatch(BatchCursor* cursor, Measurement* measurement) {
+  const MeasurementBatch* batch = cursor->batch;
+  bool found = false;
+  if (cursor->index == 0) {
+    *measurement = *batch->current;
+    found = true;
+  }
+  if (!found && batch->log != nullptr) {
+    found = batch->log->nextPending(&cursor->sequence, measurement);
+  }
+  if (!found && cursor->bufferedIndex < batch->nbroBuffered) {
+    *measurement = batch->buffered[cursor->bufferedIndex++];
+    found = true;
+  }
+  if (found) {
+    cursor->index++;
+  }
+  return found;
+}
+
+static bool nextInChunk(BatchCursor* cursor, Measurement* measurement) {
+  const MeasurementBatch* batch = cursor->batch;
+  if (batch->count != 0 && cursor->index >= batch->first + batch->count) {
+    return false;
+  }
+  // The log can only be read in order, the chunks before are skipped over
+  while (nextInBatch(cursor, measurement)) {
+    if (cursor->index > batch->first) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// JSON
+
+// Thousandths as a decimal, the digits ArduinoJson 6 printed for the double
+// they stood for: no trailing zeros, no point for whole numbers
+static size_t printJsonThousandths(Print* out, uint32_t thousandths) {
+  size_t written = out->print((unsigned long) (thousandths / 1000));
+  uint32_t fraction = thousandths % 1000;
+  if (fraction == 0) {
+    return written;
+  }
+  char decimals[4] = {
+    (char) ('0' + fraction / 100), (char) ('0' + fraction / 10 % 10), (char) ('0' + fraction % 10), '\0'
+  };
+  for (size_t end = 3; decimals[end - 1] == '0'; end--) {
+    decimals[end - 1] = '\0';
+  }
+  written += out->print('.');
+  written += out->print(decimals);
+  return written;
+}
+
+// Takes the measurement as stored and hashes that. Timestamps from before
+// the first sync since power on go out in real time.
+static size_t printMeasurementJson(Print* out, const Measurement& measurement) {
+  size_t written = 0;
+  written += out->print("{\"timeS\":");
+  written += out->print(backfilledTimeS(measurement.timeS));
+  written += out->print(",\"distanceMM\":");
+  written += out->print(measurement.distanceMM);
+  written += out->print(",\"batteryVoltage\":");
+  written += printJsonThousandths(out, measurement.batteryMV);
+  written += out->print(",\"hash\":");
+  written += out->print((unsigned long) measurementHash(measurement));
+  written += out->print('}');
+  return written;
+}
+
+size_t writeMeasurementsJson(Print* out, const MeasurementBatch& batch) {
+  size_t written = out->print('[');
+  BatchCursor cursor = beginBatch(batch);
+  Measurement measurement;
+  for (bool isFirst = true; nextInChunk(&cursor, &measurement); isFirst = false) {
+    if (!isFirst) {
+      written += out->print(',');
+    }
+    written += printMeasurementJson(out, measurement);
+  }
+  written += out->print(']');
+  return written;
+}
+
+/// Binary batch
+
+static void writeToPrint(const uint8_t* bytes, size_t length, void* context) {
+  ((Print*) context)->write(bytes, length);
+}
+
+static BatchRecord toBatchRecord(const Measurement& measurement) {
+  return {
+    .timeS = (uint32_t) backfilledTimeS(measurement.timeS),
+    .distanceMM = (uint32_t) measurement.distanceMM,
+    .batteryMV = measurement.batteryMV
+  };
+}
+
+size_t writeMeasurementsBatch(Print* out, const MeasurementBatch& batch) {
+  BatchEncoder encoder(writeToPrint, out);
+  BatchCursor cursor = beginBatch(batch);
+  Measurement measurement;
+  // Each chunk is a batch of its own, based on its first measurement
+  if (!nextInChunk(&cursor, &measurement)) {
+    encoder.begin(backfilledTimeS(batch.current->timeS));
+    return encoder.finish();
+  }
+  encoder.begin(backfilledTimeS(measurement.timeS));
+  do {
+    encoder.add(toBatchRecord(measurement));
+  } while (nextInChunk(&cursor, &measurement));
+  return encoder.finish();
+}
@@ -0,0 +1,156 @@
+#include <Arduino.h>
+#include "common_macros.h"
+#include "stream_extensions.h"
+#include "modem_channel.h"
+
+
+static bool isFinalErrorLine(const LineView& line) {
+  return line.equals("ERROR") || line.startsWith("+CME ERROR");
+}
+
+static unsigned long remainingMs(unsigned long startMillis, unsigned long timeout) {
+  unsigned long elapsed = millis() - startMillis;
+  return elapsed < timeout ? timeout - elapsed : 0;
+}
+
+ModemChannel::ModemChannel(LineReader* reader) : lineReader(reader) {}
+
+Stream* ModemChannel::stream() const {
+  return lineReader->stream();
+}
+
+LineReader* ModemChannel::reader() const {
+  return lineReader;
+}
+
+bool ModemChannel::onUrc(const char* prefix, UrcHandler handler) {
+  for (size_t i = 0; i < routeCount; i++) {
+    if (strcmp(routes[i].prefix, prefix) == 0) {
+      routes[i].handler = handler;
+      return true;
+    }
+  }
+  if (routeCount == MODEM_URC_HANDLERS_CAPACITY) {
+    LOGF("[ERR|Cellular/Channel] No room for URC handler \"%s\"\n", prefix);
+    return false;
+  }
+  routes[routeCount++] = { prefix, handler };
+  return true;
+}
+
+bool ModemChannel::dispatchUrc(const LineView& line) {
+  for (size_t i = 0; i < routeCount; i++) {
+    if (line.startsWith(routes[i].prefix)) {
+      LOGF("[INF|Cellular/Channel] URC \"%.*s\"\n", (int) line.length, line.data);
+      routes[i].handler(line);
+      return true;
+    }
+  }
+  return false;
+}
+
+unsigned char ModemChannel::sendCommand(
+  const String& command,
+  unsigned long timeout,
+  const char* infoPrefix,
+  char* info,
+  size_t infoCapacity
+) {
+  stream()->println(command);
+  return readResult(timeout, infoPrefix, info, infoCapacity);
+}
+
+unsigned char ModemChannel::readResult(
+  unsigned long timeout,
+  const char* infoPrefix,
+  char* info,
+  size_t infoCapacity
+) {
+  unsigned long startMillis = millis();
+  bool infoCaptured = false;
+  LineView line;
+  while (true) {
+    unsigned char ret = lineReader->readLine(&line, remainingMs(startMillis, timeout));
+    if (ret == RET_TIMEOUT) {
+      LOGLN("[ERR|Cellular/Channel] Error receiving AT status.");
+      return ERROR_RECEIVING_AT_STATUS;
+    }
+    if (ret != RET_OK || line.isEmpty()) continue;
+    if (line.equals("OK")) {
+      return AT_OK_STATUS;
+    }
+    if (isFinalErrorLine(line)) {
+      LOGF("[ERR|Cellular/Channel] Status \"%.*s\"\n", (int) line.length, line.data);
+      return AT_ERROR_STATUS;
+    }
+    // Checked before the URC routes, +CREG: is both a reply and a URC
+    if (infoPrefix != nullptr && !infoCaptured && line.startsWith(infoPrefix)) {
+      // The next read reuses the line's buffer
+      size_t length = min(line.length, infoCapacity - 1);
+      memcpy(info, line.data, length);
+      info[length] = '\0';
+      infoCaptured = true;
+      continue;
+    }
+    if (!dispatchUrc(line)) {
+      LOGF("[INF|Cellular/Channel] Ignoring \"%.*s\"\n", (int) line.length, line.data);
+    }
+  }
+}
+
+unsigned char ModemChannel::waitForLine(
+  const char* prefix,
+  LineView* line,
+  unsigned long timeout
+) {
+  unsigned long startMillis = millis();
+  while (true) {
+    unsigned char ret = lineReader->readLine(line, remainingMs(startMillis, timeout));
+    if (ret == RET_TIMEOUT) {
+      LOGF("[ERR|Cellular/Channel] Timeout waiting for \"%s\"\n", prefix);
+      return RET_TIMEOUT;
+    }
+    if (ret != RET_OK || line->isEmpty()) continue;
+    if (line->startsWith(prefix)) {
+      // Keep handler state in sync when waiting on a URC directly
+      dispatchUrc(*line);
+      return RET_OK;
+    }
+    if (isFinalErrorLine(*line)) {
+      LOGF("[ERR|Cellular/Channel] Status \"%.*s\" waiting for \"%s\"\n", (int) line->length, line->data, prefix);
+      return RET_ERROR;
+    }
+    if (!dispatchUrc(*line)) {
+      LOGF("[INF|Cellular/Channel] Ignoring \"%.*s\"\n", (int) line->length, line->data);
+    }
+  }
+}
+
+unsigned char ModemChannel::waitUntil(bool (*condition)(), unsigned long timeout) {
+  unsigned long startMillis = millis();
+  LineView line;
+  while (!condition()) {
+    unsigned long remaining = remainingMs(startMillis, timeout);
+    if (remaining == 0) {
+      return RET_TIMEOUT;
+    }
+    if (lineReader->readLine(&line, remaining) != RET_OK || line.isEmpty()) continue;
+    if (!dispatchUrc(line)) {
+      LOGF("[INF|Cellular/Channel] Ignoring \"%.*s\"\n", (int) line.length, line.data);
+    }
+  }
+  return RET_OK;
+}
+
+void ModemChannel::poll() {
+  LineView line;
+  while (lineReader->available() > 0) {
+    if (lineReader->readLine(&line, 0) != RET_OK) {
+      // Only part of a line has arrived, the rest is picked up by the next read
+      return;
+    }
+    if (!line.isEmpty() && !dispatchUrc(line)) {
+      LOGF("[INF|Cellular/Channel] Ignoring \"%.*s\"\n", (int) line.length, line.data);
+    }
+  }
+}
@@ -0,0 +1,43 @@
+#include <Arduino.h>
+#include "common_macros.h"
+#include "rtc_batch.h"
+#include "rtc_sealed.h"
+
+
+RTC_DATA_ATTR RtcBatch rtcBatch;
+
+bool rtcBatchIsValid() {
+  return rtcIsValid(rtcBatch, RTC_BATCH_MAGIC, RTC_BATCH_VERSION)
+    && rtcBatch.nbroMeasurements <= RTC_BATCH_CAPACITY
+    && rtcBatch.nbroMeasurements <= rtcBatch.pending.count;
+}
+
+void resetRtcBatch(const MeasurementSummary& pending) {
+  resetRtc(&rtcBatch, RTC_BATCH_MAGIC, RTC_BATCH_VERSION);
+  rtcBatch.pending = pending;
+  sealRtc(&rtcBatch);
+}
+
+bool rtcBatchIsFull() {
+  return rtcBatch.nbroMeasurements == RTC_BATCH_CAPACITY;
+}
+
+void appendToRtcBatch(const Measurement& measurement) {
+  rtcBatch.measurements[rtcBatch.nbroMeasurements++] = measurement;
+  addToSummary(&rtcBatch.pending, measurement);
+  sealRtc(&rtcBatch);
+}
+
+uint32_t nbroPendingInLog() {
+  return rtcBatch.pending.count - rtcBatch.nbroMeasurements;
+}
+
+void moveRtcBatchToLog(MeasurementLog* measurementLog) {
+  LOGF("[INF|RtcBatch] Moving %d measurements to the log\n", rtcBatch.nbroMeasurements);
+  for (uint16_t i = 0; i < rtcBatch.nbroMeasurements; i++) {
+    measurementLog->append(rtcBatch.measurements[i]);
+  }
+  // Not the RTC copy of the summary, appends that overwrite pending records
+  // leave it counting them and keeping their bounds
+  resetRtcBatch(measurementLog->pendingSummary());
+}
@@ -0,0 +1,68 @@
+#include <Arduino.h>
+#include "sensor_units.h"
+
+
+#define BATTERY_TABLE_STEP_MV 10
+#define BATTERY_TABLE_MIN_MV 3350
+#define BATTERY_TABLE_MAX_MV 4170
+#define BATTERY_TABLE_SIZE ((BATTERY_TABLE_MAX_MV - BATTERY_TABLE_MIN_MV) / BATTERY_TABLE_STEP_MV + 1)
+
+struct BatteryCurvePoint {
+  uint16_t mV;
+  uint8_t percentage;
+};
+
+// Resting voltage by charge, full to empty. Below the last point the cell
+// counts as empty.
+static constexpr BatteryCurvePoint BATTERY_CURVE[] = {
+  { 4170, 100 }, { 4150, 95 }, { 4100, 89 }, { 4050, 83 }, { 4000, 75 }, { 3930, 65 },
+  { 3850, 50 }, { 3840, 46 }, { 3830, 42 }, { 3810, 40 }, { 3800, 36 }, { 3790, 30 },
+  { 3750, 25 }, { 3700, 11 }, { 3650, 5 }, { 3350, 2 }
+};
+static_assert(
+  BATTERY_CURVE[0].mV == BATTERY_TABLE_MAX_MV
+    && BATTERY_CURVE[sizeof(BATTERY_CURVE) / sizeof(BATTERY_CURVE[0]) - 1].mV == BATTERY_TABLE_MIN_MV,
+  "The table has to span the curve"
+);
+
+struct BatteryPercentageTable {
+  uint8_t percentages[BATTERY_TABLE_SIZE];
+};
+
+// Linear between the two points around `mV`, rounded
+static constexpr uint8_t interpolateBatteryCurve(uint16_t mV) {
+  for (size_t i = 1; i < sizeof(BATTERY_CURVE) / sizeof(BATTERY_CURVE[0]); i++) {
+    const BatteryCurvePoint& upper = BATTERY_CURVE[i - 1];
+    const BatteryCurvePoint& lower = BATTERY_CURVE[i];
+    if (mV >= lower.mV) {
+      uint32_t spanMV = upper.mV - lower.mV;
+      uint32_t rise = upper.percentage - lower.percentage;
+      return lower.percentage + (rise * (mV - lower.mV) + spanMV / 2) / spanMV;
+    }
+  }
+  return 0;
+}
+
+static constexpr BatteryPercentageTable buildBatteryPercentageTable() {
+  BatteryPercentageTable table = {};
+  for (size_t i = 0; i < BATTERY_TABLE_SIZE; i++) {
+    table.percentages[i] = interpolateBatteryCurve(BATTERY_TABLE_MIN_MV + i * BATTERY_TABLE_STEP_MV);
+  }
+  return table;
+}
+
+// Built by the compiler, 83 bytes of flash
+static constexpr BatteryPercentageTable BATTERY_PERCENTAGES = buildBatteryPercentageTable();
+static_assert(
+  BATTERY_PERCENTAGES.percentages[(3850 - BATTERY_TABLE_MIN_MV) / BATTERY_TABLE_STEP_MV] == 50
+    && BATTERY_PERCENTAGES.percentages[(3720 - BATTERY_TABLE_MIN_MV) / BATTERY_TABLE_STEP_MV] == 17,
+  "The table has to go through the curve's points and between them"
+);
+
+uint8_t batteryMVToPercentage(uint16_t batteryMV) {
+  if (batteryMV < BATTERY_TABLE_MIN_MV - BATTERY_TABLE_STEP_MV / 2) {
+    return 0;
+  }
+  uint16_t mV = _min(batteryMV, (uint16_t) BATTERY_TABLE_MAX_MV);
+  return BATTERY_PERCENTAGES.percentages[(mV - BATTERY_TABLE_MIN_MV + BATTERY_TABLE_STEP_MV / 2) / BATTERY_TABLE_STEP_MV];
+}
@@ -1,84 +1,219 @@
 #include <Arduino.h>
+#include <algorithm>
 #include "common_macros.h"
+#include "stream_extensions.h"
 
-// Private method copied from Stream.cpp
-unsigned char timedRead(
-  Stream* stream,
-  char* c,
-  unsigned long timeout = DEFAULT_TIMEOUT
+/// LineView
+
+bool LineView::isEmpty() const {
+  return length == 0;
+}
+
+bool LineView::equals(const char* other) const {
+  return strlen(other) == length && memcmp(data, other, length) == 0;
+}
+
+bool LineView::startsWith(const char* prefix) const {
+  size_t prefixLength = strlen(prefix);
+  return prefixLength <= length && memcmp(data, prefix, prefixLength) == 0;
+}
+
+int LineView::indexOf(char c, size_t from) const {
+  for (size_t i = from; i < length; i++) {
+    if (data[i] == c) return i;
+  }
+  return -1;
+}
+
+int LineView::indexOf(const char* needle, size_t from) const {
+  size_t needleLength = strlen(needle);
+  for (size_t i = from; i + needleLength <= length; i++) {
+    if (memcmp(data + i, needle, needleLength) == 0) return i;
+  }
+  return -1;
+}
+
+bool LineView::contains(const char* needle) const {
+  return indexOf(needle) >= 0;
+}
+
+long LineView::toLong(size_t from) const {
+  long value = 0;
+  bool negative = from < length && data[from] == '-';
+  if (negative) from++;
+  for (size_t i = from; i < length && data[i] >= '0' && data[i] <= '9'; i++) {
+    value = value * 10 + (data[i] - '0');
+  }
+  return negative ? -value : value;
+}
+
+/// LineReader
+
+LineReader::LineReader(Stream* stream) : source(stream) {}
+
+Stream* LineReader::stream() const {
+  return source;
+}
+
+char LineReader::at(size_t offset) const {
+  size_t index = start + offset;
+  return buffer[index < LINE_READER_CAPACITY ? index : index - LINE_READER_CAPACITY];
+}
+
+void LineReader::consumePendingLine() {
+  start = (start + pendingLineLength) % LINE_READER_CAPACITY;
+  count -= pendingLineLength;
+  pendingLineLength = 0;
+}
+
+void LineReader::fill() {
+  int waiting = source->available();
+  while (waiting-- > 0 && count < LINE_READER_CAPACITY) {
+    int c = source->read();
+    if (c < 0) break;
+    size_t end = start + count;
+    if (end >= LINE_READER_CAPACITY) end -= LINE_READER_CAPACITY;
+    buffer[end] = (char) c;
+    count++;
+  }
+}
+
+int LineReader::available() {
+  consumePendingLine();
+  return count + source->available();
+}
+
+void LineReader::clear() {
+  consumePendingLine();
+  start = 0;
+  count = 0;
+  while (source->available() > 0) {
+    source->read();
+  }
+}
+
+unsigned char LineReader::readLine(LineView* line, unsigned long timeout) {
+  consumePendingLine();
+  unsigned long startMillis = millis();
+  size_t scanned = 0;
+  while (true) {
+    fill();
+    for (; scanned < count; scanned++) {
+      if (at(scanned) != '\n') continue;
+      if (start + scanned >= LINE_READER_CAPACITY) {
+        // The line wraps around, make it contiguous
+        std::rotate(buffer, buffer + start, buffer + LINE_READER_CAPACITY);
+        start = 0;
+      }
+      size_t length = scanned;
+      if (length > 0 && buffer[start + length - 1] == '\r') {
+        length--;
+      }
+      *line = { buffer + start, length };
+      pendingLineLength = scanned + 1;
+      return RET_OK;
+    }
+    if (count == LINE_READER_CAPACITY) {
+      LOGF("Line longer than %d bytes in readLine, dropping it\n", LINE_READER_CAPACITY);
+      start = 0;
+      count = 0;
+      return RET_OVERFLOW;
+    }
+    if (millis() - startMillis >= timeout) {
+      // Keep the partial line, the rest may still arrive
+      LOGF("Timeout after %lu ms in readLine. %lu bytes buffered\n", timeout, (unsigned long) count);
+      return RET_TIMEOUT;
+    }
+    delay(LINE_READER_POLL_MS);
+  }
+}
+
+unsigned char LineReader::readExactly(
+  char* destination,
+  size_t length,
+  unsigned long timeout
 ) {
+  consumePendingLine();
   unsigned long startMillis = millis();
-  do {
-    *c = stream->read();
-    if(*c >= 0) {
+  size_t copied = 0;
+  while (true) {
+    fill();
+    while (copied < length && count > 0) {
+      destination[copied++] = buffer[start];
+      start = (start + 1) % LINE_READER_CAPACITY;
+      count--;
+    }
+    if (copied == length) {
       return RET_OK;
     }
-  } while(millis() - startMillis < timeout);
-  LOGF("Timeout after %lu ms in timedRead\n", timeout);
-  return RET_TIMEOUT;
+    if (millis() - startMillis >= timeout) {
+      LOGF("Timeout after %lu ms in readExactly. Read %lu of %lu bytes\n", timeout, (unsigned long) copied, (unsigned long) length);
+      return RET_TIMEOUT;
+    }
+    delay(LINE_READER_POLL_MS);
+  }
+}
+
+/// ByteCounter
+
+size_t ByteCounter::write(uint8_t c) {
+  count++;
+  return 1;
+}
+
+size_t ByteCounter::write(const uint8_t* buffer, size_t size) {
+  count += size;
+  return size;
 }
 
-unsigned char readStringUntil(
+/// Free functions
+
+unsigned char timedRead(
   Stream* stream,
-  char terminator,
-  String* result,
-  unsigned long timeout = DEFAULT_TIMEOUT
+  char* c,
+  unsigned long timeout
 ) {
-  *result = "";
-  int c;
   unsigned long startMillis = millis();
   do {
-    c = stream->read();
-    if (c >= 0) {
-      if (c == terminator) {
-        return RET_OK;
-      }
-      *result += (char) c;
+    // read() returns an int so -1 can't be confused with a 0xff byte
+    int read = stream->read();
+    if (read >= 0) {
+      *c = (char) read;
+      return RET_OK;
     }
+    delay(LINE_READER_POLL_MS);
   } while (millis() - startMillis < timeout);
-  LOGF("Timeout after %lu ms in readStringUntil. Read so far: \"%s\"\n", timeout, result->c_str());
+  LOGF("Timeout after %lu ms in timedRead\n", timeout);
   return RET_TIMEOUT;
 }
 
 unsigned char readLine(
-  Stream* stream,
-  String* line,
-  unsigned long timeout = DEFAULT_TIMEOUT
+  LineReader* reader,
+  LineView* line,
+  unsigned long timeout
 ) {
-  unsigned char ret = readStringUntil(stream, '\n', line, timeout);
-  if (ret != RET_OK) return ret;
-  if (line->length() > 0 && line->charAt(line->length() - 1) == '\r') {
-    line->remove(line->length() - 1);
-  }
-  return RET_OK;
+  return reader->readLine(line, timeout);
 }
 
 unsigned char readEmptyLine(
-  Stream* stream,
-  unsigned long timeout = DEFAULT_TIMEOUT
+  LineReader* reader,
+  unsigned long timeout
 ) {
-  String line;
-  unsigned char ret = readLine(stream, &line, timeout);
+  LineView line;
+  unsigned char ret = reader->readLine(&line, timeout);
   if (ret != RET_OK) return ret;
-  if (line.length() != 0) {
-    LOGF("Expected empty line, got \"%s\"\n", line.c_str());
+  if (!line.isEmpty()) {
+    LOGF("Expected empty line, got \"%.*s\"\n", (int) line.length, line.data);
     return RET_ERROR;
   }
   return RET_OK;
 }
 
 unsigned char readExactly(
-  Stream* stream,
+  LineReader* reader,
   char* buffer,
   int length,
-  unsigned long timeout = DEFAULT_TIMEOUT
+  unsigned long timeout
 ) {
-  unsigned long startMillis = millis();
-  int i = 0;
-  while (i < length) {
-    unsigned char ret = timedRead(stream, buffer + i, timeout);
-    if (ret != RET_OK) return ret;
-    i++;
-  }
-  return RET_OK;
+  return reader->readExactly(buffer, length, timeout);
 }
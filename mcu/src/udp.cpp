@@ -0,0 +1,147 @@
+#include "Arduino.h"
+#include "common_macros.h"
+#include "stream_extensions.h"
+#include "cellular.h"
+#include "wake_profile.h"
+#include "udp.h"
+
+
+// The one link the firmware uses of the modem's ten
+#define UDP_LINK 0
+#define UDP_RECEIVED_PREFIX "+IPD"
+#define UDP_DRAIN_CHUNK_BYTES 64
+// From AT+NETOPEN to the stack being up
+#define UDP_NETOPEN_TIMEOUT_MS 30000
+
+// Where the +IPD URC handler puts what the modem pushes
+struct UdpReceiveState {
+  uint8_t* buffer;
+  size_t capacity;
+  size_t length;
+  bool received;
+};
+
+static UdpReceiveState udpReceiveState;
+
+// Reads the datagram that follows the +IPD<length> line. The bytes have to
+// be read either way, they would be taken for lines otherwise.
+static void onUdpReceivedUrc(const LineView& line) {
+  long length = line.toLong(strlen(UDP_RECEIVED_PREFIX));
+  if (length <= 0) {
+    LOGF("[ERR|Cellular/UDP] Malformed datagram line \"%.*s\"\n", (int) line.length, line.data);
+    return;
+  }
+  if (udpReceiveState.buffer != nullptr && (size_t) length <= udpReceiveState.capacity) {
+    if (readExactly(&modemReader, (char*) udpReceiveState.buffer, length) == RET_OK) {
+      udpReceiveState.length = length;
+      udpReceiveState.received = true;
+    }
+    return;
+  }
+  LOGF("[WRN|Cellular/UDP] Dropping datagram of %ld bytes\n", length);
+  char drained[UDP_DRAIN_CHUNK_BYTES];
+  while (length > 0) {
+    long chunk = min(length, (long) sizeof(drained));
+    if (readExactly(&modemReader, drained, chunk) != RET_OK) {
+      return;
+    }
+    length -= chunk;
+  }
+}
+
+static bool isUdpDatagramReceived() {
+  return udpReceiveState.received;
+}
+
+// AT+CIPSEND answers with a bare "> ", no line ending to wait for
+static unsigned char waitForSendPrompt(unsigned long timeout) {
+  char c;
+  do {
+    if (readExactly(&modemReader, &c, 1, timeout) != RET_OK) {
+      return RET_TIMEOUT;
+    }
+  } while (c == '\r' || c == '\n');
+  return c == '>' ? RET_OK : RET_ERROR;
+}
+
+unsigned char openUdpSocket(uint16_t localPort, uint8_t* receiveBuffer, size_t capacity) {
+  unsigned char ret;
+  udpReceiveState = { receiveBuffer, capacity, 0, false };
+  modemChannel.onUrc(UDP_RECEIVED_PREFIX, onUdpReceivedUrc);
+  // Answers ERROR if a parked modem still has it up, CIPOPEN tells
+  LineView line;
+  if (sendNoResponseCommand(&modemChannel, "AT+NETOPEN") == AT_OK_STATUS) {
+    OK_OR_RETURN(modemChannel.waitForLine("+NETOPEN: ", &line, UDP_NETOPEN_TIMEOUT_MS));
+    if (line.toLong(strlen("+NETOPEN: ")) != 0) {
+      LOGF("[ERR|Cellular/UDP] \"%.*s\"\n", (int) line.length, line.data);
+      return RET_ERROR;
+    }
+  }
+  OK_OR_RETURN(sendNoResponseCommand(
+    &modemChannel, "AT+CIPOPEN=" + String(UDP_LINK) + ",\"UDP\",,," + String(localPort)
+  ));
+  OK_OR_RETURN(modemChannel.waitForLine("+CIPOPEN: ", &line, DEFAULT_TIMEOUT));
+  int errorIndex = line.indexOf(',');
+  if (errorIndex < 0 || line.toLong(errorIndex + 1) != 0) {
+    LOGF("[ERR|Cellular/UDP] \"%.*s\"\n", (int) line.length, line.data);
+    return RET_ERROR;
+  }
+  LOGF("[INF|Cellular/UDP] Socket open on port %u\n", localPort);
+  return RET_OK;
+}
+
+unsigned char sendUdpDatagram(
+    const char* host,
+    uint16_t port,
+    UdpDatagramWriter writeDatagram,
+    void* context
+) {
+  unsigned char ret;
+  ByteCounter counter;
+  size_t length = writeDatagram(&counter, context);
+  if (length == 0 || length > UDP_DATAGRAM_MAX_BYTES) {
+    LOGF("[ERR|Cellular/UDP] Datagram of %lu bytes\n", (unsigned long) length);
+    return RET_ERROR;
+  }
+  // A late +IPD would otherwise come in ahead of the prompt
+  modemChannel.poll();
+  modemChannel.stream()->printf("AT+CIPSEND=%d,%lu,\"%s\",%u\r\n", UDP_LINK, (unsigned long) length, host, port);
+  if (waitForSendPrompt(DEFAULT_TIMEOUT) != RET_OK) {
+    LOGLN("[ERR|Cellular/UDP] Expected the send prompt");
+    return RET_ERROR;
+  }
+  unsigned long beforeWriteUs = micros();
+  size_t written = writeDatagram(modemChannel.stream(), context);
+  recordModemUartTransfer(cellularUartBaud(), written, micros() - beforeWriteUs);
+  if (written != length) {
+    LOGF("[ERR|Cellular/UDP] Datagram changed between passes, %lu instead of %lu bytes\n", (unsigned long) written, (unsigned long) length);
+    return RET_ERROR;
+  }
+  OK_OR_RETURN(modemChannel.readResult());
+  LineView line;
+  OK_OR_RETURN(modemChannel.waitForLine("+CIPSEND: ", &line, DEFAULT_TIMEOUT));
+  LOGF("[INF|Cellular/UDP] Sent %lu bytes to %s:%u\n", (unsigned long) length, host, port);
+  return RET_OK;
+}
+
+unsigned char receiveUdpDatagram(size_t* length, unsigned long timeout) {
+  unsigned char ret;
+  // One may have come in while the last command was answered
+  OK_OR_RETURN(modemChannel.waitUntil(isUdpDatagramReceived, timeout));
+  udpReceiveState.received = false;
+  *length = udpReceiveState.length;
+  LOGF("[INF|Cellular/UDP] Received %lu bytes\n", (unsigned long) *length);
+  return RET_OK;
+}
+
+unsigned char closeUdpSocket() {
+  unsigned char ret;
+  LineView line;
+  OK_OR_RETURN(sendNoResponseCommand(&modemChannel, "AT+CIPCLOSE=" + String(UDP_LINK)));
+  OK_OR_RETURN(modemChannel.waitForLine("+CIPCLOSE: ", &line, DEFAULT_TIMEOUT));
+  OK_OR_RETURN(sendNoResponseCommand(&modemChannel, "AT+NETCLOSE"));
+  OK_OR_RETURN(modemChannel.waitForLine("+NETCLOSE: ", &line, DEFAULT_TIMEOUT));
+  udpReceiveState = { nullptr, 0, 0, false };
+  LOGLN("[INF|Cellular/UDP] Socket closed");
+  return RET_OK;
+}
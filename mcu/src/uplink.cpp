@@ -0,0 +1,183 @@
+#include <Arduino.h>
+#include "common_macros.h"
+#include "cellular.h"
+#include "deployed_config.h"
+#include "wake_profile.h"
+#include "wifi_link.h"
+#include "uplink.h"
+#include "rtc_sealed.h"
+
+
+#define UPLINK_NONE 0xff
+
+RTC_DATA_ATTR UplinkStats uplinkStats;
+
+// Also the keys of the upload
+static const char* const UPLINK_NAMES[UPLINKS] = { "cellular", "wifi" };
+static const uint32_t UPLINK_DEFAULT_CONNECT_MS[UPLINKS] = {
+  UPLINK_CELLULAR_DEFAULT_CONNECT_MS, UPLINK_WIFI_DEFAULT_CONNECT_MS
+};
+static const uint32_t UPLINK_CONNECT_MA[UPLINKS] = { UPLINK_CELLULAR_CONNECT_MA, UPLINK_WIFI_CONNECT_MA };
+static const uint32_t UPLINK_UPLOAD_MAS[UPLINKS] = { UPLINK_CELLULAR_UPLOAD_MAS, UPLINK_WIFI_UPLOAD_MAS };
+
+// This wake only
+struct UplinkState {
+  uint8_t begun;
+  uint8_t connected;
+  // WiFi was begun but didn't connect
+  bool fallback;
+  // 0 for a link that wasn't tried
+  uint32_t connectMs[UPLINKS];
+  // When the link was chosen
+  uint32_t costMAs[UPLINKS];
+};
+
+static const UplinkState UPLINK_STATE_IDLE = { UPLINK_NONE, UPLINK_NONE, false, {}, {} };
+static UplinkState uplinkState = UPLINK_STATE_IDLE;
+
+static UplinkStats* validUplinkStats() {
+  if (!rtcIsValid(uplinkStats, UPLINK_STATS_MAGIC, UPLINK_STATS_VERSION)) {
+    resetRtc(&uplinkStats, UPLINK_STATS_MAGIC, UPLINK_STATS_VERSION);
+    memcpy(uplinkStats.connectMs, UPLINK_DEFAULT_CONNECT_MS, sizeof(uplinkStats.connectMs));
+    sealRtc(&uplinkStats);
+  }
+  return &uplinkStats;
+}
+
+static void recordConnect(uint8_t link, uint32_t connectMs) {
+  UplinkStats* stats = validUplinkStats();
+  stats->connectMs[link] = (3 * stats->connectMs[link] + connectMs) / 4;
+  stats->nbroFailures[link] = 0;
+  sealRtc(&uplinkStats);
+  uplinkState.connectMs[link] = connectMs;
+}
+
+static void recordFailure(uint8_t link, uint32_t spentMs) {
+  UplinkStats* stats = validUplinkStats();
+  if (stats->nbroFailures[link] < UINT16_MAX) {
+    stats->nbroFailures[link]++;
+  }
+  // 1, 3, 7, ... without shifting past the width
+  uint32_t skip = stats->nbroFailures[link] < 16 ? (1UL << stats->nbroFailures[link]) - 1 : UINT32_MAX;
+  stats->uploadsToSkip[link] = _min(skip, (uint32_t) UPLINK_MAX_SKIPPED_UPLOADS);
+  sealRtc(&uplinkStats);
+  uplinkState.connectMs[link] = spentMs;
+  LOGF(
+    "[WRN|Uplink] %s failed %u times in a row, passed over for %u uploads\n",
+    UPLINK_NAMES[link], stats->nbroFailures[link], stats->uploadsToSkip[link]
+  );
+}
+
+uint32_t uplinkCostMAs(uint8_t link) {
+  const UplinkStats* stats = validUplinkStats();
+  return stats->connectMs[link] * UPLINK_CONNECT_MA[link] / 1000 + UPLINK_UPLOAD_MAS[link];
+}
+
+uint8_t chooseUplink() {
+  const UplinkStats* stats = validUplinkStats();
+  bool wifiAvailable = wifiIsConfigured() && stats->uploadsToSkip[UPLINK_WIFI] == 0;
+  return wifiAvailable && uplinkCostMAs(UPLINK_WIFI) < uplinkCostMAs(UPLINK_CELLULAR)
+    ? UPLINK_WIFI
+    : UPLINK_CELLULAR;
+}
+
+void beginUplink() {
+  if (uplinkState.begun != UPLINK_NONE) {
+    return;
+  }
+  for (uint8_t link = 0; link < UPLINKS; link++) {
+    uplinkState.costMAs[link] = uplinkCostMAs(link);
+  }
+  uplinkState.begun = chooseUplink();
+  LOGF(
+    "[INF|Uplink] Connecting over %s (%lu mAs, %s %lu mAs)\n",
+    UPLINK_NAMES[uplinkState.begun], (unsigned long) uplinkState.costMAs[uplinkState.begun],
+    UPLINK_NAMES[1 - uplinkState.begun], (unsigned long) uplinkState.costMAs[1 - uplinkState.begun]
+  );
+  if (uplinkState.begun == UPLINK_WIFI) {
+    beginWifiConnect();
+  } else {
+    beginCellularSetup();
+  }
+}
+
+uint8_t connectUplink() {
+  beginUplink();
+  if (uplinkState.connected != UPLINK_NONE) {
+    return uplinkState.connected;
+  }
+  // Passed over links count down with the uploads
+  UplinkStats* stats = validUplinkStats();
+  for (uint8_t link = 0; link < UPLINKS; link++) {
+    if (stats->uploadsToSkip[link] > 0) {
+      stats->uploadsToSkip[link]--;
+    }
+  }
+  sealRtc(&uplinkStats);
+
+  if (uplinkState.begun == UPLINK_WIFI) {
+    unsigned char ret = finishWifiConnect();
+    uint32_t wifiMs = wakePhaseUs(WAKE_PHASE_WIFI) / 1000;
+    if (ret == RET_OK) {
+      recordConnect(UPLINK_WIFI, wifiMs);
+      uplinkState.connected = UPLINK_WIFI;
+      return UPLINK_WIFI;
+    }
+    recordFailure(UPLINK_WIFI, wifiMs);
+    stopWifi();
+    uplinkState.fallback = true;
+    LOGLN("[WRN|Uplink] Falling back to cellular");
+  }
+  finishCellularSetup();
+  recordConnect(
+    UPLINK_CELLULAR,
+    (wakePhaseUs(WAKE_PHASE_MODEM_BOOT) + wakePhaseUs(WAKE_PHASE_REGISTRATION)) / 1000
+  );
+  uplinkState.connected = UPLINK_CELLULAR;
+  return UPLINK_CELLULAR;
+}
+
+void cancelUplink() {
+  if (uplinkState.begun == UPLINK_WIFI) {
+    stopWifi();
+  } else if (uplinkState.begun == UPLINK_CELLULAR) {
+    cancelCellularSetup();
+  }
+  uplinkState = UPLINK_STATE_IDLE;
+}
+
+void releaseUplink() {
+  if (uplinkState.connected == UPLINK_WIFI) {
+    // The modem was left as it was, off or parked
+    stopWifi();
+  } else if (deployedConfig.modemSleepMode == CELLULAR_SLEEP_MODE_DTR) {
+    LOGLN("[INF|Uplink] Parking cellular...");
+    parkCellular();
+  } else {
+    LOGLN("[INF|Uplink] Powering off cellular...");
+    powerOffCellular();
+  }
+  uplinkState = UPLINK_STATE_IDLE;
+}
+
+static size_t writeLinkValuesJson(Print* out, const char* name, const uint32_t* values) {
+  size_t written = out->printf(",\"%s\":{", name);
+  for (uint8_t link = 0; link < UPLINKS; link++) {
+    written += out->printf(link == 0 ? "\"%s\":%lu" : ",\"%s\":%lu", UPLINK_NAMES[link], (unsigned long) values[link]);
+  }
+  written += out->print('}');
+  return written;
+}
+
+size_t writeUplinkJson(Print* out) {
+  uint8_t link = uplinkState.connected;
+  size_t written = out->printf(
+    "{\"link\":\"%s\",\"fallback\":%s",
+    link != UPLINK_NONE ? UPLINK_NAMES[link] : "none",
+    uplinkState.fallback ? "true" : "false"
+  );
+  written += writeLinkValuesJson(out, "connectMs", uplinkState.connectMs);
+  written += writeLinkValuesJson(out, "costMAs", uplinkState.costMAs);
+  written += out->print('}');
+  return written;
+}
@@ -0,0 +1,52 @@
+#include <Arduino.h>
+#include <lzss_codec.h>
+#include "common_macros.h"
+#include "deployed_config.h"
+#include "upload_compression.h"
+
+
+// Fixed RAM, a few hundred bytes instead of a whole body
+static uint8_t compressionBuffer[
+  LZSS_ENCODER_BUFFER_BYTES(UPLOAD_COMPRESSION_WINDOW_BITS, UPLOAD_COMPRESSION_LOOKAHEAD_BITS)
+];
+
+CompressingPrint::CompressingPrint(Print* out)
+  : encoder(
+      UPLOAD_COMPRESSION_WINDOW_BITS,
+      UPLOAD_COMPRESSION_LOOKAHEAD_BITS,
+      compressionBuffer,
+      writeToOut,
+      out
+    ) {
+  encoder.begin();
+}
+
+void CompressingPrint::writeToOut(const uint8_t* bytes, size_t length, void* context) {
+  ((Print*) context)->write(bytes, length);
+}
+
+size_t CompressingPrint::write(uint8_t c) {
+  encoder.write(&c, 1);
+  return 1;
+}
+
+size_t CompressingPrint::write(const uint8_t* buffer, size_t size) {
+  encoder.write(buffer, size);
+  return size;
+}
+
+size_t CompressingPrint::finish() {
+  return encoder.finish();
+}
+
+bool shouldCompressUpload(size_t nbroMeasurements) {
+  return deployedConfig.uploadEncoding == UPLOAD_ENCODING_HEATSHRINK
+    && nbroMeasurements >= UPLOAD_COMPRESSION_MIN_MEASUREMENTS;
+}
+
+size_t writeCompressedBody(Print* out, void* context) {
+  CompressedBody* body = (CompressedBody*) context;
+  CompressingPrint compressing(out);
+  body->writeBody(&compressing, body->context);
+  return compressing.finish();
+}
@@ -0,0 +1,57 @@
+#include <Arduino.h>
+#include "common_macros.h"
+#include "upload_outbox.h"
+#include "rtc_sealed.h"
+
+
+RTC_DATA_ATTR UploadOutbox uploadOutbox;
+bool uploadBackoff = true;
+
+// Starts over after a power loss, any sequence does for the echo
+static UploadOutbox* validUploadOutbox() {
+  if (!rtcIsValid(uploadOutbox, UPLOAD_OUTBOX_MAGIC, UPLOAD_OUTBOX_VERSION)) {
+    resetRtc(&uploadOutbox, UPLOAD_OUTBOX_MAGIC, UPLOAD_OUTBOX_VERSION);
+    uploadOutbox.batchSequence = 1;
+    sealRtc(&uploadOutbox);
+  }
+  return &uploadOutbox;
+}
+
+uint32_t uploadBatchSequence() {
+  return validUploadOutbox()->batchSequence;
+}
+
+bool uploadIsBackingOff() {
+  return uploadBackoff && validUploadOutbox()->wakesUntilRetry > 0;
+}
+
+void passUploadBackoffWake() {
+  UploadOutbox* outbox = validUploadOutbox();
+  if (outbox->wakesUntilRetry > 0) {
+    outbox->wakesUntilRetry--;
+    sealRtc(&uploadOutbox);
+  }
+}
+
+void acknowledgeUpload() {
+  UploadOutbox* outbox = validUploadOutbox();
+  outbox->batchSequence++;
+  outbox->nbroFailures = 0;
+  outbox->wakesUntilRetry = 0;
+  sealRtc(&uploadOutbox);
+}
+
+void failUpload() {
+  UploadOutbox* outbox = validUploadOutbox();
+  if (outbox->nbroFailures < UINT16_MAX) {
+    outbox->nbroFailures++;
+  }
+  // 1, 3, 7, ... without shifting past the width
+  uint32_t backoffWakes = outbox->nbroFailures < 16 ? (1UL << outbox->nbroFailures) - 1 : UINT32_MAX;
+  outbox->wakesUntilRetry = _min(backoffWakes, (uint32_t) UPLOAD_BACKOFF_MAX_WAKES);
+  sealRtc(&uploadOutbox);
+  LOGF(
+    "[WRN|Outbox] Upload %lu failed %u times in a row, retrying in %lu wakes\n",
+    (unsigned long) outbox->batchSequence, outbox->nbroFailures, (unsigned long) outbox->wakesUntilRetry
+  );
+}
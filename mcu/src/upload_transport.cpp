@@ -0,0 +1,52 @@
+#include <Arduino.h>
+#include "common_macros.h"
+#include "cellular.h"
+#include "upload_transport.h"
+
+
+HttpUploadTransport::HttpUploadTransport(const char* url, const char* authorization, bool oneSession)
+  : url(url),
+    headers {
+      { "Authorization", authorization },
+      { "Content-Encoding", nullptr },
+    },
+    oneSession(oneSession) {}
+
+// The Content-Encoding header only goes out if there is one
+HttpRequest HttpUploadTransport::toHttpRequest(const UploadRequest& request) {
+  headers[1].value = request.contentEncoding;
+  return {
+    HTTP_METHOD_POST,
+    url,
+    request.contentType,
+    headers,
+    request.contentEncoding != nullptr ? 2u : 1u,
+    request.writeBody,
+    request.bodyContext
+  };
+}
+
+unsigned char HttpUploadTransport::begin(const UploadRequest& request) {
+  // Wait for the service to actually start rather than a fixed delay, it
+  // answers ERROR if it is still running from a previous wake
+  if (sendNoResponseCommand(&modemChannel, "AT+CCHSTART") == AT_OK_STATUS) {
+    LineView cchStartLine;
+    modemChannel.waitForLine("+CCHSTART:", &cchStartLine, DEFAULT_TIMEOUT);
+  }
+  return oneSession ? beginHttpSession(toHttpRequest(request)) : RET_OK;
+}
+
+unsigned char HttpUploadTransport::send(
+  const UploadRequest& request,
+  HttpResponseSink sink,
+  void* sinkContext,
+  HttpResult* result
+) {
+  return oneSession
+    ? httpSessionRequest(toHttpRequest(request), sink, sinkContext, result)
+    : httpRequest(toHttpRequest(request), sink, sinkContext, result);
+}
+
+unsigned char HttpUploadTransport::end() {
+  return oneSession ? endHttpSession() : RET_OK;
+}
@@ -0,0 +1,198 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+#include "common_macros.h"
+#include "wake_profile.h"
+#include "rtc_sealed.h"
+
+
+RTC_DATA_ATTR WakeProfile wakeProfile;
+
+// Also the keys of the upload
+static const char* const WAKE_PHASE_NAMES[WAKE_PHASES] = {
+  "usbCheck",
+  "battery",
+  "distance",
+  "flash",
+  "modemBoot",
+  "registration",
+  "wifi",
+  "http",
+  "modemOff",
+  "blink",
+};
+
+// This wake only, gone with deep sleep
+struct WakePhaseTiming {
+  int64_t startedUs;
+  uint32_t spentUs;
+  uint8_t depth;
+  bool ran;
+};
+
+static WakePhaseTiming wakePhaseTimings[WAKE_PHASES];
+static ModemUartTransfer wakeModemUart;
+
+/// Phase timers
+
+void beginWakeProfile() {
+  memset(wakePhaseTimings, 0, sizeof(wakePhaseTimings));
+  wakeModemUart = {};
+}
+
+void startWakePhase(WakePhase phase) {
+  WakePhaseTiming* timing = &wakePhaseTimings[phase];
+  if (timing->depth++ == 0) {
+    timing->startedUs = esp_timer_get_time();
+  }
+}
+
+void stopWakePhase(WakePhase phase) {
+  WakePhaseTiming* timing = &wakePhaseTimings[phase];
+  if (timing->depth == 0 || --timing->depth > 0) {
+    return;
+  }
+  timing->spentUs += esp_timer_get_time() - timing->startedUs;
+  timing->ran = true;
+}
+
+WakePhaseTimer::WakePhaseTimer(WakePhase phase) : phase(phase) {
+  startWakePhase(phase);
+}
+
+WakePhaseTimer::~WakePhaseTimer() {
+  stopWakePhase(phase);
+}
+
+const char* wakePhaseName(WakePhase phase) {
+  return WAKE_PHASE_NAMES[phase];
+}
+
+uint32_t wakePhaseUs(WakePhase phase) {
+  return wakePhaseTimings[phase].spentUs;
+}
+
+void recordModemUartTransfer(uint32_t baud, size_t bytes, uint32_t us) {
+  wakeModemUart.bytes += bytes;
+  wakeModemUart.us += us;
+  wakeModemUart.baud = baud;
+}
+
+const ModemUartTransfer& wakeModemUartTransfer() {
+  return wakeModemUart;
+}
+
+static uint32_t bytesPerS(const ModemUartTransfer& transfer) {
+  return transfer.us > 0 ? (uint64_t) transfer.bytes * 1000000 / transfer.us : 0;
+}
+
+/// Profile
+
+static bool wakeProfileIsValid() {
+  return rtcIsValid(wakeProfile, WAKE_PROFILE_MAGIC, WAKE_PROFILE_VERSION);
+}
+
+void clearWakeProfile() {
+  resetRtc(&wakeProfile, WAKE_PROFILE_MAGIC, WAKE_PROFILE_VERSION);
+  sealRtc(&wakeProfile);
+}
+
+static size_t bucketOf(uint32_t us) {
+  size_t bucket = 0;
+  for (uint32_t limitUs = 1000; us >= limitUs && bucket < WAKE_PROFILE_BUCKETS - 1; limitUs *= 4) {
+    bucket++;
+  }
+  return bucket;
+}
+
+static void addToHistogram(WakePhaseHistogram* histogram, uint32_t us) {
+  histogram->totalMs += us / 1000;
+  uint16_t* bucket = &histogram->buckets[bucketOf(us)];
+  if (*bucket < UINT16_MAX) {
+    (*bucket)++;
+  }
+}
+
+void finishWakeProfile() {
+  if (!wakeProfileIsValid()) {
+    clearWakeProfile();
+  }
+  for (size_t i = 0; i < WAKE_PHASES; i++) {
+    if (wakePhaseTimings[i].ran) {
+      addToHistogram(&wakeProfile.phases[i], wakePhaseTimings[i].spentUs);
+    }
+  }
+  addToHistogram(&wakeProfile.awake, esp_timer_get_time());
+  if (wakeModemUart.bytes > 0) {
+    wakeProfile.modemUart.bytes += wakeModemUart.bytes;
+    wakeProfile.modemUart.us += wakeModemUart.us;
+    wakeProfile.modemUart.baud = wakeModemUart.baud;
+  }
+  if (wakeProfile.nbroWakes < UINT16_MAX) {
+    wakeProfile.nbroWakes++;
+  }
+  sealRtc(&wakeProfile);
+}
+
+static size_t writeHistogramJson(Print* out, const char* name, const WakePhaseHistogram& histogram) {
+  size_t written = out->printf(",\"%s\":{\"totalMs\":%lu,\"histogram\":[", name, (unsigned long) histogram.totalMs);
+  for (size_t i = 0; i < WAKE_PROFILE_BUCKETS; i++) {
+    written += out->printf(i == 0 ? "%u" : ",%u", (unsigned) histogram.buckets[i]);
+  }
+  written += out->print("]}");
+  return written;
+}
+
+size_t writeWakeProfileJson(Print* out) {
+  // Nothing to go on after a power loss, the histograms are empty then
+  bool valid = wakeProfileIsValid();
+  size_t written = out->printf("{\"wakes\":%u,\"bucketsMs\":[0", valid ? (unsigned) wakeProfile.nbroWakes : 0);
+  unsigned long limitMs = 1;
+  for (size_t i = 1; i < WAKE_PROFILE_BUCKETS; i++, limitMs *= 4) {
+    written += out->printf(",%lu", limitMs);
+  }
+  written += out->print(']');
+  WakePhaseHistogram empty = {};
+  for (size_t i = 0; i < WAKE_PHASES; i++) {
+    written += writeHistogramJson(out, WAKE_PHASE_NAMES[i], valid ? wakeProfile.phases[i] : empty);
+  }
+  written += writeHistogramJson(out, "awake", valid ? wakeProfile.awake : empty);
+  ModemUartTransfer noTransfer = {};
+  const ModemUartTransfer& modemUart = valid ? wakeProfile.modemUart : noTransfer;
+  written += out->printf(
+    ",\"modemUart\":{\"baud\":%lu,\"bytes\":%lu,\"bytesPerS\":%lu}}",
+    (unsigned long) modemUart.baud, (unsigned long) modemUart.bytes, (unsigned long) bytesPerS(modemUart)
+  );
+  return written;
+}
+
+void printWakeProfile(Print* out) {
+  bool valid = wakeProfileIsValid();
+  out->printf("%-13s %10s %6s %10s\n", "phase", "this ms", "wakes", "total ms");
+  for (size_t i = 0; i < WAKE_PHASES; i++) {
+    const WakePhaseHistogram& histogram = wakeProfile.phases[i];
+    uint32_t nbroWakes = 0;
+    for (size_t j = 0; valid && j < WAKE_PROFILE_BUCKETS; j++) {
+      nbroWakes += histogram.buckets[j];
+    }
+    out->printf(
+      "%-13s %10.1f %6lu %10lu\n",
+      WAKE_PHASE_NAMES[i],
+      wakePhaseTimings[i].spentUs / 1000.0,
+      (unsigned long) nbroWakes,
+      valid ? (unsigned long) histogram.totalMs : 0UL
+    );
+  }
+  out->printf(
+    "%-13s %10.1f %6u %10lu\n",
+    "awake",
+    esp_timer_get_time() / 1000.0,
+    valid ? (unsigned) wakeProfile.nbroWakes : 0,
+    valid ? (unsigned long) wakeProfile.awake.totalMs : 0UL
+  );
+  out->printf(
+    "modem UART: %lu bytes at %lu B/s (%lu baud) this wake, %lu at %lu B/s total\n",
+    (unsigned long) wakeModemUart.bytes, (unsigned long) bytesPerS(wakeModemUart), (unsigned long) wakeModemUart.baud,
+    valid ? (unsigned long) wakeProfile.modemUart.bytes : 0UL,
+    valid ? (unsigned long) bytesPerS(wakeProfile.modemUart) : 0UL
+  );
+}
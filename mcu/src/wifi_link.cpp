@@ -0,0 +1,120 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include "common_macros.h"
+#include "wake_profile.h"
+#include "wifi_link.h"
+#include "api_secrets.h"
+#include "rtc_sealed.h"
+
+
+#ifndef WIFI_SSID
+#define WIFI_SSID ""
+#endif
+#ifndef WIFI_PASSWORD
+#define WIFI_PASSWORD ""
+#endif
+#define WIFI_POLL_MS 10
+
+RTC_DATA_ATTR WifiLinkCache wifiLinkCache;
+const char* wifiSsid = WIFI_SSID;
+
+static bool wifiConnecting = false;
+static bool wifiFastConnect = false;
+static unsigned long wifiConnectStartMillis;
+
+static bool wifiLinkCacheIsValid() {
+  return rtcIsValid(wifiLinkCache, WIFI_LINK_CACHE_MAGIC, WIFI_LINK_CACHE_VERSION);
+}
+
+static void clearWifiLinkCache() {
+  memset(&wifiLinkCache, 0, sizeof(wifiLinkCache));
+}
+
+static void saveWifiLinkCache(const uint8_t* bssid, int32_t channel) {
+  resetRtc(&wifiLinkCache, WIFI_LINK_CACHE_MAGIC, WIFI_LINK_CACHE_VERSION);
+  memcpy(wifiLinkCache.bssid, bssid, WIFI_BSSID_BYTES);
+  wifiLinkCache.channel = channel;
+  sealRtc(&wifiLinkCache);
+}
+
+bool wifiIsConfigured() {
+  return wifiSsid != nullptr && wifiSsid[0] != '\0';
+}
+
+static void startWifiConnect() {
+  wifiConnectStartMillis = millis();
+  if (wifiFastConnect) {
+    LOGF("[INF|WiFi] Connecting to %s on channel %ld\n", wifiSsid, (long) wifiLinkCache.channel);
+    WiFi.begin(wifiSsid, WIFI_PASSWORD, wifiLinkCache.channel, wifiLinkCache.bssid);
+  } else {
+    LOGF("[INF|WiFi] Scanning for %s\n", wifiSsid);
+    WiFi.begin(wifiSsid, WIFI_PASSWORD);
+  }
+}
+
+void beginWifiConnect() {
+  if (wifiConnecting) {
+    return;
+  }
+  wifiConnecting = true;
+  startWakePhase(WAKE_PHASE_WIFI);
+  // The station would otherwise write its config to flash on every connect
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  wifiFastConnect = wifiLinkCacheIsValid();
+  startWifiConnect();
+}
+
+static unsigned char waitForWifi(unsigned long timeout, wl_status_t* status) {
+  while (millis() - wifiConnectStartMillis < timeout) {
+    *status = WiFi.status();
+    if (*status == WL_CONNECTED) {
+      return RET_OK;
+    }
+    if (*status == WL_NO_SSID_AVAIL || *status == WL_CONNECT_FAILED) {
+      return RET_ERROR;
+    }
+    delay(WIFI_POLL_MS);
+  }
+  return RET_TIMEOUT;
+}
+
+unsigned char finishWifiConnect() {
+  beginWifiConnect();
+  wl_status_t status = WL_IDLE_STATUS;
+  unsigned char ret = waitForWifi(
+    wifiFastConnect ? WIFI_FAST_CONNECT_TIMEOUT_MS : WIFI_CONNECT_TIMEOUT_MS, &status
+  );
+  // A wrong password stays wrong, anything else may be an access point that
+  // moved to another channel
+  if (ret != RET_OK && wifiFastConnect && status != WL_CONNECT_FAILED) {
+    LOGF("[WRN|WiFi] Cached access point not there (status %d), scanning...\n", status);
+    clearWifiLinkCache();
+    WiFi.disconnect();
+    wifiFastConnect = false;
+    startWifiConnect();
+    ret = waitForWifi(WIFI_CONNECT_TIMEOUT_MS, &status);
+  }
+  stopWakePhase(WAKE_PHASE_WIFI);
+  if (ret != RET_OK) {
+    LOGF("[ERR|WiFi] Could not connect to %s (status %d)\n", wifiSsid, status);
+    return ret;
+  }
+  saveWifiLinkCache(WiFi.BSSID(), WiFi.channel());
+  LOGF(
+    "[INF|WiFi] Connected after %lu ms, channel %ld, RSSI %d\n",
+    millis() - wifiConnectStartMillis, (long) WiFi.channel(), WiFi.RSSI()
+  );
+  return RET_OK;
+}
+
+void stopWifi() {
+  if (!wifiConnecting) {
+    return;
+  }
+  stopWakePhase(WAKE_PHASE_WIFI);
+  WiFi.disconnect(true);
+  WiFi.mode(WIFI_OFF);
+  wifiConnecting = false;
+  LOGLN("[INF|WiFi] Radio off");
+}
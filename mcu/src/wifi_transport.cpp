@@ -0,0 +1,123 @@
+#include <Arduino.h>
+#include "common_macros.h"
+#include "stream_extensions.h"
+#include "wifi_transport.h"
+#include "api_secrets.h"
+
+
+// The body of one chunk, for HTTPClient::POST()
+class BufferPrint : public Print {
+public:
+  BufferPrint(uint8_t* buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    size_t copied = min(size, capacity - length);
+    memcpy(buffer + length, data, copied);
+    length += copied;
+    return copied;
+  }
+  using Print::write;
+
+  size_t length = 0;
+
+private:
+  uint8_t* buffer;
+  size_t capacity;
+};
+
+// Hands what HTTPClient::writeToStream() writes to the response sink, it
+// takes care of Content-Length and chunked responses alike
+class SinkStream : public Stream {
+public:
+  SinkStream(HttpResponseSink sink, void* context) : sink(sink), context(context) {}
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    if (sink != nullptr) {
+      sink((const char*) data, size, context);
+    }
+    return size;
+  }
+  using Print::write;
+
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+
+private:
+  HttpResponseSink sink;
+  void* context;
+};
+
+WifiHttpUploadTransport::WifiHttpUploadTransport(const char* url, const char* authorization)
+  : url(url), authorization(authorization) {}
+
+unsigned char WifiHttpUploadTransport::begin(const UploadRequest& request) {
+#ifdef HTTP_API_ROOT_CA
+  client.setCACert(HTTP_API_ROOT_CA);
+#else
+  // Like the modem's HTTPS, which doesn't check the certificate either
+  client.setInsecure();
+#endif
+  http.setReuse(true);
+  http.setTimeout(WIFI_HTTP_TIMEOUT_MS);
+  if (!http.begin(client, url)) {
+    LOGF("[ERR|WiFi/HTTP] Could not begin %s\n", url);
+    return RET_ERROR;
+  }
+  // Stay for every request until end()
+  http.addHeader("Authorization", authorization);
+  http.addHeader("Content-Type", request.contentType != nullptr ? request.contentType : "application/json");
+  if (request.contentEncoding != nullptr) {
+    http.addHeader("Content-Encoding", request.contentEncoding);
+  }
+  return RET_OK;
+}
+
+unsigned char WifiHttpUploadTransport::send(
+  const UploadRequest& request,
+  HttpResponseSink sink,
+  void* sinkContext,
+  HttpResult* result
+) {
+  *result = { 0, HTTP_STATUS_NONE, 0 };
+  ByteCounter counter;
+  size_t length = request.writeBody(&counter, request.bodyContext);
+  uint8_t* body = (uint8_t*) malloc(length);
+  if (body == nullptr) {
+    LOGF("[ERR|WiFi/HTTP] No memory for a body of %lu bytes\n", (unsigned long) length);
+    return RET_ERROR;
+  }
+  BufferPrint bodyPrint(body, length);
+  request.writeBody(&bodyPrint, request.bodyContext);
+  int status = bodyPrint.length == length ? http.POST(body, length) : 0;
+  free(body);
+  if (status <= 0) {
+    LOGF("[ERR|WiFi/HTTP] Request failed (%d)\n", status);
+    return RET_ERROR;
+  }
+  result->status = status;
+  result->statusClass = httpStatusClass(status);
+  SinkStream response(sink, sinkContext);
+  int received = http.writeToStream(&response);
+  if (received < 0) {
+    LOGF("[ERR|WiFi/HTTP] Reading the response failed (%d)\n", received);
+    return RET_ERROR;
+  }
+  result->bodyLength = received;
+  LOGF("[INF|WiFi/HTTP] %lu bytes, status %d, %lu bytes back\n", (unsigned long) length, status, (unsigned long) received);
+  return RET_OK;
+}
+
+unsigned char WifiHttpUploadTransport::end() {
+  http.end();
+  client.stop();
+  return RET_OK;
+}
@@ -1,7 +1,9 @@
 resource "aws_dynamodb_table" "data" {
   name           = "${var.dynamodb_table_prefix}_data"
-  # hash_key and range_key can seemingly not be the same in terraform, so we
-  # use a dummy hash_key
+  # hash_key and range_key can seemingly not be the same in terraform. The
+  # hash_key is the device's hash of a measurement, or its time for devices
+  # that don't send one. The API looks up the hash before storing, so a
+  # retried upload whose time it corrected differently isn't stored twice.
   hash_key       = "hash"
   range_key      = "timeS"
   billing_mode   = "PROVISIONED"